@@ -30,7 +30,6 @@ sbindir=${exec_prefix}/sbin
 
 enable_debug=yes
 enable_optimization=no
-enable_resolver_fork=
 enable_warnings=
 enable_testgui=
 
@@ -1,5 +1,6 @@
 #include "wvtest.h"
 #include "wvsslstream.h"
+#include "wvsslcontext.h"
 #include "wvloopback2.h"
 #include "wvx509mgr.h"
 #include "wvrsa.h"
@@ -317,6 +318,174 @@ WVTEST_MAIN("ssl establish connection")
 }
 
 
+static WvSSLContext *srvctx = NULL;
+
+
+static void echoline(WvSSLStream *ssl)
+{
+    const char *line = ssl->getline(0);
+    if (line)
+	ssl->print("%s\n", line);
+}
+
+
+static void resume_accept(IWvStream *conn)
+{
+    WvSSLStream *ssl = new WvSSLStream(conn, *srvctx);
+    ssl->setcallback(wv::bind(echoline, ssl));
+    WvIStreamList::globallist.append(ssl, true, "ssl server stream");
+}
+
+
+WVTEST_MAIN("ssl session resumption")
+{
+    WvIStreamList::globallist.zap();
+    
+    WvX509Mgr *cert = new WvX509Mgr("cn=random_stupid_dn", 1024);
+    srvctx = new WvSSLContext(cert, true);
+    WVRELEASE(cert); // the context has its own reference
+    WvSSLContext *clictx = new WvSSLContext;
+    WVPASS(srvctx->isok());
+    WVPASS(clictx->isok());
+    
+    WvTCPListener l(WvIPPortAddr("127.0.0.1", 0));
+    l.onaccept(resume_accept);
+    WvIStreamList::globallist.append(&l, false, "listener");
+    WvIPPortAddr caddr("127.0.0.1", l.src()->port);
+    
+    for (int i = 0; i < 3; i++)
+    {
+	WvSSLStream *ssl = new WvSSLStream(new WvTCPConn(caddr), *clictx);
+	WvIStreamList::globallist.append(ssl, false, "ssl client stream");
+	ssl->print("hello %s\n", i);
+	
+	WvString line;
+	for (int j = 0; j < 100 && !line; j++)
+	{
+	    WvIStreamList::globallist.runonce(10);
+	    line = ssl->getline(0);
+	}
+	WVPASSEQ(line, WvString("hello %s", i));
+	
+	WvIStreamList::globallist.unlink(ssl);
+	WVRELEASE(ssl);
+    }
+    
+    // only the first one had to do the whole handshake
+    WVPASSEQ(clictx->full_handshakes(), 1);
+    WVPASSEQ(clictx->resumed_handshakes(), 2);
+    WVPASSEQ(srvctx->full_handshakes(), 1);
+    WVPASSEQ(srvctx->resumed_handshakes(), 2);
+    
+    // without the saved session, it's back to the slow way
+    clictx->flush_sessions();
+    WvSSLStream *ssl = new WvSSLStream(new WvTCPConn(caddr), *clictx);
+    WvIStreamList::globallist.append(ssl, true, "ssl client stream");
+    ssl->print("again\n");
+    WvString line;
+    for (int j = 0; j < 100 && !line; j++)
+    {
+	WvIStreamList::globallist.runonce(10);
+	line = ssl->getline(0);
+    }
+    WVPASSEQ(line, "again");
+    WVPASSEQ(clictx->full_handshakes(), 2);
+    
+    WvIStreamList::globallist.zap();
+    WVRELEASE(clictx);
+    WVRELEASE(srvctx);
+}
+
+
+static WvDynBuf sendfile_got;
+
+
+static void sendfile_read(WvSSLStream *ssl)
+{
+    ssl->read(sendfile_got, 1024*1024);
+}
+
+
+static void sendfile_accept(IWvStream *conn)
+{
+    WvSSLStream *ssl = new WvSSLStream(conn, *srvctx);
+    ssl->setcallback(wv::bind(sendfile_read, ssl));
+    WvIStreamList::globallist.append(ssl, true, "ssl server stream");
+}
+
+
+// sendfile() has to get the file there whether or not the kernel can do
+// TLS, so this works either way; it just tells you which way it went.
+WVTEST_MAIN("ssl ktls sendfile")
+{
+    WvIStreamList::globallist.zap();
+    sendfile_got.zap();
+    
+    WvX509Mgr *cert = new WvX509Mgr("cn=random_stupid_dn", 1024);
+    srvctx = new WvSSLContext(cert, true);
+    WVRELEASE(cert);
+    WvSSLContext *clictx = new WvSSLContext;
+    clictx->use_ktls();
+    
+    char fname[] = "/tmp/wvsslsendfile.XXXXXX";
+    int fd = mkstemp(fname);
+    WVPASS(fd >= 0);
+    unlink(fname);
+    const size_t total = 1024*1024;
+    char chunk[4096];
+    for (size_t i = 0; i < total; i += sizeof(chunk))
+    {
+	for (size_t j = 0; j < sizeof(chunk); j++)
+	    chunk[j] = (i + j) * 7 % 251;
+	WVPASSEQ(write(fd, chunk, sizeof(chunk)), (ssize_t)sizeof(chunk));
+    }
+    
+    WvTCPListener l(WvIPPortAddr("127.0.0.1", 0));
+    l.onaccept(sendfile_accept);
+    WvIStreamList::globallist.append(&l, false, "listener");
+    WvSSLStream *ssl = new WvSSLStream(
+		new WvTCPConn(WvIPPortAddr("127.0.0.1", l.src()->port)),
+		*clictx);
+    WvIStreamList::globallist.append(ssl, true, "ssl client stream");
+    
+    // get the handshake out of the way, so the kernel gets a chance
+    ssl->print("hello\n");
+    for (int i = 0; i < 100 && sendfile_got.used() < 6; i++)
+	WvIStreamList::globallist.runonce(10);
+    WVPASSEQ(sendfile_got.getstr(), "hello\n");
+    printf("kernel TLS: %s\n", ssl->ktls() ? "yes" : "no");
+    fflush(stdout);
+    
+    // a bit from the middle first, then everything
+    WVPASSEQ(ssl->sendfile(fd, 4096, 4096), 4096);
+    size_t sent = 0;
+    for (int i = 0; i < 1000 && sent < total; i++)
+    {
+	sent += ssl->sendfile(fd, sent, total - sent);
+	WvIStreamList::globallist.runonce(1);
+    }
+    WVPASSEQ(sent, total);
+    for (int i = 0; i < 1000 && sendfile_got.used() < total + 4096; i++)
+	WvIStreamList::globallist.runonce(10);
+    WVPASSEQ(sendfile_got.used(), total + 4096);
+    
+    bool same = true;
+    const unsigned char *p = sendfile_got.get(4096);
+    for (size_t j = 0; j < 4096; j++)
+	same = same && p[j] == (4096 + j) * 7 % 251;
+    p = sendfile_got.get(total);
+    for (size_t j = 0; j < total; j++)
+	same = same && p[j] == j * 7 % 251;
+    WVPASS(same);
+    
+    close(fd);
+    WvIStreamList::globallist.zap();
+    sendfile_got.zap();
+    WVRELEASE(clictx);
+    WVRELEASE(srvctx);
+}
+
+
 WVTEST_MAIN("x509 refcounting")
 {
     WvX509Mgr *x509 = new WvX509Mgr("cn=random_stupid_dn,dn=foo", 512);
@@ -355,3 +524,45 @@ WVTEST_MAIN("sslcert moniker creation")
 
     WVRELEASE(dumb);
 }
+
+
+// Not really a test: how fast can we push data through a pair of SSL
+// streams talking over a socketpair?
+WVTEST_MAIN("ssl throughput")
+{
+    WvX509Mgr x509("cn=random_stupid_dn", 1024);
+    WvIStreamList list;
+    WvSSLStream *s1, *s2;
+    sslloop(list, x509, s1, s2);
+    
+    // get the handshake out of the way first
+    s2->print("hello\n");
+    run(list, s1, s2);
+    WVPASSEQ(s1->blocking_getline(10000), "hello");
+    s2->outbuf_limit(1024*1024);
+    
+    const size_t total = 64*1024*1024;
+    char chunk[65536];
+    memset(chunk, 'x', sizeof(chunk));
+    size_t sent = 0, got = 0;
+    WvDynBuf buf;
+    WvTime start = wvtime();
+    while (got < total && s1->isok() && s2->isok())
+    {
+	while (sent < total)
+	{
+	    size_t wrote = s2->write(chunk, sizeof(chunk));
+	    sent += wrote;
+	    if (wrote < sizeof(chunk))
+		break;
+	}
+	list.runonce(10);
+	got += s1->read(buf, 1024*1024);
+	buf.zap();
+    }
+    time_t msec = msecdiff(wvtime(), start);
+    WVPASSEQ(got, total);
+    printf("%ld MB through SSL: %ld MB/sec\n", (long)(total >> 20),
+	   msec ? (long)(total >> 20) * 1000 / msec : 0);
+    fflush(stdout);
+}
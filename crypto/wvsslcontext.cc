@@ -0,0 +1,194 @@
+/*
+ * Worldvisions Weaver Software:
+ *   Copyright (C) 1997-2007 Net Integration Technologies, Inc.
+ *
+ * An SSL context that lots of WvSSLStreams can share.  See wvsslcontext.h.
+ */
+#define OPENSSL_NO_KRB5
+#include "wvsslcontext.h"
+#include "wvx509mgr.h"
+#include <openssl/ssl.h>
+#include <openssl/err.h>
+
+UUID_MAP_BEGIN(WvSSLContext)
+  UUID_MAP_ENTRY(IObject)
+  UUID_MAP_END
+
+
+static int wv_verify_cb(int preverify_ok, X509_STORE_CTX *ctx)
+{
+   // This is just returns true, since what we really want
+   // is for the WvSSLValidateCallback to do this work
+   return 1;
+}
+
+
+WvSSLContext::WvSSLContext(WvX509Mgr *_x509, bool _is_server)
+    : debug("SSL Context", WvLog::Debug5)
+{
+    ctx = NULL;
+    x509 = _x509;
+    if (x509)
+	x509->addRef(); // openssl may keep a pointer to this object
+    is_server = _is_server;
+    full = resumed = 0;
+
+    wvssl_init();
+
+    if (x509 && !x509->isok())
+    {
+	seterr("Certificate + key pair invalid.");
+	return;
+    }
+
+    if (is_server && !x509)
+    {
+	seterr("Certificate not available: server mode not possible!");
+	return;
+    }
+
+    ERR_clear_error();
+    ctx = SSL_CTX_new(is_server ? SSLv23_server_method()
+		      : SSLv23_client_method());
+    if (!ctx)
+    {
+	debug("Can't get SSL context! Error: %s\n",
+	      ERR_reason_error_string(ERR_get_error()));
+	seterr("Can't get SSL context!");
+	return;
+    }
+    SSL_CTX_set_app_data(ctx, this);
+
+    if (is_server)
+    {
+	// Allow SSL Writes to only write part of a request...
+	SSL_CTX_set_mode(ctx, SSL_MODE_ENABLE_PARTIAL_WRITE);
+
+	// Tell SSL to use 128 bit or better ciphers - this appears to
+	// be necessary for some reason... *sigh*
+	SSL_CTX_set_cipher_list(ctx, "HIGH");
+
+	// Enable the workarounds for broken clients and servers
+	// and disable the insecure SSLv2 protocol
+        SSL_CTX_set_options(ctx, SSL_OP_ALL|SSL_OP_NO_SSLv2);
+
+	if (!x509->bind_ssl(ctx))
+	{
+	    seterr("Unable to bind Certificate to SSL Context!");
+	    return;
+	}
+
+        SSL_CTX_set_verify(ctx, SSL_VERIFY_PEER|SSL_VERIFY_CLIENT_ONCE,
+                               wv_verify_cb);
+
+	// OpenSSL keeps the server's session cache (and hands out session
+	// tickets) all by itself, but since we ask for client certificates,
+	// it won't resume anything unless we tell it which sessions are ours.
+	static const unsigned char sid_ctx[] = "wvstreams";
+	SSL_CTX_set_session_id_context(ctx, sid_ctx, sizeof(sid_ctx) - 1);
+	SSL_CTX_set_session_cache_mode(ctx, SSL_SESS_CACHE_SERVER);
+
+	debug("Server mode ready.\n");
+    }
+    else
+    {
+        if (x509 && !x509->bind_ssl(ctx))
+        {
+            seterr("Unable to bind Certificate to SSL Context!");
+            return;
+        }
+
+	// We'd rather keep the client sessions ourselves, by peer, than
+	// have OpenSSL keep them by session ID, which doesn't help us find
+	// them again.  WvSSLStream gets them from the new session callback.
+	SSL_CTX_set_session_cache_mode(ctx, SSL_SESS_CACHE_CLIENT
+				       | SSL_SESS_CACHE_NO_INTERNAL_STORE);
+
+	debug("Client mode ready.\n");
+    }
+}
+
+
+WvSSLContext::~WvSSLContext()
+{
+    debug("%s full handshakes, %s resumed.\n", full, resumed);
+    flush_sessions();
+    if (ctx)
+	SSL_CTX_free(ctx);
+    WVRELEASE(x509);
+    wvssl_free();
+}
+
+
+void WvSSLContext::flush_sessions()
+{
+    SessionMap::iterator i;
+    for (i = sessions.begin(); i != sessions.end(); ++i)
+	SSL_SESSION_free(i->second);
+    sessions.clear();
+}
+
+
+bool WvSSLContext::use_ktls(bool enable)
+{
+#ifdef SSL_OP_ENABLE_KTLS
+    if (!ctx)
+	return false;
+    if (enable)
+	SSL_CTX_set_options(ctx, SSL_OP_ENABLE_KTLS);
+    else
+	SSL_CTX_clear_options(ctx, SSL_OP_ENABLE_KTLS);
+    return true;
+#else
+    return !enable;
+#endif
+}
+
+
+void WvSSLContext::save_session(WvStringParm peer, SSL_SESSION *sess)
+{
+    SessionMap::iterator i = sessions.find(peer);
+    if (i != sessions.end())
+    {
+	SSL_SESSION_free(i->second);
+	i->second = sess;
+	return;
+    }
+
+    // Too many?  It doesn't much matter which one goes; it'll just have
+    // to do a full handshake next time.
+    if (sessions.size() >= MAX_SESSIONS)
+    {
+	SSL_SESSION_free(sessions.begin()->second);
+	sessions.erase(sessions.begin());
+    }
+    sessions[peer] = sess;
+}
+
+
+void WvSSLContext::resume_session(WvStringParm peer, SSL *ssl)
+{
+    SessionMap::iterator i = sessions.find(peer);
+    if (i != sessions.end())
+	SSL_set_session(ssl, i->second);
+}
+
+
+void WvSSLContext::forget_session(WvStringParm peer)
+{
+    SessionMap::iterator i = sessions.find(peer);
+    if (i != sessions.end())
+    {
+	SSL_SESSION_free(i->second);
+	sessions.erase(i);
+    }
+}
+
+
+void WvSSLContext::handshake_done(SSL *ssl)
+{
+    if (SSL_session_reused(ssl))
+	resumed++;
+    else
+	full++;
+}
@@ -4,6 +4,8 @@
  */
 #define OPENSSL_NO_KRB5
 #include "wvsslstream.h"
+#include "wvsslcontext.h"
+#include "wvaddr.h"
 #include "wvx509mgr.h"
 #include "wvcrypto.h"
 #include "wvlistener.h"
@@ -171,88 +173,49 @@ WvSSLStream::WvSSLStream(IWvStream *_slave, WvX509Mgr *_x509,
     WvStreamClone(_slave),
     debug(WvString("WvSSLStream %s", ++ssl_stream_count), WvLog::Debug5),
     write_bouncebuf(MAX_BOUNCE_AMOUNT), write_eat(0),
-    read_bouncebuf(MAX_BOUNCE_AMOUNT), read_pending(false)
+    read_pending(false)
 {
-    x509 = _x509;
-    if (x509)
-	x509->addRef(); // openssl may keep a pointer to this object
-    
+    // a context all our own, which nobody else will ever get to use
+    context = new WvSSLContext(_x509, _is_server);
     vcb = _vcb;
-    if (!vcb && global_vcb)
-	vcb = wv::bind(global_vcb, _1, this);;
+    init();
+}
+
+
+WvSSLStream::WvSSLStream(IWvStream *_slave, WvSSLContext &_context,
+    WvSSLValidateCallback _vcb) :
+    WvStreamClone(_slave),
+    debug(WvString("WvSSLStream %s", ++ssl_stream_count), WvLog::Debug5),
+    write_bouncebuf(MAX_BOUNCE_AMOUNT), write_eat(0),
+    read_pending(false)
+{
+    context = &_context;
+    context->addRef();
+    vcb = _vcb;
+    init();
+}
+
 
-    is_server = _is_server;
-    ctx = NULL;
+void WvSSLStream::init()
+{
+    x509 = context->x509;
+    ctx = context->ctx;
+    is_server = context->server();
+    
+    if (!vcb && global_vcb)
+	vcb = wv::bind(global_vcb, _1, this);
+    
     ssl = NULL;
-    //meth = NULL;
     sslconnected = ssl_stop_read = ssl_stop_write = false;
+    ktls_send = false;
     
     wvssl_init();
     
-    if (x509 && !x509->isok())
+    if (!context->isok())
     {
-	seterr("Certificate + key pair invalid.");
+	seterr(context->errstr());
 	return;
     }
-
-    if (is_server && !x509)
-    {
-	seterr("Certificate not available: server mode not possible!");
-	return;
-    }
-
-    if (is_server)
-    {
-    	debug("Configured algorithms and methods for server mode.\n");
-
-	ctx = SSL_CTX_new(SSLv23_server_method());
-    	if (!ctx)
-    	{
-            ERR_print_errors_fp(stderr);
-            debug("Can't get SSL context! Error: %s\n", 
-                  ERR_reason_error_string(ERR_get_error()));
-	    seterr("Can't get SSL context!");
-	    return;
-    	}
-	
-	// Allow SSL Writes to only write part of a request...
-	SSL_CTX_set_mode(ctx, SSL_MODE_ENABLE_PARTIAL_WRITE);
-
-	// Tell SSL to use 128 bit or better ciphers - this appears to
-	// be necessary for some reason... *sigh*
-	SSL_CTX_set_cipher_list(ctx, "HIGH");
-
-	// Enable the workarounds for broken clients and servers
-	// and disable the insecure SSLv2 protocol
-        SSL_CTX_set_options(ctx, SSL_OP_ALL|SSL_OP_NO_SSLv2);
-
-	if (!x509->bind_ssl(ctx))
-	{
-	    seterr("Unable to bind Certificate to SSL Context!");
-	    return;
-	}
-	
-        SSL_CTX_set_verify(ctx, SSL_VERIFY_PEER|SSL_VERIFY_CLIENT_ONCE, 
-                               wv_verify_cb);
-	
-	debug("Server mode ready.\n");
-    }
-    else
-    {
-    	debug("Configured algorithms and methods for client mode.\n");
-    
-    	ctx = SSL_CTX_new(SSLv23_client_method());
-    	if (!ctx)
-    	{
-	    seterr("Can't get SSL context!");
-	    return;
-    	}
-        if (x509 && !x509->bind_ssl(ctx))
-        {
-            seterr("Unable to bind Certificate to SSL Context!");
-            return;
-        }
-    }
     
     //SSL_CTX_set_read_ahead(ctx, 1);
 
@@ -263,6 +226,14 @@ WvSSLStream::WvSSLStream(IWvStream *_slave, WvX509Mgr *_x509,
     	seterr("Can't create SSL object!");
 	return;
     }
+    SSL_set_app_data(ssl, this);
+    
+    // We hand SSL_write() the caller's data directly, but if it has to be
+    // retried, it gets our copy instead, at a different address.
+    SSL_set_mode(ssl, SSL_MODE_ENABLE_PARTIAL_WRITE
+		 | SSL_MODE_ACCEPT_MOVING_WRITE_BUFFER);
+    if (!is_server)
+	SSL_CTX_sess_set_new_cb(ctx, new_session_cb);
 
     // If we set this, it seems we always verify the client... security hole,
     // no?  Well, if we don't set it, the server doesn't even ask the client
@@ -288,11 +259,21 @@ WvSSLStream::~WvSSLStream()
     if (geterr())
 	debug("Error was: %s\n", errstr());
     
-    WVRELEASE(x509);
+    WVRELEASE(context);
     wvssl_free();
 }
 
 
+int WvSSLStream::new_session_cb(SSL *ssl, SSL_SESSION *sess)
+{
+    WvSSLStream *s = (WvSSLStream *)SSL_get_app_data(ssl);
+    if (!s || !s->peer)
+	return 0; // we don't know who it's from, so it's no use to us
+    s->context->save_session(s->peer, sess);
+    return 1; // we're keeping it
+}
+
+
 void WvSSLStream::printerr(WvStringParm func)
 {
     unsigned long l = ERR_get_error();
@@ -317,113 +298,72 @@ size_t WvSSLStream::uread(void *buf, size_t len)
     // the next time around unless we're sure there is nothing left
     read_pending = true;
     
-    size_t total = 0;
-    for (;;)
+    // SSL_read() doesn't care if we call it again with a different buffer,
+    // so it can decrypt straight into the caller's.
+    ERR_clear_error();
+    int result = SSL_read(ssl, buf, len);
+    // debug("<< SSL_read result %s for %s bytes\n", result, len);
+    if (result <= 0)
     {
-        // handle SSL_read quirk
-        if (read_bouncebuf.used() != 0)
-        {
-            // copy out cached data
-            size_t amount = len < read_bouncebuf.used() ?
-                len : read_bouncebuf.used();
-            read_bouncebuf.move(buf, amount);
-
-            // locate next chunk in buffer
-            len -= amount;
-            total += amount;
-            if (len == 0)
-	    {
-		read_pending = false;
-                break;
-	    }
-            buf = (unsigned char *)buf + amount;
-	    
-	    // FIXME: this shouldn't be necessary, but it resolves weird
-	    // problems when the other end disconnects in the middle of
-	    // SSL negotiation, but only on emakela's machine.  I don't
-	    // know why.  -- apenwarr (2004/02/10)
-	    break;
-        }
-
-        // attempt to read
-        read_bouncebuf.zap(); // force use of same position in buffer
-        size_t avail = read_bouncebuf.free();
-        unsigned char *data = read_bouncebuf.alloc(avail);
-        
-	ERR_clear_error();
-        int result = SSL_read(ssl, data, avail);
-	// debug("<< SSL_read result %s for %s bytes (wanted %s)\n",
-	//      result, avail, len);
-        if (result <= 0)
-        {
-	    error_t err = errno;
-            read_bouncebuf.unalloc(avail);
-            int sslerrcode = SSL_get_error(ssl, result);
-	    switch (sslerrcode)
-            {
-                case SSL_ERROR_WANT_READ:
-		    debug("<< SSL_read() needs to wait for writable.\n");
-                    break; // wait for later
-                case SSL_ERROR_WANT_WRITE:
-		    debug("<< SSL_read() needs to wait for readable.\n");
-                    break; // wait for later
-                    
-                case SSL_ERROR_NONE:
-                    break; // no error, but can't make progress
-                    
-	        case SSL_ERROR_ZERO_RETURN:
-		    debug("<< EOF: zero return\n");
+	error_t err = errno;
+	int sslerrcode = SSL_get_error(ssl, result);
+	switch (sslerrcode)
+	{
+	    case SSL_ERROR_WANT_READ:
+		debug("<< SSL_read() needs to wait for writable.\n");
+		break; // wait for later
+	    case SSL_ERROR_WANT_WRITE:
+		debug("<< SSL_read() needs to wait for readable.\n");
+		break; // wait for later
 		
-		    // don't do this if we're returning nonzero!
-		    // (SSL has no way to do a one-way shutdown, so if SSL
-		    // detects a read problem, it's also a write problem.)
-		    if (!total) { noread(); nowrite(); }
-                    break;
-
-		case SSL_ERROR_SYSCALL:
-		    if (!err)
-		    {
-			if (result == 0)
-			{
-			    debug("<< EOF: syscall error "
-				  "(%s/%s, %s/%s) total=%s\n",
-				  stop_read, stop_write,
-				  isok(), cloned && cloned->isok(), total);
-			    
-			    // don't do this if we're returning nonzero!
-			    // (SSL has no way to do a one-way shutdown, so
-			    // if SSL detects a read problem, it's also a
-			    // write problem.)
-			    if (!total) { noread(); nowrite(); }
-			}
-		    }
-		    else
+	    case SSL_ERROR_NONE:
+		break; // no error, but can't make progress
+		
+	    case SSL_ERROR_ZERO_RETURN:
+		debug("<< EOF: zero return\n");
+		
+		// SSL has no way to do a one-way shutdown, so if SSL detects
+		// a read problem, it's also a write problem.
+		noread(); nowrite();
+		break;
+
+	    case SSL_ERROR_SYSCALL:
+		if (!err)
+		{
+		    if (result == 0)
 		    {
-			debug("<< SSL_read() err=%s (%s)\n",
-			    err, strerror(err));
-			seterr_both(err, WvString("SSL read: %s",
-			    strerror(err)));
+			debug("<< EOF: syscall error (%s/%s, %s/%s)\n",
+			      stop_read, stop_write,
+			      isok(), cloned && cloned->isok());
+			
+			// SSL has no way to do a one-way shutdown, so if SSL
+			// detects a read problem, it's also a write problem.
+			noread(); nowrite();
 		    }
-		    break;
-                    
-                default:
-                    printerr("SSL_read");
-                    seterr("SSL read error #%s", sslerrcode);
-                    break;
-            }
-            read_pending = false;
-            break; // wait for next iteration
-        }
-	// debug("<< read result was %s\n", result);
-	
-	if (result < 0)
-	    result = 0;
-        read_bouncebuf.unalloc(avail - result);
+		}
+		else
+		{
+		    debug("<< SSL_read() err=%s (%s)\n", err, strerror(err));
+		    seterr_both(err, WvString("SSL read: %s", strerror(err)));
+		}
+		break;
+		
+	    default:
+		printerr("SSL_read");
+		seterr("SSL read error #%s", sslerrcode);
+		break;
+	}
+	read_pending = false;
+	return 0; // wait for next iteration
     }
+    
+    // SSL_read() only hands out one record at a time, so if we filled
+    // buf, or it's still got some, there's more where that came from.
+    read_pending = (size_t)result == len || SSL_pending(ssl) > 0;
 
     // debug("<< read %s bytes (%s, %s)\n",
-    //	  total, isok(), cloned && cloned->isok());
-    return total;
+    //	  result, isok(), cloned && cloned->isok());
+    return result;
 }
 
 
@@ -438,6 +378,10 @@ size_t WvSSLStream::uwrite(const void *buf, size_t len)
 
     if (len == 0) return 0;
 
+    // if the kernel does the encryption, SSL has nothing left to do
+    if (ktls_send)
+	return WvStreamClone::uwrite(buf, len);
+
 //    debug(">> I want to write %s bytes.\n", len);
 
     size_t total = 0;
@@ -461,25 +405,24 @@ size_t WvSSLStream::uwrite(const void *buf, size_t len)
     // 
     for (;;) 
     {
-        // handle SSL_write quirk
-        if (write_bouncebuf.used() == 0)
+        // handle SSL_write quirk: if the bounce buffer isn't empty, then
+        // SSL_write returned SSL_ERROR_WANT_WRITE on the previous call and
+        // we must invoke it with precisely the same data.  Otherwise, we
+        // can encrypt straight out of buf, one record at a time.
+        const unsigned char *data;
+        size_t used = write_bouncebuf.used();
+        bool bounced = used != 0;
+        if (bounced)
+            data = write_bouncebuf.get(used);
+        else
         {
             if (len == 0) break;
-
-            // copy new data into the bounce buffer only if empty
-            // if it were not empty, then SSL_write probably returned
-            // SSL_ERROR_WANT_WRITE on the previous call and we
-            // must invoke it with precisely the same arguments
-            size_t amount = len < write_bouncebuf.free() ?
-                len : write_bouncebuf.free();
-            write_bouncebuf.put(buf, amount);
+            used = len < MAX_BOUNCE_AMOUNT ? len : MAX_BOUNCE_AMOUNT;
+            data = (const unsigned char *)buf;
             // note: we don't adjust the total yet...
-        } // otherwise we use what we cached last time in bounce buffer
+        }
         
         // attempt to write
-        size_t used = write_bouncebuf.used();
-        const unsigned char *data = write_bouncebuf.get(used);
-
         ERR_clear_error();
         int result = SSL_write(ssl, data, used);
 	// debug("<< SSL_write result %s for %s bytes\n",
@@ -487,7 +430,16 @@ size_t WvSSLStream::uwrite(const void *buf, size_t len)
         if (result <= 0)
         {
             int sslerrcode = SSL_get_error(ssl, result);
-            write_bouncebuf.unget(used);
+            
+            // We'll have to try again with the same bytes, but the caller
+            // doesn't have to give them back to us exactly the same way,
+            // so this is the one time we need our own copy.
+            if (bounced)
+                write_bouncebuf.unget(used);
+            else if (sslerrcode == SSL_ERROR_WANT_READ
+                     || sslerrcode == SSL_ERROR_WANT_WRITE)
+                write_bouncebuf.put(data, used);
+            
             switch (sslerrcode)
             {
                 case SSL_ERROR_WANT_READ:
@@ -550,6 +502,55 @@ size_t WvSSLStream::uwrite(const void *buf, size_t len)
     return total;
 }
 
+size_t WvSSLStream::sendfile(int fd, off_t offset, size_t len)
+{
+    if (!isok() || !len || stop_write)
+	return 0;
+    
+    size_t total = 0;
+#ifdef SSL_OP_ENABLE_KTLS
+    // The file can go straight from the page cache to the socket, but
+    // only if nothing's still waiting to go out ahead of it.  Whatever
+    // the socket doesn't take now goes the slow way, below.
+    if (ktls_send && flush(0))
+    {
+	ERR_clear_error();
+	ossl_ssize_t sent = SSL_sendfile(ssl, fd, offset, len, 0);
+	if (sent > 0)
+	{
+	    total = sent;
+	    offset += sent;
+	    len -= sent;
+	}
+	else if (SSL_get_error(ssl, sent) != SSL_ERROR_WANT_WRITE)
+	    debug(">> SSL_sendfile() failed (%s); reading it instead.\n",
+		  strerror(errno));
+    }
+#endif
+    
+    // the slow way: read it in, and write it like anything else
+    WvDynBuf buf;
+    while (len)
+    {
+	size_t want = len < 65536 ? len : 65536;
+	unsigned char *p = buf.alloc(want);
+	ssize_t got = pread(fd, p, want, offset);
+	buf.unalloc(want - (got > 0 ? got : 0));
+	if (got <= 0)
+	    break;
+	
+	size_t wrote = write(buf, got);
+	buf.zap();
+	total += wrote;
+	offset += wrote;
+	len -= wrote;
+	if (wrote < (size_t)got)
+	    break; // outbuf_limit()
+    }
+    return total;
+}
+
+
 void WvSSLStream::close()
 {
     debug("Closing SSL connection (ok=%s,sr=%s,sw=%s,child=%s).\n",
@@ -565,12 +566,6 @@ void WvSSLStream::close()
     }
     
     WvStreamClone::close();
-    
-    if (ctx)
-    {
-	SSL_CTX_free(ctx);
-	ctx = NULL;
-    }
 }
 
 
@@ -618,15 +613,14 @@ void WvSSLStream::pre_select(SelectInfo &si)
 	si.inherit_request = true; // ignore force_select() until connected
     }
     
-    // the SSL library might be keeping its own internal buffers
-    // or we might have left buffered data behind deliberately
-    if (si.wants.readable && (read_pending || read_bouncebuf.used()))
+    // the SSL library might be keeping its own internal buffers, so don't
+    // wait for the fd.  (Check the same things post_select() does, or a
+    // WvPoller won't even ask post_select().)  But still ask about the fd,
+    // or we'd never find out when we can flush outbuf.
+    if ((si.wants.readable || readcb) && read_pending)
     {
 	// debug("pre_select: try reading again immediately.\n");
 	si.msec_timeout = 0;
-	si.inherit_request = oldinherit;
-	si.wants = oldwant;
-	return;
     }
 
     WvStreamClone::pre_select(si);
@@ -668,6 +662,15 @@ bool WvSSLStream::post_select(SelectInfo &si)
         WvFDStream *fdstream = static_cast<WvFDStream*>(cloned);
         int fd = fdstream->getfd();
         assert(fd >= 0);
+	
+	// if we've talked to this peer before, maybe we can skip most of
+	// the handshake
+	if (!is_server && SSL_get_fd(ssl) < 0 && cloned->src())
+	{
+	    peer = *cloned->src();
+	    context->resume_session(peer, ssl);
+	}
+	
         ERR_clear_error();
 	SSL_set_fd(ssl, fd);
 //	debug("SSL connected on fd %s.\n", fd);
@@ -687,20 +690,30 @@ bool WvSSLStream::post_select(SelectInfo &si)
 	{
 	    if (errno == EAGAIN)
 		debug("Still waiting for SSL negotiation.\n");
-	    else if (!errno)
-            {
-                printerr(is_server ? "SSL_accept" : "SSL_connect");
-		seterr(WvString("SSL negotiation failed (%s)!", err));
-            }
 	    else
-            {
+	    {
                 printerr(is_server ? "SSL_accept" : "SSL_connect");
-		seterr(errno);
-            }
+		if (!errno)
+		    seterr(WvString("SSL negotiation failed (%s)!", err));
+		else
+		    seterr(errno);
+		
+		// in case it was the old session it didn't like
+		if (!!peer)
+		    context->forget_session(peer);
+	    }
 	}
 	else  // We're connected, so let's do some checks ;)
 	{
-	    debug("SSL connection using cipher %s.\n", SSL_get_cipher(ssl));
+	    context->handshake_done(ssl);
+	    debug("SSL connection using cipher %s%s.\n", SSL_get_cipher(ssl),
+		  SSL_session_reused(ssl) ? " (resumed)" : "");
+#ifdef SSL_OP_ENABLE_KTLS
+	    // only if WvSSLContext::use_ktls() asked for it, and it worked
+	    ktls_send = BIO_get_ktls_send(SSL_get_wbio(ssl));
+	    if (ktls_send)
+		debug("Kernel TLS is doing the encryption.\n");
+#endif
 
 	    WvX509 *peercert = new WvX509(SSL_get_peer_certificate(ssl));
 	    //Should we try to validate before storing, or not?
@@ -734,8 +747,7 @@ bool WvSSLStream::post_select(SelectInfo &si)
 	return false;
     }
 
-    if ((si.wants.readable || readcb)
-	&& (read_pending || read_bouncebuf.used()))
+    if ((si.wants.readable || readcb) && read_pending)
 	result = true;
 
     return result;
@@ -5,6 +5,7 @@
 #include "wvfork.h"
 #include "wvtest.h"
 #include "wvloopback.h"
+#include "wvtimeutils.h"
 #include "wvuid.h"
 
 
@@ -220,6 +221,98 @@ WVTEST_MAIN("dbusserver overlapping registrations")
     delete l2;
 }
 
+static int busreplies = 0;
+static bool busreply(WvDBusMsg &msg)
+{
+    WVFAIL(msg.iserror());
+    busreplies++;
+    return true;
+}
+
+
+static void busmatch(WvDBusConn &conn, WvStringParm method,
+		     WvStringParm rule)
+{
+    int want = busreplies + 1;
+    conn.send(WvDBusMsg("org.freedesktop.DBus", "/org/freedesktop/DBus",
+			"org.freedesktop.DBus", method).append(rule),
+	      busreply);
+    while (busreplies < want)
+	WvIStreamList::globallist.runonce();
+}
+
+
+static int buserrors = 0;
+static bool buserror(WvDBusMsg &msg)
+{
+    WVPASS(msg.iserror());
+    buserrors++;
+    return true;
+}
+
+
+static WvStringList members_seen;
+static bool member_seen(WvDBusMsg &msg)
+{
+    if (msg.get_interface() != "x.y.z.anything")
+	return false;
+    members_seen.append(msg.get_member());
+    return true;
+}
+
+
+WVTEST_MAIN("dbusserver match rules")
+{
+    TestDBusServer serv;
+    WvDBusConn conn1(serv.moniker);
+    WvDBusConn conn2(serv.moniker);
+    WvIStreamList::globallist.append(&conn1, false, "dbus connection 1");
+    WvIStreamList::globallist.append(&conn2, false, "dbus connection 2");
+    conn2.add_callback(WvDBusConn::PriNormal, member_seen);
+
+    // WvDBusConn asks for every signal when it connects; take that back
+    // and ask for just the ones we want, twice over
+    busmatch(conn2, "RemoveMatch", "type='signal'");
+    busmatch(conn2, "AddMatch",
+	     "type='signal',interface='x.y.z.anything',member='wanted'");
+    busmatch(conn2, "AddMatch", "member='wanted', path_namespace='/foo'");
+    busmatch(conn2, "AddMatch", "type='signal',arg0='special'");
+
+    WvDBusSignal("/foo/bar", "x.y.z.anything", "wanted").send(conn1);
+    WvDBusSignal("/foo/bar", "x.y.z.anything", "unwanted").send(conn1);
+    WvDBusSignal("/foo/bar", "x.y.z.anything", "unwanted")
+	.append("special").send(conn1);
+    WvDBusSignal("/", "x.y.z.anything", "wanted").send(conn1);
+    while (members_seen.count() < 3 || WvIStreamList::globallist.select(200))
+	WvIStreamList::globallist.runonce();
+    WVPASSEQ(members_seen.join(" "), "wanted unwanted wanted");
+
+    // every rule that matched got counted, even though conn2 only got
+    // each message once
+    WvStringList counts;
+    WvDBusMatchRuleList::Iter i(serv.s->match_rules());
+    for (i.rewind(); i.next(); )
+	if (i->conn->uniquename() == conn2.uniquename())
+	    counts.append("%s", i->matched);
+    WVPASSEQ(counts.join(" "), "2 1 1");
+
+    // nonsense gets an error back
+    conn2.send(WvDBusMsg("org.freedesktop.DBus", "/org/freedesktop/DBus",
+			 "org.freedesktop.DBus", "AddMatch")
+	       .append("type='nonsense'"), buserror);
+    conn2.send(WvDBusMsg("org.freedesktop.DBus", "/org/freedesktop/DBus",
+			 "org.freedesktop.DBus", "RemoveMatch")
+	       .append("member='never added'"), buserror);
+    while (buserrors < 2)
+	WvIStreamList::globallist.runonce();
+    members_seen.zap();
+    WvDBusSignal("/foo", "x.y.z.anything", "wanted").send(conn1);
+    while (members_seen.count() < 1 || WvIStreamList::globallist.select(200))
+	WvIStreamList::globallist.runonce();
+    WVPASSEQ(members_seen.count(), 1);
+}
+
+
 static bool got_uid = false;
 static bool check_uid(WvDBusMsg &msg)
 {
@@ -290,3 +383,53 @@ WVTEST_MAIN("GetConnectionUnixUser")
 
     conn1.close();
 }
+
+
+static int sunk = 0;
+static bool sink(WvDBusMsg &msg)
+{
+    if (msg.get_member() != "sink")
+	return false;
+    sunk++;
+    return true;
+}
+
+
+// Not really a test: just sees how fast the server can pass messages from
+// one client to another.
+WVTEST_MAIN("dbusserver forwarding speed")
+{
+    TestDBusServer serv;
+    WvDBusConn from(serv.moniker);
+    WvDBusConn to(serv.moniker);
+    WvIStreamList::globallist.append(&from, false, "dbus connection 1");
+    WvIStreamList::globallist.append(&to, false, "dbus connection 2");
+    
+    to.add_callback(WvDBusConn::PriNormal, sink);
+    
+    reg_count = 0;
+    from.request_name("ca.nit.Source", name_registered);
+    to.request_name("ca.nit.Sink", name_registered);
+    while (reg_count < 2)
+         WvIStreamList::globallist.runonce();
+    
+    const int num = 20000;
+    sunk = 0;
+    WvTime start = wvstime();
+    for (int i = 0; i < num; i++)
+    {
+	WvDBusMsg("ca.nit.Sink", "/sink", "ca.nit.Sink", "sink")
+	    .append("some string argument").append(i)
+	    .array_start("s").append("one").append("two").array_end()
+	    .send(from);
+	if (i % 100 == 0)
+	    WvIStreamList::globallist.runonce(0);
+    }
+    while (sunk < num)
+	WvIStreamList::globallist.runonce(100);
+    time_t ms = msecdiff(wvstime(), start);
+    
+    WVPASSEQ(sunk, num);
+    printf("%d messages through the server: %ld/sec\n",
+	   num, (long)(num * 1000 / (ms ? ms : 1)));
+}
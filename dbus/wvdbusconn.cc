@@ -205,6 +205,17 @@ uint32_t WvDBusConn::send(WvDBusMsg msg)
 }
 
 
+uint32_t WvDBusConn::forward(WvDBusMsg &msg)
+{
+    // Unlike send(), don't log the whole message: whoever's forwarding it
+    // already logged it on the way in, and printing it twice is slow.
+    msg.splice(out_queue);
+    if (authorized)
+	write(out_queue);
+    return msg.get_serial();
+}
+
+
 void WvDBusConn::send(WvDBusMsg msg, const WvDBusCallback &onreply,
 		      time_t msec_timeout)
 {
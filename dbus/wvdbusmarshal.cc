@@ -1,43 +1,156 @@
 /* -*- Mode: C++ -*-
  * Worldvisions Weaver Software:
  *   Copyright (C) 2004-2006 Net Integration Technologies, Inc.
- * 
- * Wrapper code for marshalling/demarshalling WvDBusMsg objects.  This is
- * in a separate file from WvDBusMsg in case you want to use a WvDBusMsg
- * but not our special/gross marshalling code from wvdbusmarshal_c.c.
- * 
- */ 
+ *
+ * Code for marshalling/demarshalling WvDBusMsg objects.  We do it
+ * ourselves instead of asking libdbus: the header gets written straight
+ * into the output buffer, and incoming messages get picked apart right
+ * where they are in the input buffer.
+ *
+ */
 #include "wvdbusmsg.h"
 #undef interface // windows
 #include <dbus/dbus.h>
 
+// The part of the header that's always there: byte order, type, flags,
+// protocol version, body length, serial, and the length of the array of
+// header fields.
+#define FIXED_HEADER 16
 
-static int wvdbus_message_length(const char *buf, size_t len)
+// Nothing's allowed to be bigger than this, says the spec.
+#define MAX_MESSAGE (128*1024*1024)
+
+
+static bool host_bigendian()
 {
-    int msglen = dbus_message_demarshal_bytes_needed(buf, len);
-    if (msglen > 0)
-        return msglen;
-    else if (msglen == 0)
-        return DBUS_MINIMUM_HEADER_SIZE;
+    static const uint16_t one = 1;
+    return *(const unsigned char *)&one == 0;
+}
 
-    return 0;
+
+static uint32_t swap32(uint32_t x)
+{
+    return (x >> 24) | ((x >> 8) & 0xff00) | ((x << 8) & 0xff0000) | (x << 24);
 }
 
 
-WvDBusMsg *WvDBusMsg::demarshal(WvBuf &buf)
+static uint32_t read32(const unsigned char *p, bool swap)
 {
-    // to make sure bytes are aligned (as required by d-bus), copy them into a 
-    // new buffer (not very efficient, but what can you do without reworking
-    // our buffer implementation)
-    WvDynBuf alignedbuf;
-    size_t buflen = buf.used();
-    alignedbuf.put(buf.peek(0, buflen), buflen);
+    uint32_t x;
+    memcpy(&x, p, 4);
+    return swap ? swap32(x) : x;
+}
+
+
+// Writes a header into p, or just counts how long it would be if p is
+// NULL.  Alignment is relative to p, which is the start of the message.
+class WvDBusHeaderWriter
+{
+public:
+    unsigned char *p;
+    size_t off;
+    bool swap;
+
+    WvDBusHeaderWriter(unsigned char *_p, bool _swap)
+	: p(_p), off(0), swap(_swap)
+	{ }
+
+    void pad(size_t n)
+    {
+	size_t next = (off + n - 1) & ~(n - 1);
+	if (p)
+	    memset(p + off, 0, next - off);
+	off = next;
+    }
+
+    void byte(unsigned char c)
+    {
+	if (p)
+	    p[off] = c;
+	off++;
+    }
+
+    void u32(uint32_t x)
+    {
+	pad(4);
+	if (p)
+	{
+	    if (swap)
+		x = swap32(x);
+	    memcpy(p + off, &x, 4);
+	}
+	off += 4;
+    }
+
+    void bytes(const char *s, size_t len)
+    {
+	if (p)
+	    memcpy(p + off, s, len);
+	off += len;
+    }
+
+    // A header field is a struct of its code and a variant.
+    void field_start(int code, char type)
+    {
+	pad(8);
+	byte(code);
+	byte(1);
+	byte(type);
+	byte(0);
+    }
+
+    void field(int code, char type, WvStringParm s)
+    {
+	if (s.isnull())
+	    return;
+	size_t len = s.len();
+	field_start(code, type);
+	if (type == DBUS_TYPE_SIGNATURE)
+	    byte(len);
+	else
+	    u32(len);
+	bytes(s.cstr(), len + 1);
+    }
+
+    void field(int code, uint32_t x)
+    {
+	if (!x)
+	    return;
+	field_start(code, DBUS_TYPE_UINT32);
+	u32(x);
+    }
+};
+
+
+// Looks at the fixed part of a header, and returns how long the whole
+// message is (and its header, in hdrlen), or 0 if it's garbage.
+static size_t message_length(const unsigned char *p, size_t &hdrlen)
+{
+    if ((p[0] != DBUS_LITTLE_ENDIAN && p[0] != DBUS_BIG_ENDIAN)
+	|| p[3] != DBUS_MAJOR_PROTOCOL_VERSION)
+	return 0;
 
+    bool swap = (p[0] == DBUS_BIG_ENDIAN) != host_bigendian();
+    size_t bodylen = read32(p + 4, swap), fieldlen = read32(p + 12, swap);
+    if (bodylen > MAX_MESSAGE || fieldlen > MAX_MESSAGE)
+	return 0;
+
+    hdrlen = (FIXED_HEADER + fieldlen + 7) & ~7;
+    if (hdrlen + bodylen > MAX_MESSAGE)
+	return 0;
+    return hdrlen + bodylen;
+}
+
+
+WvDBusMsg *WvDBusMsg::demarshal(WvBuf &buf)
+{
     // first get size of message to demarshal. if too little or bad length,
     // return NULL (possibly after consuming the bad data)
-    size_t messagelen = wvdbus_message_length((const char *)
-                                              alignedbuf.peek(0, buflen), 
-                                              buflen);
+    size_t buflen = buf.used();
+    if (buflen < FIXED_HEADER)
+	return NULL;
+    size_t hdrlen = 0;
+    size_t messagelen = message_length(buf.peek(0, FIXED_HEADER), hdrlen);
     if (messagelen == 0) // invalid message data
     {
 	buf.get(buflen); // clear invalid crap - the best we can do
@@ -46,54 +159,209 @@ WvDBusMsg *WvDBusMsg::demarshal(WvBuf &buf)
     else if (messagelen > buflen) // not enough data
 	return NULL;
 
-    // Assuming that worked and we can demarshal a message, try to do so
-    DBusError error;
-    dbus_error_init(&error);
-    DBusMessage *_msg = dbus_message_demarshal((const char *)
-                                               alignedbuf.peek(0, buflen), 
-                                               messagelen, &error);
-    if (dbus_error_is_set(&error))
-        dbus_error_free (&error);
-    buf.get(messagelen);
-
-    if (_msg)
+    // The header fields are an array of (byte, variant), so we can just
+    // walk through them with an Iter, right where they are in buf.
+    const unsigned char *p = buf.peek(0, hdrlen);
+    bool swap = (p[0] == DBUS_BIG_ENDIAN) != host_bigendian();
+    WvDBusMsg *msg = new WvDBusMsg;
+    Data *d = msg->d;
+    d->bigendian = (p[0] == DBUS_BIG_ENDIAN);
+    d->type = p[1];
+    d->flags = p[2];
+    d->serial = read32(p + 8, swap);
+
+    static const char fieldsig[] = "a(yv)";
+    Iter top(p, swap, fieldsig, fieldsig + 5,
+	     FIXED_HEADER - 4, FIXED_HEADER + read32(p + 12, swap), false);
+    bool ok = top.next();
+    Iter fields(top.open());
+    for (fields.rewind(); ok && fields.next(); )
     {
-	WvDBusMsg *msg = new WvDBusMsg(_msg);
-	dbus_message_unref(_msg);
-	return msg;
+	Iter f(fields.open());
+	int code = f.getnext().get_int();
+	Iter v(f.getnext().open());
+	v.next();
+
+	int want;
+	WvString *str = NULL;
+	switch (code)
+	{
+	case DBUS_HEADER_FIELD_PATH:
+	    want = DBUS_TYPE_OBJECT_PATH;
+	    str = &d->path;
+	    break;
+	case DBUS_HEADER_FIELD_INTERFACE:
+	    want = DBUS_TYPE_STRING;
+	    str = &d->iface;
+	    break;
+	case DBUS_HEADER_FIELD_MEMBER:
+	    want = DBUS_TYPE_STRING;
+	    str = &d->member;
+	    break;
+	case DBUS_HEADER_FIELD_ERROR_NAME:
+	    want = DBUS_TYPE_STRING;
+	    str = &d->error;
+	    break;
+	case DBUS_HEADER_FIELD_DESTINATION:
+	    want = DBUS_TYPE_STRING;
+	    str = &d->dest;
+	    break;
+	case DBUS_HEADER_FIELD_SENDER:
+	    want = DBUS_TYPE_STRING;
+	    str = &d->sender;
+	    break;
+	case DBUS_HEADER_FIELD_SIGNATURE:
+	    want = DBUS_TYPE_SIGNATURE;
+	    str = &d->sig;
+	    break;
+	case DBUS_HEADER_FIELD_REPLY_SERIAL:
+	    want = DBUS_TYPE_UINT32;
+	    if (v.type() == want)
+		d->replyserial = v.get32();
+	    break;
+	default:
+	    continue; // we're supposed to ignore ones we don't know
+	}
+
+	if (v.type() != want)
+	    ok = false;
+	else if (str)
+	    *str = v.get_cstr();
     }
-    else
+
+    switch (d->type)
+    {
+    case DBUS_MESSAGE_TYPE_INVALID:
+	ok = false;
+	break;
+    case DBUS_MESSAGE_TYPE_METHOD_CALL:
+	ok = ok && !!d->path && !!d->member;
+	break;
+    case DBUS_MESSAGE_TYPE_SIGNAL:
+	ok = ok && !!d->path && !!d->iface && !!d->member;
+	break;
+    case DBUS_MESSAGE_TYPE_ERROR:
+	ok = ok && !!d->error && d->replyserial;
+	break;
+    case DBUS_MESSAGE_TYPE_METHOD_RETURN:
+	ok = ok && d->replyserial;
+	break;
+    }
+
+    // The message is ours now.  If it's in its own chunk of buf, merge()
+    // just takes that instead of copying it.  We keep the header too, so
+    // that marshal() can pass it along without making a new one.
+    d->body.merge(buf, messagelen);
+    d->rawhdr = hdrlen;
+    d->rawsender = !!d->sender;
+    if (!ok || !msg->body_ok())
+    {
+	delete msg;
 	return NULL;
+    }
+    return msg;
 }
 
 
 size_t WvDBusMsg::demarshal_bytes_needed(WvBuf &buf)
 {
-    // to make sure bytes are aligned (as required by d-bus), copy them into a 
-    // new buffer (not very efficient, but what can you do without reworking
-    // our buffer implementation)
-    WvDynBuf alignedbuf;
-    size_t used = buf.used();
-    alignedbuf.put(buf.peek(0, used), used);
-
-    return wvdbus_message_length((const char *)alignedbuf.peek(0, used), used);
+    if (buf.used() < FIXED_HEADER)
+	return FIXED_HEADER;
+    size_t hdrlen;
+    return message_length(buf.peek(0, FIXED_HEADER), hdrlen);
 }
 
 
-void WvDBusMsg::marshal(WvBuf &buf)
+void WvDBusMsg::marshal_header(WvBuf &buf)
 {
-    DBusMessage *msg = *this;
+    static uint32_t global_serial = 1000;
+    if (!d->serial)
+        d->serial = ++global_serial;
 
-    static uint32_t global_serial = 1000;   
-    if (!dbus_message_get_serial(msg))
+    // Go through the header twice: once to see how long it is, and then
+    // again to write it straight into buf.
+    bool swap = d->bigendian != host_bigendian();
+    const unsigned char *raw = NULL;
+    size_t rawlen = 0;
+    if (d->rawhdr)
     {
-        dbus_message_set_serial(msg, ++global_serial);
+	raw = d->body.peek(0, d->rawhdr);
+	rawlen = FIXED_HEADER + read32(raw + 12, swap);
     }
+    unsigned char *p = NULL;
+    size_t fieldlen = 0;
+    for (;;)
+    {
+	WvDBusHeaderWriter w(p, swap);
+	if (raw)
+	{
+	    // We're passing along a message we got, so the header it came
+	    // with is fine, except that it might need a sender.
+	    w.bytes((const char *)raw, rawlen);
+	    if (!d->rawsender)
+		w.field(DBUS_HEADER_FIELD_SENDER, DBUS_TYPE_STRING, d->sender);
+	}
+	else
+	{
+	    // the serial and the length of the fields get filled in below
+	    w.byte(d->bigendian ? DBUS_BIG_ENDIAN : DBUS_LITTLE_ENDIAN);
+	    w.byte(d->type);
+	    w.byte(d->flags);
+	    w.byte(DBUS_MAJOR_PROTOCOL_VERSION);
+	    w.u32(d->body.used());
+	    w.u32(0);
+	    w.u32(0);
+	    w.field(DBUS_HEADER_FIELD_PATH, DBUS_TYPE_OBJECT_PATH, d->path);
+	    w.field(DBUS_HEADER_FIELD_INTERFACE, DBUS_TYPE_STRING, d->iface);
+	    w.field(DBUS_HEADER_FIELD_MEMBER, DBUS_TYPE_STRING, d->member);
+	    w.field(DBUS_HEADER_FIELD_ERROR_NAME, DBUS_TYPE_STRING, d->error);
+	    w.field(DBUS_HEADER_FIELD_REPLY_SERIAL, d->replyserial);
+	    w.field(DBUS_HEADER_FIELD_DESTINATION, DBUS_TYPE_STRING, d->dest);
+	    w.field(DBUS_HEADER_FIELD_SENDER, DBUS_TYPE_STRING, d->sender);
+	    if (!!d->sig)
+		w.field(DBUS_HEADER_FIELD_SIGNATURE, DBUS_TYPE_SIGNATURE,
+			d->sig);
+	}
+	fieldlen = w.off - FIXED_HEADER;
+	w.pad(8);
+
+	if (p)
+	    break;
+	p = buf.alloc(w.off);
+    }
+
+    WvDBusHeaderWriter w(p, swap);
+    w.off = 8;
+    w.u32(d->serial);
+    w.u32(fieldlen);
+}
+
+
+void WvDBusMsg::marshal(WvBuf &buf)
+{
+    marshal_header(buf);
+    size_t bodylen = d->body.used() - d->rawhdr;
+    if (bodylen)
+	buf.put(d->body.peek(d->rawhdr, bodylen), bodylen);
+}
+
+
+// Below this, it's cheaper to copy the body than to hand its buffers over.
+#define SPLICE_MIN 4096
+
+
+void WvDBusMsg::splice(WvBuf &buf)
+{
+    marshal_header(buf);
+    d->body.skip(d->rawhdr);
+    d->rawhdr = 0;
+    size_t bodylen = d->body.used();
+    if (bodylen < SPLICE_MIN)
+	buf.put(d->body.get(bodylen), bodylen);
+    else
+	buf.merge(d->body);
 
-    dbus_message_lock (msg); 
-    char *cbuf;
-    int len;
-    dbus_message_marshal(msg, &cbuf, &len);
-    buf.put(cbuf, len);
-    free(cbuf);
+    // and now it doesn't have any arguments
+    d->sig = "";
+    d->changed();
 }
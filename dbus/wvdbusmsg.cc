@@ -15,6 +15,10 @@
 #include <dbus/dbus.h>
 
 
+// Containers can't nest deeper than this, says the spec.
+#define MAX_DEPTH 64
+
+
 class WvDBusReplyMsg : public WvDBusMsg
 {
 public:
@@ -24,72 +28,345 @@ public:
      * 
      * Don't call this directly.  Use WvDBusMsg::reply() instead.
      */
-    WvDBusReplyMsg(DBusMessage *_msg);
+    WvDBusReplyMsg(const WvDBusMsg &_msg);
 
     virtual ~WvDBusReplyMsg() {}
 };
 
 
+static bool host_bigendian()
+{
+    static const uint16_t one = 1;
+    return *(const unsigned char *)&one == 0;
+}
+
+
+static uint16_t read16(const unsigned char *p, bool swap)
+{
+    uint16_t x;
+    memcpy(&x, p, 2);
+    return swap ? (x >> 8) | (x << 8) : x;
+}
+
+
+static uint32_t swap32(uint32_t x)
+{
+    return (x >> 24) | ((x >> 8) & 0xff00) | ((x << 8) & 0xff0000) | (x << 24);
+}
+
+
+static uint32_t read32(const unsigned char *p, bool swap)
+{
+    uint32_t x;
+    memcpy(&x, p, 4);
+    return swap ? swap32(x) : x;
+}
+
+
+static uint64_t read64(const unsigned char *p, bool swap)
+{
+    uint64_t x;
+    memcpy(&x, p, 8);
+    return swap ? ((uint64_t)swap32(x) << 32) | swap32(x >> 32) : x;
+}
+
+
+static size_t align(size_t off, size_t n)
+{
+    return (off + n - 1) & ~(n - 1);
+}
+
+
+// How values of the given type are aligned, relative to the start of the
+// message.
+static size_t alignment(char type)
+{
+    switch (type)
+    {
+    case 'n': case 'q':
+	return 2;
+    case 'b': case 'i': case 'u': case 'h': case 's': case 'o': case 'a':
+	return 4;
+    case 'x': case 't': case 'd': case '(': case '{':
+	return 8;
+    default: // y, g, v
+	return 1;
+    }
+}
+
+
+// Returns the end of the single complete type that starts at sig, or NULL
+// if there isn't one there.
+static const char *sigskip(const char *sig, const char *sigend,
+			   int depth = 0)
+{
+    if (sig >= sigend || depth > MAX_DEPTH)
+	return NULL;
+    
+    switch (*sig)
+    {
+    case 'y': case 'b': case 'n': case 'q': case 'i': case 'u': case 'x':
+    case 't': case 'd': case 'h': case 's': case 'o': case 'g': case 'v':
+	return sig + 1;
+	
+    case 'a':
+	return sigskip(sig + 1, sigend, depth + 1);
+	
+    case '(':
+    case '{':
+	{
+	    char close = (*sig == '(') ? ')' : '}';
+	    const char *p = sig + 1;
+	    if (p < sigend && *p == close)
+		return NULL; // no empty structs allowed
+	    while (p && p < sigend && *p != close)
+		p = sigskip(p, sigend, depth + 1);
+	    return (p && p < sigend) ? p + 1 : NULL;
+	}
+	
+    default:
+	return NULL;
+    }
+}
+
+
+// Moves pos past the value at pos, whose type is the complete type at sig,
+// without going past end.  Returns false if it doesn't fit or isn't what
+// sig says it is.
+// 
+// This never looks outside [pos, end), so it's safe on any old junk, but
+// to be quick it just jumps over arrays using their length.  If you want
+// to know that everything inside them is okay too, set 'check'.
+static bool skip_value(const unsigned char *body, bool swap,
+		       const char *sig, const char *sigend,
+		       size_t &pos, size_t end, bool check, int depth = 0)
+{
+    if (depth > MAX_DEPTH)
+	return false;
+    pos = align(pos, alignment(*sig));
+    if (pos > end)
+	return false;
+    
+    size_t len;
+    switch (*sig)
+    {
+    case 'y':
+	len = 1;
+	break;
+    case 'n': case 'q':
+	len = 2;
+	break;
+    case 'b': case 'i': case 'u': case 'h':
+	len = 4;
+	break;
+    case 'x': case 't': case 'd':
+	len = 8;
+	break;
+	
+    case 's':
+    case 'o':
+	if (end - pos < 4)
+	    return false;
+	len = read32(body + pos, swap);
+	if (len >= end - pos - 4 || body[pos + 4 + len])
+	    return false; // too long, or not nul-terminated
+	if (check && memchr(body + pos + 4, 0, len))
+	    return false;
+	pos += 4 + len + 1;
+	return true;
+	
+    case 'g':
+	if (end - pos < 1)
+	    return false;
+	len = body[pos];
+	if (len >= end - pos - 1 || body[pos + 1 + len])
+	    return false;
+	pos += 1 + len + 1;
+	return true;
+	
+    case 'v':
+	{
+	    // a signature with exactly one complete type in it, then a
+	    // value of that type
+	    size_t sigpos = pos;
+	    if (!skip_value(body, swap, "g", NULL, pos, end, check, depth + 1))
+		return false;
+	    const char *vsig = (const char *)body + sigpos + 1;
+	    const char *vsigend = vsig + body[sigpos];
+	    if (sigskip(vsig, vsigend) != vsigend)
+		return false;
+	    return skip_value(body, swap, vsig, vsigend, pos, end, check,
+			      depth + 1);
+	}
+	
+    case 'a':
+	{
+	    if (end - pos < 4)
+		return false;
+	    len = read32(body + pos, swap);
+	    size_t start = align(pos + 4, alignment(sig[1]));
+	    if (start > end || len > end - start)
+		return false;
+	    pos = start + len;
+	    if (!check)
+		return true;
+	    
+	    const char *esigend = sigskip(sig + 1, sigend);
+	    size_t p = start;
+	    while (p < pos)
+		if (!skip_value(body, swap, sig + 1, esigend, p, pos, check,
+				depth + 1))
+		    return false;
+	    return true;
+	}
+	
+    case '(':
+    case '{':
+	{
+	    const char *p = sig + 1;
+	    while (*p != ')' && *p != '}')
+	    {
+		const char *next = sigskip(p, sigend);
+		if (!next || !skip_value(body, swap, p, next, pos, end, check,
+					 depth + 1))
+		    return false;
+		p = next;
+	    }
+	    return true;
+	}
+	
+    default:
+	return false;
+    }
+    
+    if (len > end - pos)
+	return false;
+    if (check && *sig == 'b' && read32(body + pos, swap) > 1)
+	return false;
+    pos += len;
+    return true;
+}
+
+
 
 WvDBusMsg::Iter::Iter(const WvDBusMsg &_msg)
-    : first(new DBusMessageIter), it(new DBusMessageIter)
 {
-    dbus_message_iter_init(_msg, first);
+    Data *d = _msg.d;
+    size_t used = d->body.used();
+    body = used ? d->body.peek(0, used) + d->rawhdr
+	        : (const unsigned char *)"";
+    swap = d->bigendian != host_bigendian();
+    sig = d->sig.cstr();
+    sigend = sig + d->sig.len();
+    start = 0;
+    end = used - d->rawhdr;
+    isarray = false;
     rewind();
 }
 
 
 WvDBusMsg::Iter::Iter(const WvDBusMsg::Iter &_it)
-    : first(new DBusMessageIter), it(new DBusMessageIter)
+    : body(_it.body), swap(_it.swap), sig(_it.sig), sigend(_it.sigend),
+      start(_it.start), end(_it.end), isarray(_it.isarray)
 {
-    *first = *_it.first;
     rewind();
 }
 
 
-WvDBusMsg::Iter::Iter(const DBusMessageIter &_first)
-    : first(new DBusMessageIter), it(new DBusMessageIter)
+WvDBusMsg::Iter::Iter(const unsigned char *_body, bool _swap,
+		      const char *_sig, const char *_sigend,
+		      size_t _start, size_t _end, bool _isarray)
+    : body(_body), swap(_swap), sig(_sig), sigend(_sigend),
+      start(_start), end(_end), isarray(_isarray)
 {
-    *first = _first;
     rewind();
 }
 
 
 WvDBusMsg::Iter::~Iter()
 {
-    delete first;
-    delete it;
 }
 
 
 void WvDBusMsg::Iter::rewind()
 {
     rewound = true;
+    cursig = cursigend = NULL;
+    pos = after = start;
 }
 
 
 bool WvDBusMsg::Iter::next()
 {
+    const char *nsig;
+    size_t npos;
+    
     if (rewound)
-	*it = *first;
-    else if (type() != DBUS_TYPE_INVALID)
-	dbus_message_iter_next(it);
+    {
+	nsig = sig;
+	npos = start;
+    }
+    else if (cursig)
+    {
+	nsig = isarray ? sig : cursigend;
+	npos = after;
+    }
+    else
+	return false; // already fell off the end
+    
     rewound = false;
-    return type() != DBUS_TYPE_INVALID;
+    cursig = cursigend = NULL;
+    if (isarray ? npos >= end : nsig >= sigend)
+	return false;
+    
+    // find the end of the new element now, so that reading it is safe
+    const char *nsigend = sigskip(nsig, sigend);
+    size_t nafter = npos;
+    if (!nsigend
+	|| !skip_value(body, swap, nsig, nsigend, nafter, end, false))
+	return false; // broken, so that's the end
+    
+    cursig = nsig;
+    cursigend = nsigend;
+    pos = align(npos, alignment(*nsig));
+    after = nafter;
+    return true;
 }
 
 
 int WvDBusMsg::Iter::type() const
 {
-    return dbus_message_iter_get_arg_type(it);
+    if (!cursig)
+	return DBUS_TYPE_INVALID;
+    else if (*cursig == '(')
+	return DBUS_TYPE_STRUCT;
+    else if (*cursig == '{')
+	return DBUS_TYPE_DICT_ENTRY;
+    else
+	return *cursig;
 }
 
 
 WvDBusMsg::Iter WvDBusMsg::Iter::open() const
 {
-    DBusMessageIter sub;
-    dbus_message_iter_recurse(it, &sub);
-    return Iter(sub); 
+    switch (type())
+    {
+    case DBUS_TYPE_VARIANT:
+	{
+	    const char *vsig = (const char *)body + pos + 1;
+	    size_t len = body[pos];
+	    return Iter(body, swap, vsig, vsig + len, pos + 1 + len + 1,
+			after, false);
+	}
+    case DBUS_TYPE_STRUCT:
+    case DBUS_TYPE_DICT_ENTRY:
+	return Iter(body, swap, cursig + 1, cursigend - 1, pos, after, false);
+    case DBUS_TYPE_ARRAY:
+	return Iter(body, swap, cursig + 1, cursigend,
+		    align(pos + 4, alignment(cursig[1])), after, true);
+    default:
+	return Iter(body, swap, sigend, sigend, after, after, false);
+    }
 }
 
 
@@ -117,11 +394,29 @@ WvString WvDBusMsg::Iter::get_all()
 }
 
 
+uint32_t WvDBusMsg::Iter::get32() const
+{
+    return read32(body + pos, swap);
+}
+
+
+uint64_t WvDBusMsg::Iter::get64() const
+{
+    return read64(body + pos, swap);
+}
+
+
+const char *WvDBusMsg::Iter::get_cstr() const
+{
+    if (*cursig == 'g')
+	return (const char *)body + pos + 1;
+    else
+	return (const char *)body + pos + 4;
+}
+
+
 WvString WvDBusMsg::Iter::get_str() const
 {
-    char *s;
-    double d;
-    
     switch (type())
     {
     case DBUS_TYPE_BYTE:
@@ -139,11 +434,9 @@ WvString WvDBusMsg::Iter::get_str() const
     case DBUS_TYPE_UINT64: 
 	return get_uint();
     case DBUS_TYPE_DOUBLE: 
-	dbus_message_iter_get_basic(it, &d);
-	return d;
+	return get_double();
     case DBUS_TYPE_STRING: 
-	dbus_message_iter_get_basic(it, &s);
-	return s;
+	return get_cstr();
     case DBUS_TYPE_VARIANT:
 	return WvString("{%s}", open().getnext().get_str());
     case DBUS_TYPE_STRUCT:
@@ -159,41 +452,28 @@ WvString WvDBusMsg::Iter::get_str() const
 
 int64_t WvDBusMsg::Iter::get_int() const
 {
-    dbus_bool_t b;
-    unsigned char c;
-    dbus_int16_t s;
-    dbus_int32_t i;
-    dbus_int64_t l;
-    char *str;
-    
     switch (type())
     {
     case DBUS_TYPE_BYTE: 
-	dbus_message_iter_get_basic(it, &c);
-	return c;
+	return body[pos];
 	
     case DBUS_TYPE_BOOLEAN: 
-	dbus_message_iter_get_basic(it, &b);
-	return b;
+	return get32();
 	
     case DBUS_TYPE_INT16: 
     case DBUS_TYPE_UINT16: 
-	dbus_message_iter_get_basic(it, &s);
-	return s;
+	return (int16_t)read16(body + pos, swap);
 	
     case DBUS_TYPE_INT32: 
     case DBUS_TYPE_UINT32:
-	dbus_message_iter_get_basic(it, &i);
-	return i;
+	return (int32_t)get32();
 	
     case DBUS_TYPE_INT64: 
     case DBUS_TYPE_UINT64: 
-	dbus_message_iter_get_basic(it, &l);
-	return l;
+	return (int64_t)get64();
 	
     case DBUS_TYPE_STRING: 
-	dbus_message_iter_get_basic(it, &str);
-	return WvString(str).num();
+	return WvFastString(get_cstr()).num();
 	
     case DBUS_TYPE_VARIANT:
 	return open().getnext().get_int();
@@ -206,41 +486,28 @@ int64_t WvDBusMsg::Iter::get_int() const
 
 uint64_t WvDBusMsg::Iter::get_uint() const
 {
-    dbus_bool_t b;
-    unsigned char c;
-    dbus_uint16_t s;
-    dbus_uint32_t i;
-    dbus_uint64_t l;
-    char *str;
-    
     switch (type())
     {
     case DBUS_TYPE_BYTE: 
-	dbus_message_iter_get_basic(it, &c);
-	return c;
+	return body[pos];
 	
     case DBUS_TYPE_BOOLEAN: 
-	dbus_message_iter_get_basic(it, &b);
-	return b;
+	return get32();
 	
     case DBUS_TYPE_INT16: 
     case DBUS_TYPE_UINT16: 
-	dbus_message_iter_get_basic(it, &s);
-	return s;
+	return read16(body + pos, swap);
 	
     case DBUS_TYPE_INT32: 
     case DBUS_TYPE_UINT32:
-	dbus_message_iter_get_basic(it, &i);
-	return i;
+	return get32();
 	
     case DBUS_TYPE_INT64: 
     case DBUS_TYPE_UINT64: 
-	dbus_message_iter_get_basic(it, &l);
-	return l;
+	return get64();
 	
     case DBUS_TYPE_STRING: 
-	dbus_message_iter_get_basic(it, &str);
-	return WvString(str).num();
+	return WvFastString(get_cstr()).num();
 	
     case DBUS_TYPE_VARIANT:
 	return open().getnext().get_uint();
@@ -253,46 +520,28 @@ uint64_t WvDBusMsg::Iter::get_uint() const
 
 double WvDBusMsg::Iter::get_double() const
 {
-    dbus_bool_t b;
-    unsigned char c;
-    dbus_uint16_t s;
-    dbus_uint32_t i;
-    dbus_uint64_t l;
-    char *str;
-    double d;
-    
     switch (type())
     {
     case DBUS_TYPE_DOUBLE:
-	dbus_message_iter_get_basic(it, &d);
-        return d;
+	{
+	    uint64_t l = get64();
+	    double d;
+	    memcpy(&d, &l, sizeof(d));
+	    return d;
+	}
 
     case DBUS_TYPE_BYTE: 
-	dbus_message_iter_get_basic(it, &c);
-	return c;
-	
     case DBUS_TYPE_BOOLEAN: 
-	dbus_message_iter_get_basic(it, &b);
-	return b;
-	
     case DBUS_TYPE_INT16: 
     case DBUS_TYPE_UINT16: 
-	dbus_message_iter_get_basic(it, &s);
-	return s;
-	
     case DBUS_TYPE_INT32: 
     case DBUS_TYPE_UINT32:
-	dbus_message_iter_get_basic(it, &i);
-	return i;
-	
     case DBUS_TYPE_INT64: 
     case DBUS_TYPE_UINT64: 
-	dbus_message_iter_get_basic(it, &l);
-	return l;
+	return get_uint();
 	
     case DBUS_TYPE_STRING: 
-	dbus_message_iter_get_basic(it, &str);
-	return atof(str);
+	return atof(get_cstr());
 	
     case DBUS_TYPE_VARIANT:
 	return open().getnext().get_double();
@@ -312,84 +561,168 @@ WvString *WvDBusMsg::Iter::ptr() const
 
 
 
-static DBusMessageIter *new_append_iter(WvDBusMsg &msg)
+WvDBusMsg::Data::Data()
+    : refs(1), bigendian(host_bigendian()),
+      type(DBUS_MESSAGE_TYPE_INVALID), flags(0), serial(0), replyserial(0),
+      sig(""), dmsg(NULL), rawhdr(0), rawsender(false)
+{
+}
+
+
+WvDBusMsg::Data::~Data()
 {
-    DBusMessageIter *it = new DBusMessageIter;
-    dbus_message_iter_init_append(msg, it);
-    return it;
+    changed();
+}
+
+
+void WvDBusMsg::Data::changed()
+{
+    if (dmsg)
+    {
+	dbus_message_unref(dmsg);
+	dmsg = NULL;
+    }
+    if (rawhdr)
+    {
+	body.skip(rawhdr);
+	rawhdr = 0;
+    }
+}
+
+
+void WvDBusMsg::init()
+{
+    Container *top = new Container;
+    top->type = 0;
+    top->sigdone = false;
+    top->lenpos = top->start = 0;
+    itlist.prepend(top, true);
+}
+
+
+WvDBusMsg::WvDBusMsg()
+{
+    d = new Data;
+    init();
 }
 
 
 WvDBusMsg::WvDBusMsg(WvStringParm busname, WvStringParm objectname, 
                      WvStringParm interface, WvStringParm method)
 {
-    msg = dbus_message_new_method_call(busname, objectname, interface, method);
-    itlist.prepend(new_append_iter(*this), true);
+    d = new Data;
+    d->type = DBUS_MESSAGE_TYPE_METHOD_CALL;
+    if (!!busname)
+	d->dest = busname;
+    d->path = objectname;
+    if (!!interface)
+	d->iface = interface;
+    d->member = method;
+    init();
 }
 
 
 WvDBusMsg::WvDBusMsg(WvDBusMsg &_msg)
 {
-    msg = _msg.msg;
-    dbus_message_ref(msg);
-    itlist.prepend(new_append_iter(*this), true);
+    d = _msg.d;
+    d->refs++;
+    init();
 }
 
 
 WvDBusMsg::WvDBusMsg(DBusMessage *_msg)
 {
-    msg = _msg;
-    dbus_message_ref(msg);
-    itlist.prepend(new_append_iter(*this), true);
+    // libdbus knows how to turn it into bytes, and we know how to turn
+    // bytes into us
+    WvDynBuf buf;
+    char *cbuf;
+    int len;
+    if (dbus_message_marshal(_msg, &cbuf, &len))
+    {
+	buf.put(cbuf, len);
+	free(cbuf);
+    }
+    
+    WvDBusMsg *m = demarshal(buf);
+    if (m)
+    {
+	d = m->d;
+	d->refs++;
+	delete m;
+    }
+    else
+	d = new Data;
+    init();
 }
 
 
 WvDBusMsg::~WvDBusMsg()
 {
-    dbus_message_unref(msg);
+    if (!--d->refs)
+	delete d;
 }
 
 
 WvDBusMsg::operator DBusMessage* () const
 {
-    return msg;
+    if (!d->dmsg)
+    {
+	// libdbus won't take it without a serial, so this gives it one,
+	// just like sending it would.
+	WvDynBuf buf;
+	const_cast<WvDBusMsg *>(this)->marshal(buf);
+	size_t len = buf.used();
+	DBusError error;
+	dbus_error_init(&error);
+	d->dmsg = dbus_message_demarshal((const char *)buf.get(len), len,
+					 &error);
+	if (dbus_error_is_set(&error))
+	    dbus_error_free(&error);
+    }
+    return d->dmsg;
+}
+
+
+int WvDBusMsg::get_type() const
+{
+    return d->type;
 }
 
 
 WvString WvDBusMsg::get_sender() const
 {
-    return dbus_message_get_sender(msg);
+    return d->sender;
 }
 
 
 WvString WvDBusMsg::get_dest() const
 {
-    return dbus_message_get_destination(msg);
+    return d->dest;
 }
 
 
 WvString WvDBusMsg::get_path() const
 {
-    return dbus_message_get_path(msg);
+    return d->path;
 }
 
 
 WvString WvDBusMsg::get_interface() const
 {
-    return dbus_message_get_interface(msg);
+    return d->iface;
 }
 
 
 WvString WvDBusMsg::get_member() const
 {
-    return dbus_message_get_member(msg);
+    return d->member;
 }
 
 
 WvString WvDBusMsg::get_error() const
 {
     if (iserror())
-	return dbus_message_get_error_name(msg);
+	return d->error;
 
     return WvString::null;
 }
@@ -405,13 +738,28 @@ bool WvDBusMsg::is_reply() const
 
 uint32_t WvDBusMsg::get_serial() const
 {
-    return dbus_message_get_serial(msg);
+    return d->serial;
 }
 
 
 uint32_t WvDBusMsg::get_replyserial() const
 {
-    return dbus_message_get_reply_serial(msg);
+    return d->replyserial;
+}
+
+
+void WvDBusMsg::set_sender(WvStringParm sender)
+{
+    // marshal() can add a sender to the header we came with, but it can't
+    // change one that's already there
+    if (d->rawsender)
+	d->changed();
+    else if (d->dmsg)
+    {
+	dbus_message_unref(d->dmsg);
+	d->dmsg = NULL;
+    }
+    d->sender = sender;
 }
 
 
@@ -427,6 +775,26 @@ WvString WvDBusMsg::get_argstr() const
 }
 
 
+bool WvDBusMsg::body_ok() const
+{
+    size_t used = d->body.used() - d->rawhdr;
+    const unsigned char *body = used ? d->body.peek(d->rawhdr, used)
+	                             : (const unsigned char *)"";
+    bool swap = d->bigendian != host_bigendian();
+    const char *sig = d->sig.cstr(), *sigend = sig + d->sig.len();
+    size_t pos = 0;
+    
+    while (sig < sigend)
+    {
+	const char *next = sigskip(sig, sigend);
+	if (!next || !skip_value(body, swap, sig, next, pos, used, true))
+	    return false;
+	sig = next;
+    }
+    return pos == used;
+}
+
+
 WvDBusMsg::operator WvString() const
 {
     WvString dest(get_dest());
@@ -458,156 +826,216 @@ WvDBusMsg::operator WvString() const
 }
 
 
+void WvDBusMsg::pad(size_t n)
+{
+    static const unsigned char zeros[8] = { 0 };
+    size_t used = d->body.used(), padded = align(used, n);
+    if (padded > used)
+	d->body.put(zeros, padded - used);
+}
+
+
+// The fixed-size types are aligned to their own size.
+WvDBusMsg &WvDBusMsg::append_basic(char type, const void *data, size_t len)
+{
+    d->changed();
+    if (!itlist.first()->sigdone)
+    {
+	char t[2] = { type, 0 };
+	d->sig.append(WvFastString(t));
+    }
+    
+    pad(len);
+    unsigned char *p = d->body.alloc(len);
+    memcpy(p, data, len);
+    if (d->bigendian != host_bigendian())
+	for (size_t i = 0; i < len / 2; i++)
+	{
+	    unsigned char c = p[i];
+	    p[i] = p[len - 1 - i];
+	    p[len - 1 - i] = c;
+	}
+    return *this;
+}
+
+
 WvDBusMsg &WvDBusMsg::append(const char *s)
 {
-    assert(msg);
     assert(s);
-    dbus_message_iter_append_basic(itlist.first(), DBUS_TYPE_STRING, &s);
+    uint32_t len = strlen(s);
+    append_basic(DBUS_TYPE_STRING, &len, 4);
+    d->body.put(s, len + 1);
     return *this;
 }
 
 
 WvDBusMsg &WvDBusMsg::append(bool b)
 {
-    assert(msg);
-    dbus_bool_t bb = b;
-    dbus_message_iter_append_basic(itlist.first(), DBUS_TYPE_BOOLEAN, &bb);
-    return *this;
+    uint32_t bb = b;
+    return append_basic(DBUS_TYPE_BOOLEAN, &bb, 4);
 }
 
 
 WvDBusMsg &WvDBusMsg::append(signed char c)
 {
-    assert(msg);
-    dbus_unichar_t cc = c;
-    dbus_message_iter_append_basic(itlist.first(), DBUS_TYPE_BYTE, &cc);
-    return *this;
+    return append_basic(DBUS_TYPE_BYTE, &c, 1);
 }
 
 
 WvDBusMsg &WvDBusMsg::append(unsigned char c)
 {
-    assert(msg);
-    dbus_unichar_t cc = c;
-    dbus_message_iter_append_basic(itlist.first(), DBUS_TYPE_BYTE, &cc);
-    return *this;
+    return append_basic(DBUS_TYPE_BYTE, &c, 1);
 }
 
 
 WvDBusMsg &WvDBusMsg::append(int16_t i)
 {
-    assert(msg);
-    dbus_message_iter_append_basic(itlist.first(), DBUS_TYPE_INT16, &i);
-    return *this;
+    return append_basic(DBUS_TYPE_INT16, &i, 2);
 }
 
 
 WvDBusMsg &WvDBusMsg::append(uint16_t i)
 {
-    assert(msg);
-    dbus_message_iter_append_basic(itlist.first(), DBUS_TYPE_UINT16, &i);
-    return *this;
+    return append_basic(DBUS_TYPE_UINT16, &i, 2);
 }
 
 
 WvDBusMsg &WvDBusMsg::append(int32_t i)
 {
-    assert(msg);
-    dbus_message_iter_append_basic(itlist.first(), DBUS_TYPE_INT32, &i);
-    return *this;
+    return append_basic(DBUS_TYPE_INT32, &i, 4);
 }
 
 
 WvDBusMsg &WvDBusMsg::append(uint32_t i)
 {
-    assert(msg);
-    dbus_message_iter_append_basic(itlist.first(), DBUS_TYPE_UINT32, &i);
-    return *this;
+    return append_basic(DBUS_TYPE_UINT32, &i, 4);
 }
 
 
 WvDBusMsg &WvDBusMsg::append(int64_t i)
 {
-    assert(msg);
-    dbus_message_iter_append_basic(itlist.first(), DBUS_TYPE_INT64, &i);
-    return *this;
+    return append_basic(DBUS_TYPE_INT64, &i, 8);
 }
 
 
 WvDBusMsg &WvDBusMsg::append(uint64_t i)
 {
-    assert(msg);
-    dbus_message_iter_append_basic(itlist.first(), DBUS_TYPE_UINT64, &i);
-    return *this;
+    return append_basic(DBUS_TYPE_UINT64, &i, 8);
 }
 
 
 WvDBusMsg &WvDBusMsg::append(double d)
 {
-    assert(msg);
-    dbus_message_iter_append_basic(itlist.first(), DBUS_TYPE_DOUBLE, &d);
-    return *this;
+    return append_basic(DBUS_TYPE_DOUBLE, &d, 8);
 }
 
 
-WvDBusMsg &WvDBusMsg::variant_start(WvStringParm element_type)
+WvDBusMsg &WvDBusMsg::container_start(char type, WvStringParm element_type)
 {
-    DBusMessageIter *parent = itlist.first();
-    DBusMessageIter *sub = new DBusMessageIter;
-    dbus_message_iter_open_container(parent,
-				     DBUS_TYPE_VARIANT, element_type, sub);
-    itlist.prepend(sub, true);
+    d->changed();
+    Container *parent = itlist.first();
+    Container *c = new Container;
+    c->type = type;
+    c->sigdone = true;
+    c->lenpos = c->start = 0;
+    
+    switch (type)
+    {
+    case DBUS_TYPE_VARIANT:
+	{
+	    if (!parent->sigdone)
+		d->sig.append("v");
+	    // the signature of what's inside goes first
+	    unsigned char len = element_type.len();
+	    d->body.put(&len, 1);
+	    d->body.put(element_type.cstr(), len + 1);
+	}
+	break;
+	
+    case DBUS_TYPE_ARRAY:
+	{
+	    if (!parent->sigdone)
+		d->sig.append(WvString("a%s", element_type));
+	    // the length goes first, and we don't know it yet
+	    pad(4);
+	    c->lenpos = d->body.used();
+	    uint32_t zero = 0;
+	    d->body.put(&zero, 4);
+	    pad(alignment(element_type.cstr()[0]));
+	    c->start = d->body.used();
+	}
+	break;
+	
+    case DBUS_STRUCT_BEGIN_CHAR:
+	// we find out what's in it as things get appended
+	if (!parent->sigdone)
+	{
+	    d->sig.append("(");
+	    c->sigdone = false;
+	}
+	pad(8);
+	break;
+    }
+    
+    itlist.prepend(c, true);
     return *this;
 }
 
 
-WvDBusMsg &WvDBusMsg::variant_end()
+WvDBusMsg &WvDBusMsg::container_end()
 {
     assert(itlist.count() >= 2);
     
-    WvList<DBusMessageIter>::Iter i(itlist);
-    i.rewind(); i.next();
-    DBusMessageIter *sub = i.ptr();
-    i.next();
-    DBusMessageIter *parent = i.ptr();
+    d->changed();
+    Container *c = itlist.first();
+    if (c->type == DBUS_TYPE_ARRAY)
+    {
+	uint32_t len = d->body.used() - c->start;
+	if (d->bigendian != host_bigendian())
+	    len = swap32(len);
+	memcpy(d->body.mutablepeek(c->lenpos, 4), &len, 4);
+    }
+    else if (c->type == DBUS_STRUCT_BEGIN_CHAR && !c->sigdone)
+	d->sig.append(")");
     
-    dbus_message_iter_close_container(parent, sub);
     itlist.unlink_first();
     return *this;
 }
 
 
+WvDBusMsg &WvDBusMsg::variant_start(WvStringParm element_type)
+{
+    return container_start(DBUS_TYPE_VARIANT, element_type);
+}
+
+
+WvDBusMsg &WvDBusMsg::variant_end()
+{
+    return container_end();
+}
+
+
 WvDBusMsg &WvDBusMsg::struct_start(WvStringParm element_type)
 {
-    DBusMessageIter *parent = itlist.first();
-    DBusMessageIter *sub = new DBusMessageIter;
-    dbus_message_iter_open_container(parent,
-				     DBUS_TYPE_STRUCT, 0, sub);
-    itlist.prepend(sub, true);
-    return *this;
+    return container_start(DBUS_STRUCT_BEGIN_CHAR, element_type);
 }
 
 
 WvDBusMsg &WvDBusMsg::struct_end()
 {
-    return array_end(); // same thing
+    return container_end();
 }
 
 
 WvDBusMsg &WvDBusMsg::array_start(WvStringParm element_type)
 {
-    DBusMessageIter *parent = itlist.first();
-    DBusMessageIter *sub = new DBusMessageIter;
-    dbus_message_iter_open_container(parent,
-				     DBUS_TYPE_ARRAY, element_type, sub);
-    itlist.prepend(sub, true);
-    return *this;
+    return container_start(DBUS_TYPE_ARRAY, element_type);
 }
 
 
 WvDBusMsg &WvDBusMsg::array_end()
 {
-    return variant_end(); // same thing
+    return container_end();
 }
 
 
@@ -634,7 +1062,7 @@ WvDBusMsg WvDBusMsg::reply()
 
 bool WvDBusMsg::iserror() const
 {
-    return dbus_message_get_type(msg) == DBUS_MESSAGE_TYPE_ERROR;
+    return d->type == DBUS_MESSAGE_TYPE_ERROR;
 }
 
 
@@ -644,28 +1072,34 @@ void WvDBusMsg::send(WvDBusConn &conn)
 }
 
 
-WvDBusReplyMsg::WvDBusReplyMsg(DBusMessage *_msg) 
-    : WvDBusMsg(dbus_message_new_method_return(_msg))
+WvDBusReplyMsg::WvDBusReplyMsg(const WvDBusMsg &_msg) 
 {
-    dbus_message_unref(msg);
+    d->type = DBUS_MESSAGE_TYPE_METHOD_RETURN;
+    d->flags = DBUS_HEADER_FLAG_NO_REPLY_EXPECTED;
+    d->replyserial = _msg.get_serial();
+    d->dest = _msg.get_sender();
 }
 
 
 WvDBusSignal::WvDBusSignal(WvStringParm objectname, WvStringParm interface,
                            WvStringParm name)
-    : WvDBusMsg(dbus_message_new_signal(objectname, interface, name))
 {
-    dbus_message_unref(msg);
+    d->type = DBUS_MESSAGE_TYPE_SIGNAL;
+    d->flags = DBUS_HEADER_FLAG_NO_REPLY_EXPECTED;
+    d->path = objectname;
+    d->iface = interface;
+    d->member = name;
 }
 
 
-DBusMessage *WvDBusError::setup1(WvDBusMsg &in_reply_to,
-			 WvStringParm errname, WvStringParm message)
-{
-    return dbus_message_new_error(in_reply_to, errname, message);
-}
-
-void WvDBusError::setup2()
+void WvDBusError::setup(WvDBusMsg &in_reply_to,
+			WvStringParm errname, WvStringParm message)
 {
-    dbus_message_unref(msg);
+    d->type = DBUS_MESSAGE_TYPE_ERROR;
+    d->flags = DBUS_HEADER_FLAG_NO_REPLY_EXPECTED;
+    d->error = errname;
+    d->replyserial = in_reply_to.get_serial();
+    d->dest = in_reply_to.get_sender();
+    if (!message.isnull())
+	append(message);
 }
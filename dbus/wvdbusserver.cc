@@ -17,6 +17,7 @@
 #undef interface // windows
 #include <dbus/dbus.h>
 #include "wvx509.h"
+#include <vector>
 
 
 class WvDBusServerAuth : public IWvDBusAuth
@@ -108,6 +109,135 @@ bool WvDBusServerAuth::authorize(WvDBusConn &c)
 }
 
 
+WvDBusMatchRule::WvDBusMatchRule(WvDBusConn *_conn, WvStringParm _rule)
+    : conn(_conn)
+{
+    type = 0;
+    matched = 0;
+    ok = true;
+
+    // key='value' pairs separated by commas.  Inside quotes, everything is
+    // literal; outside them, \' is an apostrophe.
+    const char *p = _rule;
+    while (ok && p && *p)
+    {
+	while (isspace((unsigned char)*p))
+	    p++;
+	if (!*p)
+	    break;
+
+	const char *eq = strchr(p, '=');
+	if (!eq)
+	{
+	    ok = false;
+	    break;
+	}
+	WvString key;
+	key.setsize(eq - p + 1);
+	memcpy(key.edit(), p, eq - p);
+	key.edit()[eq - p] = '\0';
+
+	WvDynBuf value;
+	bool inquote = false;
+	for (p = eq + 1; *p; p++)
+	{
+	    if (inquote)
+	    {
+		if (*p == '\'')
+		    inquote = false;
+		else
+		    value.putch(*p);
+	    }
+	    else if (*p == '\'')
+		inquote = true;
+	    else if (*p == '\\' && p[1] == '\'')
+		value.putch(*++p);
+	    else if (*p == ',')
+		break;
+	    else
+		value.putch(*p);
+	}
+	if (inquote)
+	    ok = false;
+	else if (!set(trim_string(key.edit()), value.getstr()))
+	    ok = false;
+
+	if (*p == ',')
+	    p++;
+    }
+
+    // RemoveMatch has to find it again, even if it's written differently
+    WvStringList parts;
+    static const char *typenames[] = {
+	NULL, "method_call", "method_return", "error", "signal"
+    };
+    if (type)
+	parts.append("type='%s'", typenames[type]);
+    if (!!sender)
+	parts.append("sender='%s'", sender);
+    if (!!iface)
+	parts.append("interface='%s'", iface);
+    if (!!member)
+	parts.append("member='%s'", member);
+    if (!!path)
+	parts.append("path='%s'", path);
+    if (!!path_namespace)
+	parts.append("path_namespace='%s'", path_namespace);
+    if (!!dest)
+	parts.append("destination='%s'", dest);
+    std::map<int, WvString>::const_iterator i;
+    for (i = args.begin(); i != args.end(); ++i)
+	parts.append("arg%s='%s'", i->first, i->second);
+    rule = parts.join(",");
+}
+
+
+bool WvDBusMatchRule::set(WvStringParm key, WvStringParm value)
+{
+    if (key == "type")
+    {
+	if (value == "signal")
+	    type = DBUS_MESSAGE_TYPE_SIGNAL;
+	else if (value == "method_call")
+	    type = DBUS_MESSAGE_TYPE_METHOD_CALL;
+	else if (value == "method_return")
+	    type = DBUS_MESSAGE_TYPE_METHOD_RETURN;
+	else if (value == "error")
+	    type = DBUS_MESSAGE_TYPE_ERROR;
+	else
+	    return false;
+    }
+    else if (key == "sender")
+	sender = value;
+    else if (key == "interface")
+	iface = value;
+    else if (key == "member")
+	member = value;
+    else if (key == "path")
+	path = value;
+    else if (key == "path_namespace")
+	path_namespace = value;
+    else if (key == "destination")
+	dest = value;
+    else if (!strncmp(key, "arg", 3) && isdigit((unsigned char)key[3]))
+    {
+	char *end;
+	long n = strtol(key.cstr() + 3, &end, 10);
+	if (n > 63)
+	    return false;
+	// argNpath and arg0namespace are real, but we don't do them; just
+	// let everything through, and the client can sort it out.
+	if (!*end)
+	    args[n] = value;
+	else if (strcmp(end, "path") && strcmp(end, "namespace"))
+	    return false;
+    }
+    else if (key != "eavesdrop") // we don't hide anything anyway
+	return false;
+    return true;
+}
+
+
 WvDBusServer::WvDBusServer()
     : log("DBus Server", WvLog::Debug)
 {
@@ -195,10 +325,146 @@ void WvDBusServer::unregister_conn(WvDBusConn *conn)
 	}
     }
     
+    {
+	WvDBusMatchRuleList::Iter i(rules);
+	for (i.rewind(); i.next(); )
+	{
+	    if (i->conn == conn)
+	    {
+		unindex_rule(i.ptr());
+		i.xunlink();
+	    }
+	}
+    }
+    
     all_conns.unlink(conn);
 }
 
 
+bool WvDBusServer::add_match(WvDBusConn *conn, WvStringParm rule)
+{
+    WvDBusMatchRule *r = new WvDBusMatchRule(conn, rule);
+    if (!r->isok())
+    {
+	delete r;
+	return false;
+    }
+
+    log("add_match(%s, %s)\n", conn->uniquename(), r->rule);
+    rules.append(r, true);
+    if (!!r->iface)
+	rules_by_iface.insert(std::make_pair(r->iface, r));
+    else if (!!r->member)
+	rules_by_member.insert(std::make_pair(r->member, r));
+    else if (!!r->path)
+	rules_by_path.insert(std::make_pair(r->path, r));
+    else
+	wild_rules.append(r, false);
+    return true;
+}
+
+
+bool WvDBusServer::remove_match(WvDBusConn *conn, WvStringParm rule)
+{
+    WvDBusMatchRule want(conn, rule);
+    if (!want.isok())
+	return false;
+
+    WvDBusMatchRuleList::Iter i(rules);
+    for (i.rewind(); i.next(); )
+    {
+	if (i->conn == conn && i->rule == want.rule)
+	{
+	    // if they added it twice, it takes two RemoveMatches
+	    log("remove_match(%s, %s)\n", conn->uniquename(), want.rule);
+	    unindex_rule(i.ptr());
+	    i.xunlink();
+	    return true;
+	}
+    }
+    return false;
+}
+
+
+static void unindex(std::multimap<WvString,WvDBusMatchRule*> &index,
+		    WvStringParm key, WvDBusMatchRule *r)
+{
+    std::multimap<WvString,WvDBusMatchRule*>::iterator i, end;
+    end = index.upper_bound(key);
+    for (i = index.lower_bound(key); i != end; ++i)
+    {
+	if (i->second == r)
+	{
+	    index.erase(i);
+	    return;
+	}
+    }
+}
+
+
+void WvDBusServer::unindex_rule(WvDBusMatchRule *r)
+{
+    if (!!r->iface)
+	unindex(rules_by_iface, r->iface, r);
+    else if (!!r->member)
+	unindex(rules_by_member, r->member, r);
+    else if (!!r->path)
+	unindex(rules_by_path, r->path, r);
+    else
+	wild_rules.unlink(r);
+}
+
+
+bool WvDBusServer::rule_matches(const WvDBusMatchRule *r, WvDBusConn &from,
+				WvDBusMsg &msg, int type) const
+{
+    if (r->type && r->type != type)
+	return false;
+    if (!!r->iface && r->iface != msg.get_interface())
+	return false;
+    if (!!r->member && r->member != msg.get_member())
+	return false;
+    if (!!r->path && r->path != msg.get_path())
+	return false;
+    if (!!r->dest && r->dest != msg.get_dest())
+	return false;
+
+    if (!!r->path_namespace && r->path_namespace != "/")
+    {
+	WvString path(msg.get_path());
+	size_t len = r->path_namespace.len();
+	if (strncmp(path, r->path_namespace, len)
+	    || (path[len] != '\0' && path[len] != '/'))
+	    return false;
+    }
+
+    if (!!r->sender && r->sender != from.uniquename())
+    {
+	std::map<WvString,WvDBusConn*>::const_iterator i
+	    = name_to_conn.find(r->sender);
+	if (i == name_to_conn.end() || i->second != &from)
+	    return false;
+    }
+
+    if (!r->args.empty())
+    {
+	WvDBusMsg::Iter i(msg);
+	int n = 0;
+	std::map<int, WvString>::const_iterator a;
+	for (a = r->args.begin(); a != r->args.end(); ++a)
+	{
+	    for (; n <= a->first; n++)
+		if (!i.next())
+		    return false;
+	    if (i.type() != DBUS_TYPE_STRING || i.get_str() != a->second)
+		return false;
+	}
+    }
+
+    return true;
+}
+
+
 bool WvDBusServer::do_server_msg(WvDBusConn &conn, WvDBusMsg &msg)
 {
     WvString method(msg.get_member());
@@ -269,8 +535,24 @@ bool WvDBusServer::do_server_msg(WvDBusConn &conn, WvDBusMsg &msg)
     }
     else if (method == "AddMatch")
     {
-	// we just proxy every signal to everyone for now
-	msg.reply().send(conn);
+	WvDBusMsg::Iter args(msg);
+	WvString rule = args.getnext();
+	if (add_match(&conn, rule))
+	    msg.reply().send(conn);
+	else
+	    WvDBusError(msg, "org.freedesktop.DBus.Error.MatchRuleInvalid",
+			"Can't parse match rule '%s'", rule).send(conn);
+	return true;
+    }
+    else if (method == "RemoveMatch")
+    {
+	WvDBusMsg::Iter args(msg);
+	WvString rule = args.getnext();
+	if (remove_match(&conn, rule))
+	    msg.reply().send(conn);
+	else
+	    WvDBusError(msg, "org.freedesktop.DBus.Error.MatchRuleNotFound",
+			"No such match rule '%s'", rule).send(conn);
 	return true;
     }
     else if (method == "StartServiceByName")
@@ -379,9 +661,9 @@ bool WvDBusServer::do_bridge_msg(WvDBusConn &conn, WvDBusMsg &msg)
 	log("Proxying #%s -> %s\n",
 	    msg.get_serial(),
 	    dconn ? dconn->uniquename() : WvString("(UNKNOWN)"));
-	dbus_message_set_sender(msg, conn.uniquename().cstr());
+	msg.set_sender(conn.uniquename());
 	if (dconn)
-	    dconn->send(msg);
+	    dconn->forward(msg);
 	else
 	{
 	    log(WvLog::Warning,
@@ -400,14 +682,47 @@ bool WvDBusServer::do_broadcast_msg(WvDBusConn &conn, WvDBusMsg &msg)
     if (!msg.get_dest())
     {
 	log("Broadcasting #%s\n", msg.get_serial());
+	msg.set_sender(conn.uniquename());
 	
-	// note: we broadcast messages even back to the connection where
-	// they originated.  I'm not sure this is necessarily ideal, but if
-	// you don't do that then an app can't signal objects that might be
-	// inside itself.
-	WvDBusConnList::Iter i(all_conns);
-	for (i.rewind(); i.next(); )
-	    i->send(msg);
+	// Only look at the rules filed under this message's interface,
+	// member and path, plus the ones that didn't have any of those.
+	// Every rule that matches gets counted, but each connection only
+	// gets the message once, no matter how many of its rules match.
+	// 
+	// note: we send messages even back to the connection where they
+	// originated, if it asked for them.  Otherwise an app can't signal
+	// objects that might be inside itself.
+	int type = msg.get_type();
+	WvString iface(msg.get_interface()), member(msg.get_member()),
+	    path(msg.get_path());
+	std::vector<WvDBusMatchRule*> candidates;
+	RuleIndex::const_iterator ri, end;
+	end = rules_by_iface.upper_bound(iface);
+	for (ri = rules_by_iface.lower_bound(iface); ri != end; ++ri)
+	    candidates.push_back(ri->second);
+	end = rules_by_member.upper_bound(member);
+	for (ri = rules_by_member.lower_bound(member); ri != end; ++ri)
+	    candidates.push_back(ri->second);
+	end = rules_by_path.upper_bound(path);
+	for (ri = rules_by_path.lower_bound(path); ri != end; ++ri)
+	    candidates.push_back(ri->second);
+	WvDBusMatchRuleList::Iter wi(wild_rules);
+	for (wi.rewind(); wi.next(); )
+	    candidates.push_back(wi.ptr());
+
+	std::map<WvDBusConn*,bool> sent;
+	for (size_t n = 0; n < candidates.size(); n++)
+	{
+	    WvDBusMatchRule *r = candidates[n];
+	    if (!rule_matches(r, conn, msg, type))
+		continue;
+	    r->matched++;
+	    if (!sent[r->conn])
+	    {
+		sent[r->conn] = true;
+		r->conn->send(msg);
+	    }
+	}
         return true;
     }
     return false;
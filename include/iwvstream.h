@@ -15,6 +15,7 @@
 
 class WvAddr;
 class WvStream;
+class WvPoller;
 
 
 /* The stream gets passed back as a parameter. */
@@ -54,6 +55,9 @@ public:
 	time_t msec_timeout;        // max time to wait, or -1 for forever
 	bool inherit_request;       // 'wants' values passed to child streams
 	bool global_sure;           // should we run the globalstream callback
+	WvPoller *poller;           // if set, use this instead of the fd_sets
+	
+	SelectInfo() : poller(NULL) { }
     };
     
     IWvStream();
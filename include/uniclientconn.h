@@ -27,6 +27,9 @@
 class UniClientConn : public WvStreamClone
 {
     WvDynBuf msgbuf;
+    WvDynBuf framebuf;  /*!< the current binary message, minus the command */
+    bool binread;       /*!< true once the other end is sending binary */
+    bool binwrite;      /*!< true once we're sending binary */
 
 protected:
     WvLog log;
@@ -77,8 +80,14 @@ public:
 	// events
 	EVENT_HELLO, /*!< HELLO <message> v18 */
 	EVENT_NOTICE, /*!< NOTICE <key> <oldval> <newval> v18 */
+
+	// more requests
+	REQ_SUBSCRIBE, /*!< sub <pattern> v21 */
+	REQ_UNSUBSCRIBE, /*!< unsub <pattern> v21 */
+	REQ_MGET, /*!< mget <key> <key>... v22 */
+	REQ_BINARY, /*!< binary ==> binary v23 */
     };
-    static const int NUM_COMMANDS = EVENT_NOTICE + 1;
+    static const int NUM_COMMANDS = REQ_BINARY + 1;
     struct CommandInfo
     {
         const char *name;
@@ -107,6 +116,29 @@ public:
      */
     WvString readarg();
 
+    /**
+     * Reads the next argument from the command payload as a key.
+     * Returns: false if there are no more arguments
+     */
+    bool readkey(UniConfKey &key);
+
+    /**
+     * Switches to the binary encoding, where each message is a length
+     * followed by the command number and its arguments, and keys and
+     * values go across as they are instead of being tcl-escaped.  Only
+     * ask for this if the other end speaks protocol version 23 or later.
+     *
+     * We send a "binary" command, and everything we write after it is
+     * binary.  The other end answers with its own "binary" and switches
+     * too.  Since each direction switches right after its own "binary",
+     * neither end has to wait for the other.
+     */
+    void use_binary();
+
+    /** Returns true if we're sending binary messages. */
+    bool isbinary() const
+        { return binwrite; }
+
     /**
      * Writes a command to the connection.
      * "command" is the command
@@ -114,6 +146,16 @@ public:
      */
     void writecmd(Command command, WvStringParm payload = WvString::null);
 
+    /**
+     * Writes a command whose arguments are a key and, unless it's null, a
+     * value.  Use this instead of escaping them yourself, so the binary
+     * encoding doesn't have to unescape them again.
+     */
+    void writecmd(Command command, const UniConfKey &key, WvStringParm value);
+
+    /** Writes a command whose arguments are a list of keys. */
+    void writecmd(Command command, const UniConfKeyList &keys);
+
     /**
      * Writes a REPLY_OK message.
      * "payload" is the payload, defaults to ""
@@ -152,6 +194,10 @@ private:
 
     /** Writes a message to the connection. */
     void writemsg(WvStringParm message);
+
+    bool readframe();
+    bool readkeysegs(UniConfKey &key);
+    void writeframe(Command command, WvBuf &args);
 };
 
 #endif // __UNICONFCONN_H
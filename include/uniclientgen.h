@@ -13,6 +13,9 @@
 #include "wvstringlist.h"
 #include "uniclientconn.h"
 #include "uniconfkey.h"
+#include "uniconfpair.h"
+
+class UniListIter;
 
 /**
  * Communicates with a UniConfDaemon to fetch and store keys and
@@ -31,18 +34,51 @@ class UniClientGen : public UniConfGen
 
     WvLog log;
 
-    WvString result_key;        /*!< the key that the current result is from */
-    WvString result;            /*!< the result from the current key */
-    
-    UniListIter *result_list;   /*!< result list for iterations */
-
-    bool cmdinprogress;     /*!< true while a command is in progress */
-    bool cmdsuccess;        /*!< true when a command completed successfully */
+    /**
+     * A request we've sent and haven't seen the whole reply to yet.  The
+     * server answers requests in the order it got them, so whatever comes
+     * back always belongs to the first one in 'pending'.  That means we
+     * can have lots of them outstanding at once.
+     */
+    DeclareWvTable(UniConfKey);
+    class Request
+    {
+    public:
+	unsigned long seq;      /*!< requests are numbered in sending order */
+	UniConfKey key;         /*!< the key we asked about */
+	WvString value;         /*!< the value from a ONEVAL or CHILD reply */
+	UniListIter *list;      /*!< collects VALs, if not NULL */
+	UniConfKeyList *keys;   /*!< the keys in a prefetching mget */
+	UniConfKeyTable *got;   /*!< ...and the ones it's sent us so far */
+	bool subtree;           /*!< a prefetching recursive subt */
+	bool prefetch;          /*!< the results go in 'prefetched' */
+	bool success;
+
+	Request(const UniConfKey &_key = UniConfKey::EMPTY)
+	    : seq(0), key(_key), list(NULL), keys(NULL), got(NULL),
+	      subtree(false),
+	      prefetch(false), success(false) { }
+	~Request();
+
+	bool covers(const UniConfKey &k) const;
+    };
+    DeclareWvList(Request);
+    RequestList pending;
+    unsigned long lastseq;      /*!< the last request we sent */
+    unsigned long doneseq;      /*!< the last request that got its answer */
+
+    // values we got back from prefetch(), keyed by key().  A null value
+    // means we know the key doesn't exist.
+    DeclareWvDict(UniConfPair, UniConfKey, key());
+    UniConfPairDict prefetched;
 
     time_t timeout; // command timeout in ms
 
     int version; /*!< version number of the protocol */
 
+    UniConfKeyList subscriptions; /*!< patterns we asked for NOTICEs about */
+    bool auto_subscribe;   /*!< subscribe to whatever we read */
+
 public:
     /**
      * Creates a generator which can communicate with a daemon using
@@ -55,6 +91,41 @@ public:
 
     time_t set_timeout(time_t _timeout);
 
+    /**
+     * Asks the daemon to only send us change notifications for keys that
+     * match one of our subscribed patterns, which may use "*" and "...".
+     * Until we subscribe to something, we hear about every change.
+     * Servers older than protocol version 21 don't know about this, and
+     * just keep sending everything.
+     */
+    void subscribe(const UniConfKey &pattern);
+    void unsubscribe(const UniConfKey &pattern);
+
+    /**
+     * If 'enable' is true, automatically subscribe to every key and subtree
+     * that we read, so we only hear about changes to things we (or a
+     * UniCacheGen on top of us) might have cached.  This is off by default,
+     * since a callback on a key nobody has read wouldn't get called
+     * anymore.
+     */
+    void set_auto_subscribe(bool enable)
+        { auto_subscribe = enable; }
+
+    /**
+     * Starts fetching all the given keys, without waiting for the answer;
+     * later calls to get() for them won't need a round trip of their own.
+     * Servers with protocol version 22 or later get them all in one mget
+     * request; otherwise we just send all the gets at once.
+     */
+    void prefetch(const UniConfKeyList &keys);
+
+    /**
+     * Gets the values of all the given keys in a single round trip, and
+     * appends them to 'pairs' in the same order.  Keys that don't exist
+     * get a null value.
+     */
+    void getv(const UniConfKeyList &keys, UniConfPairList &pairs);
+
     /***** Overridden members *****/
 
     virtual bool isok();
@@ -62,6 +133,7 @@ public:
     virtual bool refresh();
     virtual void flush_buffers();
     virtual void commit(); 
+    virtual void prefetch(const UniConfKey &key, bool recursive);
     virtual WvString get(const UniConfKey &key);
     virtual void set(const UniConfKey &key, WvStringParm value);
     virtual void setv(const UniConfPairList &pairs);
@@ -72,7 +144,20 @@ public:
 protected:
     virtual Iter *do_iterator(const UniConfKey &key, bool recursive);
     void conncallback();
-    bool do_select();
+    void send(Request *req, bool autofree, UniClientConn::Command cmd,
+	      WvStringParm msg = WvString::null);
+    void send(Request *req, bool autofree, UniClientConn::Command cmd,
+	      const UniConfKey &key, WvStringParm value);
+    void send(Request *req, bool autofree, UniClientConn::Command cmd,
+	      const UniConfKeyList &keys);
+    void finish(bool success);
+    void fail_pending();
+    void do_select(unsigned long seq);
+    bool do_select(Request &req);
+    void autosubscribe(const UniConfKey &pattern);
+    void subscribe_once(const UniConfKey &pattern);
+    void store(const UniConfKey &key, WvStringParm value);
+    void update(const UniConfKey &key, WvStringParm value);
 };
 
 
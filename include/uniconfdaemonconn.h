@@ -21,6 +21,13 @@ class UniConfDaemon;
 /**
  * Retains all state and behavior related to a single UniConf daemon
  * connection.
+ *
+ * Until the client sends a "sub" command, it gets a NOTICE for every key
+ * that changes anywhere, like it always did.  After that, it only gets
+ * notices for keys matching one of the patterns it subscribed to.  Each
+ * pattern is a key that may contain "*" and "..." segments; we register a
+ * watch on its longest non-wildcard prefix (so UniConfRoot's watch tree
+ * only bothers us about changes under there) and check the rest ourselves.
  */
 class UniConfDaemonConn : public UniClientConn 
 {
@@ -40,6 +47,7 @@ protected:
     virtual void do_noop();
     virtual void do_reply(WvStringParm reply);
     virtual void do_get(const UniConfKey &key);
+    virtual void do_mget(const UniConfKeyList &keys);
     virtual void do_set(const UniConfKey &key, WvStringParm value);
     virtual void do_remove(const UniConfKey &key);
     virtual void do_subtree(const UniConfKey &key, bool recursive);
@@ -48,11 +56,33 @@ protected:
     virtual void do_refresh();
     virtual void do_quit();
     virtual void do_help();
+    virtual void do_subscribe(const UniConfKey &pattern);
+    virtual void do_unsubscribe(const UniConfKey &pattern);
 
     virtual void addcallback();
     virtual void delcallback();
 
     void deltacallback(const UniConf &cfg, const UniConfKey &key);
+
+private:
+    // all the subscribed patterns with the same non-wildcard prefix share
+    // one watch
+    class Subscription
+    {
+    public:
+	WvString base;
+	UniConfKeyList patterns;
+
+	Subscription(WvStringParm _base) : base(_base) { }
+    };
+    DeclareWvDict(Subscription, WvString, base);
+
+    SubscriptionDict subs;
+    bool filtered; /*!< true once the client has subscribed to anything */
+
+    void subcallback(Subscription *sub, const UniConf &cfg,
+		     const UniConfKey &key);
+    void notify(const UniConfKey &key, WvStringParm value);
 };
 
 #endif // __UNICONFDAEMONCONN_H
@@ -251,6 +251,14 @@ public:
      */
     void append(const UniConfKey &other);
 
+    /**
+     * Appends a single segment to this path.  The segment mustn't contain
+     * any slashes; an empty one means a trailing slash.  This skips all
+     * the parsing that append() does, for when you already have the key in
+     * pieces.
+     */
+    void appendseg(WvStringParm segment);
+
     /**
      * Prepends a path to this path.
      * "other" is the path
@@ -299,6 +307,15 @@ public:
         return range(n, n + 1);
     }
 
+    /**
+     * Returns the nth segment as a plain string, without making a new key
+     * out of it.  A trailing slash is an empty last segment.
+     */
+    const WvString &segmentstr(int n) const
+    {
+        return store->segments[left + n];
+    }
+
     /**
      * Returns the path formed by the first n segments of this path and 
      * removes them from the key.
@@ -10,6 +10,7 @@
 #include "uniconfkey.h"
 #include "unihashtree.h"
 #include "wvtr1.h"
+#include <stdlib.h>
 
 /**
  * A recursively composed dictionary for tree-structured
@@ -83,22 +84,28 @@ public:
     /** Removes and deletes all children of this node. */
     void zap()
     {
-        if (!(this->xchildren))
+        if (!this->haschildren())
             return;
-        // set xchildren to NULL first so that the zap() will happen faster
+        // take the children away first so that the zap() will happen faster
         // otherwise, each child will attempt to unlink itself uselessly
-
-        typename UniHashTreeBase::Container *oldchildren = this->xchildren;
-        this->xchildren = NULL;
+        size_t n;
+        UniHashTreeBase **oldchildren = this->_takechildren(n);
 
         // delete all children
-        typename UniHashTreeBase::Container::Iter i(*oldchildren);
-        for (i.rewind(); i.next();)
-            delete static_cast<Sub*>(i.ptr());
+        for (size_t i = 0; i < n; i++)
+            delete static_cast<Sub*>(oldchildren[i]);
 
-        delete oldchildren;
+        free(oldchildren);
     }
 
+    /**
+     * Returns roughly how many bytes this node and everything under it
+     * take up, not counting the interned key segments (see
+     * UniHashTreeBase::internstats()).
+     */
+    size_t memusage() const
+        { return this->_memusage(sizeof(Sub)); }
+
     /**
      * Performs a traversal on this tree using the specified
      * visitor function and traversal type(s).
@@ -166,6 +173,17 @@ public:
     /** Sets the value field. */
     void setvalue(WvStringParm value)
         { xvalue = value; }
+
+    /** Like UniConfTree::memusage(), but counts the values too. */
+    size_t memusage() const
+        { return _memusage(sizeof(UniConfValueTree), valueusage); }
+
+private:
+    static size_t valueusage(const UniHashTreeBase *node)
+    {
+        const WvString &v = static_cast<const UniConfValueTree*>(node)->xvalue;
+        return v.len() < WVSTRING_SMALL ? 0 : sizeof(WvStringBuf) + v.len();
+    }
 };
 
 
@@ -1,7 +1,7 @@
 /* -*- Mode: C++ -*-
  * Worldvisions Weaver Software:
  *   Copyright (C) 1997-2002 Net Integration Technologies, Inc.
- * 
+ *
  * UniConf low-level tree storage abstraction.
  */
 #ifndef __UNIHASHTREE_H
@@ -9,46 +9,97 @@
 
 #include "uniconfkey.h"
 #include "wvtr1.h"
-#include "wvscatterhash.h"
+#include "wvflathash.h"
 
 class UniHashTreeBase;
 
+/** One interned key segment, shared by all the nodes with that name. */
+struct UniInternedSeg
+{
+    WvString str;
+    unsigned refs;
+
+    UniInternedSeg(WvStringParm _str) : str(_str), refs(0) { }
+};
+
 // parameters: a node (won't be NULL), userdata
 typedef wv::function<void(const UniHashTreeBase*,
 			  void*)> UniHashTreeBaseVisitor;
 // parameters: 1st node (may be NULL), 2nd node (may be NULL), userdata
-typedef wv::function<bool(const UniHashTreeBase*, 
+typedef wv::function<bool(const UniHashTreeBase*,
 			  const UniHashTreeBase*)> UniHashTreeBaseComparator;
 
+/**
+ * The untyped part of UniConfTree.
+ *
+ * Trees get big, so the nodes are kept small.  Each node only stores its
+ * own segment of the key, not a whole UniConfKey, and the segment strings
+ * are interned: every node called "name" points at the same one.  The
+ * children live in a sorted array, which we binary search, until there
+ * are more than MAX_SORTED of them; then they move to a WvFlatHash.
+ *
+ * Either way, iterating over the children gives you them in the same
+ * order: sorted case-insensitively, except that runs of digits sort by
+ * their value, so "2" comes before "10".
+ */
 class UniHashTreeBase
 {
 protected:
     struct Accessor
     {
-        static const UniConfKey *get_key(const UniHashTreeBase *obj)
-            { return &obj->key(); }
+        static const WvFastString *get_key(const UniHashTreeBase *obj)
+            { return &obj->xseg->str; }
     };
 
-    typedef WvScatterHash<UniHashTreeBase, UniConfKey, Accessor> Container;
+    typedef WvFlatHash<UniHashTreeBase, WvFastString, Accessor,
+		       StrCaseComp> Container;
     typedef UniHashTreeBaseVisitor BaseVisitor;
     typedef UniHashTreeBaseComparator BaseComparator;
 
+    /** How many children we keep in a sorted array before hashing them. */
+    enum { MAX_SORTED = 16 };
+
 public:
     ~UniHashTreeBase();
 
     /** Returns the key field. */
-    const UniConfKey &key() const
-        { return xkey; }
+    UniConfKey key() const
+        { return UniConfKey(xseg->str); }
 
     /** Returns true if the node has children. */
     bool haschildren() const;
 
+    /** Returns the number of direct children of this node. */
+    size_t numchildren() const;
+
+    /**
+     * Returns how many distinct key segments are interned right now, and
+     * roughly how many bytes they take up.
+     */
+    static void internstats(size_t &segments, size_t &bytes);
+
 protected:
     UniHashTreeBase(UniHashTreeBase *parent, const UniConfKey &key);
 
     UniConfKey _fullkey(const UniHashTreeBase *ancestor = NULL) const;
     UniHashTreeBase *_find(const UniConfKey &key) const;
     UniHashTreeBase *_findchild(const UniConfKey &key) const;
+    UniHashTreeBase *_findseg(WvStringParm seg) const;
+
+    /**
+     * Unhooks all our children from us and returns them in an array,
+     * which the caller has to free().  The children still think we're
+     * their parent, but they don't mind.
+     */
+    UniHashTreeBase **_takechildren(size_t &n);
+
+    /**
+     * Returns roughly how many bytes this subtree takes up, given the size
+     * of each node, plus whatever 'extra' says each node has hanging off
+     * it, if it's set.
+     */
+    size_t _memusage(size_t nodesize,
+		     size_t (*extra)(const UniHashTreeBase *) = NULL) const;
 
     static bool _recursivecompare(
         const UniHashTreeBase *a, const UniHashTreeBase *b,
@@ -60,7 +111,6 @@ protected:
 	bool preorder, bool postorder);
 
     UniHashTreeBase *xparent; /*!< the parent of this subtree */
-    Container *xchildren; /*!< the hash table of children */
 
 private:
     void _setparent(UniHashTreeBase *parent);
@@ -72,13 +122,57 @@ private:
     /** Called by a child to unlink itself from this node. */
     void unlink(UniHashTreeBase *node);
 
-    UniConfKey xkey;   /*!< the name of this entry */
+    /** The first index in xkids whose segment is greater than 'seg'. */
+    int upper(WvStringParm seg) const;
+
+    /** The sorted children as a newly malloc()ed array, for comparing. */
+    UniHashTreeBase **sortedchildren(size_t &n) const;
+    static int segsorter(const void *a, const void *b);
+
+    UniInternedSeg *xseg; /*!< the name of this entry */
+    union
+    {
+	UniHashTreeBase **xkids; /*!< sorted children, if xnkids >= 0 */
+	Container *xhash;	 /*!< hashed children, if xnkids < 0 */
+    };
+    int xnkids;
 
 protected:
-    class Iter : public Container::Iter
+    /**
+     * Iterates over the children of a node, in the order described above.  It's okay
+     * to delete the current child, or any other, while iterating.
+     * Children that get added while iterating might or might not show up,
+     * but all the others show up exactly once, even if the node switches
+     * from a sorted array to a hash partway through.
+     */
+    class Iter
     {
     public:
-        Iter(UniHashTreeBase &b) : Container::Iter(*b.xchildren) { }
+        Iter(UniHashTreeBase &b);
+        Iter(const Iter &other);
+        ~Iter();
+
+        void rewind();
+        bool next();
+        bool cur() const
+            { return xcur != NULL; }
+        UniHashTreeBase *ptr() const
+            { return xcur; }
+
+    private:
+        UniHashTreeBase *node;
+        UniHashTreeBase *xcur;
+        WvString curseg;
+        int idx;
+
+        // A hash has no order of its own, so for those we sort the names
+        // up front and look each one up as we get to it.
+        UniInternedSeg **snap;
+        int nsnap;
+        void snapshot(bool after_cur);
+        void dropsnapshot();
+
+        Iter &operator= (const Iter &); // not defined
     };
     friend class Iter;
 };
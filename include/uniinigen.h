@@ -9,6 +9,7 @@
 
 #include "unitempgen.h"
 #include "wvlog.h"
+#include "wvflathash.h"
 #include <sys/stat.h>
 
 class WvFile;
@@ -21,6 +22,10 @@ class WvFile;
  * To mount, use the moniker prefix "ini:" followed by the
  * path of the .ini file.
  * 
+ * Big files are expensive to write out, so we remember where each
+ * top-level section lives in the file we last read or wrote.  When we
+ * commit, sections nobody has touched since then get copied straight
+ * from the old file instead of being printed all over again.
  */
 class UniIniGen : public UniTempGen
 {
@@ -28,11 +33,28 @@ public:
     typedef wv::function<void()> SaveCallback;
 
 private:
+    /** Where a top-level key's section is in the file, if it's anywhere. */
+    class Section
+    {
+    public:
+        Section(WvStringParm _seg, off_t _start, size_t _len)
+            : seg(_seg), start(_start), len(_len), dirty(false)
+            { }
+
+        WvString seg;
+        off_t start;
+        size_t len;
+        bool dirty; // changed since then, so we can't copy it
+    };
+    DeclareWvFlatCaseDict(Section, WvString, seg);
+
     WvString filename;
     int create_mode;
     WvLog log;
     struct stat old_st;
     SaveCallback save_cb;
+    SectionCaseDict sections;
+    bool sections_ok; // false if 'sections' doesn't describe old_st's file
     
 public:
     /**
@@ -56,7 +78,16 @@ private:
     bool commit_atomic(WvStringParm real_filename);
 #endif
     
-    void save(WvStream &file, UniConfValueTree &parent);
+    /**
+     * Writes out the whole tree.  If 'oldfd' is the file we last read or
+     * wrote, unchanged sections get copied from it.
+     */
+    void save(WvStream &file, int oldfd = -1);
+
+    /** Fills in 'newtree' from the contents of the file. */
+    void parse(const char *data, size_t size, UniConfValueTree *newtree);
+    void save_stat(WvStringParm fname);
+    void forget_sections();
     bool refreshcomparator(const UniConfValueTree *a,
 			   const UniConfValueTree *b);
 };
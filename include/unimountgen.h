@@ -11,6 +11,7 @@
 #include "wvmoniker.h"
 #include "wvstringlist.h"
 #include "wvtr1.h"
+#include "wvflathash.h"
 
 
 /** The UniMountTree implementation realized as a UniConfGen. */
@@ -33,6 +34,30 @@ protected:
     typedef class WvList<UniGenMount> MountList;
     MountList mounts;
 
+    /**
+     * One node in the tree of mountpoints.  There's a node for each
+     * segment of each mountpoint, so finding the mounts that cover a key
+     * means following its segments down from the root, instead of
+     * comparing the key to every mountpoint.  Nodes with no mounts at or
+     * under them get thrown away, so a node with children always has
+     * something mounted under it.
+     */
+    class MountNode;
+    DeclareWvFlatCaseDict(MountNode, WvString, seg);
+    class MountNode
+    {
+    public:
+        MountNode(WvStringParm seg, MountNode *parent)
+            : seg(seg), parent(parent)
+	    { }
+
+        WvString seg;
+        MountNode *parent;
+        MountNodeCaseDict children;
+        MountList mounts; // mounted right here, newest first
+    };
+    MountNode root;
+
     /** undefined. */
     UniMountGen(const UniMountGen &other);
 
@@ -98,6 +123,7 @@ public:
     virtual bool exists(const UniConfKey &key);
     virtual bool haschildren(const UniConfKey &key);
     virtual WvString get(const UniConfKey &key);
+    virtual void prefetch(const UniConfKey &key, bool recursive);
     virtual void set(const UniConfKey &key, WvStringParm value);
     virtual void setv(const UniConfPairList &pairs);
     virtual void commit();
@@ -107,6 +133,14 @@ public:
     virtual Iter *recursiveiterator(const UniConfKey &key);
 
 private:
+    /**
+     * Find the node for the mountpoint 'key', creating it (and the ones
+     * leading up to it) if 'create' is set.
+     */
+    MountNode *findnode(const UniConfKey &key, bool create = false);
+    /** Throw away 'node' and its parents, if nothing's mounted under them. */
+    void prunenode(MountNode *node);
+
     /** Find the active generator for a given key. */
     UniGenMount *findmount(const UniConfKey &key);
     /** Find a unique active generator a given key, will return NULL if
@@ -0,0 +1,116 @@
+/* -*- Mode: C++ -*-
+ * Worldvisions Weaver Software:
+ *   Copyright (C) 1997-2002 Net Integration Technologies, Inc.
+ *
+ * A queue that makes WvLog asynchronous.  See wvasynclog.cc.
+ */
+#ifndef __WVASYNCLOG_H
+#define __WVASYNCLOG_H
+
+#include "wvlog.h"
+
+/**
+ * Normally, every WvLog message is handed to every WvLogRcv right away,
+ * which formats it and writes it to a file or the console or syslog before
+ * the print() returns.  With lots of debug logging turned on, that means
+ * your program spends its time waiting for the disk.
+ *
+ * While a WvAsyncLog exists, WvLog just copies each message into a
+ * fixed-size ring buffer and returns.  The messages get sent on to the
+ * receivers later, from the main loop: add the WvAsyncLog to
+ * WvIStreamList::globallist (or whatever list you run), and whenever
+ * there's something in the queue, it'll be selectable and its callback
+ * will write out a batch of messages.  Receivers still see exactly the
+ * same calls as before, in the same order, just a bit later.
+ *
+ * If the ring fills up before the main loop gets around to emptying it,
+ * 'overflow' decides what to do with new messages:
+ *
+ *   Drop  -- throw them away quietly.
+ *   Count -- throw them away, but once the queue empties, log a warning
+ *            saying how many were lost.
+ *   Block -- write out everything in the queue right now, synchronously,
+ *            and then queue the new message.
+ *
+ * Messages too big to ever fit in the ring are written out synchronously
+ * (after the queue, so they stay in order).  Messages that receivers log
+ * while we're writing out the queue don't get queued either.
+ *
+ * There can only be one WvAsyncLog at a time.  Deleting it writes out
+ * whatever is left and makes WvLog synchronous again.
+ */
+class WvAsyncLog : public WvStream
+{
+    friend class WvLog;
+public:
+    enum Overflow { Drop, Count, Block };
+
+    WvAsyncLog(size_t _max_records = 1024, size_t _max_bytes = 256*1024,
+	       Overflow _overflow = Count);
+    virtual ~WvAsyncLog();
+
+    /** Write out up to 'max' queued messages right now. */
+    void drain(size_t max = (size_t)-1);
+
+    /** How many messages are in the queue right now. */
+    size_t depth() const
+        { return num; }
+
+    /** The most messages that were ever in the queue at once. */
+    size_t max_depth() const
+        { return maxnum; }
+
+    /** How many messages went through the queue. */
+    unsigned long total_queued() const
+        { return queued; }
+
+    /** How many messages were written out of the queue. */
+    unsigned long total_written() const
+        { return written; }
+
+    /** How many messages were dropped because the queue was full. */
+    unsigned long total_dropped() const
+        { return dropped; }
+
+    /** How many times Block had to write out the queue synchronously. */
+    unsigned long total_blocked() const
+        { return blocked; }
+
+    /** the queue itself is always ok */
+    virtual bool isok() const;
+
+    virtual void pre_select(SelectInfo &si);
+    virtual bool post_select(SelectInfo &si);
+
+protected:
+    virtual void execute();
+
+private:
+    struct Rec
+    {
+	WvString app;
+	int loglevel;
+	time_t when;
+	size_t off, len;
+    };
+
+    Rec *recs;
+    size_t max_records, first, num, maxnum;
+    char *data;
+    size_t max_bytes, wpos;
+    Overflow overflow;
+    bool draining;
+    unsigned long queued, written, dropped, blocked, unreported;
+
+    /**
+     * Called by WvLog::uwrite().  Returns true if we took care of the
+     * message, false if it should be written out right away.
+     */
+    bool enqueue(WvStringParm app, int loglevel, const char *buf, size_t len);
+    bool find_room(size_t len, size_t &off) const;
+
+public:
+    const char *wstype() const { return "WvAsyncLog"; }
+};
+
+#endif // __WVASYNCLOG_H
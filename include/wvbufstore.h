@@ -386,6 +386,56 @@ protected:
 
 
 
+/**
+ * A pool of recycled memory chunks for the buffers that
+ * WvLinkedBufferStore (and so WvDynBuf) creates and throws away all the
+ * time.
+ *
+ * Chunks come in power-of-two size classes, from MIN_CHUNK up to
+ * MAX_CHUNK bytes.  A request is rounded up to the next class, and
+ * released chunks wait on that class's free list for the next request
+ * of the same size, up to 'limit' bytes altogether.  Anything bigger
+ * than MAX_CHUNK goes straight to the heap.
+ *
+ * Like the rest of WvStreams, this isn't thread-safe; there's one pool
+ * per process, shared by everyone in the main loop.
+ */
+class WvBufChunkPool
+{
+public:
+    enum { MIN_CHUNK = 64, MAX_CHUNK = 1048576 };
+
+    struct Stats
+    {
+        size_t hits;       // chunks handed out from a free list
+        size_t misses;     // chunks we had to allocate
+        size_t oversize;   // too big for the pool, allocated directly
+        size_t in_use;     // bytes currently handed out
+        size_t in_use_max; // high-water mark for in_use
+        size_t cached;     // bytes waiting on the free lists
+        size_t cached_max; // high-water mark for cached
+    };
+
+    /** Don't keep more than this many bytes around for later. */
+    static size_t limit;
+
+    /**
+     * Returns a chunk of at least 'size' bytes, and changes 'size' to
+     * its real size, which you must pass back to put().
+     */
+    static void *get(size_t &size);
+
+    /** Returns a chunk from get() to the pool. */
+    static void put(void *chunk, size_t size);
+
+    /** Frees all the chunks waiting on the free lists. */
+    static void trim();
+
+    static const Stats &stats();
+};
+
+
+
 /**
  * The WvLinkedBuffer storage class.
  * 
@@ -435,6 +485,7 @@ protected:
 protected:
     /**
      * Called when a new buffer must be allocated to coalesce chunks.
+     * The default implementation takes its memory from WvBufChunkPool.
      *
      * "minsize" is the minimum size for the new buffer
      * Returns: the new buffer
@@ -137,6 +137,13 @@ public:
      */
     uint32_t send(WvDBusMsg msg);
     
+    /**
+     * Pass along a message that came from some other connection.  It's
+     * like send(), but the message's bytes get moved instead of copied, so
+     * it's got no arguments left afterwards.
+     */
+    uint32_t forward(WvDBusMsg &msg);
+    
     /**
      * Send a message on the bus, calling onreply() when the reply comes in
      * or the messages times out.
@@ -10,6 +10,10 @@
  * WvDBusMsg is intended to be an easy-to-use abstraction over the low-level 
  * D-Bus DBusMessage structure. It represents a message being passed around on 
  * the bus.
+ *
+ * Inside, we keep the header fields and the body in D-Bus wire format
+ * ourselves, since going through libdbus for every message is slow.  We
+ * only make a DBusMessage if somebody asks for one.
  */ 
 #ifndef __WVDBUSMSG_H
 #define __WVDBUSMSG_H
@@ -18,7 +22,6 @@
 #include "wvbuf.h"
 #include <stdint.h>
 
-struct DBusMessageIter;
 struct DBusMessage;
 
 class WvDBusMsg;
@@ -43,12 +46,18 @@ public:
 
     /**
      * Constructs a new WvDBus message from an existing low-level D-Bus 
-     * message.
+     * message.  We take our own copy of it, so changing _msg afterwards
+     * won't change us.
      */
     WvDBusMsg(DBusMessage *_msg);
 
     virtual ~WvDBusMsg();
 
+    /**
+     * Returns a libdbus copy of this message, made the first time you ask
+     * for it.  It's ours, so don't unref it, and changing it won't change
+     * us; use set_sender() and friends for that.
+     */
     operator DBusMessage* () const;
     
     /**
@@ -79,6 +88,18 @@ public:
      */
     void marshal(WvBuf &buf);
     
+    /**
+     * Like marshal(), but moves the message's bytes into buf instead of
+     * copying them, as far as it can.  There's no body left in the message
+     * afterwards, so only use this when you're done with it, like when
+     * you're just passing it along.
+     * (Implementation in wvdbusmarshal.cc)
+     */
+    void splice(WvBuf &buf);
+    
+    /** The DBUS_MESSAGE_TYPE_* of this message. */
+    int get_type() const;
+    
     WvString get_sender() const;
     WvString get_dest() const;
     WvString get_path() const;
@@ -90,6 +111,12 @@ public:
     bool is_reply() const;
     operator WvString() const;
     
+    /**
+     * Changes who this message says it's from.  The bus does this to
+     * every message that goes through it.
+     */
+    void set_sender(WvStringParm sender);
+    
     void get_arglist(WvStringList &list) const;
     WvString get_argstr() const;
 
@@ -176,13 +203,11 @@ public:
     class Iter
     {
     public:
-	DBusMessageIter *const first, *const it;
 	mutable WvString s;
 	bool rewound;
 	
 	Iter(const WvDBusMsg &_msg);
 	Iter(const WvDBusMsg::Iter &_it);
-	Iter(const DBusMessageIter &_first);
 	~Iter();
 
         /**
@@ -280,11 +305,90 @@ public:
 	operator WvString() const { return *ptr(); }
  	
 	WvIterStuff(WvString);
+	
+    private:
+	// We read straight out of the message body, so don't change the
+	// message while you're iterating through it.
+	const unsigned char *body;
+	bool swap;
+	
+	// The container we're walking through: the signature of its
+	// elements (just one, repeated, if it's an array) and where its
+	// contents are in the body.
+	const char *sig, *sigend;
+	size_t start, end;
+	bool isarray;
+	
+	// the current element: its signature, and where it starts and ends
+	const char *cursig, *cursigend;
+	size_t pos, after;
+	
+	Iter(const unsigned char *_body, bool _swap,
+	     const char *_sig, const char *_sigend,
+	     size_t _start, size_t _end, bool _isarray);
+	
+	uint32_t get32() const;
+	uint64_t get64() const;
+	const char *get_cstr() const;
+	
+	friend class WvDBusMsg;
     };
 
 protected:
-    mutable DBusMessage *msg;
-    WvList<DBusMessageIter> itlist;
+    /**
+     * Everything in a message.  Copies of a WvDBusMsg share this, so
+     * append()ing to one appends to all of them.
+     */
+    struct Data
+    {
+	int refs;
+	bool bigendian; // the byte order of the body
+	int type, flags;
+	uint32_t serial, replyserial;
+	WvString path, iface, member, error, dest, sender, sig;
+	WvDynBuf body;
+	DBusMessage *dmsg; // the libdbus copy, if we've made one
+	
+	// If the message came from demarshal(), the header it came with is
+	// still at the front of body, and is this long.  We pass it along
+	// as it is, except for the serial and sender, which are easy to fix.
+	size_t rawhdr;
+	bool rawsender; // that header already has a sender in it
+	
+	Data();
+	~Data();
+	
+	/**
+	 * Forget the libdbus copy and the header we came with, because
+	 * something changed.
+	 */
+	void changed();
+    };
+    
+    /** A container we're in the middle of append()ing to. */
+    struct Container
+    {
+	char type;
+	bool sigdone; // the signature already says what goes in here
+	size_t lenpos, start; // for arrays
+    };
+    
+    /** A message with nothing in it; the subclasses fill in the rest. */
+    WvDBusMsg();
+
+    Data *d;
+    WvList<Container> itlist;
+    
+private:
+    void init();
+    void marshal_header(WvBuf &buf);
+    void pad(size_t align);
+    WvDBusMsg &append_basic(char type, const void *data, size_t len);
+    WvDBusMsg &container_start(char type, WvStringParm element_type);
+    WvDBusMsg &container_end();
+    
+    /** Checks that the body really is what the signature says it is. */
+    bool body_ok() const;
 };
 
 
@@ -298,23 +402,19 @@ public:
 
 class WvDBusError : public WvDBusMsg
 {
-    DBusMessage *setup1(WvDBusMsg &in_reply_to,
-		       WvStringParm errname, WvStringParm message);
-    void setup2();
+    void setup(WvDBusMsg &in_reply_to,
+	       WvStringParm errname, WvStringParm message);
 public:
     WvDBusError(WvDBusMsg &in_reply_to,
 		WvStringParm errname, WvStringParm message)
-	: WvDBusMsg(setup1(in_reply_to, errname, message))
     {
-	setup2();
+	setup(in_reply_to, errname, message);
     }
     
     WvDBusError(WvDBusMsg &in_reply_to,
 		WvStringParm errname, WVSTRING_FORMAT_DECL)
-	: WvDBusMsg(setup1(in_reply_to, errname,
-			   WvString(WVSTRING_FORMAT_CALL)))
     {
-	setup2();
+	setup(in_reply_to, errname, WvString(WVSTRING_FORMAT_CALL));
     }
 };
 
@@ -21,12 +21,43 @@
 #include "wvlog.h"
 #include "wvistreamlist.h"
 #include <stdint.h>
+#include <map>
 
 class WvDBusMsg;
 class WvDBusConn;
 DeclareWvList(WvDBusConn);
 
 
+/**
+ * A match rule that a connection gave us with AddMatch, like
+ * "type='signal',interface='ca.nit.foo',member='bar'".  Broadcast messages
+ * only go to connections with a rule that matches them.
+ */
+class WvDBusMatchRule
+{
+public:
+    WvDBusMatchRule(WvDBusConn *_conn, WvStringParm _rule);
+
+    /** False if we couldn't make sense of the rule. */
+    bool isok() const
+        { return ok; }
+
+    WvDBusConn *conn;
+    WvString rule;   // put back together in a standard order
+    int type;        // a DBUS_MESSAGE_TYPE_*, or 0 for any type
+    WvString sender, iface, member, path, path_namespace, dest;
+    std::map<int, WvString> args; // argN='value'
+
+    /** How many messages this rule has matched so far. */
+    unsigned long matched;
+
+private:
+    bool ok;
+    bool set(WvStringParm key, WvStringParm value);
+};
+DeclareWvList(WvDBusMatchRule);
+
+
 class WvDBusServer : public WvIStreamList
 {
     WvIStreamList listeners;
@@ -85,10 +116,32 @@ public:
      */
     WvString get_addr();
 
+    /**
+     * All the match rules that our connections have registered, so you can
+     * see how many messages each one has matched.
+     */
+    const WvDBusMatchRuleList &match_rules() const
+        { return rules; }
+
 private:
     WvLog log;
     WvDBusConnList all_conns;
     std::map<WvString,WvDBusConn*> name_to_conn;
+
+    // Match rules are filed under their interface if they have one, or
+    // else their member, or else their path, so a broadcast only has to
+    // look at the rules that could possibly match it.  Rules with none of
+    // those go in wild_rules.
+    typedef std::multimap<WvString,WvDBusMatchRule*> RuleIndex;
+    WvDBusMatchRuleList rules;
+    RuleIndex rules_by_iface, rules_by_member, rules_by_path;
+    WvDBusMatchRuleList wild_rules;
+
+    bool add_match(WvDBusConn *conn, WvStringParm rule);
+    bool remove_match(WvDBusConn *conn, WvStringParm rule);
+    void unindex_rule(WvDBusMatchRule *r);
+    bool rule_matches(const WvDBusMatchRule *r, WvDBusConn &from,
+		      WvDBusMsg &msg, int type) const;
     
     void new_connection_cb(IWvStream *s);
     void conn_closed(WvStream &s);
@@ -8,6 +8,7 @@
 #define __WVFDSTREAM_H
 
 #include "wvstream.h"
+#include <typeinfo>
 
 /**
  * Base class for streams built on Unix file descriptors.
@@ -29,6 +30,22 @@ protected:
     /** Have we actually shut down the read/write sides? */
     bool shutdown_read, shutdown_write;
 
+    /**
+     * ureadv() and uwritev() only use readv() and writev() if the stream
+     * is exactly this class; anything else gets uread() and uwrite().
+     */
+    const std::type_info *iov_type;
+
+    /**
+     * A subclass whose uread() and uwrite() are still just read() and
+     * write() on the fds calls this with its own typeid() in its
+     * constructor, so ureadv() and uwritev() can use readv() and writev().
+     * It's not inherited: a subclass of that which overrides uread() or
+     * uwrite() doesn't get bypassed unless it asks too.
+     */
+    void allow_iov(const std::type_info &type)
+        { iov_type = &type; }
+
     /**
      * Sets the file descriptor for both reading and writing.
      * Convenience method.
@@ -104,6 +121,8 @@ public:
     virtual bool isok() const;
     virtual size_t uread(void *buf, size_t count);
     virtual size_t uwrite(const void *buf, size_t count);
+    virtual size_t ureadv(WvBuf &outbuf, size_t count);
+    virtual size_t uwritev(WvBuf &inbuf, size_t count);
     virtual void pre_select(SelectInfo &si);
     virtual bool post_select(SelectInfo &si);
     virtual void maybe_autoclose();
@@ -0,0 +1,227 @@
+/* -*- Mode: C++ -*-
+ * Worldvisions Weaver Software:
+ *   Copyright (C) 1997-2003 Net Integration Technologies, Inc.
+ *
+ * An open-addressing hash table container.  See wvflathash.cc.
+ */
+#ifndef __WVFLATHASH_H
+#define __WVFLATHASH_H
+
+#include "wvhash.h"
+#include "wvsorter.h"
+#include <sys/types.h>
+
+/**
+ * The untyped base class of WvFlatHash<T>.
+ *
+ * Like WvScatterHash, this stores pointers to elements directly in one big
+ * array instead of hanging a WvLink off each slot, but lookups are a lot
+ * cheaper: next to the array there's one "control byte" per slot, holding
+ * seven bits of the element's hash (or "empty" or "deleted").  A lookup
+ * checks a whole group of 16 control bytes at once (with SSE2, if we have
+ * it) and only calls compare() on slots whose seven bits match, which is
+ * almost never a wasted call.  The table grows by itself so it never gets
+ * more than 7/8 full.
+ *
+ * As with WvScatterHash, you can remove() elements while iterating, but
+ * add()ing one may rearrange the table and mess up your iterators.
+ */
+class WvFlatHashBase
+{
+    // Copy constructor - not defined anywhere!
+    WvFlatHashBase(const WvFlatHashBase &t);
+public:
+    WvFlatHashBase(unsigned _numslots);
+    virtual ~WvFlatHashBase();
+
+    enum { GROUP = 16 };
+    static const unsigned null_idx = (unsigned)-1;
+
+    size_t count() const { return num; }
+    bool isempty() const { return !num; }
+
+    /** The number of slots we have right now; always a power of two. */
+    unsigned capacity() const { return numslots; }
+
+    /** How many bytes the slots take up (not counting the elements). */
+    size_t memusage() const
+        { return numslots * (sizeof(Slot) + 1); }
+
+    /******* IterBase ******/
+    class IterBase
+    {
+    public:
+        IterBase(WvFlatHashBase &_table) : table(&_table) { }
+
+        IterBase(const IterBase &other)
+            : table(other.table), index(other.index) { }
+
+        void rewind() { index = 0; }
+	bool cur()
+	    { return index <= table->numslots; }
+	void *vptr()
+	    { return get(); }
+
+        bool next()
+        {
+            while (++index <= table->numslots
+		   && !is_full(table->ctrl[index-1])) { }
+	    return index <= table->numslots;
+        }
+
+        bool get_autofree() const
+	{
+            return table->xslots[index-1].autofree;
+	}
+
+        void set_autofree(bool autofree)
+	{
+            table->xslots[index-1].autofree = autofree;
+	}
+
+    protected:
+        void *get() const { return table->xslots[index-1].data; }
+
+        WvFlatHashBase *table;
+        unsigned index;
+    };
+
+protected:
+    friend class IterBase;
+
+    struct Slot
+    {
+	void *data;
+	unsigned hash;
+	bool autofree;
+    };
+
+    // control byte values: anything with the top bit clear is a full slot
+    enum { EMPTY = 0x80, DELETED = 0xfe };
+    static bool is_full(unsigned char c)
+        { return !(c & 0x80); }
+
+    virtual void do_delete(void *data) = 0;
+    virtual bool compare(const void *key, const void *elem) const = 0;
+
+    unsigned genfind(const void *key, unsigned hash) const;
+    void *genfind_or_null(const void *key, unsigned hash) const;
+    void _add(void *data, unsigned hash, bool autofree);
+    void _remove(const void *key, unsigned hash);
+    void _zap();
+    void _set_autofree(const void *key, unsigned hash, bool autofree);
+    bool _get_autofree(const void *key, unsigned hash) const;
+
+private:
+    Slot *xslots;
+    unsigned char *ctrl;
+    unsigned numslots;
+    size_t num, deleted;
+
+    void setup(unsigned _numslots);
+    void rehash(unsigned newslots);
+    unsigned find_free(unsigned hash) const;
+};
+
+
+template <
+    class T,                                            // element type
+    class K,                                            // key type
+    class Accessor,                                     // element to key
+    template <class> class Comparator = OpEqComp        // comparison func
+>
+class WvFlatHash : public WvFlatHashBase
+{
+protected:
+    typedef Comparator<K> MyComparator;
+
+    virtual bool compare(const void *key, const void *elem) const
+        { return MyComparator::compare((const K *)key,
+                Accessor::get_key((const T *)elem)); }
+
+    unsigned hash(const T *data) const
+        { return MyComparator::hash(Accessor::get_key(data)); }
+
+    virtual void do_delete(void *data)
+        { delete (T *)data; }
+
+public:
+    WvFlatHash(unsigned _numslots = 0) : WvFlatHashBase(_numslots) { }
+    virtual ~WvFlatHash() { _zap(); }
+
+    T *operator[] (const K &key) const
+        { return (T *)genfind_or_null(&key, MyComparator::hash(&key)); }
+
+    void add(const T *data, bool autofree = false)
+        { _add((void *)data, hash(data), autofree); }
+
+    void remove(const T *data)
+        { _remove(Accessor::get_key(data), hash(data)); }
+
+    void set_autofree(const K &key, bool autofree)
+        { _set_autofree(&key, MyComparator::hash(&key), autofree); }
+
+    void set_autofree(const T *data, bool autofree)
+        { _set_autofree(Accessor::get_key(data), hash(data), autofree); }
+
+    bool get_autofree(const K &key) const
+        { return _get_autofree(&key, MyComparator::hash(&key)); }
+
+    bool get_autofree(const T *data) const
+        { return _get_autofree(Accessor::get_key(data), hash(data)); }
+
+    void zap()
+        { _zap(); }
+
+    class Iter : public WvFlatHashBase::IterBase
+    {
+    public:
+        Iter(WvFlatHash &_table) : IterBase(_table) { }
+        Iter(const Iter &other) : IterBase(other) { }
+
+        T *ptr() const
+            { return (T *)(get()); }
+
+        WvIterStuff(T);
+    };
+
+    typedef class WvSorter<T, WvFlatHashBase, WvFlatHashBase::IterBase>
+	Sorter;
+};
+
+
+#define DeclareWvFlatDict2(_classname_,  _type_, _ftype_, _field_)        \
+        __WvFlatDict_base(_classname_, _type_, _ftype_, &obj->_field_,    \
+			  OpEqComp)
+
+#define DeclareWvFlatDict(_type_, _ftype_, _field_)                       \
+        DeclareWvFlatDict2(_type_##Dict, _type_, _ftype_, _field_)
+
+#define DeclareWvFlatTable2(_classname_, _type_)                          \
+        __WvFlatDict_base(_classname_, _type_, _type_, obj, OpEqComp)
+
+#define DeclareWvFlatTable(_type_)                                        \
+        DeclareWvFlatTable2(_type_##Table, _type_)
+
+// the same, but string keys are compared (and hashed) case-insensitively
+#define DeclareWvFlatCaseDict2(_classname_,  _type_, _ftype_, _field_)    \
+        __WvFlatDict_base(_classname_, _type_, _ftype_, &obj->_field_,    \
+			  StrCaseComp)
+
+#define DeclareWvFlatCaseDict(_type_, _ftype_, _field_)                   \
+        DeclareWvFlatCaseDict2(_type_##CaseDict, _type_, _ftype_, _field_)
+
+
+#define __WvFlatDict_base(_classname_, _type_, _ftype_, _field_, _comp_)  \
+    template <class T, class K>                                           \
+    struct _classname_##Accessor                                          \
+    {                                                                     \
+        static const K *get_key(const T *obj)                             \
+            { return _field_; }                                           \
+    };                                                                    \
+                                                                          \
+    typedef WvFlatHash<_type_, _ftype_,                                   \
+             _classname_##Accessor<_type_, _ftype_>, _comp_> _classname_
+
+
+#endif // __WVFLATHASH_H
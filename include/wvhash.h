@@ -9,19 +9,27 @@
 
 #include "wvstring.h"
 
-// predefined hashing functions (note: string hashes are case-insensitive)
+// predefined hashing functions
 unsigned WvHash(WvStringParm s);
 unsigned WvHash(const char *s);
 unsigned WvHash(const int &i);
 unsigned WvHash(const void *p);
 
+// case-insensitive string hashes, for keys that get compared with strcasecmp()
+unsigned WvHashNoCase(WvStringParm s);
+unsigned WvHashNoCase(const char *s);
 
-// Default comparison function used by WvHashTable
+
+// Default comparison function used by WvHashTable.  Comparators also
+// decide how keys are hashed, since keys that compare equal had better
+// hash the same.
 template <class K>
 struct OpEqComp
 {
     static bool compare(const K *key1, const K *key2)
         { return *key1 == *key2; }
+    static unsigned hash(const K *key)
+        { return WvHash(*key); }
 };
 
 
@@ -31,6 +39,8 @@ struct StrCaseComp
 {
     static bool compare(const K *key1, const K *key2)
         { return strcasecmp(*key1, *key2) == 0; }
+    static unsigned hash(const K *key)
+        { return WvHashNoCase(*key); }
 };
 
 #endif // __WVHASH_H
@@ -39,7 +39,12 @@
  * "foo" is looked up twice.  Both table searches return &amp;s.
  * The suggested table size of 10 elements places no upper bound on
  * the maximum number of elements, but optimizes the hash table for
- * holding roughly 10 elements.
+ * holding roughly 10 elements.  If it ends up holding a lot more than
+ * that, the table grows: a bigger array of slots is allocated, and the
+ * elements are moved over to it a few slots at a time by later add()s and
+ * remove()s, so no single call has to move all of them.  Nothing moves
+ * while there are any iterators around, so iterating works just like
+ * it always did.
  * 
  * To match an element, the WvString operator== function is used.  That
  * means this particular example is rather contrived since if you already
@@ -91,18 +96,43 @@ class WvHashTableBase
     WvHashTableBase(const WvHashTableBase &t); 
 protected:
     WvHashTableBase(unsigned _numslots);
-    virtual ~WvHashTableBase() {}; 
+    virtual ~WvHashTableBase();
     WvHashTableBase& operator= (const WvHashTableBase &t);
     void setup()
         { /* default: do nothing */ }
     void shutdown()
         { /* default: do nothing */ }
-    WvLink *prevlink(WvListBase *slots, const void *data, unsigned hash) const;
-    void *genfind(WvListBase *slots, const void *data, unsigned hash) const;
 
-    
+    /**
+     * Returns the link before the one holding the element matching 'data',
+     * and sets 'list' to the slot it's in.  If there's no such element,
+     * returns the last link of the slot it would be in.  Never NULL.
+     */
+    WvLink *prevlink(const void *data, unsigned hash,
+		     WvListBase **list = NULL) const;
+    void *genfind(const void *data, unsigned hash) const;
+
+    /** Returns the slot a new element with the given hash belongs in. */
+    WvListBase *addslot(unsigned hash);
+
+    /** Call after removing an element. */
+    void removed();
 
     virtual bool compare(const void *key, const void *elem) const = 0;
+    virtual unsigned do_hash(const void *data) const = 0;
+    virtual WvListBase *new_slots(unsigned n) = 0;
+    virtual void delete_slots(WvListBase *slots) = 0;
+
+    // while we're growing, the old array of slots that still has elements
+    // in it; slots below rehash_idx have been emptied already.
+    WvListBase *oldslots;
+    unsigned oldnumslots, rehash_idx;
+
+    size_t num;
+
+    void rehash_step(unsigned nslots);
+    void zap_old();
+
 public:
     unsigned numslots;
     WvListBase *wvslots;
@@ -128,10 +158,25 @@ public:
 	WvLink *link;
 	
 	IterBase(WvHashTableBase &_tbl) : tbl(& _tbl)
-            { }
+            { attach(); }
         IterBase(const IterBase &other) : tbl(other.tbl),
             tblindex(other.tblindex), link(other.link)
-            { }
+            { if (tbl) attach(); }
+	~IterBase()
+	    { detach(); }
+	IterBase &operator= (const IterBase &other)
+	{
+	    if (this != &other)
+	    {
+		detach();
+		tbl = other.tbl;
+		tblindex = other.tblindex;
+		link = other.link;
+		if (tbl)
+		    attach();
+	    }
+	    return *this;
+	}
 	void rewind()
             { tblindex = 0; link = &tbl->wvslots[0].head; }
 	WvLink *next();
@@ -155,7 +200,22 @@ public:
 	{
 	    link->set_autofree(autofree);
 	}
+
+    private:
+	// it's pretty common to delete a table before the iterator goes out
+	// of scope, so the table unhooks any iterators still on its list
+	// when it dies, and then tbl is NULL.
+	IterBase *nextiter;
+	void attach()
+	    { nextiter = tbl->iterators; tbl->iterators = this; }
+	void detach();
+	friend class WvHashTableBase;
     };
+
+protected:
+    // the iterators that currently point at us, so we know not to move
+    // anything around
+    IterBase *iterators;
 };
 
 
@@ -172,13 +232,22 @@ class WvHashTable : public WvHashTableBase
 protected:
     typedef Comparator<K> MyComparator; 
 
-    unsigned hash(const T *data)
-	{ return WvHash(*Accessor::get_key(data)); }
+    unsigned hash(const T *data) const
+	{ return MyComparator::hash(Accessor::get_key(data)); }
 
     virtual bool compare(const void *key, const void *elem) const
         { return MyComparator::compare((const K *)key,
                 Accessor::get_key((const T *)elem)); }
 
+    virtual unsigned do_hash(const void *data) const
+        { return hash((const T *)data); }
+
+    virtual WvListBase *new_slots(unsigned n)
+        { return new WvList<T>[n]; }
+
+    virtual void delete_slots(WvListBase *slots)
+        { deletev (WvList<T> *)slots; }
+
 public:
     /**
      * Creates a hash table.
@@ -192,16 +261,16 @@ public:
 	{ return (WvList<T> *)wvslots; }
 
     virtual ~WvHashTable()
-        { shutdown(); deletev sl(); }
+        { shutdown(); zap_old(); deletev sl(); }
 
     void add(T *data, bool autofree)
-        { sl()[hash(data) % numslots].append(data, autofree); }
+        { ((WvList<T> *)addslot(hash(data)))->append(data, autofree); }
 
     WvLink *getlink(const K &key)
-        { return prevlink(wvslots, &key, WvHash(key))->next; }
+        { return prevlink(&key, MyComparator::hash(&key))->next; }
 
     T *operator[] (const K &key) const
-        { return (T *)genfind(wvslots, &key, WvHash(key)); }
+        { return (T *)genfind(&key, MyComparator::hash(&key)); }
 
     /**
      * Returns the state of autofree for the element associated with key.
@@ -236,15 +305,21 @@ public:
 
     void remove(const T *data)
     {
-	unsigned h = hash(data);
-        WvLink *l = prevlink(wvslots, Accessor::get_key(data), h);
-	if (l && l->next) sl()[h % numslots].unlink_after(l);
+	WvListBase *list;
+        WvLink *l = prevlink(Accessor::get_key(data), hash(data), &list);
+	if (l && l->next)
+	{
+	    ((WvList<T> *)list)->unlink_after(l);
+	    removed();
+	}
     }
 
     void zap()
     {
+	zap_old();
 	deletev sl();
 	wvslots = new WvList<T>[numslots];
+	num = 0;
     }
 
     class Iter : public WvHashTableBase::IterBase
@@ -23,6 +23,7 @@ typedef int pid_t;
 #endif
 
 class WvLog;
+class WvAsyncLog;
 
 // a WvLogRcv registers itself with WvLog and prints, captures,
 // or transmits log messages.
@@ -56,6 +57,7 @@ typedef wv::function<WvString(WvStringParm)> WvLogFilter;
 class WvLog : public WvStream
 {
     friend class WvLogRcvBase;
+    friend class WvAsyncLog;
 public:
     enum LogLevel {
 	Critical = 0,
@@ -78,8 +80,14 @@ protected:
     static WvLogRcvBaseList *receivers;
     static int num_receivers, num_logs;
     static WvLogRcvBase *default_receiver;
+    static WvAsyncLog *async;
+    static time_t msgtime;
     WvLogFilter* filter;
 
+    /** Hand a message to all the receivers. */
+    static void deliver(WvStringParm app, int loglevel,
+			const char *buf, size_t len);
+
 public:
     WvLog(WvStringParm _app, LogLevel _loglevel = Info,  
             WvLogFilter* filter = 0);
@@ -148,6 +156,13 @@ public:
      */
     virtual size_t uwrite(const void *buf, size_t len);
     
+    /**
+     * When the message the receivers are looking at right now was logged.
+     * That's usually now, unless a WvAsyncLog queued it for a while.
+     */
+    static time_t timestamp()
+        { return msgtime ? msgtime : wvtime().tv_sec; }
+    
     /** a useful substitute for the normal C perror() function */
     void perror(WvStringParm s)
         { print("%s: %s\n", s, strerror(errno)); }
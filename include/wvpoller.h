@@ -0,0 +1,187 @@
+/* -*- Mode: C++ -*-
+ * Worldvisions Weaver Software:
+ *   Copyright (C) 1997-2002 Net Integration Technologies, Inc.
+ *
+ * A pluggable replacement for the fd_sets in SelectInfo.  See wvpoller.cc.
+ */
+#ifndef __WVPOLLER_H
+#define __WVPOLLER_H
+
+#include "iwvstream.h"
+#include "wvtimeutils.h"
+#include <sys/types.h>
+#include <map>
+#include <set>
+#include <vector>
+
+/**
+ * WvPoller remembers which file descriptors the streams are interested in
+ * from one select() to the next, so that a backend like epoll only has to
+ * be told about the *changes* instead of being handed three brand new
+ * fd_sets every time around the main loop.  It also isn't limited to
+ * FD_SETSIZE.
+ *
+ * During pre_select(), streams call add() for each fd they care about.
+ * wait() then pushes any differences since the last round to the backend
+ * and blocks, and afterwards post_select() can ask isset() about each fd.
+ * Any fd that wasn't add()ed this round is forgotten automatically.
+ *
+ * As a bonus, the poller keeps track of which stream "owns" each fd (see
+ * set_owner()), so that WvIStreamList can skip post_select() for all the
+ * streams that obviously have nothing to do.
+ *
+ * If create() returns NULL, there's no usable backend and the caller should
+ * stick to the good old fd_sets and ::select().
+ */
+class WvPoller
+{
+public:
+    enum { READ = 1, WRITE = 2, EXCEPT = 4 };
+
+    virtual ~WvPoller();
+
+    /** Returns a new poller using the best available backend, or NULL. */
+    static WvPoller *create();
+
+    /** If true, create() always returns NULL.  Mostly for debugging. */
+    static bool disabled;
+
+    /**
+     * Tell every poller that fd is about to be closed, so they can stop
+     * watching it while it still means something.  WvFdStream does this
+     * for you.
+     */
+    static void fd_closed(int fd);
+
+    /** Start a new round: forget last round's results and owners. */
+    void begin();
+
+    /** Changes with every begin(), so you can tell one round from another. */
+    unsigned current_round() const
+        { return round; }
+
+    /**
+     * Declare interest in 'events' (READ|WRITE|EXCEPT) on fd this round.
+     * 'cookie' identifies whoever the fd belongs to (usually the stream);
+     * if it changes, we assume the fd number was closed and reused behind
+     * our back and register it from scratch.
+     */
+    void add(int fd, unsigned events, const void *cookie = NULL);
+
+    /**
+     * Commit this round's declarations and wait for up to msec_timeout
+     * milliseconds (-1 means forever).  Returns the number of ready fds,
+     * or -1 with errno set, just like ::select().
+     */
+    int wait(time_t msec_timeout);
+
+    /** After wait(), returns true if fd is ready for any of 'events'. */
+    bool isset(int fd, unsigned events) const
+    {
+	return fd >= 0 && (size_t)fd < fds.size()
+	    && fds[fd].round == round && (fds[fd].revents & events);
+    }
+
+    /**
+     * The stream that will be blamed for any fds add()ed from now on.
+     * WvIStreamList sets this to each of its children in turn during
+     * pre_select().  NULL means nobody in particular.
+     */
+    IWvStream *owner() const
+        { return cur_owner; }
+    void set_owner(IWvStream *s)
+        { cur_owner = s; }
+
+    /**
+     * Remember that the given stream list is tracking its children this
+     * round, so its post_select() can skip the ones that aren't ready.
+     */
+    void add_tracker(IWvStream *list)
+        { trackers.push_back(list); }
+    bool is_tracker(IWvStream *list) const;
+
+    /**
+     * Ask for post_select() on stream s after the wait, if msec_timeout
+     * milliseconds have elapsed by then.  0 means unconditionally.
+     */
+    void add_timeout(IWvStream *s, time_t msec_timeout);
+
+    /**
+     * Returns true if s owns a ready fd, or asked for a timeout that has
+     * expired by now.
+     */
+    bool is_ready(IWvStream *s) const;
+
+protected:
+    WvPoller();
+
+    /** Tell the backend to change fd's interest set from 'had' to 'want'. */
+    virtual bool _update(int fd, unsigned had, unsigned want) = 0;
+
+    /**
+     * Wait for events; call ready() once for each fd that fires.  Returns
+     * -1 on error, otherwise anything else.
+     */
+    virtual int _wait(time_t msec_timeout) = 0;
+
+    /**
+     * Throw away all backend state; everything will be re-added.  Also
+     * called whenever there's nothing left to watch.
+     */
+    virtual void _reset() = 0;
+
+    /**
+     * Called by _wait() backends to report an event.  'serial' must be the
+     * value serial(fd) had when the fd was registered; if it doesn't match,
+     * the event is from a previous incarnation of that fd number and the
+     * backend gets _reset().
+     */
+    void ready(int fd, unsigned serial, unsigned revents);
+
+    /** The registration serial number for fd, used to weed out ghosts. */
+    unsigned serial(int fd) const
+        { return fds[fd].serial; }
+
+private:
+    struct FdInfo
+    {
+	unsigned want;       // events add()ed this round
+	unsigned registered; // events the backend currently knows about
+	unsigned revents;    // events that fired in the last wait()
+	unsigned round;      // the last round this fd was add()ed in
+	unsigned serial;     // bumped whenever the fd is newly registered
+	bool always_ready;   // backend can't poll it (eg. a regular file)
+	bool shared;         // more than one owner add()ed it this round
+	bool moved;          // cookie changed since the last round
+	IWvStream *owner;    // who add()ed it
+	const void *cookie;  // what add()ed it
+
+	FdInfo()
+	    : want(0), registered(0), revents(0), round(0), serial(0),
+	      always_ready(false), shared(false), moved(false),
+	      owner(NULL), cookie(NULL)
+	    { }
+    };
+
+    std::vector<FdInfo> fds;
+    std::vector<int> declared, active, fired;
+    std::vector<std::pair<int, IWvStream *> > shared_fds;
+    std::vector<IWvStream *> trackers;
+    std::map<IWvStream *, WvTime> timeouts;
+    std::set<IWvStream *> hot;
+    IWvStream *cur_owner;
+    unsigned round;
+    bool need_reset;
+    size_t nregistered;
+
+    void commit();
+    void reset();
+    void unregister(int fd);
+    void heat(int fd);
+
+#ifndef _WIN32
+    static void onfork(pid_t pid);
+#endif
+};
+
+#endif // __WVPOLLER_H
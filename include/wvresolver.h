@@ -20,7 +20,15 @@ DeclareWvDict(WvResolverAddr, WvIPAddr, addr[0]);
 
 DeclareWvList(WvIPAddr);
 
-/** ASynchronous DNS resolver functions, so that we can do non-blocking lookups */
+/**
+ * ASynchronous DNS resolver functions, so that we can do non-blocking lookups.
+ *
+ * Names in /etc/hosts come straight from there; for anything else, we ask
+ * the nameservers in /etc/resolv.conf ourselves, over UDP (or TCP, if the
+ * answer doesn't fit), while you select() on us.  Answers stay in the
+ * cache for as long as their TTL says, and "no such name" answers for as
+ * long as the zone's SOA record says (RFC 2308).
+ */
 class WvResolver
 {
     static int numresolvers;
@@ -30,6 +38,15 @@ public:
     WvResolver();
     ~WvResolver();
     
+    /**
+     * Get the nameservers and search domains from resolvconf, and the
+     * local names from hosts, instead of /etc/resolv.conf and /etc/hosts;
+     * an empty string means the usual file.  A nameserver can have a port,
+     * as in "nameserver 127.0.0.1:5353", which is mostly for testing.
+     * This empties the cache.
+     */
+    static void set_config(WvStringParm resolvconf, WvStringParm hosts);
+    
     /**
      * Return -1 on timeout, or the number of addresses found, which may
      * be 0 if the address does not exist.
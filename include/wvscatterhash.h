@@ -19,11 +19,22 @@
 #define IS_AUTO_FREE(x) ((x) == 3)
 #define IS_DELETED(x) ((x) == 1)
 
+/**
+ * The untyped base class of WvScatterHash<T>.
+ *
+ * When a big table gets too full, we allocate a bigger one and move the
+ * elements over a few at a time during later calls to add() and remove(),
+ * instead of all at once.  Until that's done, lookups check both.  Nothing
+ * gets moved while there are iterators around, so you can still remove()
+ * (and, as long as the table doesn't get really full, add()) while
+ * iterating.  Small tables just get rebuilt in one go, like they always
+ * did, so add()ing to one of those can still upset your iterators.
+ */
 class WvScatterHashBase
 {
 public:
     WvScatterHashBase(unsigned _numslots);
-    virtual ~WvScatterHashBase() { deletev xslots; deletev xstatus; }
+    virtual ~WvScatterHashBase();
 
     static const unsigned null_idx = (unsigned)-1;
     static const unsigned prime_numbers[];
@@ -36,14 +47,19 @@ public:
     class IterBase
     {
     public:
-        IterBase(WvScatterHashBase &_table) : table(&_table) { }
+        IterBase(WvScatterHashBase &_table) : table(&_table)
+            { attach(); }
 
         IterBase(const IterBase &other)
-            : table(other.table), index(other.index) { }
+            : table(other.table), index(other.index)
+            { attach(); }
+
+        ~IterBase()
+            { detach(); }
 
         void rewind() { index = 0; }
 	bool cur()
-	    { return index <= table->numslots; }
+	    { return index <= table->totalslots(); }
 	void *vptr()
 	    { return get(); }
 	
@@ -53,27 +69,42 @@ public:
                 return false;
 
 	    /* FIXME: Couldn't this be a *little* clearer? */
-            while (++index <= table->numslots &&
-                   !IS_OCCUPIED(table->xstatus[index-1])) { }
+            while (++index <= table->totalslots() &&
+                   !IS_OCCUPIED(table->status_at(index-1))) { }
 
-	    return index <= table->numslots;
+	    return index <= table->totalslots();
         }
 
         bool get_autofree() const
 	{
-            return IS_AUTO_FREE(table->xstatus[index-1]);
+            return IS_AUTO_FREE(table->status_at(index-1));
 	}
 
         void set_autofree(bool autofree)
 	{
-            table->xstatus[index-1] = autofree ? 3 : 2;
+            table->status_at(index-1) = autofree ? 3 : 2;
 	}
 
     protected:
-        void *get() const { return table->xslots[index-1]; }
+        void *get() const { return table->slot_at(index-1); }
 
         WvScatterHashBase *table;
         unsigned index;
+
+    private:
+        // see WvHashTableBase::IterBase: a dying table sets table to NULL.
+        // (UniHashTreeBase also likes to make iterators on a NULL table.)
+        IterBase *nextiter;
+        void attach()
+        {
+            if (table)
+            {
+                nextiter = table->iterators;
+                table->iterators = this;
+            }
+        }
+        void detach();
+        friend class WvScatterHashBase;
     };
 
 
@@ -91,6 +122,22 @@ protected:
     int prime_index;
     unsigned numslots;
 
+    // while we're growing, the old table that we're still moving things
+    // out of; everything below migrate_idx has been moved already.
+    Slot *oldslots;
+    Status *oldstatus;
+    unsigned oldnumslots, migrate_idx;
+
+    IterBase *iterators;
+
+    // genfind() and the iterators number the old slots after the new ones
+    unsigned totalslots() const
+        { return numslots + (oldslots ? oldnumslots : 0); }
+    Slot &slot_at(unsigned i) const
+        { return i < numslots ? xslots[i] : oldslots[i - numslots]; }
+    Status &status_at(unsigned i) const
+        { return i < numslots ? xstatus[i] : oldstatus[i - numslots]; }
+
     unsigned genfind(const void *data, unsigned hash) const;
     Slot genfind_or_null(const void *data, unsigned hash) const;
     void _add(void *data, bool autofree);
@@ -105,11 +152,16 @@ protected:
 
 private:
     void rebuild();
-    unsigned second_hash(unsigned hash) const
-        { return (hash % (numslots - 1)) + 1; }
-    unsigned curhash(unsigned hash, unsigned hash2, unsigned attempt) const
-        //{ return (hash + attempt * attempt) % numslots; }
-        { return (hash + attempt*hash2) % numslots; }
+    void migrate(unsigned nslots);
+    void insert(void *data, unsigned hash, Status status);
+    unsigned find_in(const Slot *slots, const Status *status, unsigned n,
+		     const void *data, unsigned hash) const;
+    static unsigned second_hash(unsigned hash, unsigned n)
+        { return (hash % (n - 1)) + 1; }
+    static unsigned curhash(unsigned hash, unsigned hash2, unsigned attempt,
+			    unsigned n)
+        //{ return (hash + attempt * attempt) % n; }
+        { return (hash + attempt*hash2) % n; }
 
     size_t used;
     size_t num;
@@ -132,7 +184,7 @@ protected:
                 Accessor::get_key((const T *)elem)); }
 
     unsigned hash(const T *data)
-        { return WvHash(*Accessor::get_key(data)); }
+        { return MyComparator::hash(Accessor::get_key(data)); }
 
     virtual unsigned do_hash(const void *data)
         { return hash((const T *)data); }
@@ -145,7 +197,7 @@ public:
     virtual ~WvScatterHash() { _zap(); }
 
     T *operator[] (const K &key) const
-        { return (T *)(genfind_or_null(&key, WvHash(key))); }
+        { return (T *)(genfind_or_null(&key, MyComparator::hash(&key))); }
 
     void add(const T *data, bool autofree = false)
         { _add((void *)data, hash(data), autofree); }
@@ -155,7 +207,7 @@ public:
 
     void set_autofree(const K &key, bool autofree)
     {
-	_set_autofree(key, WvHash(key), autofree);
+	_set_autofree(key, MyComparator::hash(&key), autofree);
     }
 
     void set_autofree(const T *data, bool autofree)
@@ -165,7 +217,7 @@ public:
 
     bool get_autofree(const K &key)
     {
-	return _get_autofree(key, WvHash(key));
+	return _get_autofree(key, MyComparator::hash(&key));
     }
 
     bool get_autofree(const T *data)
@@ -183,7 +235,7 @@ public:
         Iter(WvScatterHash &_table) : IterBase(_table) { }
         Iter(const Iter &other) : IterBase(other) { }
 
-        unsigned char *getstatus() { return &xstatus[index-1]; }
+        unsigned char *getstatus() { return &table->status_at(index-1); }
 
         T *ptr() const
             { return (T *)(get()); }
@@ -0,0 +1,112 @@
+/* -*- Mode: C++ -*-
+ * Worldvisions Weaver Software:
+ *   Copyright (C) 1997-2007 Net Integration Technologies, Inc.
+ *
+ * An SSL context that lots of WvSSLStreams can share.
+ */
+#ifndef __WVSSLCONTEXT_H
+#define __WVSSLCONTEXT_H
+
+#include "wverror.h"
+#include "wvlog.h"
+#include "wvxplc.h"
+#include <map>
+
+struct ssl_st;
+struct ssl_ctx_st;
+struct ssl_session_st;
+
+typedef struct ssl_ctx_st SSL_CTX;
+typedef struct ssl_st SSL;
+typedef struct ssl_session_st SSL_SESSION;
+
+class WvX509Mgr;
+
+/**
+ * Everything about an SSL connection that doesn't change from one
+ * connection to the next: the certificate and key, the cipher list, and
+ * the options.  Setting all that up is slow, so if you're going to make
+ * lots of WvSSLStreams, make one of these and give it to all of them.
+ *
+ * It also remembers SSL sessions, so that the next handshake with the
+ * same peer can skip all the public key stuff.  A server context does
+ * that for both session IDs and session tickets; a client context keeps
+ * the last session it got from each peer address.
+ *
+ * It's refcounted; each WvSSLStream using it holds a reference.
+ */
+class WvSSLContext : public IObject, public WvErrorBase
+{
+    IMPLEMENT_IOBJECT(WvSSLContext);
+public:
+    /**
+     * Set up a context for clients, or for servers if is_server is true.
+     * The x509 is optional for a client, and mandatory for a server.  We
+     * addRef() it, so you can release yours whenever you like.
+     */
+    WvSSLContext(WvX509Mgr *_x509 = NULL, bool _is_server = false);
+    virtual ~WvSSLContext();
+
+    virtual bool isok() const
+        { return ctx && WvErrorBase::isok(); }
+
+    bool server() const
+        { return is_server; }
+
+    /** How many handshakes went all the way through the key exchange. */
+    unsigned long full_handshakes() const
+        { return full; }
+
+    /** How many handshakes got to reuse an earlier session. */
+    unsigned long resumed_handshakes() const
+        { return resumed; }
+
+    /** Forget all the sessions we were hanging onto. */
+    void flush_sessions();
+
+    /**
+     * Ask for kernel TLS (Linux only): once the handshake is done, the
+     * kernel does the record encryption, so our streams can write straight
+     * to the socket, and WvSSLStream::sendfile() doesn't have to read the
+     * file at all.  Returns false if this OpenSSL can't do it.  Even if it
+     * can, each connection quietly goes on the old way if the kernel
+     * doesn't have the tls module or doesn't like the cipher.
+     */
+    bool use_ktls(bool enable = true);
+
+    /** The OpenSSL context itself.  Don't free it! */
+    SSL_CTX *ctx;
+
+    /** Our certificate, or NULL if we didn't get one. */
+    WvX509Mgr *x509;
+
+private:
+    bool is_server;
+    unsigned long full, resumed;
+    WvLog debug;
+
+    /** Client sessions we can try again, by peer address. */
+    typedef std::map<WvString, SSL_SESSION *> SessionMap;
+    SessionMap sessions;
+
+    /** The most sessions we keep, so a client with lots of peers can't
+     * fill up all of memory with them. */
+    enum { MAX_SESSIONS = 1024 };
+
+    // These are for WvSSLStream.
+    friend class WvSSLStream;
+
+    /** Hang onto sess (which we now own) for the next connection to peer. */
+    void save_session(WvStringParm peer, SSL_SESSION *sess);
+
+    /** If we've got a session for peer, have ssl try to resume it. */
+    void resume_session(WvStringParm peer, SSL *ssl);
+
+    /** The session we had for peer didn't work out, so drop it. */
+    void forget_session(WvStringParm peer);
+
+    /** Count ssl's handshake, which just finished. */
+    void handshake_done(SSL *ssl);
+};
+
+#endif // __WVSSLCONTEXT_H
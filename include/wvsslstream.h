@@ -16,12 +16,16 @@ struct ssl_st;
 struct ssl_ctx_st;
 struct ssl_method_st;
 
+struct ssl_session_st;
+
 typedef struct ssl_ctx_st SSL_CTX;
 typedef struct ssl_st SSL;
 typedef struct ssl_method_st SSL_METHOD;
+typedef struct ssl_session_st SSL_SESSION;
 
 class WvX509;
 class WvX509Mgr;
+class WvSSLContext;
 class WvSSLStream;
 
 typedef wv::function<bool(WvX509*)> WvSSLValidateCallback;
@@ -54,6 +58,16 @@ public:
     WvSSLStream(IWvStream *_slave, WvX509Mgr *_x509 = NULL, 
     		WvSSLValidateCallback _vcb = 0, bool _is_server = false);
     
+    /**
+     * Start an SSL connection on the stream _slave, using a context that
+     * other streams might be sharing too (which is a lot faster than
+     * making a new one every time).  Whether we're a client or a server
+     * depends on the context.  We addRef() it, so you can release yours
+     * whenever you like.
+     */
+    WvSSLStream(IWvStream *_slave, WvSSLContext &_context,
+		WvSSLValidateCallback _vcb = 0);
+    
     /** Cleans up everything (calls close + frees up the SSL Objects used) */
     virtual ~WvSSLStream();
     
@@ -65,10 +79,25 @@ public:
     virtual void noread();
     virtual void nowrite();
     
+    /**
+     * Send len bytes of the file fd, starting at offset, just as if you'd
+     * read them in and write()n them.  With kernel TLS (see
+     * WvSSLContext::use_ktls()), they go from the file to the socket
+     * without passing through us at all.  Returns how many bytes we took.
+     */
+    size_t sendfile(int fd, off_t offset, size_t len);
+    
+    /** True if the kernel is doing the encryption for our writes. */
+    bool ktls() const
+        { return ktls_send; }
+    
 protected:
     WvX509Mgr *x509;
     
-    /** SSL Context - used to create SSL Object */
+    /** Where our settings (and saved sessions) come from */
+    WvSSLContext *context;
+    
+    /** SSL Context - used to create SSL Object; it belongs to context */
     SSL_CTX *ctx;
     
     /**
@@ -81,6 +110,18 @@ protected:
     virtual size_t uread(void *buf, size_t len);
     
 private:
+    /** The part of the constructors that's the same for both. */
+    void init();
+    
+    /**
+     * Who we're talking to, for finding our session again next time.
+     * Only clients bother.
+     */
+    WvString peer;
+    
+    /** OpenSSL calls this when a client gets a session it can reuse. */
+    static int new_session_cb(SSL *ssl, SSL_SESSION *sess);
+    
     /**
      * Connection Status Flag, since SSL takes a few seconds to
      * initialize itself.
@@ -106,18 +147,20 @@ private:
     /**
      * SSL_write() may return an SSL_ERROR_WANT_WRITE code which
      * indicates that the function should be called again with
-     * precisely the same arguments as the last time.  To ensure that
-     * this can happen, we must unfortunately copy data into a bounce
-     * buffer and remeber the fact.  We use a WvBuf here to allow
-     * an arbitrary amount of data to be set aside.
+     * precisely the same arguments as the last time.  Our caller won't
+     * necessarily do that, so when it happens, we copy the data into a
+     * bounce buffer and remember the fact.  The rest of the time, we
+     * write straight out of the caller's buffer.
      */
     WvInPlaceBuf write_bouncebuf;
     size_t write_eat;
 
-    /** Similar nastiness happens with SSL_read() */
-    WvInPlaceBuf read_bouncebuf;
+    /** SSL might be hanging onto data that select() doesn't know about */
     bool read_pending;
 
+    /** The kernel encrypts what we write, so SSL_write() isn't needed */
+    bool ktls_send;
+
     /** Need to buffer writes until sslconnected */
     WvDynBuf unconnected_buf;
 
@@ -156,6 +156,26 @@ public:
     virtual size_t uwrite(const void *buf, size_t count)
         { return count; /* basic WvStream doesn't actually do anything! */ }
 
+    /**
+     * Like uread(), but reads straight into outbuf, without making it
+     * find 'count' contiguous bytes first if the stream can help it.
+     * Returns the number of bytes added to outbuf.
+     *
+     * The default just calls uread() and adds the result to outbuf.
+     */
+    virtual size_t ureadv(WvBuf &outbuf, size_t count);
+
+    /**
+     * Like uwrite(), but takes up to 'count' bytes straight out of inbuf,
+     * even if they're spread over several pieces.  Returns the number of
+     * bytes written, which are removed from inbuf.
+     *
+     * The default only writes the first contiguous piece, using uwrite(),
+     * so nothing ever has to be copied together.  WvFdStream uses
+     * writev() to do the whole thing at once.
+     */
+    virtual size_t uwritev(WvBuf &inbuf, size_t count);
+
     /**
      * Read up to one line of data from the stream and return a
      * pointer to the internal buffer containing this line.  If the
@@ -584,19 +604,28 @@ protected:
     //
     // all of the fields are filled in with new values
     // si.msec_timeout contains the time until the next alarm expires
+    // if poller is non-NULL, fds are added to it instead of the fd_sets
     void _build_selectinfo(SelectInfo &si, time_t msec_timeout,
         bool readable, bool writable, bool isexcept,
-        bool forceable);
+        bool forceable, WvPoller *poller = NULL);
 
-    // runs the actual select() function over the given
-    // SelectInfo data structure, returns the number of descriptors
-    // in the set, and sets the error code if a problem occurs
+    // runs the actual select() function (or the poller's wait()) over
+    // the given SelectInfo data structure, returns the number of
+    // descriptors in the set, and sets the error code if a problem occurs
     int _do_select(SelectInfo &si);
 
     // processes the SelectInfo data structure (runs post_select)
     // returns true if there are callbacks to be dispatched
     bool _process_selectinfo(SelectInfo &si, bool forceable);
 
+    // Streams whose owner is being tracked by a WvPoller (see
+    // WvIStreamList) don't add their alarms to si.msec_timeout one by one;
+    // they just mark themselves in the shared alarm heap.  The tracking
+    // list then calls next_alarm() once to find the soonest one, and after
+    // the wait, ring_alarms() wakes up only the owners of expired alarms.
+    static time_t next_alarm(WvPoller *poller);
+    static void ring_alarms(WvPoller *poller);
+
     // tries to empty the output buffer if the stream is writable
     // not quite the same as flush() since it merely empties the output
     // buffer asynchronously whereas flush() might have other semantics
@@ -637,7 +666,11 @@ protected:
     size_t queue_min;		// minimum bytes to read()
     time_t autoclose_time;	// close eventually, even if output is queued
     WvTime alarm_time;          // select() returns true at this time
-    WvTime last_alarm_check;    // last time we checked the alarm_remaining
+    size_t alarm_slot;          // our index in the alarm heap, if any
+    WvPoller *alarm_poller;     // the poller our alarm was marked for...
+    unsigned alarm_round;       // ...and in which round
+    IWvStream *alarm_owner;     // who to wake up when our alarm rings
+    friend class WvAlarmHeap;
     
     /**
      * The callback() function calls execute(), and then calls the user-
@@ -24,6 +24,9 @@
 /* 1 byte for terminating NUL */
 #define WVSTRING_EXTRA 1
 
+/* WvString keeps strings shorter than this (including the NUL) inside itself */
+#define WVSTRING_SMALL 24
+
 
 #define __WVS_F(n) WvStringParm __wvs_##n
 #define __WVS_FORM(n) WvStringParm __wvs_##n = WvFastString::null
@@ -101,6 +104,17 @@ protected:
     // WvStringBuf used for char* strings that have not been cloned.
     static WvStringBuf nullbuf;
     
+    // WvStringBuf used by strings whose data lives in their own small[]
+    // array instead of on the heap.
+    static WvStringBuf smallbuf;
+    
+    /**
+     * Short strings live here instead of in a malloc()ed WvStringBuf, with
+     * buf pointing at smallbuf.  Since it can't be shared, copying a short
+     * string copies the data; longer ones are still copy-on-write.
+     */
+    char small[WVSTRING_SMALL];
+    
 public:
     // a null string, converted to char* as "(nil)"
     static const WvFastString null;
@@ -125,6 +139,10 @@ public:
      * too, since no special behaviour is required in this direction.  (Note
      * that copying from a WvFastString to a WvString _does_ require special
      * care!)
+     *
+     * Short strings keep their data inside the string object itself, so
+     * for those we copy the bytes into our own small[], rather than leave
+     * you pointing into a WvString that might go away first.
      */
     WvFastString(const WvFastString &s);
     WvFastString(const WvString &s);
@@ -186,6 +204,28 @@ public:
      * the world.
      */
     WvFastString(WVSTRING_FORMAT_DECL) 
+    {
+	link(&nullbuf, NULL);
+	format(small, WVSTRING_FORMAT_CALL);
+    }
+    
+    ~WvFastString();
+    
+    /*
+     * Figure out the length of this string.  ==0 if NULL or empty.
+     */
+    size_t len() const;
+
+protected:
+    void construct(const char *_str);
+    void link_or_copy(const WvFastString &s);
+    
+    /**
+     * Render a format string into this string, like the format constructor
+     * does.  If 'room' is non-NULL, it points at WVSTRING_SMALL bytes we
+     * can use instead of allocating, if the result is short enough.
+     */
+    void format(char *room, WVSTRING_FORMAT_DEFN)
     {
 	const WvFastString *x[20];
 
@@ -210,19 +250,11 @@ public:
 	x[18] = (&__wvs_a18 != &null)? &__wvs_a18 : 0;
 	x[19] = (&__wvs_a19 != &null)? &__wvs_a19 : 0;
 
-	link(&nullbuf, NULL);
-	do_format(*this, __wvs_format.str, x);
+	do_format(*this, __wvs_format.str, x, room);
     }
     
-    ~WvFastString();
-    
-    /*
-     * Figure out the length of this string.  ==0 if NULL or empty.
-     */
-    size_t len() const;
-
-protected:
-    void construct(const char *_str);
+    static void do_format(WvFastString &output, const char *format,
+			  const WvFastString * const *a, char *room);
 
     // this doesn't exist - it's just here to keep it from being auto-created
     // by stupid C++.
@@ -307,7 +339,10 @@ public:
  *
  * When you copy one WvString to another, it does _not_ duplicate the
  * buffer; it just creates another pointer to it. To really duplicate
- * the buffer, call the unique() member function.
+ * the buffer, call the unique() member function.  (Strings shorter than
+ * WVSTRING_SMALL bytes are the exception: they're stored right inside the
+ * WvString, so there's no buffer to share and copying them is cheaper
+ * than a malloc() anyway.)
  *
  * To change the contents of a WvString, you need to run its edit()
  * member function, which executes unique() and then returns a char*
@@ -333,15 +368,17 @@ public:
     static const WvString empty;
  
     WvString() {} // nothing special needed
-    WvString(short i) : WvFastString(i) { } // nothing special
-    WvString(unsigned short i) : WvFastString(i) { } // nothing special
-    WvString(int i) : WvFastString(i) { } // nothing special
-    WvString(unsigned int i) : WvFastString(i) { } // nothing special
-    WvString(long i) : WvFastString(i) { } // nothing special
-    WvString(unsigned long i) : WvFastString(i) { } // nothing special
-    WvString(long long i) : WvFastString(i) { } // nothing special
-    WvString(unsigned long long i) : WvFastString(i) { } // nothing special
-    WvString(double i) : WvFastString(i) { } // nothing special
+    
+    /** Numbers always fit in small[], so these never allocate. */
+    WvString(short i);
+    WvString(unsigned short i);
+    WvString(int i);
+    WvString(unsigned int i);
+    WvString(long i);
+    WvString(unsigned long i);
+    WvString(long long i);
+    WvString(unsigned long long i);
+    WvString(double i);
     
     /**
      * Magic copy constructor for "fast" char* strings.  When we copy from
@@ -375,8 +412,8 @@ public:
      */
     inline WvString(const std::string &s);
 
-    WvString(WVSTRING_FORMAT_DECL) : WvFastString(WVSTRING_FORMAT_CALL)
-        { }
+    WvString(WVSTRING_FORMAT_DECL)
+        { format(small, WVSTRING_FORMAT_CALL); }
     
     WvString &append(WvStringParm s);
     WvString &append(WVSTRING_FORMAT_DECL)
@@ -384,6 +421,8 @@ public:
 
     WvString &operator= (int i);
     WvString &operator= (const WvFastString &s2);
+    WvString &operator= (const WvString &s2)
+        { return *this = (const WvFastString &)s2; }
     WvString &operator= (const char *s2)
         { return *this = WvFastString(s2); }
     
@@ -408,6 +447,10 @@ protected:
             // still can (and should!) use fast parameter passing via WvFastString.
             unique();
         }
+    
+private:
+    void use_small()
+        { unlink(); link(&smallbuf, small); }
 };
 
 
@@ -55,7 +55,7 @@ class WvTask
     
     WvTaskMan &man;
     ucontext_t mystate;	// used for resuming the task
-    ucontext_t func_call, func_return;
+    void *sp;		// ...or this, with the assembly task switcher
     
     TaskFunc *func;
     void *userdata;
@@ -93,6 +93,12 @@ class WvTaskMan
     static void do_task();
     static void call_func(WvTask *task);
 
+    // stacks are mmap()ed with a guard page underneath, and go back into
+    // a pool when the task is done with them.  See wvtask.cc.
+    static void *alloc_stack(size_t size);
+    static void free_stack(void *stack, size_t size);
+    static void zap_stacks();
+
     static char *stacktop;
     static ucontext_t stackmaster_task;
     
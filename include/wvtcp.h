@@ -27,9 +27,41 @@
 #include "wvfdstream.h"
 #include "wvaddr.h"
 #include "wvresolver.h"
+#include "wvtimeutils.h"
 
 
 class WvTCPListener;
+class WvTCPConn;
+DeclareWvList(WvTCPConn);
+
+
+/**
+ * How long it's been taking to connect() to one particular address:port.
+ * counts[i] is the number of connections that finished in under 2^i
+ * milliseconds (but not under 2^(i-1)); the last bucket gets everything
+ * slower than that.  'abandoned' counts attempts we gave up on before they
+ * finished, usually because some other address won the race.
+ */
+struct WvTCPConnectStats
+{
+    enum { BUCKETS = 16 };
+    
+    WvString target;
+    unsigned long counts[BUCKETS];
+    unsigned long failed, abandoned;
+    bool down; // did the most recent attempt fail?
+    
+    WvTCPConnectStats(WvStringParm _target);
+    
+    void add(time_t msec);
+    unsigned long succeeded() const;
+    
+    /**
+     * Returns the upper bound (in ms) of the bucket containing the pct'th
+     * percentile of successful connects, or -1 if there weren't any.
+     */
+    time_t percentile(int pct) const;
+};
 
 /**
  * WvTCPConn tries to make all outgoing connections asynchronously (in
@@ -46,6 +78,16 @@ protected:
     WvIPPortAddr remaddr;
     WvResolver dns;
     
+    // When a name resolves to more than one address, we try them all at
+    // once (well, staggered a bit) and keep whichever connects first.
+    WvTCPConnList racing;
+    WvIPAddrList untried;
+    WvTime next_try;
+    WvError race_err;
+    
+    bool timing;
+    WvTime connect_start;
+    
     /** Start a WvTCPConn on an already-open socket (used by WvTCPListener) */
     WvTCPConn(int _fd, const WvIPPortAddr &_remaddr);
     
@@ -55,6 +97,33 @@ protected:
     /** Resolve the remote address, if it was fed in non-IP form */
     void check_resolver();
     
+    /** Start connecting to the next address in 'untried' */
+    void start_racer();
+    
+    /** Check on the racers; returns true if the race is over. */
+    bool check_racers(SelectInfo &si);
+    
+    /** Record how the connect() attempt went, if we were timing it */
+    void connect_done(bool ok);
+    
+    static WvTCPConnectStats *stats_for(const WvIPPortAddr &target);
+    static WvString debugger_tcpconnect_run_cb(WvStringParm cmd,
+            WvStringList &args,
+            WvStreamsDebugger::ResultCallback result_cb, void *);
+    
+public:
+    /**
+     * When racing several addresses, how long (in ms) to wait for one
+     * attempt before starting the next one alongside it.  Default 250.
+     */
+    static time_t connect_stagger;
+    
+    /**
+     * Returns the connect() latency histogram for the given target, or
+     * NULL if we've never tried connecting to it.
+     */
+    static const WvTCPConnectStats *connect_stats(const WvIPPortAddr &target);
+    
 public:
    /**
     * WvTCPConn tries to make all outgoing connections asynchronously (in
@@ -121,9 +190,13 @@ public:
      * Note: isok() will always be true if !resolved, even though fd==-1.
      */
     virtual bool isok() const;
+    
+    /** override close() to give up on any connections still racing. */
+    virtual void close();
 
 protected:
     virtual size_t uwrite(const void *buf, size_t count);
+    virtual size_t uwritev(WvBuf &inbuf, size_t count);
 
 public:
     const char *wstype() const { return "WvTCPConn"; }
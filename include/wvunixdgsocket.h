@@ -35,6 +35,7 @@ public:
     virtual  ~WvUnixDGSocket();
 
     virtual size_t uwrite(const void *buf, size_t count);
+    virtual size_t uwritev(WvBuf &inbuf, size_t count);
     virtual void pre_select(SelectInfo &si);
     virtual bool post_select(SelectInfo &si);
    
@@ -0,0 +1,398 @@
+#include "wvresolver.h"
+#include "wvudp.h"
+#include "wvtcp.h"
+#include "wvtcplistener.h"
+#include "wvfile.h"
+#include "wvistreamlist.h"
+#include "wvstreamclone.h"
+#include "wvstringlist.h"
+#include "wvstrutils.h"
+#include "wvtest.h"
+#include <unistd.h>
+
+// A little nameserver that knows about a few names in example.com, and
+// does the things real ones do to us every so often.
+static WvStringList queries;
+static bool dropped_slow;
+
+
+static void putname(WvBuf &buf, WvStringParm name)
+{
+    WvStringList labels;
+    labels.split(name, ".");
+    WvStringList::Iter i(labels);
+    for (i.rewind(); i.next(); )
+    {
+	buf.putch(i->len());
+	buf.putstr(*i);
+    }
+    buf.putch(0);
+}
+
+
+static void put16(WvBuf &buf, unsigned x)
+{
+    buf.putch(x >> 8);
+    buf.putch(x & 0xff);
+}
+
+
+static void put32(WvBuf &buf, unsigned long x)
+{
+    put16(buf, x >> 16);
+    put16(buf, x & 0xffff);
+}
+
+
+static void put_a(WvBuf &buf, WvStringParm name, unsigned long ttl,
+		  WvStringParm addr)
+{
+    putname(buf, name);
+    put16(buf, 1);
+    put16(buf, 1);
+    put32(buf, ttl);
+    put16(buf, 4);
+    buf.put(WvIPAddr(addr).binaddr, 4);
+}
+
+
+static void put_cname(WvBuf &buf, WvStringParm name, WvStringParm target)
+{
+    WvDynBuf rdata;
+    putname(rdata, target);
+    putname(buf, name);
+    put16(buf, 5);
+    put16(buf, 1);
+    put32(buf, 3600);
+    put16(buf, rdata.used());
+    buf.merge(rdata);
+}
+
+
+static void put_soa(WvBuf &buf, unsigned long minimum)
+{
+    WvDynBuf rdata;
+    putname(rdata, "ns.example.com");
+    putname(rdata, "hostmaster.example.com");
+    put32(rdata, 1);
+    put32(rdata, 3600);
+    put32(rdata, 600);
+    put32(rdata, 86400);
+    put32(rdata, minimum);
+    putname(buf, "example.com");
+    put16(buf, 6);
+    put16(buf, 1);
+    put32(buf, 3600);
+    put16(buf, rdata.used());
+    buf.merge(rdata);
+}
+
+
+// Puts the answer to the query q into buf, or returns false to ignore it.
+static bool answer(WvBuf &buf, const unsigned char *q, size_t len, bool tcp)
+{
+    char qname[256];
+    size_t off = 12, namelen = 0;
+    while (off < len && q[off] && namelen + q[off] < 255)
+    {
+	if (namelen)
+	    qname[namelen++] = '.';
+	memcpy(qname + namelen, q + off + 1, q[off]);
+	namelen += q[off];
+	off += q[off] + 1;
+    }
+    qname[namelen] = 0;
+    off += 5; // the zero, and the type and class
+    WvString name(strlwr(qname));
+    queries.append(tcp ? WvString("tcp:%s", name) : name);
+
+    WvDynBuf rrs;
+    int rcode = 0, nanswers = 0, nauthority = 0;
+    bool truncated = false;
+    if (name == "www.example.com")
+    {
+	put_a(rrs, name, 3600, "10.0.0.1");
+	put_a(rrs, name, 3600, "10.0.0.2");
+	nanswers = 2;
+    }
+    else if (name == "short.example.com")
+    {
+	put_a(rrs, name, 1, "10.0.0.3");
+	nanswers = 1;
+    }
+    else if (name == "alias.example.com")
+    {
+	put_cname(rrs, name, "www.example.com");
+	put_a(rrs, "www.example.com", 3600, "10.0.0.1");
+	put_a(rrs, "www.example.com", 3600, "10.0.0.2");
+	nanswers = 3;
+    }
+    else if (name == "srv.example.com")
+    {
+	put_a(rrs, name, 3600, "127.0.0.1");
+	nanswers = 1;
+    }
+    else if (name == "gone.example.com" || name == "brief.example.com")
+    {
+	rcode = 3;
+	put_soa(rrs, name == "gone.example.com" ? 3600 : 1);
+	nauthority = 1;
+    }
+    else if (name == "broken.example.com")
+	rcode = 2;
+    else if (name == "slow.example.com" && !dropped_slow)
+    {
+	dropped_slow = true;
+	return false;
+    }
+    else if (name == "slow.example.com")
+    {
+	put_a(rrs, name, 3600, "10.0.0.4");
+	nanswers = 1;
+    }
+    else if (name == "big.example.com" && !tcp)
+	truncated = true;
+    else if (name == "big.example.com")
+    {
+	for (int i = 1; i <= 40; i++)
+	    put_a(rrs, name, 3600, WvString("10.1.0.%s", i));
+	nanswers = 40;
+    }
+    else
+	rcode = 3; // and no SOA, so no caching
+
+    buf.put(q, 2);
+    buf.putch(0x81 | (truncated ? 0x02 : 0));
+    buf.putch(0x80 | rcode);
+    put16(buf, 1);
+    put16(buf, nanswers);
+    put16(buf, nauthority);
+    put16(buf, 0);
+    buf.put(q + 12, off - 12);
+    buf.merge(rrs);
+    return true;
+}
+
+
+static void udp_query(WvUDPStream *udp)
+{
+    unsigned char q[512];
+    size_t len = udp->read(q, sizeof(q));
+    WvDynBuf buf;
+    if (len && answer(buf, q, len, false))
+	udp->write(buf, buf.used());
+}
+
+
+static void tcp_query(WvStream *conn)
+{
+    WvDynBuf in;
+    conn->read(in, 65536);
+    size_t len = in.used() >= 2 ? (in.peek(0, 1)[0] << 8) | in.peek(1, 1)[0]
+			       : 0;
+    if (!len || in.used() < len + 2)
+    {
+	conn->unread(in, in.used());
+	return;
+    }
+    in.skip(2);
+
+    WvDynBuf buf, out;
+    answer(buf, in.get(len), len, true);
+    put16(out, buf.used());
+    out.merge(buf);
+    conn->write(out, out.used());
+}
+
+
+static void tcp_accept(IWvStream *conn)
+{
+    WvStreamClone *s = new WvStreamClone(conn);
+    s->setcallback(wv::bind(tcp_query, s));
+    WvIStreamList::globallist.append(s, true, "dns tcp");
+}
+
+
+// Runs a nameserver, and points WvResolver at it, until it goes away.
+class StubDNS
+{
+public:
+    WvUDPStream udp;
+    WvTCPListener *tcp;
+    WvString conf, hosts;
+
+    StubDNS()
+	: udp(WvIPPortAddr("127.0.0.1", 0), WvIPPortAddr()),
+	  conf("/tmp/wvresolver-%s.conf", getpid()),
+	  hosts("/tmp/wvresolver-%s.hosts", getpid())
+    {
+	queries.zap();
+	dropped_slow = false;
+	const WvIPPortAddr *local = (const WvIPPortAddr *)udp.local();
+	udp.setcallback(wv::bind(udp_query, &udp));
+	WvIStreamList::globallist.append(&udp, false, "dns udp");
+	tcp = new WvTCPListener(*local);
+	tcp->onaccept(tcp_accept);
+	WvIStreamList::globallist.append(tcp, true, "dns tcp listener");
+
+	WvFile(conf, O_WRONLY|O_CREAT|O_TRUNC).print(
+		"# a comment\n"
+		"search example.com\n"
+		"nameserver ::1\n"
+		"nameserver %s\n"
+		"options timeout:1 attempts:2\n", *local);
+	WvFile(hosts, O_WRONLY|O_CREAT|O_TRUNC).print(
+		"127.0.0.1 localhost\n"
+		"::1 localhost6\n"
+		"10.9.8.7\tmyhost MyAlias # it's mine\n");
+	WvResolver::set_config(conf, hosts);
+    }
+
+    ~StubDNS()
+    {
+	WvResolver::set_config("", "");
+	WvIStreamList::globallist.zap();
+	unlink(conf);
+	unlink(hosts);
+    }
+
+    // how many times somebody asked us about name
+    int asked(WvStringParm name)
+    {
+	int n = 0;
+	WvStringList::Iter i(queries);
+	for (i.rewind(); i.next(); )
+	    if (*i == name)
+		n++;
+	return n;
+    }
+};
+
+
+// Returns what findaddr() says, once it's sure, while the nameserver runs.
+static int lookup(WvResolver &dns, WvStringParm name,
+		  WvIPAddrList *addrs = NULL)
+{
+    for (int i = 0; i < 500; i++)
+    {
+	int res = dns.findaddr(0, name, NULL, addrs);
+	if (res >= 0)
+	    return res;
+	WvIStreamList::globallist.runonce(10);
+    }
+    return -1;
+}
+
+
+WVTEST_MAIN("resolver hosts file")
+{
+    StubDNS stub;
+    WvResolver dns;
+    const WvIPAddr *addr = NULL;
+
+    WVPASSEQ(dns.findaddr(0, "1.2.3.4", &addr), 1);
+    WVPASSEQ(WvString(*addr), "1.2.3.4");
+    WVPASSEQ(dns.findaddr(0, "myhost", &addr), 1);
+    WVPASSEQ(WvString(*addr), "10.9.8.7");
+    WVPASSEQ(dns.findaddr(0, "myalias", &addr), 1);
+    WVPASSEQ(WvString(*addr), "10.9.8.7");
+    WVPASSEQ(dns.findaddr(0, "localhost", &addr), 1);
+    WVPASSEQ(WvString(*addr), "127.0.0.1");
+    WVPASSEQ(queries.count(), 0);
+}
+
+
+WVTEST_MAIN("resolver queries")
+{
+    StubDNS stub;
+    WvResolver dns;
+    WvIPAddrList addrs;
+
+    WVPASSEQ(lookup(dns, "www.example.com", &addrs), 2);
+    WVPASSEQ(addrs.count(), 2);
+    WVPASSEQ(WvString(*addrs.first()), "10.0.0.1");
+    WVPASSEQ(WvString(*addrs.last()), "10.0.0.2");
+
+    // the second time, it's in the cache, but the cache is by what you
+    // asked for, not what the server thinks is the same name
+    WVPASSEQ(dns.findaddr(0, "www.example.com", NULL), 2);
+    WVPASSEQ(stub.asked("www.example.com"), 1);
+    WVPASSEQ(lookup(dns, "WWW.example.com"), 2);
+    WVPASSEQ(stub.asked("www.example.com"), 2);
+
+    // search domains, CNAMEs
+    WVPASSEQ(lookup(dns, "www"), 2);
+    WVPASSEQ(stub.asked("www.example.com"), 3);
+    WVPASSEQ(lookup(dns, "alias.example.com"), 2);
+
+    // no such name, and the SOA says we can remember that for an hour
+    WVPASSEQ(lookup(dns, "gone.example.com"), 0);
+    WVPASSEQ(lookup(dns, "gone.example.com"), 0);
+    WVPASSEQ(stub.asked("gone.example.com"), 1);
+    WVPASSEQ(lookup(dns, "nothing.example.com"), 0);
+
+    // the server fails, and we try again before giving up
+    WVPASSEQ(lookup(dns, "broken.example.com"), 0);
+    WVPASSEQ(stub.asked("broken.example.com"), 2);
+
+    // the first query gets lost, so we have to send another one
+    WVPASSEQ(lookup(dns, "slow.example.com"), 1);
+    WVPASSEQ(stub.asked("slow.example.com"), 2);
+
+    // too big for UDP
+    WVPASSEQ(lookup(dns, "big.example.com"), 40);
+    WVPASSEQ(stub.asked("big.example.com"), 1);
+    WVPASSEQ(stub.asked("tcp:big.example.com"), 1);
+
+    // not even a valid name
+    WVPASSEQ(lookup(dns, "bad..name"), 0);
+}
+
+
+WVTEST_MAIN("resolver ttls")
+{
+    StubDNS stub;
+    WvResolver dns;
+
+    WVPASSEQ(lookup(dns, "www.example.com"), 2);
+    WVPASSEQ(lookup(dns, "short.example.com"), 1);
+    WVPASSEQ(lookup(dns, "gone.example.com"), 0);
+    WVPASSEQ(lookup(dns, "brief.example.com"), 0);
+    sleep(3);
+
+    WVPASSEQ(lookup(dns, "www.example.com"), 2);
+    WVPASSEQ(lookup(dns, "short.example.com"), 1);
+    WVPASSEQ(lookup(dns, "gone.example.com"), 0);
+    WVPASSEQ(lookup(dns, "brief.example.com"), 0);
+    WVPASSEQ(stub.asked("www.example.com"), 1);
+    WVPASSEQ(stub.asked("short.example.com"), 2);
+    WVPASSEQ(stub.asked("gone.example.com"), 1);
+    WVPASSEQ(stub.asked("brief.example.com"), 2);
+}
+
+
+WVTEST_MAIN("resolver in the select loop")
+{
+    StubDNS stub;
+    WvTCPListener l(WvIPPortAddr("127.0.0.1", 0));
+    WvIStreamList::globallist.append(&l, false, "listener");
+
+    WvTCPConn *conn = new WvTCPConn("srv.example.com", l.src()->port);
+    WvIStreamList::globallist.append(conn, true, "conn");
+    for (int i = 0; i < 100 && !conn->isconnected(); i++)
+	WvIStreamList::globallist.runonce(10);
+    WVPASS(conn->isok());
+    WVPASS(conn->isconnected());
+    WVPASSEQ(WvString(*conn->src()),
+	     WvString("127.0.0.1:%s", l.src()->port));
+
+    WvTCPConn *bad = new WvTCPConn("gone.example.com", 1);
+    WvIStreamList::globallist.append(bad, false, "bad");
+    for (int i = 0; i < 100 && bad->isok(); i++)
+	WvIStreamList::globallist.runonce(10);
+    WVFAIL(bad->isok());
+    WvIStreamList::globallist.unlink(bad);
+    WVRELEASE(bad);
+
+    WvIStreamList::globallist.unlink(&l);
+}
@@ -1,7 +1,9 @@
 #include "wvtcp.h"
 #include "wvtcplistener.h"
+#include "wvfile.h"
 #include "wvtest.h"
 #include <errno.h>
+#include <unistd.h>
 
 WVTEST_MAIN("tcp connection")
 {
@@ -100,3 +102,85 @@ WVTEST_MAIN("connection refused 2")
     WVPASSEQ(tcp.geterr(), ECONNREFUSED);
     printf("Error string is '%s'\n", tcp.errstr().cstr());
 }
+
+
+static void race_until_connected(WvTCPConn &tcp)
+{
+    for (int i = 0; i < 20 && !tcp.isconnected(); i++)
+	tcp.runonce(1000);
+}
+
+
+// A name with a dead address ahead of a live one: we should end up on the
+// live one without sitting through the stagger first.
+WVTEST_MAIN("racing several addresses")
+{
+    WvTCPListener listen("127.0.0.2:0");
+    WVPASS(listen.isok());
+    WvIPPortAddr live(*listen.src());
+    WvIPPortAddr dead("127.0.0.1", live.port);
+    
+    WvString conf("/tmp/wvtcp-%s.conf", getpid());
+    WvString hosts("/tmp/wvtcp-%s.hosts", getpid());
+    WvFile(conf, O_WRONLY|O_CREAT|O_TRUNC).print("");
+    WvFile(hosts, O_WRONLY|O_CREAT|O_TRUNC).print(
+	    "127.0.0.1 race.test\n"
+	    "127.0.0.2 race.test\n");
+    WvResolver::set_config(conf, hosts);
+    WvTCPConn::connect_stagger = 10000;
+    WvString target("race.test:%s", live.port);
+    
+    WvTime start = wvtime();
+    {
+	WvTCPConn tcp(target);
+	race_until_connected(tcp);
+	WVPASS(tcp.isok());
+	WVPASS(tcp.isconnected());
+	WVPASSEQ(WvString(*tcp.src()), WvString(live));
+	WVPASS(msecdiff(wvtime(), start) < 5000);
+    }
+    
+    const WvTCPConnectStats *d = WvTCPConn::connect_stats(dead);
+    const WvTCPConnectStats *l = WvTCPConn::connect_stats(live);
+    WVPASS(d);
+    WVPASS(l);
+    if (d && l)
+    {
+	WVPASSEQ(d->failed, 1);
+	WVPASSEQ(d->succeeded(), 0);
+	WVPASS(d->down);
+	WVPASSEQ(l->succeeded(), 1);
+	WVFAIL(l->down);
+	WVPASS(l->percentile(50) >= 1);
+	WVPASSEQ(l->percentile(50), l->percentile(99));
+	
+	// now the dead one goes to the back of the line, and since the
+	// live one wins right away, we never even try it
+	{
+	    WvTCPConn tcp(target);
+	    race_until_connected(tcp);
+	    WVPASS(tcp.isok());
+	    WVPASSEQ(WvString(*tcp.src()), WvString(live));
+	}
+	WVPASSEQ(d->failed, 1);
+	WVPASSEQ(l->succeeded(), 2);
+	
+	// and if they're both dead, we hear about it
+	listen.close();
+	{
+	    WvTCPConn tcp(target);
+	    race_until_connected(tcp);
+	    WVPASS(tcp.isconnected());
+	    WVFAIL(tcp.isok());
+	    WVPASSEQ(tcp.geterr(), ECONNREFUSED);
+	}
+	WVPASSEQ(d->failed, 2);
+	WVPASSEQ(l->failed, 1);
+	WVPASS(l->down);
+    }
+    
+    WvTCPConn::connect_stagger = 250;
+    WvResolver::set_config("", "");
+    unlink(conf);
+    unlink(hosts);
+}
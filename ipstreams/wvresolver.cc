@@ -1,31 +1,337 @@
 /*
  * Worldvisions Weaver Software:
  *   Copyright (C) 1997-2002 Net Integration Technologies, Inc.
- * 
+ *
  * DNS name resolver with support for background lookups.
+ *
+ * We used to fork a child to call gethostbyname() for every name that
+ * wasn't in the cache, which gets ugly when a few hundred connections
+ * start at once.  Now we just talk DNS ourselves: a query is one little
+ * UDP packet, and the answer shows up on a socket we can select() on like
+ * any other stream.
  */
 #include "wvresolver.h"
-#include "wvloopback.h"
-#include "wvaddr.h"
-#include "wvtcp.h"
+#include "wvudp.h"
+#include "wvfile.h"
+#include "wvstringlist.h"
+#include "wvstrutils.h"
+#include "wvtimeutils.h"
 #include <sys/types.h>
-#include <signal.h>
+#include <sys/stat.h>
 #include <time.h>
 
-#ifdef _WIN32
-#define WVRESOLVER_SKIP_FORK
-typedef int pid_t;
-#define kill(a,b)
-#define waitpid(a,b,c) (0)
-#define alarm(a)
-#include "streams.h"
-#else
-#include "wvautoconf.h"
-#include "wvfork.h"
-#include <netdb.h>
-#include <sys/wait.h>
+#ifndef _WIN32
+#include <sys/socket.h>
+#include <unistd.h>
 #endif
 
+// Nothing stays in the cache for less than this, so that whoever asked
+// gets to see the answer, even if its TTL was 0.
+#define MIN_TTL 1
+
+// ...or for more than this, no matter what the nameserver says.
+#define MAX_TTL (24*60*60)
+
+// RFC 2308 section 5 says not to remember that a name doesn't exist for
+// more than a few hours.
+#define MAX_NEGATIVE_TTL (3*60*60)
+
+// If the nameservers don't answer at all, don't bother them again for
+// this long.  (RFC 2308 section 7 lets us wait up to five minutes.)
+#define FAIL_TTL 60
+
+// Like libc, we don't use more than this many from resolv.conf.
+#define MAX_SERVERS 3
+#define MAX_SEARCH 6
+
+#define DNS_PORT 53
+#define DNS_HEADER 12
+#define DNS_TYPE_A 1
+#define DNS_TYPE_CNAME 5
+#define DNS_TYPE_SOA 6
+#define DNS_CLASS_IN 1
+
+
+// set_config() can change these, mostly for testing
+static WvString resolvconf_file("/etc/resolv.conf");
+static WvString hosts_file("/etc/hosts");
+
+
+static uint16_t get16(const unsigned char *p)
+{
+    return (p[0] << 8) | p[1];
+}
+
+
+static uint32_t get32(const unsigned char *p)
+{
+    return ((uint32_t)p[0] << 24) | (p[1] << 16) | (p[2] << 8) | p[3];
+}
+
+
+static void put16(WvBuf &buf, uint16_t x)
+{
+    buf.putch(x >> 8);
+    buf.putch(x & 0xff);
+}
+
+
+// A query id that nobody else can guess, so it's harder to fake an answer.
+// Opening /dev/urandom for every query would be a bit much, so we take a
+// bunch of them at a time.
+static uint16_t random_id()
+{
+    static unsigned char pool[64];
+    static size_t left = 0;
+
+    if (left < 2)
+    {
+	WvFile urandom("/dev/urandom", O_RDONLY);
+	left = urandom.read(pool, sizeof(pool)) & ~1;
+	if (left < 2)
+	{
+	    // no /dev/urandom?  Well, it's better than nothing.
+	    static unsigned int seed = time(NULL) ^ (getpid() << 16);
+	    return rand_r(&seed) & 0xffff;
+	}
+    }
+    left -= 2;
+    return get16(pool + left);
+}
+
+
+// Only takes a.b.c.d, with no funny business, unlike inet_addr().
+static bool parse_ipv4(const char *s, unsigned char ip[4])
+{
+    for (int i = 0; i < 4; i++)
+    {
+	if (*s < '0' || *s > '9')
+	    return false;
+	char *end;
+	unsigned long n = strtoul(s, &end, 10);
+	if (n > 255 || *end != (i < 3 ? '.' : 0))
+	    return false;
+	ip[i] = n;
+	s = end + 1;
+    }
+    return true;
+}
+
+
+// Writes a query for the A records of name into buf.  Returns false if
+// name can't be a DNS name at all.
+static bool dns_query(WvBuf &buf, unsigned id, WvStringParm name)
+{
+    put16(buf, id);
+    put16(buf, 0x0100); // just a query, with recursion desired
+    put16(buf, 1);      // one question...
+    put16(buf, 0);      // ...and nothing else
+    put16(buf, 0);
+    put16(buf, 0);
+
+    const char *p = name;
+    size_t total = 1;
+    while (*p)
+    {
+	const char *dot = strchr(p, '.');
+	size_t len = dot ? dot - p : strlen(p);
+	total += len + 1;
+	if (len < 1 || len > 63 || total > 255)
+	    return false;
+	buf.putch(len);
+	buf.put(p, len);
+	p += dot ? len + 1 : len;
+    }
+    if (total == 1)
+	return false;
+    buf.putch(0);
+    put16(buf, DNS_TYPE_A);
+    put16(buf, DNS_CLASS_IN);
+    return true;
+}
+
+
+// Reads the (maybe compressed) name at off in the message p, and moves
+// off past it.  Returns false if it's garbage.
+static bool dns_name(const unsigned char *p, size_t len, size_t &off,
+		     WvString &name)
+{
+    char out[256];
+    size_t outlen = 0, pos = off;
+    bool jumped = false;
+
+    // a loop of pointers would go on forever; no real name has this many
+    for (int jumps = 0; jumps < 64; )
+    {
+	if (pos >= len)
+	    return false;
+	unsigned c = p[pos];
+	if (!c)
+	{
+	    if (!jumped)
+		off = pos + 1;
+	    out[outlen] = 0;
+	    name = out;
+	    return true;
+	}
+	else if ((c & 0xc0) == 0xc0)
+	{
+	    if (pos + 1 >= len)
+		return false;
+	    if (!jumped)
+		off = pos + 2;
+	    jumped = true;
+	    jumps++;
+	    pos = ((c & 0x3f) << 8) | p[pos + 1];
+	}
+	else if ((c & 0xc0) || pos + 1 + c > len || outlen + c + 1 > 255)
+	    return false;
+	else
+	{
+	    if (outlen)
+		out[outlen++] = '.';
+	    memcpy(out + outlen, p + pos + 1, c);
+	    outlen += c;
+	    pos += 1 + c;
+	}
+    }
+    return false;
+}
+
+
+enum DNSResult
+{
+    DNS_IGNORE,    // not an answer to our question at all
+    DNS_FOUND,     // here are the addresses
+    DNS_NOTFOUND,  // no such name, or it has no addresses
+    DNS_FAILED,    // the nameserver couldn't tell us; ask another one
+    DNS_TRUNCATED  // too big for UDP; ask again with TCP
+};
+
+
+static void min_ttl(long &ttl, long rrttl)
+{
+    if (ttl < 0 || rrttl < ttl)
+	ttl = rrttl;
+}
+
+
+// Picks apart what the nameserver said in answer to our query (with the
+// given id) for qname, and adds any addresses to addrs.  Anything that
+// isn't the answer we're waiting for is DNS_IGNORE, so nobody can confuse
+// us just by sending us packets.
+//
+// For DNS_FOUND, ttl is how long we can keep the addresses.  For
+// DNS_NOTFOUND, it's how long we can remember there aren't any, according
+// to the SOA record in the answer, or -1 if there wasn't one.
+static DNSResult dns_answer(const unsigned char *p, size_t len, unsigned id,
+			    WvStringParm qname, WvIPAddrList &addrs,
+			    long &ttl)
+{
+    if (len < DNS_HEADER || get16(p) != id || !(p[2] & 0x80)
+	|| get16(p + 4) != 1)
+	return DNS_IGNORE;
+
+    size_t off = DNS_HEADER;
+    WvString name;
+    if (!dns_name(p, len, off, name) || off + 4 > len
+	|| strcasecmp(name, qname)
+	|| get16(p + off) != DNS_TYPE_A || get16(p + off + 2) != DNS_CLASS_IN)
+	return DNS_IGNORE;
+    off += 4;
+
+    if (p[2] & 0x02)
+	return DNS_TRUNCATED;
+    int rcode = p[3] & 0x0f;
+    if (rcode != 0 && rcode != 3) // 3 is "no such name"
+	return DNS_FAILED;
+
+    // The answers can start with a chain of CNAMEs that we follow to the
+    // real name, which is the one that has the A records.  Nameservers
+    // always put the chain in order.
+    unsigned nanswers = get16(p + 6), nauthority = get16(p + 8);
+    WvString want(qname);
+    long negttl = -1;
+    ttl = -1;
+    for (unsigned i = 0; i < nanswers + nauthority; i++)
+    {
+	WvString owner;
+	if (!dns_name(p, len, off, owner) || off + 10 > len)
+	    return DNS_FAILED;
+	unsigned type = get16(p + off), cls = get16(p + off + 2);
+	long rrttl = get32(p + off + 4);
+	size_t rdlen = get16(p + off + 8);
+	off += 10;
+	if (off + rdlen > len)
+	    return DNS_FAILED;
+	if (rrttl > 0x7fffffffL || rrttl < 0) // RFC 2181 section 8
+	    rrttl = 0;
+
+	if (cls != DNS_CLASS_IN)
+	    ; // not interested
+	else if (i < nanswers && !strcasecmp(owner, want))
+	{
+	    if (type == DNS_TYPE_CNAME)
+	    {
+		size_t o = off;
+		if (!dns_name(p, len, o, want))
+		    return DNS_FAILED;
+		min_ttl(ttl, rrttl);
+	    }
+	    else if (type == DNS_TYPE_A && rdlen == 4)
+	    {
+		addrs.append(new WvIPAddr(p + off), true);
+		min_ttl(ttl, rrttl);
+	    }
+	}
+	else if (i >= nanswers && type == DNS_TYPE_SOA)
+	{
+	    // RFC 2308 section 5: the SOA's own TTL, or its MINIMUM field,
+	    // whichever is less.
+	    size_t o = off;
+	    WvString junk;
+	    if (dns_name(p, len, o, junk) && dns_name(p, len, o, junk)
+		&& o + 20 <= off + rdlen)
+	    {
+		long minimum = get32(p + o + 16);
+		if (minimum > 0x7fffffffL || minimum < 0)
+		    minimum = 0;
+		negttl = rrttl;
+		min_ttl(negttl, minimum);
+	    }
+	}
+	off += rdlen;
+    }
+
+    if (rcode == 0 && !addrs.isempty())
+	return DNS_FOUND;
+    ttl = negttl;
+    return DNS_NOTFOUND;
+}
+
+
+// A nonblocking TCP connection, for when the answer doesn't fit in a UDP
+// packet.  (Not a WvTCPConn, since it has a WvResolver inside.)
+static WvFdStream *tcp_connect(const WvIPPortAddr &server)
+{
+    WvFdStream *s = new WvFdStream(socket(PF_INET, SOCK_STREAM, 0));
+    if (s->getfd() < 0)
+    {
+	s->seterr(errno);
+	return s;
+    }
+    s->set_nonblock(true);
+    s->set_close_on_exec(true);
+
+    sockaddr *sa = server.sockaddr();
+    if (connect(s->getfd(), sa, server.sockaddr_len()) < 0
+	&& errno != EINPROGRESS)
+	s->seterr(errno);
+    delete sa;
+    return s;
+}
+
+
 class WvResolverHost
 {
 public:
@@ -33,33 +339,43 @@ public:
     WvIPAddr *addr;
     WvIPAddrList addrlist;
     bool done, negative;
-    pid_t pid;
-    WvLoopback *loop;
-    time_t last_tried;
+    time_t expires;
+
+    // The rest is only for while we're still looking it up.
+    WvFdStream *stream;      // to the nameserver we're asking
+    bool tcp;                // true if stream is a TCP connection
+    WvDynBuf answer;         // the part of the TCP answer we've got so far
+    unsigned id;             // the id of the query we're waiting for
+    WvStringList candidates; // names to try after qname, from 'search'
+    WvString qname;          // the one we're asking about now
+    int server, tries;
+    long negttl;             // RFC 2308 TTL from NXDOMAINs so far, or -1
+    WvTime retry_at;         // when we give up on this server
 
     WvResolverHost(WvStringParm _name) : name(_name)
         { init(); addr = NULL; }
     ~WvResolverHost()
-        {
-	    WVRELEASE(loop);
-#ifndef WVRESOLVER_SKIP_FORK
-            if (pid && pid != -1)
-            {
-                kill(pid, SIGKILL);
-                pid_t rv;
-                // In case a signal is in the process of being delivered...
-                while ((rv = waitpid(pid, NULL, 0)) != pid)
-                    if (rv == -1 && errno != EINTR)
-                        break;
-            }
-#endif
-        }
+        { WVRELEASE(stream); }
+
+    bool finished() const
+        { return done || negative; }
+
+    void start();
+    void poll();
+    void run(int msec_timeout);
+
 protected:
     WvResolverHost()
         { init(); }
     void init()
-        { done = negative = false;
-          pid = 0; loop = NULL; last_tried = time(NULL); }
+        { done = negative = false; expires = 0;
+	  stream = NULL; tcp = false; id = server = tries = 0; negttl = -1; }
+
+private:
+    void next_name();
+    void next_server();
+    void send(bool use_tcp);
+    void finish(bool found, long ttl);
 };
 
 class WvResolverAddr : public WvResolverHost
@@ -69,58 +385,414 @@ public:
         { addr = _addr; }
 };
 
-// static members of WvResolver
-int WvResolver::numresolvers = 0;
-WvResolverHostDict *WvResolver::hostmap = NULL;
-WvResolverAddrDict *WvResolver::addrmap = NULL;
 
+// What resolv.conf and hosts say.  We check them every time we start a
+// lookup, and read them again if they've changed.
+class WvResolverConfig
+{
+public:
+    WvIPPortAddr servers[MAX_SERVERS];
+    int nservers;
+    WvStringList search;
+    int ndots, timeout, attempts;
+
+    // each name in hosts, in lowercase, is a finished WvResolverHost
+    WvResolverHostDict hosts;
+
+    WvResolverConfig() : hosts(10)
+        { resolvconf_mtime = hosts_mtime = -1; read_resolvconf(); }
+
+    void refresh();
+
+private:
+    WvString resolvconf, hostsfile;
+    time_t resolvconf_mtime, hosts_mtime;
+
+    void read_resolvconf();
+    void read_hosts();
+    void add_server(WvStringParm s);
+};
+
+static WvResolverConfig *config = NULL;
+
+
+static time_t mtime(WvStringParm filename)
+{
+    struct stat st;
+    if (stat(filename, &st) < 0)
+	return 0;
+    return st.st_mtime;
+}
+
+
+void WvResolverConfig::refresh()
+{
+    time_t t = mtime(resolvconf_file);
+    if (resolvconf != resolvconf_file || t != resolvconf_mtime)
+    {
+	resolvconf = resolvconf_file;
+	resolvconf_mtime = t;
+	read_resolvconf();
+    }
+
+    t = mtime(hosts_file);
+    if (hostsfile != hosts_file || t != hosts_mtime)
+    {
+	hostsfile = hosts_file;
+	hosts_mtime = t;
+	read_hosts();
+    }
+}
 
-// function that runs in a child task
 
-static void namelookup(const char *name, WvLoopback *loop)
+void WvResolverConfig::read_resolvconf()
 {
-    struct hostent *he;
-    
-    // wait up to one minute...
-    alarm(60);
-    
-    for (int count = 0; count < 10; count++)
+    // the defaults, according to resolv.conf(5)
+    nservers = 0;
+    search.zap();
+    ndots = 1;
+    timeout = 5;
+    attempts = 2;
+
+    WvFile file(resolvconf, O_RDONLY);
+    const char *line;
+    while (file.isok() && (line = file.blocking_getline(-1)) != NULL)
     {
-	he = gethostbyname(name);
-	if (he)
+	WvStringList words;
+	words.split(line);
+	if (words.isempty())
+	    continue;
+	WvString key = words.popstr();
+
+	if (key == "nameserver" && !words.isempty())
+	    add_server(words.popstr());
+	else if (key == "search" || key == "domain")
 	{
-            char **addr = he->h_addr_list;
-            while (*addr != NULL)
-            {
-  	        loop->print("%s ", WvIPAddr((unsigned char *)(*addr)));
-                addr++;
-            }
-            loop->print("\n");
-	    alarm(0);
-	    return;
+	    // the last one wins
+	    search.zap();
+	    while (!words.isempty() && search.count() < MAX_SEARCH)
+	    {
+		search.append(words.popstr());
+		if (key == "domain")
+		    break;
+	    }
+	}
+	else if (key == "options")
+	{
+	    WvStringList::Iter i(words);
+	    for (i.rewind(); i.next(); )
+	    {
+		if (!strncmp(*i, "ndots:", 6))
+		    ndots = WvString(i->cstr() + 6).num();
+		else if (!strncmp(*i, "timeout:", 8))
+		    timeout = WvString(i->cstr() + 8).num();
+		else if (!strncmp(*i, "attempts:", 9))
+		    attempts = WvString(i->cstr() + 9).num();
+	    }
+	}
+    }
+
+    if (ndots < 0 || ndots > 15)
+	ndots = ndots < 0 ? 0 : 15;
+    if (timeout < 1 || timeout > 30)
+	timeout = timeout < 1 ? 1 : 30;
+    if (attempts < 1 || attempts > 5)
+	attempts = attempts < 1 ? 1 : 5;
+    if (!nservers)
+	servers[nservers++] = WvIPPortAddr("127.0.0.1", DNS_PORT);
+}
+
+
+void WvResolverConfig::add_server(WvStringParm s)
+{
+    if (nservers >= MAX_SERVERS)
+	return;
+
+    WvString host(s);
+    uint16_t port = DNS_PORT;
+    char *colon = strchr(host.edit(), ':');
+    if (colon)
+    {
+	if (strchr(colon + 1, ':'))
+	    return; // IPv6, which is no use to us
+	*colon = 0;
+	port = atoi(colon + 1);
+    }
+
+    unsigned char ip[4];
+    if (parse_ipv4(host, ip) && port)
+	servers[nservers++] = WvIPPortAddr(ip, port);
+}
+
+
+void WvResolverConfig::read_hosts()
+{
+    hosts.zap();
+
+    WvFile file(hostsfile, O_RDONLY);
+    char *line;
+    while (file.isok() && (line = file.blocking_getline(-1)) != NULL)
+    {
+	char *comment = strchr(line, '#');
+	if (comment)
+	    *comment = 0;
+
+	WvStringList words;
+	words.split(line);
+	unsigned char ip[4];
+	if (words.count() < 2 || !parse_ipv4(words.popstr(), ip))
+	    continue; // junk, or IPv6
+
+	WvStringList::Iter i(words);
+	for (i.rewind(); i.next(); )
+	{
+	    strlwr(i->edit());
+	    WvResolverHost *host = hosts[*i];
+	    if (!host)
+	    {
+		host = new WvResolverHost(*i);
+		host->done = true;
+		hosts.add(host, true);
+	    }
+	    host->addrlist.append(new WvIPAddr(ip), true);
+	    if (!host->addr)
+		host->addr = host->addrlist.first();
 	}
-	
-	// not found (yet?)
-	
-	if (h_errno != TRY_AGAIN)
+    }
+}
+
+
+// Figure out which names we're going to ask about, and ask about the first
+// one.  Maybe we don't need to ask anyone at all.
+void WvResolverHost::start()
+{
+    unsigned char ip[4];
+    if (parse_ipv4(name, ip))
+    {
+	addrlist.append(new WvIPAddr(ip), true);
+	finish(true, MAX_TTL);
+	return;
+    }
+
+    WvString lname(name);
+    strlwr(lname.edit());
+    WvResolverHost *local = config->hosts[lname];
+    if (local)
+    {
+	WvIPAddrList::Iter i(local->addrlist);
+	for (i.rewind(); i.next(); )
+	    addrlist.append(new WvIPAddr(*i), true);
+	finish(true, MIN_TTL); // so we notice soon if hosts changes
+	return;
+    }
+
+    // Like libc: a name that ends in a dot is just itself.  Otherwise,
+    // with at least ndots dots, it's probably already the whole name, so
+    // we try it first; with fewer, it's probably short for something in
+    // one of the search domains, so we try those first.
+    size_t len = strlen(name);
+    if (len && name[len - 1] == '.')
+    {
+	WvString abs(name);
+	abs.edit()[len - 1] = 0;
+	candidates.append(abs);
+    }
+    else
+    {
+	int dots = 0;
+	for (const char *p = name; *p; p++)
+	    if (*p == '.')
+		dots++;
+
+	if (dots >= config->ndots)
+	    candidates.append(name);
+	WvStringList::Iter i(config->search);
+	for (i.rewind(); i.next(); )
+	    candidates.append(WvString("%s.%s", name, *i));
+	if (dots < config->ndots)
+	    candidates.append(name);
+    }
+
+    next_name();
+}
+
+
+// The last name didn't exist, so try the next one.
+void WvResolverHost::next_name()
+{
+    if (candidates.isempty())
+    {
+	// RFC 2308 says not to cache a negative answer at all without an
+	// SOA, but we have to keep it long enough for anyone to see it.
+	finish(false, negttl >= 0 ? negttl : MIN_TTL);
+	return;
+    }
+
+    qname = candidates.popstr();
+    server = tries = 0;
+    send(false);
+}
+
+
+// The server we asked isn't going to answer, so try the next one, until
+// we've tried each of them as many times as resolv.conf says.
+void WvResolverHost::next_server()
+{
+    if (++tries >= config->attempts * config->nservers)
+    {
+	finish(false, FAIL_TTL);
+	return;
+    }
+
+    server = (server + 1) % config->nservers;
+    send(false);
+}
+
+
+void WvResolverHost::send(bool use_tcp)
+{
+    // Every query gets a new socket, with a new random port, so a late
+    // answer to an old one can't get mixed up with this one.  The id
+    // makes it a bit harder yet to fake an answer.
+    WVRELEASE(stream);
+    answer.zap();
+    tcp = use_tcp;
+    id = random_id();
+
+    WvDynBuf query;
+    if (!dns_query(query, id, qname))
+    {
+	next_name(); // it can't exist, then
+	return;
+    }
+
+    const WvIPPortAddr &to = config->servers[server];
+    if (tcp)
+    {
+	// over TCP, the query starts with its length
+	WvDynBuf qlen;
+	put16(qlen, query.used());
+	stream = tcp_connect(to);
+	stream->write(qlen, qlen.used());
+    }
+    else
+	stream = new WvUDPStream(WvIPPortAddr(), to);
+    stream->write(query, query.used());
+    retry_at = msecadd(wvtime(), config->timeout * 1000);
+}
+
+
+void WvResolverHost::finish(bool found, long ttl)
+{
+    WVRELEASE(stream);
+    answer.zap();
+    candidates.zap();
+
+    done = found;
+    negative = !found;
+    addr = found ? addrlist.first() : NULL;
+
+    long most = found ? MAX_TTL : MAX_NEGATIVE_TTL;
+    if (ttl < MIN_TTL)
+	ttl = MIN_TTL;
+    else if (ttl > most)
+	ttl = most;
+    expires = time(NULL) + ttl;
+}
+
+
+// Deal with whatever the nameserver had to say, if anything, and move on
+// to the next one if it's taking too long.
+void WvResolverHost::poll()
+{
+    while (stream && !finished())
+    {
+	DNSResult res;
+	long ttl = -1;
+	if (!tcp)
+	{
+	    unsigned char buf[4096];
+	    size_t len = stream->read(buf, sizeof(buf));
+	    if (!len)
+		break;
+	    res = dns_answer(buf, len, id, qname, addrlist, ttl);
+	}
+	else
+	{
+	    stream->read(answer, 65536);
+	    if (answer.used() < 2)
+		break;
+	    size_t len = get16(answer.peek(0, 2));
+	    if (answer.used() < 2 + len)
+		break;
+	    answer.skip(2);
+	    res = dns_answer(answer.get(len), len, id, qname, addrlist, ttl);
+
+	    // nobody else can get into a TCP connection, so it's just wrong
+	    if (res == DNS_IGNORE || res == DNS_TRUNCATED)
+		res = DNS_FAILED;
+	}
+
+	if (res != DNS_FOUND)
+	    addrlist.zap();
+	switch (res)
 	{
-	    alarm(0);
-	    return; // not found; blank output
+	case DNS_IGNORE:
+	    break;
+	case DNS_FOUND:
+	    finish(true, ttl);
+	    break;
+	case DNS_NOTFOUND:
+	    if (ttl >= 0 && (negttl < 0 || ttl < negttl))
+		negttl = ttl;
+	    next_name();
+	    break;
+	case DNS_FAILED:
+	    next_server();
+	    break;
+	case DNS_TRUNCATED:
+	    send(true);
+	    break;
 	}
-	
-	// avoid spinning in a tight loop.
-	//
-	// sleep() is documented to possibly mess with the alarm(), so we
-	// have to make sure to reset the alarm here.  That's a shame,
-	// because otherwise it would timeout nicely after 60 seconds
-	// overall, not 60 seconds per request.
-	sleep(1);
-
-	alarm(60);
     }
+
+    if (stream && !finished()
+	&& (!stream->isok() || msecdiff(retry_at, wvtime()) <= 0))
+	next_server();
 }
 
 
+// Keep at it for up to msec_timeout milliseconds (forever, if it's
+// negative), or until we know the answer.
+void WvResolverHost::run(int msec_timeout)
+{
+    WvTime end = msecadd(wvtime(), msec_timeout);
+    for (;;)
+    {
+	poll();
+	if (finished() || !msec_timeout)
+	    return;
+
+	time_t wait = msecdiff(retry_at, wvtime());
+	if (msec_timeout > 0)
+	{
+	    time_t left = msecdiff(end, wvtime());
+	    if (left <= 0)
+		return;
+	    if (left < wait)
+		wait = left;
+	}
+	stream->select(wait < 0 ? 0 : wait, true, false);
+    }
+}
+
+
+// static members of WvResolver
+int WvResolver::numresolvers = 0;
+WvResolverHostDict *WvResolver::hostmap = NULL;
+WvResolverAddrDict *WvResolver::addrmap = NULL;
+
+
 WvResolver::WvResolver()
 {
     numresolvers++;
@@ -128,6 +800,8 @@ WvResolver::WvResolver()
 	hostmap = new WvResolverHostDict(10);
     if (!addrmap)
 	addrmap = new WvResolverAddrDict(10);
+    if (!config)
+	config = new WvResolverConfig;
 }
 
 
@@ -138,171 +812,67 @@ WvResolver::~WvResolver()
     {
 	delete hostmap;
 	delete addrmap;
+	delete config;
 	hostmap = NULL;
 	addrmap = NULL;
+	config = NULL;
     }
 }
 
 
+void WvResolver::set_config(WvStringParm resolvconf, WvStringParm hosts)
+{
+    resolvconf_file = !resolvconf ? WvString("/etc/resolv.conf")
+				  : WvString(resolvconf);
+    hosts_file = !hosts ? WvString("/etc/hosts") : WvString(hosts);
+    if (hostmap)
+	hostmap->zap();
+}
+
+
 // returns >0 on success, 0 on not found, -1 on timeout
 // If addr==NULL, this just tests to see if the name exists.
 int WvResolver::findaddr(int msec_timeout, WvStringParm name,
 			 WvIPAddr const **addr,
                          WvIPAddrList *addrlist)
 {
-    WvResolverHost *host;
-    time_t now = time(NULL);
-    int res = 0;
-    
-    host = (*hostmap)[name];
+    WvResolverHost *host = (*hostmap)[name];
 
-    if (host)
+    // whatever we found out, it's good until its TTL runs out
+    if (host && host->finished() && host->expires < time(NULL))
     {
-	// refresh successes after 5 minutes, retry failures every 1 minute
-	if ((host->done && host->last_tried + 60*5 < now)
-	    || (!host->done && host->last_tried + 60 < now))
-	{
-	    // expired from the cache.  Force a repeat lookup below...
-	    hostmap->remove(host);
-	    host = NULL;
-	}
-	else if (host->done)
-	{
-	    // entry exists, is marked done, and hasn't expired yet.  Return
-	    // the cached value.
-	    if (addr)
-		*addr = host->addr;
-            if (addrlist)
-            {
-                WvIPAddrList::Iter i(host->addrlist);
-                for (i.rewind(); i.next(); )
-                {
-                    addrlist->append(i.ptr(), false);
-                    res++;
-                }
-            }
-            else
-                res = 1;
-	    return res;
-	}
-	else if (host->negative)
-	{
-	    // the entry is in the cache, but the response was negative:
-	    // the name doesn't exist.
-	    return 0;
-	}
-	
-	// if we get here, 'host' either exists (still in progress)
-	// or is NULL (need to start again).
+	hostmap->remove(host);
+	host = NULL;
     }
 
     if (!host)
     {
 	// nothing matches this hostname in the cache.  Create a new entry,
 	// and start a new lookup.
+	config->refresh();
 	host = new WvResolverHost(name);
 	hostmap->add(host, true);
-	
-	host->loop = new WvLoopback();
-	
-#ifdef WVRESOLVER_SKIP_FORK
-        // background name resolution doesn't work when debugging with gdb!
-	namelookup(name, host->loop);
-#else
-        // fork a subprocess so we don't block while doing the DNS lookup.
-
-	// close everything but host->loop in the subprocess.
-	host->pid = wvfork(host->loop->getrfd(), host->loop->getwfd());
-	
-	if (!host->pid)
-	{
-	    // child process
-	    host->loop->noread();
-	    namelookup(name, host->loop);
-	    _exit(1);
-	}
-#endif
-	
-	// parent process
-	host->loop->nowrite();
+	host->start();
     }
 
-#ifndef WVRESOLVER_SKIP_FORK
-    
-    // if we get here, we are the parent task waiting for the child.
-    
-    do
-    {
-	if (waitpid(host->pid, NULL, WNOHANG) == host->pid)
-	    host->pid = 0;
-	
-	if (!host->loop->select(msec_timeout < 0 ? 100 : msec_timeout,
-				true, false))
-	{
-	    if (host->pid)
-	    {
-		if (msec_timeout >= 0)
-		    return -1; // timeout, but still trying
-	    }
-	    else
-	    {
-		// the child is dead.  Clean up our stream, too.
-		WVRELEASE(host->loop);
-		host->loop = NULL;
-		host->negative = true;
-		return 0; // exited while doing search
-	    }
-	}
-	else
-	    break;
-    } while (host->pid && msec_timeout < 0); // repeat if unlimited timeout!
-#endif
+    if (!host->finished())
+	host->run(msec_timeout);
+    if (!host->finished())
+	return -1; // timeout, but still trying
+    if (host->negative)
+	return 0;
 
-    // data coming in!
-    char *line;
-    
-    do
-    {
-	line = host->loop->blocking_getline(-1);
-    } while (!line && host->loop->isok());
-    
-    if (line && line[0] != 0)
+    if (addr)
+	*addr = host->addr;
+    if (addrlist)
     {
-        res = 1;
-        WvIPAddr *resolvedaddr;
-        char *p;
-        p = strtok(line, " \n");
-	resolvedaddr = new WvIPAddr(p);
-	host->addr = resolvedaddr;
-        host->addrlist.append(resolvedaddr, true);
-        if (addr)
-            *addr = host->addr;
-        if (addrlist)
-            addrlist->append(host->addr, false);
-        do
-        {
-            p = strtok(NULL, " \n");
-            if (p)
-            {
-                res++;
-                resolvedaddr = new WvIPAddr(p);
-                host->addrlist.append(resolvedaddr, true);
-                if (addrlist)
-                    addrlist->append(resolvedaddr, false);
-            }
-        } while (p);
-	host->done = true;
+	WvIPAddrList::Iter i(host->addrlist);
+	for (i.rewind(); i.next(); )
+	    addrlist->append(i.ptr(), false);
     }
-    else
-	host->negative = true;
 
-    if (host->pid && waitpid(host->pid, NULL, 0) == host->pid)
-	host->pid = 0;
-    WVRELEASE(host->loop);
-    host->loop = NULL;
-    
     // Return as many addresses as we find.
-    return host->negative ? 0 : res;
+    return host->addrlist.count();
 }
 
 void WvResolver::clearhost(WvStringParm hostname)
@@ -316,14 +886,24 @@ void WvResolver::clearhost(WvStringParm hostname)
 void WvResolver::pre_select(WvStringParm hostname, WvStream::SelectInfo &si)
 {
     WvResolverHost *host = (*hostmap)[hostname];
-    
+
     if (host)
     {
-	if (host->loop)
-	    host->loop->xpre_select(si,
-			    WvStream::SelectRequest(true, false, false));
-	else
+	if (host->finished())
+	{
 	    si.msec_timeout = 0; // already ready
+	    return;
+	}
+
+	host->stream->xpre_select(si,
+			  WvStream::SelectRequest(true, false, false));
+
+	// and wake up in time to try the next server
+	time_t wait = msecdiff(host->retry_at, wvtime());
+	if (wait < 0)
+	    wait = 0;
+	if (si.msec_timeout < 0 || wait < si.msec_timeout)
+	    si.msec_timeout = wait;
     }
 }
 
@@ -331,14 +911,15 @@ void WvResolver::pre_select(WvStringParm hostname, WvStream::SelectInfo &si)
 bool WvResolver::post_select(WvStringParm hostname, WvStream::SelectInfo &si)
 {
     WvResolverHost *host = (*hostmap)[hostname];
-    
+
     if (host)
     {
-	if (host->loop)
-	    return host->loop->xpost_select(si,
-                    WvStream::SelectRequest(true, false, false));
-	else
-	    return true; // already ready
+	if (!host->finished()
+	    && (host->stream->xpost_select(si,
+			  WvStream::SelectRequest(true, false, false))
+		|| msecdiff(host->retry_at, wvtime()) <= 0))
+	    host->poll();
+	return host->finished();
     }
     return false;
 }
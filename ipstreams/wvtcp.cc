@@ -9,6 +9,7 @@
 #include "wvistreamlist.h"
 #include "wvmoniker.h"
 #include "wvlinkerhack.h"
+#include "wvhashtable.h"
 #include <fcntl.h>
 
 #ifdef _WIN32
@@ -89,13 +90,71 @@ static IWvListener *listener(WvStringParm s, IObject *)
 static WvMoniker<IWvListener> lreg("tcp", listener);
 
 
+DeclareWvDict(WvTCPConnectStats, WvString, target);
+
+static WvTCPConnectStatsDict &all_stats()
+{
+    static WvTCPConnectStatsDict stats(10);
+    return stats;
+}
+
+
+WvTCPConnectStats::WvTCPConnectStats(WvStringParm _target)
+    : target(_target)
+{
+    memset(counts, 0, sizeof(counts));
+    failed = abandoned = 0;
+    down = false;
+}
+
+
+void WvTCPConnectStats::add(time_t msec)
+{
+    int b = 0;
+    while (b < BUCKETS - 1 && msec >= (1 << b))
+	b++;
+    counts[b]++;
+}
+
+
+unsigned long WvTCPConnectStats::succeeded() const
+{
+    unsigned long total = 0;
+    for (int b = 0; b < BUCKETS; b++)
+	total += counts[b];
+    return total;
+}
+
+
+time_t WvTCPConnectStats::percentile(int pct) const
+{
+    unsigned long total = succeeded(), sum = 0;
+    if (!total)
+	return -1;
+    
+    unsigned long want = (total * pct + 99) / 100;
+    for (int b = 0; b < BUCKETS - 1; b++)
+    {
+	sum += counts[b];
+	if (sum >= want)
+	    return 1 << b;
+    }
+    return 1 << (BUCKETS - 1);
+}
+
+
+time_t WvTCPConn::connect_stagger = 250;
+
+
 WvTCPConn::WvTCPConn(const WvIPPortAddr &_remaddr)
 {
+    allow_iov(typeid(WvTCPConn));
     remaddr = (_remaddr.is_zero() && FORCE_NONZERO)
 	? WvIPPortAddr("127.0.0.1", _remaddr.port) : _remaddr;
     resolved = true;
     connected = false;
     incoming = false;
+    timing = false;
     
     do_connect();
 }
@@ -104,11 +163,13 @@ WvTCPConn::WvTCPConn(const WvIPPortAddr &_remaddr)
 WvTCPConn::WvTCPConn(int _fd, const WvIPPortAddr &_remaddr)
     : WvFDStream(_fd)
 {
+    allow_iov(typeid(WvTCPConn));
     remaddr = (_remaddr.is_zero() && FORCE_NONZERO)
 	? WvIPPortAddr("127.0.0.1", _remaddr.port) : _remaddr;
     resolved = true;
     connected = true;
     incoming = true;
+    timing = false;
     nice_tcpopts();
 }
 
@@ -116,6 +177,7 @@ WvTCPConn::WvTCPConn(int _fd, const WvIPPortAddr &_remaddr)
 WvTCPConn::WvTCPConn(WvStringParm _hostname, uint16_t _port)
     : hostname(_hostname)
 {
+    allow_iov(typeid(WvTCPConn));
     struct servent* serv;
     char *hnstr = hostname.edit(), *cptr;
     
@@ -136,6 +198,7 @@ WvTCPConn::WvTCPConn(WvStringParm _hostname, uint16_t _port)
     
     resolved = connected = false;
     incoming = false;
+    timing = false;
     
     WvIPAddr x(hostname);
     if (x != WvIPAddr())
@@ -151,7 +214,30 @@ WvTCPConn::WvTCPConn(WvStringParm _hostname, uint16_t _port)
 
 WvTCPConn::~WvTCPConn()
 {
-    // nothing to do
+    // WvFdStream's destructor would only call *its* close(), and we've got
+    // racers to clean up
+    close();
+}
+
+
+void WvTCPConn::close()
+{
+    if (timing)
+    {
+	timing = false;
+	stats_for(remaddr)->abandoned++;
+    }
+    
+    WvTCPConnList::Iter i(racing);
+    for (i.rewind(); i.next(); )
+    {
+	WvTCPConn *racer = i.ptr();
+	i.xunlink();
+	WVRELEASE(racer);
+    }
+    untried.zap();
+    
+    WvFDStream::close();
 }
 
 
@@ -201,6 +287,12 @@ void WvTCPConn::do_connect()
 	setfd(rwfd);
 	
 	nice_tcpopts();
+	
+	if (!incoming)
+	{
+	    timing = true;
+	    connect_start = wvtime();
+	}
     }
     
 #ifndef _WIN32
@@ -218,7 +310,10 @@ void WvTCPConn::do_connect()
     assert(ret <= 0);
     
     if (ret == 0 || (ret < 0 && err == EISCONN))
+    {
 	connected = true;
+	connect_done(true);
+    }
     else if (ret < 0
 	     && err != EINPROGRESS
 	     && err != EWOULDBLOCK
@@ -227,16 +322,84 @@ void WvTCPConn::do_connect()
 	     && err != EINVAL /* apparently winsock 1.1 might do this */)
     {
 	connected = true; // "connection phase" is ended, anyway
+	connect_done(false);
 	seterr(err);
     }
     delete sa;
 }
 
 
+void WvTCPConn::connect_done(bool ok)
+{
+    if (!timing)
+	return;
+    timing = false;
+    
+    WvTCPConnectStats *stats = stats_for(remaddr);
+    if (ok)
+	stats->add(msecdiff(wvtime(), connect_start));
+    else
+	stats->failed++;
+    stats->down = !ok;
+}
+
+
+WvTCPConnectStats *WvTCPConn::stats_for(const WvIPPortAddr &target)
+{
+    static bool first = true;
+    if (first)
+    {
+	first = false;
+	WvStreamsDebugger::add_command("tcpconnect", 0,
+		debugger_tcpconnect_run_cb, 0);
+    }
+    
+    WvString key(target);
+    WvTCPConnectStats *stats = all_stats()[key];
+    if (!stats)
+    {
+	stats = new WvTCPConnectStats(key);
+	all_stats().add(stats, true);
+    }
+    return stats;
+}
+
+
+const WvTCPConnectStats *WvTCPConn::connect_stats(const WvIPPortAddr &target)
+{
+    return all_stats()[WvString(target)];
+}
+
+
+WvString WvTCPConn::debugger_tcpconnect_run_cb(WvStringParm cmd,
+	WvStringList &args,
+	WvStreamsDebugger::ResultCallback result_cb, void *)
+{
+    const char *format_str = "%21s%s%6s%s%6s%s%9s%s%6s%s%6s%s%6s";
+    WvStringList result;
+    result.append(format_str, "---------------Target", "-", "----OK", "-",
+		  "Failed", "-", "Abandoned", "-", "---p50", "-",
+		  "---p90", "-", "---p99");
+    result_cb(cmd, result);
+    WvTCPConnectStatsDict::Iter i(all_stats());
+    for (i.rewind(); i.next(); )
+    {
+	result.zap();
+	result.append(format_str, i->target, " ", i->succeeded(), " ",
+		      i->failed, " ", i->abandoned, " ",
+		      i->percentile(50), " ", i->percentile(90), " ",
+		      i->percentile(99));
+	result_cb(cmd, result);
+    }
+    return WvString::null;
+}
+
+
 void WvTCPConn::check_resolver()
 {
     const WvIPAddr *ipr;
-    int dnsres = dns.findaddr(0, hostname, &ipr);
+    WvIPAddrList addrs;
+    int dnsres = dns.findaddr(0, hostname, &ipr, &addrs);
     
     if (dnsres == 0)
     {
@@ -244,13 +407,105 @@ void WvTCPConn::check_resolver()
 	resolved = true;
 	seterr(WvString("Unknown host \"%s\"", hostname));
     }
-    else if (dnsres > 0)
+    else if (dnsres == 1)
     {
 	// fprintf(stderr, "%p: resolver succeeded!\n", this);
 	remaddr = WvIPPortAddr(*ipr, remaddr.port);
 	resolved = true;
 	do_connect();
     }
+    else if (dnsres > 1)
+    {
+	// Keep the DNS order, except that addresses that failed last time
+	// go to the back of the line.
+	resolved = true;
+	WvIPAddrList::Iter i(addrs);
+	for (int pass = 0; pass < 2; pass++)
+	{
+	    for (i.rewind(); i.next(); )
+	    {
+		const WvTCPConnectStats *stats
+		    = connect_stats(WvIPPortAddr(*i, remaddr.port));
+		if ((stats && stats->down) == (pass == 1))
+		    untried.append(new WvIPAddr(*i), true);
+	    }
+	}
+	remaddr = WvIPPortAddr(*untried.first(), remaddr.port);
+	start_racer();
+    }
+}
+
+
+void WvTCPConn::start_racer()
+{
+    WvTCPConn *racer
+	= new WvTCPConn(WvIPPortAddr(*untried.first(), remaddr.port));
+    untried.unlink_first();
+    racing.append(racer, false);
+    next_try = msecadd(wvtime(), connect_stagger);
+}
+
+
+bool WvTCPConn::check_racers(SelectInfo &si)
+{
+    WvTCPConn *winner = NULL;
+    bool lost = false;
+    
+    WvTCPConnList::Iter i(racing);
+    for (i.rewind(); i.next(); )
+    {
+	WvTCPConn *racer = i.ptr();
+	racer->xpost_select(si, SelectRequest(false, true, false));
+	if (!racer->isok())
+	{
+	    race_err.noerr();
+	    race_err.seterr(*racer);
+	    lost = true;
+	    i.xunlink();
+	    WVRELEASE(racer);
+	}
+	else if (racer->isconnected())
+	{
+	    winner = racer;
+	    i.xunlink();
+	    break;
+	}
+    }
+    
+    if (winner)
+    {
+	// steal its socket, and forget about everybody else
+	int fd = winner->getfd();
+	winner->setfd(-1);
+	remaddr = winner->remaddr;
+	WVRELEASE(winner);
+	
+	for (i.rewind(); i.next(); )
+	{
+	    WvTCPConn *racer = i.ptr();
+	    i.xunlink();
+	    WVRELEASE(racer);
+	}
+	untried.zap();
+	
+	setfd(fd);
+	connected = true;
+	return true;
+    }
+    
+    // no sense waiting out the stagger if somebody just gave up
+    if (!untried.isempty()
+	&& (lost || msecdiff(wvtime(), next_try) >= 0))
+	start_racer();
+    
+    if (racing.isempty())
+    {
+	connected = true; // "connection phase" is ended, anyway
+	WvErrorBase::seterr(race_err);
+	return true;
+    }
+    
+    return false;
 }
 
 #ifndef SO_ORIGINAL_DST
@@ -312,6 +567,23 @@ void WvTCPConn::pre_select(SelectInfo &si)
 	}
 	WvFDStream::pre_select(si);
 	si.wants.writable = oldw;
+	
+	WvTCPConnList::Iter i(racing);
+	for (i.rewind(); i.next(); )
+	{
+	    if (!i->isok())
+		si.msec_timeout = 0; // let post_select() notice
+	    else
+		i->xpre_select(si, SelectRequest(false, true, false));
+	}
+	if (!racing.isempty() && !untried.isempty())
+	{
+	    time_t wait = msecdiff(next_try, wvtime());
+	    if (wait < 0)
+		wait = 0;
+	    if (si.msec_timeout < 0 || wait < si.msec_timeout)
+		si.msec_timeout = wait;
+	}
 	return;
     }
 }
@@ -332,8 +604,11 @@ bool WvTCPConn::post_select(SelectInfo &si)
     }
     else
     {
+	if (!racing.isempty() && check_racers(si) && !isok())
+	    return true; // oops, couldn't connect to any of them!
+	
 	result = WvFDStream::post_select(si);
-	if (result && !connected)
+	if (result && !connected && racing.isempty())
 	{
 	    // the manual for connect() says just re-calling connect() later
 	    // will return either EISCONN or the error code from the previous
@@ -351,12 +626,15 @@ bool WvTCPConn::post_select(SelectInfo &si)
 			   &conn_res, &res_size))
 	    {
 		// getsockopt failed
-		seterr(errno);
+		int err = errno;
+		connect_done(false);
+		seterr(err);
 		connected = true; // not in connecting phase anymore
 	    }
 	    else if (conn_res != 0)
 	    {
 		// connect failed
+		connect_done(false);
 		seterr(conn_res);
 		connected = true; // not in connecting phase anymore
 	    }
@@ -374,7 +652,11 @@ bool WvTCPConn::post_select(SelectInfo &si)
 
 bool WvTCPConn::isok() const
 {
-    return !resolved || WvFDStream::isok();
+    if (!resolved)
+	return true;
+    if (!racing.isempty())
+	return WvStream::isok(); // no fd of our own yet
+    return WvFDStream::isok();
 }
 
 
@@ -387,6 +669,15 @@ size_t WvTCPConn::uwrite(const void *buf, size_t count)
 }
 
 
+size_t WvTCPConn::uwritev(WvBuf &inbuf, size_t count)
+{
+    if (connected)
+	return WvFDStream::uwritev(inbuf, count);
+    else
+	return 0; // can't write yet; let them enqueue it instead
+}
+
+
 
 
 WvTCPListener::WvTCPListener(const WvIPPortAddr &_listenport)
@@ -130,6 +130,16 @@ size_t WvUDPStream::uwrite(const void *buf, size_t count)
 }
 
 
+size_t WvUDPStream::uwritev(WvBuf &inbuf, size_t count)
+{
+    // one write is one packet, so don't split it up
+    size_t len = uwrite(inbuf.get(count), count);
+    if (isok() && len < count)
+	inbuf.unget(count - len);
+    return len;
+}
+
+
 void WvUDPStream::enable_broadcasts()
 {
     int value = 1;
@@ -88,6 +88,15 @@ size_t WvUnixDGSocket::uwrite(const void *buf, size_t count)
     return count;
 }
 
+size_t WvUnixDGSocket::uwritev(WvBuf &inbuf, size_t count)
+{
+    // one write is one packet, so don't split it up
+    size_t len = uwrite(inbuf.get(count), count);
+    if (isok() && len < count)
+	inbuf.unget(count - len);
+    return len;
+}
+
 void WvUnixDGSocket::pre_select(SelectInfo &si)
 {
     SelectRequest oldwant = si.wants;
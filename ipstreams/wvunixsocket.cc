@@ -96,6 +96,7 @@ static WvMoniker<IWvListener> lmodereg("unixmode", modelistener);
 WvUnixConn::WvUnixConn(int _fd, const WvUnixAddr &_addr)
     : WvFDStream(_fd), addr(_addr)
 {
+    allow_iov(typeid(WvUnixConn));
     // all is well and we're connected.
     set_nonblock(true);
     set_close_on_exec(true);
@@ -105,6 +106,7 @@ WvUnixConn::WvUnixConn(int _fd, const WvUnixAddr &_addr)
 WvUnixConn::WvUnixConn(const WvUnixAddr &_addr)
     : addr(_addr)
 {
+    allow_iov(typeid(WvUnixConn));
     setfd(socket(PF_UNIX, SOCK_STREAM, 0));
     if (getfd() < 0)
     {
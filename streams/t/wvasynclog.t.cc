@@ -0,0 +1,174 @@
+#include "wvtest.h"
+#include "wvasynclog.h"
+#include "wvlogbuffer.h"
+#include "wvistreamlist.h"
+#include "wvtimeutils.h"
+
+
+static int count_msgs(WvLogBuffer &buf)
+{
+    return buf.messages().count();
+}
+
+
+WVTEST_MAIN("async log basics")
+{
+    WvLogBuffer buf(100);
+    WvLog log("async", WvLog::Info);
+
+    {
+	WvAsyncLog q(16, 1024);
+	log("one\n");
+	log("two\n");
+	WVPASSEQ(q.depth(), 2);
+	WVPASSEQ(count_msgs(buf), 0);
+
+	// the main loop writes them out
+	WvIStreamList l;
+	l.append(&q, false, "async log");
+	l.runonce(0);
+	WVPASSEQ(q.depth(), 0);
+	WVPASSEQ(count_msgs(buf), 2);
+
+	log("three\n");
+	WVPASSEQ(q.total_queued(), 3);
+	WVPASSEQ(q.total_written(), 2);
+	WVPASSEQ(q.max_depth(), 2);
+    } // deleting it writes out the rest
+
+    WVPASSEQ(count_msgs(buf), 3);
+    WvLogBuffer::MsgList::Iter i(buf.messages());
+    i.rewind();
+    WVPASS(i.next());
+    WVPASSEQ(i->source, "async");
+    WVPASSEQ(i->message, "one");
+    WVPASS(i.next());
+    WVPASSEQ(i->message, "two");
+    WVPASS(i.next());
+    WVPASSEQ(i->message, "three");
+
+    // and now it's synchronous again
+    log("four\n");
+    WVPASSEQ(count_msgs(buf), 4);
+}
+
+
+WVTEST_MAIN("async log overflow")
+{
+    WvLogBuffer buf(100);
+    WvLog log("async", WvLog::Info);
+
+    // Count: throw them away, and then tell us about it
+    {
+	WvAsyncLog q(4, 1024, WvAsyncLog::Count);
+	for (int i = 0; i < 10; i++)
+	    log("msg %s\n", i);
+	WVPASSEQ(q.depth(), 4);
+	WVPASSEQ(q.total_dropped(), 6);
+	q.drain();
+	WVPASSEQ(count_msgs(buf), 5);
+	WvLogBuffer::MsgList::Iter i(buf.messages());
+	for (i.rewind(); i.next(); )
+	    if (!i.cur()->next)
+		WVPASSEQ(i->message,
+			 "6 log messages dropped; the queue was full.");
+    }
+
+    // Drop: just throw them away
+    buf.messages().zap();
+    {
+	WvAsyncLog q(4, 1024, WvAsyncLog::Drop);
+	for (int i = 0; i < 10; i++)
+	    log("msg %s\n", i);
+	WVPASSEQ(q.total_dropped(), 6);
+    }
+    WVPASSEQ(count_msgs(buf), 4);
+
+    // Block: write out the queue and keep going
+    buf.messages().zap();
+    {
+	WvAsyncLog q(4, 1024, WvAsyncLog::Block);
+	for (int i = 0; i < 10; i++)
+	    log("msg %s\n", i);
+	WVPASSEQ(q.total_dropped(), 0);
+	WVPASSEQ(q.total_blocked(), 2);
+	WVPASSEQ(q.depth(), 2);
+    }
+    WVPASSEQ(count_msgs(buf), 10);
+    WvLogBuffer::MsgList::Iter i(buf.messages());
+    int n = 0;
+    bool in_order = true;
+    for (i.rewind(); i.next(); n++)
+	if (i->message != WvString("msg %s", n))
+	    in_order = false;
+    WVPASS(in_order);
+}
+
+
+WVTEST_MAIN("async log byte ring")
+{
+    WvLogBuffer buf(1000);
+    WvLog log("async", WvLog::Info);
+    WvString msg("0123456789abcdefghijklmnopqrstuvwxyz\n");
+
+    {
+	// room for plenty of records, but only a few messages' worth of
+	// bytes, so we have to wrap around the byte ring a lot
+	WvAsyncLog q(100, msg.len() * 3 + 10, WvAsyncLog::Block);
+	for (int i = 0; i < 50; i++)
+	{
+	    log(msg);
+	    if (i % 7 == 0)
+		q.drain(1);
+	}
+
+	// too big to ever queue: goes straight through, after the rest
+	WvString big("%s%s%s%s", msg, msg, msg, msg);
+	log(big);
+	WVPASSEQ(q.depth(), 0);
+    }
+
+    WVPASSEQ(count_msgs(buf), 54);
+    WvLogBuffer::MsgList::Iter i(buf.messages());
+    bool all_ok = true;
+    for (i.rewind(); i.next(); )
+	if (i->message != "0123456789abcdefghijklmnopqrstuvwxyz")
+	    all_ok = false;
+    WVPASS(all_ok);
+}
+
+
+// Not really a test: how long does logging take with a slow receiver?
+class SlowLogRcv : public WvLogRcvBase
+{
+public:
+    int count;
+    SlowLogRcv() { count = 0; }
+protected:
+    virtual void log(WvStringParm, int, const char *, size_t)
+        { count++; usleep(20); }
+};
+
+WVTEST_MAIN("async log speed")
+{
+    const int num = 2000;
+    SlowLogRcv rcv;
+    WvLog log("speed", WvLog::Debug);
+
+    WvTime start = wvtime();
+    for (int i = 0; i < num; i++)
+	log("message number %s\n", i);
+    time_t sync_msec = msecdiff(wvtime(), start);
+
+    WvAsyncLog q(num, num * 64);
+    start = wvtime();
+    for (int i = 0; i < num; i++)
+	log("message number %s\n", i);
+    time_t async_msec = msecdiff(wvtime(), start);
+    q.drain();
+    WVPASSEQ(rcv.count, num * 2);
+
+    printf("%d messages: %ld ms synchronous, %ld ms to queue\n",
+	   num, (long)sync_msec, (long)async_msec);
+    fflush(stdout);
+}
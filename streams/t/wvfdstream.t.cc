@@ -4,6 +4,7 @@
 #else
 #include <unistd.h>
 #endif
+#include <ctype.h>
 #include <string.h>
 
 #include "wvfdstream.h"
@@ -254,6 +255,120 @@ WVTEST_MAIN("inbuf after read error")
 }
 
 
+WVTEST_MAIN("scatter/gather")
+{
+    int socks[2];
+    WVPASS(!wvsocketpair(SOCK_STREAM, socks));
+    WvFdStream s1(socks[0]), s2(socks[1]);
+    
+    // a buffer made of several separate pieces
+    WvDynBuf out, piece;
+    WvString expect;
+    for (int i = 0; i < 5; i++)
+    {
+	WvString str("piece %s of five;", i);
+	piece.putstr(str);
+	out.merge(piece);
+	expect.append(str);
+    }
+    WVPASSEQ(s1.write(out), expect.len());
+    WVPASSEQ(out.used(), 0);
+    
+    // read it into a buffer that's already got some stuff in it
+    WvDynBuf in;
+    in.putstr("before;");
+    size_t got = 0;
+    while (got < expect.len() && s2.select(1000, true, false))
+	got += s2.read(in, 1024);
+    WVPASSEQ(got, expect.len());
+    WVPASSEQ(in.getstr(), WvString("before;%s", expect));
+    
+    // lots of delayed output in pieces should all go out in one flush
+    s1.delay_output(true);
+    char data[3000];
+    for (int i = 0; i < 5; i++)
+    {
+	memset(data, 'a' + i, sizeof(data));
+	s1.write(data, sizeof(data));
+    }
+    s1.delay_output(false);
+    s1.flush(0);
+    got = 0;
+    while (got < 5 * sizeof(data) && s2.select(1000, true, false))
+	got += s2.read(in, 100000);
+    WVPASSEQ(got, 5 * sizeof(data));
+    WVPASSEQ(in.used(), 5 * sizeof(data));
+    WVPASSEQ(in.peek(0, 1)[0], 'a');
+    WVPASSEQ(in.peek(5 * sizeof(data) - 1, 1)[0], 'e');
+}
+
+
+// A subclass that mangles everything it writes and reads, like a stream
+// doing its own framing would.  writev() and readv() mustn't go around it.
+class UpperFD : public WvFDStream
+{
+public:
+    size_t nwrote, nread;
+    
+    UpperFD(int fd) : WvFDStream(fd)
+	{ nwrote = nread = 0; }
+    
+    virtual size_t uwrite(const void *buf, size_t count)
+    {
+	WvString s;
+	s.setsize(count + 1);
+	char *p = s.edit();
+	for (size_t i = 0; i < count; i++)
+	    p[i] = toupper(((const char *)buf)[i]);
+	size_t len = WvFDStream::uwrite(p, count);
+	nwrote += len;
+	return len;
+    }
+    
+    virtual size_t uread(void *buf, size_t count)
+    {
+	size_t len = WvFDStream::uread(buf, count);
+	for (size_t i = 0; i < len; i++)
+	    ((char *)buf)[i] = tolower(((char *)buf)[i]);
+	nread += len;
+	return len;
+    }
+};
+
+
+WVTEST_MAIN("scatter/gather with uwrite() and uread() overridden")
+{
+    int socks[2];
+    WVPASS(!wvsocketpair(SOCK_STREAM, socks));
+    UpperFD s1(socks[0]), s2(socks[1]);
+    
+    WvDynBuf out, piece;
+    WvString expect;
+    for (int i = 0; i < 5; i++)
+    {
+	WvString str("piece %s of five;", i);
+	piece.putstr(str);
+	out.merge(piece);
+	expect.append(str);
+    }
+    size_t wrote = s1.write(out);
+    s1.flush(1000);
+    WVPASSEQ(wrote, expect.len());
+    WVPASSEQ(s1.nwrote, expect.len());
+    
+    // leave some room at the end of the buffer, so ureadv() would want
+    // to use readv()
+    WvDynBuf in;
+    in.putstr("Before;");
+    size_t got = 0;
+    while (got < expect.len() && s2.select(1000, true, false))
+	got += s2.read(in, 1024);
+    WVPASSEQ(got, expect.len());
+    WVPASSEQ(s2.nread, expect.len());
+    WVPASSEQ(in.getstr(), WvString("Before;%s", expect));
+}
+
+
 class FooFD : public WvFDStream {
 public:
     FooFD(int fd) : WvFDStream(fd)
@@ -89,3 +89,47 @@ WVTEST_MAIN("spinning list 2")
     WVPASSEQ(scount, 0);
     WVPASSEQ(lcount, 0);
 }
+
+
+WVTEST_MAIN("lots of alarms")
+{
+    int counts[100], strays = 0;
+    WvStream s[100], stray;
+    WvIStreamList l;
+    for (int i = 0; i < 100; i++)
+    {
+	counts[i] = 0;
+	s[i].setcallback(wv::bind(cb, &counts[i]));
+	s[i].alarm(60000 + i);
+	l.append(&s[i], false, "alarmer");
+    }
+    
+    // an expired alarm on a stream nobody selects shouldn't wake us up
+    stray.setcallback(wv::bind(cb, &strays));
+    stray.alarm(0);
+    
+    s[42].alarm(50);
+    s[7].alarm(100);
+    WvTime start = wvtime();
+    l.runonce(5000);
+    WVPASS(msecdiff(wvtime(), start) < 1000);
+    l.runonce(5000);
+    WVPASS(msecdiff(wvtime(), start) < 2000);
+    
+    for (int i = 0; i < 100; i++)
+    {
+	if (i == 7 || i == 42)
+	    WVPASSEQ(counts[i], 1);
+	else
+	    WVPASSEQ(counts[i], 0);
+    }
+    WVPASSEQ(strays, 0);
+    WVPASSEQ(s[42].alarm_remaining(), -1);
+    WVPASS(s[0].alarm_remaining() > 50000);
+    
+    // nothing due for a while, so this should time out quietly
+    start = wvtime();
+    l.runonce(100);
+    WVPASS(msecdiff(wvtime(), start) >= 90);
+    WVPASSEQ(counts[0], 0);
+}
@@ -0,0 +1,182 @@
+#include "wvpoller.h"
+#include "wvtest.h"
+#include "wvfdstream.h"
+#include "wvistreamlist.h"
+#include "wvfile.h"
+#include "wvfileutils.h"
+#include <fcntl.h>
+#include <sys/resource.h>
+
+
+static bool have_poller()
+{
+    WvPoller *p = WvPoller::create();
+    delete p;
+    return p != NULL;
+}
+
+
+WVTEST_MAIN("poller basics")
+{
+    WvPoller *p = WvPoller::create();
+    if (!p)
+	return; // no backend on this platform; select() is used instead
+
+    int fds[2];
+    WVPASS(pipe(fds) == 0);
+
+    p->begin();
+    p->add(fds[0], WvPoller::READ);
+    p->add(fds[1], WvPoller::WRITE);
+    WVPASSEQ(p->wait(0), 1);
+    WVFAIL(p->isset(fds[0], WvPoller::READ));
+    WVPASS(p->isset(fds[1], WvPoller::WRITE));
+
+    WVPASSEQ(write(fds[1], "x", 1), 1);
+    p->begin();
+    p->add(fds[0], WvPoller::READ);
+    WVPASSEQ(p->wait(1000), 1);
+    WVPASS(p->isset(fds[0], WvPoller::READ));
+    WVFAIL(p->isset(fds[1], WvPoller::WRITE)); // not asked for this time
+
+    // same again: nothing changed, so it's still readable
+    p->begin();
+    p->add(fds[0], WvPoller::READ);
+    WVPASSEQ(p->wait(0), 1);
+
+    // closed and reopened as the same number behind the poller's back
+    close(fds[0]);
+    int newfds[2];
+    WVPASS(pipe(newfds) == 0);
+    WVPASSEQ(newfds[0], fds[0]);
+    p->begin();
+    p->add(newfds[0], WvPoller::READ, &newfds);
+    WVPASSEQ(p->wait(0), 0);
+    WVPASSEQ(write(newfds[1], "y", 1), 1);
+    p->begin();
+    p->add(newfds[0], WvPoller::READ, &newfds);
+    WVPASSEQ(p->wait(1000), 1);
+    WVPASS(p->isset(newfds[0], WvPoller::READ));
+
+    close(fds[1]);
+    close(newfds[0]);
+    close(newfds[1]);
+    delete p;
+}
+
+
+WVTEST_MAIN("poller regular files")
+{
+    WvPoller *p = WvPoller::create();
+    if (!p)
+	return;
+
+    // epoll won't take regular files, but select() says they're always
+    // ready, so the poller should too.
+    WvString fname = wvtmpfilename("wvpoller");
+    int fd = open(fname, O_RDWR | O_CREAT, 0600);
+    WVPASS(fd >= 0);
+    p->begin();
+    p->add(fd, WvPoller::READ);
+    WVPASSEQ(p->wait(-1), 1);
+    WVPASS(p->isset(fd, WvPoller::READ));
+    close(fd);
+    unlink(fname);
+    delete p;
+}
+
+
+class CountingStream : public WvFdStream
+{
+public:
+    int post_selects;
+
+    CountingStream(int rfd, int wfd)
+	: WvFdStream(rfd, wfd), post_selects(0)
+	{ }
+
+    virtual bool post_select(SelectInfo &si)
+    {
+	post_selects++;
+	return WvFdStream::post_select(si);
+    }
+};
+
+
+static void readall(CountingStream *s)
+{
+    char buf[128];
+    s->read(buf, sizeof(buf));
+}
+
+
+WVTEST_MAIN("only ready streams get post_select")
+{
+    int fds[5][2];
+    CountingStream *s[5];
+    WvIStreamList l;
+    for (int i = 0; i < 5; i++)
+    {
+	WVPASS(pipe(fds[i]) == 0);
+	s[i] = new CountingStream(fds[i][0], fds[i][1]);
+	s[i]->setcallback(wv::bind(readall, s[i]));
+	l.append(s[i], true, "counting");
+    }
+
+    l.runonce(0);
+    for (int i = 0; i < 5; i++)
+	s[i]->post_selects = 0;
+
+    WVPASSEQ(write(fds[3][1], "x", 1), 1);
+    l.runonce(1000);
+
+    bool polling = have_poller();
+    for (int i = 0; i < 5; i++)
+    {
+	if (i == 3)
+	    WVPASSEQ(s[i]->post_selects, 1);
+	else if (polling)
+	    WVPASSEQ(s[i]->post_selects, 0);
+    }
+
+    // the select() fallback still works too
+    WvPoller::disabled = true;
+    WVPASSEQ(write(fds[1][1], "x", 1), 1);
+    s[1]->post_selects = 0;
+    WvIStreamList l2;
+    l2.append(s[1], false, "counting");
+    l2.runonce(1000);
+    WVPASSEQ(s[1]->post_selects, 1);
+    WvPoller::disabled = false;
+}
+
+
+WVTEST_MAIN("fds above FD_SETSIZE")
+{
+    if (!have_poller())
+	return; // select() can't do this anyway
+
+    struct rlimit rl;
+    getrlimit(RLIMIT_NOFILE, &rl);
+    if (rl.rlim_cur <= FD_SETSIZE + 10 && rl.rlim_max > FD_SETSIZE + 10)
+    {
+	rl.rlim_cur = FD_SETSIZE + 11;
+	setrlimit(RLIMIT_NOFILE, &rl);
+	getrlimit(RLIMIT_NOFILE, &rl);
+    }
+    if (rl.rlim_cur <= FD_SETSIZE + 10)
+	return; // not allowed to open that many
+
+    int fds[2];
+    WVPASS(pipe(fds) == 0);
+    int bigfd = fcntl(fds[0], F_DUPFD, FD_SETSIZE + 5);
+    WVPASS(bigfd > FD_SETSIZE);
+    close(fds[0]);
+
+    WvFdStream s(bigfd, fds[1]);
+    WVFAIL(s.select(0, true, false));
+    s.write("hello");
+    WVPASS(s.select(1000, true, false));
+    char buf[10];
+    WVPASSEQ(s.read(buf, sizeof(buf)), 5);
+}
@@ -0,0 +1,189 @@
+/*
+ * Worldvisions Weaver Software:
+ *   Copyright (C) 1997-2002 Net Integration Technologies, Inc.
+ *
+ * A queue that makes WvLog asynchronous.  See wvasynclog.h.
+ *
+ * The queue is a ring of records, plus a ring of bytes holding the message
+ * text.  Each message is stored in one piece: if it doesn't fit between
+ * the write position and the end of the byte ring, we skip the rest and
+ * start again at the beginning.  Everything happens on the main loop, so
+ * there's no locking; the only thing a WvLog::print() ever does to the
+ * queue is copy some bytes and bump a couple of indexes.
+ */
+#include "wvasynclog.h"
+#include <string.h>
+
+// how many messages to write out per callback, so a big backlog doesn't
+// starve everybody else in the main loop
+#define DRAIN_BATCH 256
+
+
+WvAsyncLog::WvAsyncLog(size_t _max_records, size_t _max_bytes,
+		       Overflow _overflow)
+{
+    assert(!WvLog::async);
+
+    max_records = _max_records ? _max_records : 1;
+    max_bytes = _max_bytes ? _max_bytes : 1;
+    overflow = _overflow;
+    recs = new Rec[max_records];
+    data = new char[max_bytes];
+    first = num = maxnum = wpos = 0;
+    draining = false;
+    queued = written = dropped = blocked = unreported = 0;
+
+    WvLog::async = this;
+}
+
+
+WvAsyncLog::~WvAsyncLog()
+{
+    drain();
+    WvLog::async = NULL;
+    deletev recs;
+    deletev data;
+}
+
+
+bool WvAsyncLog::isok() const
+{
+    return true;
+}
+
+
+void WvAsyncLog::pre_select(SelectInfo &si)
+{
+    WvStream::pre_select(si);
+    if (num || unreported)
+	si.msec_timeout = 0;
+}
+
+
+bool WvAsyncLog::post_select(SelectInfo &si)
+{
+    return WvStream::post_select(si) || num || unreported;
+}
+
+
+void WvAsyncLog::execute()
+{
+    WvStream::execute();
+    drain(DRAIN_BATCH);
+}
+
+
+// Finds a place for 'len' more bytes in the byte ring.  The bytes in use
+// are the ones from the oldest record's offset up to wpos, wrapping around
+// the end if wpos is before it.  We never let wpos catch up to the oldest
+// record, since then we couldn't tell full from empty.
+bool WvAsyncLog::find_room(size_t len, size_t &off) const
+{
+    if (!num)
+    {
+	off = 0;
+	return len < max_bytes;
+    }
+
+    size_t rpos = recs[first].off;
+    if (wpos >= rpos)
+    {
+	if (len <= max_bytes - wpos)
+	{
+	    off = wpos;
+	    return true;
+	}
+	off = 0;
+	return len < rpos;
+    }
+    else
+    {
+	off = wpos;
+	return len < rpos - wpos;
+    }
+}
+
+
+bool WvAsyncLog::enqueue(WvStringParm app, int loglevel,
+			 const char *buf, size_t len)
+{
+    if (draining)
+	return false; // a receiver is logging; let it through
+    if (!len)
+	return true;
+
+    if (len >= max_bytes)
+    {
+	// never going to fit.  Write out the queue first, to keep things
+	// in order, and then let it through.
+	drain();
+	return false;
+    }
+
+    size_t off;
+    if (num == max_records || !find_room(len, off))
+    {
+	if (overflow == Block)
+	{
+	    blocked++;
+	    drain();
+	    find_room(len, off);
+	}
+	else
+	{
+	    dropped++;
+	    if (overflow == Count)
+		unreported++;
+	    return true;
+	}
+    }
+
+    Rec &r = recs[(first + num) % max_records];
+    r.app = app;
+    r.loglevel = loglevel;
+    r.when = wvtime().tv_sec;
+    r.off = off;
+    r.len = len;
+    memcpy(data + off, buf, len);
+    wpos = off + len;
+
+    num++;
+    queued++;
+    if (num > maxnum)
+	maxnum = num;
+    return true;
+}
+
+
+void WvAsyncLog::drain(size_t max)
+{
+    if (draining)
+	return;
+    draining = true;
+
+    for (; num && max; max--)
+    {
+	Rec &r = recs[first];
+	WvLog::msgtime = r.when;
+	WvLog::deliver(r.app, r.loglevel, data + r.off, r.len);
+	r.app = WvString::null;
+	first = (first + 1) % max_records;
+	num--;
+	written++;
+    }
+    WvLog::msgtime = 0;
+
+    if (!num)
+    {
+	first = wpos = 0;
+	if (unreported)
+	{
+	    WvString msg("%s log messages dropped; the queue was full.\n",
+			 unreported);
+	    unreported = 0;
+	    WvLog::deliver("WvAsyncLog", WvLog::Warning, msg, msg.len());
+	}
+    }
+
+    draining = false;
+}
@@ -6,10 +6,12 @@
  */
 #include "wvfdstream.h"
 #include "wvmoniker.h"
+#include "wvpoller.h"
 #include <fcntl.h>
 
 #ifndef _WIN32
 #include <sys/socket.h>
+#include <sys/uio.h>
 
 inline bool isselectable(int fd)
 {
@@ -52,14 +54,14 @@ static IWvStream *creator(WvStringParm s, IObject *)
 static WvMoniker<IWvStream> reg("fd", creator);
 
 WvFdStream::WvFdStream(int _rwfd)
-    : rfd(_rwfd), wfd(_rwfd)
+    : rfd(_rwfd), wfd(_rwfd), iov_type(&typeid(WvFdStream))
 {
     shutdown_read = shutdown_write = false;
 }
 
 
 WvFdStream::WvFdStream(int _rfd, int _wfd)
-    : rfd(_rfd), wfd(_wfd)
+    : rfd(_rfd), wfd(_wfd), iov_type(&typeid(WvFdStream))
 {
     shutdown_read = shutdown_write = false;
 }
@@ -122,9 +124,15 @@ void WvFdStream::close()
 	WvStream::close();
 	//fprintf(stderr, "closing%d:%d/%d\n", (int)this, rfd, wfd);
 	if (rfd >= 0)
+	{
+	    WvPoller::fd_closed(rfd);
 	    ::close(rfd);
+	}
 	if (wfd >= 0 && wfd != rfd)
+	{
+	    WvPoller::fd_closed(wfd);
 	    ::close(wfd);
+	}
 	rfd = wfd = -1;
 	//fprintf(stderr, "closed!\n");
     }
@@ -183,6 +191,115 @@ size_t WvFdStream::uwrite(const void *buf, size_t count)
 }
 
 
+#ifndef _WIN32
+
+// more than enough for the handful of pieces a WvDynBuf usually has
+#define MAX_IOV 64
+
+size_t WvFdStream::ureadv(WvBuf &outbuf, size_t count)
+{
+    if (!count || !isok()) return 0;
+    
+    // if there's some room left at the end of outbuf, fill that up before
+    // starting a new piece, so we don't waste it (or need two reads).  A
+    // subclass with its own uread() needs to see every byte, though.
+    size_t first = outbuf.optallocable();
+    if (!first || first >= count || typeid(*this) != *iov_type)
+	return WvStream::ureadv(outbuf, count);
+    
+    size_t before = outbuf.used();
+    outbuf.alloc(first);
+    outbuf.alloc(count - first);
+    
+    struct iovec iov[MAX_IOV];
+    int n = 0;
+    for (size_t done = 0; done < count && n < MAX_IOV; n++)
+    {
+	size_t len = outbuf.optpeekable(before + done);
+	if (len > count - done)
+	    len = count - done;
+	iov[n].iov_base = outbuf.mutablepeek(before + done, len);
+	iov[n].iov_len = len;
+	done += len;
+    }
+    
+    int in = ::readv(rfd, iov, n);
+    outbuf.unalloc(count - (in > 0 ? in : 0));
+    
+    // same as uread()
+    if (in <= 0)
+    {
+	if (in < 0 && (errno==EINTR || errno==EAGAIN || errno==ENOBUFS))
+	    return 0; // interrupted
+
+	seterr(in < 0 ? errno : 0);
+	return 0;
+    }
+    return in;
+}
+
+
+size_t WvFdStream::uwritev(WvBuf &inbuf, size_t count)
+{
+    if (!count || !isok()) return 0;
+    
+    // a subclass with its own uwrite() needs to see every byte
+    if (typeid(*this) != *iov_type)
+	return WvStream::uwritev(inbuf, count);
+    
+    struct iovec iov[MAX_IOV];
+    int n = 0;
+    size_t done = 0;
+    for (; done < count && n < MAX_IOV; n++)
+    {
+	size_t len = inbuf.optpeekable(done);
+	if (len > count - done)
+	    len = count - done;
+	if (!len)
+	    break;
+	iov[n].iov_base = (void *)inbuf.peek(done, len);
+	iov[n].iov_len = len;
+	done += len;
+    }
+    
+    // only one piece?  uwrite() can handle that.
+    if (n <= 1)
+	return WvStream::uwritev(inbuf, count);
+    
+    int out = ::writev(wfd, iov, n);
+    
+    // same as uwrite()
+    if (out <= 0)
+    {
+	int err = errno;
+	if (out < 0 && (err == ENOBUFS || err==EAGAIN))
+	    return 0; // kernel buffer full - data not written (yet!)
+    
+	seterr(out < 0 ? err : 0); // a more critical error
+	return 0;
+    }
+    
+    inbuf.skip(out);
+    return out;
+}
+
+#else // _WIN32
+
+// no readv()/writev() here; just do it the old way.
+size_t WvFdStream::ureadv(WvBuf &outbuf, size_t count)
+{
+    return WvStream::ureadv(outbuf, count);
+}
+
+
+size_t WvFdStream::uwritev(WvBuf &inbuf, size_t count)
+{
+    return WvStream::uwritev(inbuf, count);
+}
+
+#endif // _WIN32
+
+
 void WvFdStream::maybe_autoclose()
 {
     if (stop_write && !shutdown_write && !outbuf.used())
@@ -191,7 +308,10 @@ void WvFdStream::maybe_autoclose()
 	if (wfd < 0)
 	    return;
 	if (rfd != wfd)
+	{
+	    WvPoller::fd_closed(wfd);
 	    ::close(wfd);
+	}
 	else
 	    ::shutdown(wfd, SHUT_WR); // might be a socket        
 	wfd = -1;
@@ -201,7 +321,10 @@ void WvFdStream::maybe_autoclose()
     {
 	shutdown_read = true;
         if (rfd != wfd)
+	{
+	    WvPoller::fd_closed(rfd);
             ::close(rfd);
+	}
         else
             ::shutdown(rfd, SHUT_RD); // might be a socket
         rfd = -1;
@@ -211,6 +334,27 @@ void WvFdStream::maybe_autoclose()
 }
 
 
+// put fd in the given fd_set, or tell the poller about it if there is one.
+static inline void fd_add(IWvStream::SelectInfo &si, int fd,
+			  fd_set &set, unsigned event, const void *cookie)
+{
+    if (si.poller)
+	si.poller->add(fd, event, cookie);
+    else
+	FD_SET(fd, &set);
+}
+
+
+static inline bool fd_isset(IWvStream::SelectInfo &si, int fd,
+			    fd_set &set, unsigned event)
+{
+    if (si.poller)
+	return si.poller->isset(fd, event);
+    else
+	return FD_ISSET(fd, &set);
+}
+
+
 void WvFdStream::pre_select(SelectInfo &si)
 {
     WvStream::pre_select(si);
@@ -223,7 +367,7 @@ void WvFdStream::pre_select(SelectInfo &si)
     if (si.wants.readable && (rfd >= 0))
     {
 	if (isselectable(rfd))
-	    FD_SET(rfd, &si.read);
+	    fd_add(si, rfd, si.read, WvPoller::READ, this);
 	else
 	    si.msec_timeout = 0; // not selectable -> *always* readable
     } 
@@ -233,15 +377,17 @@ void WvFdStream::pre_select(SelectInfo &si)
     if ((si.wants.writable || outbuf.used() || autoclose_time) && (wfd >= 0))
     {
 	if (isselectable(wfd))
-	    FD_SET(wfd, &si.write);
+	    fd_add(si, wfd, si.write, WvPoller::WRITE, this);
 	else
 	    si.msec_timeout = 0; // not selectable -> *always* writable
     }
     
     if (si.wants.isexception)
     {
-	if (rfd >= 0 && isselectable(rfd)) FD_SET(rfd, &si.except);
-	if (wfd >= 0 && isselectable(wfd)) FD_SET(wfd, &si.except);
+	if (rfd >= 0 && isselectable(rfd))
+	    fd_add(si, rfd, si.except, WvPoller::EXCEPT, this);
+	if (wfd >= 0 && isselectable(wfd))
+	    fd_add(si, wfd, si.except, WvPoller::EXCEPT, this);
     }
     
     if (si.max_fd < rfd)
@@ -258,7 +404,7 @@ bool WvFdStream::post_select(SelectInfo &si)
     // flush the output buffer if possible
     size_t outbuf_used = outbuf.used();
     if (wfd >= 0 && (outbuf_used || autoclose_time)
-	&& FD_ISSET(wfd, &si.write) && should_flush())
+	&& fd_isset(si, wfd, si.write, WvPoller::WRITE) && should_flush())
     {
         flush_outbuf(0);
 	
@@ -270,10 +416,10 @@ bool WvFdStream::post_select(SelectInfo &si)
     bool rforce = si.wants.readable && !isselectable(rfd),
          wforce = si.wants.writable && !isselectable(wfd);
     bool val = 
-	   (rfd >= 0 && (rforce || FD_ISSET(rfd, &si.read)))
-	|| (wfd >= 0 && (wforce || FD_ISSET(wfd, &si.write)))
-	|| (rfd >= 0 && (FD_ISSET(rfd, &si.except)))
-	|| (wfd >= 0 && (FD_ISSET(wfd, &si.except)));
+	   (rfd >= 0 && (rforce || fd_isset(si, rfd, si.read, WvPoller::READ)))
+	|| (wfd >= 0 && (wforce || fd_isset(si, wfd, si.write, WvPoller::WRITE)))
+	|| (rfd >= 0 && (fd_isset(si, rfd, si.except, WvPoller::EXCEPT)))
+	|| (wfd >= 0 && (fd_isset(si, wfd, si.except, WvPoller::EXCEPT)));
     
     // fprintf(stderr, "fds_post_select: %d/%d %d/%d %d\n", 
     //          rfd, wfd, rforce, wforce, val);
@@ -9,6 +9,7 @@
 
 WvFile::WvFile()
 {
+    allow_iov(typeid(WvFile));
     readable = writable = false;
 }
 
@@ -19,6 +20,7 @@ WvFile::WvFile()
  */
 WvFile::WvFile(int rwfd) : WvFDStream(rwfd)
 {
+    allow_iov(typeid(WvFile));
     if (rwfd > -1)
     {
 	/* We have to do it this way since O_RDONLY is defined as 0
@@ -36,6 +38,7 @@ WvFile::WvFile(int rwfd) : WvFDStream(rwfd)
 
 WvFile::WvFile(WvStringParm filename, int mode, int create_mode)
 {
+    allow_iov(typeid(WvFile));
 #ifdef _WIN32
     mode |= O_BINARY; // WvStreams users aren't expecting crlf mangling
 #endif
@@ -6,6 +6,7 @@
  * callback() functions know how to handle multiple simultaneous streams.
  */
 #include "wvistreamlist.h"
+#include "wvpoller.h"
 #include "wvstringlist.h"
 #include "wvstreamsdebugger.h"
 #include "wvstrutils.h"
@@ -103,6 +104,15 @@ void WvIStreamList::pre_select(SelectInfo &si)
     WvCrashInfo::InStreamState old_in_stream_state = WvCrashInfo::in_stream_state;
     WvCrashInfo::in_stream_state = WvCrashInfo::PRE_SELECT;
 
+    // If we're the outermost list using this poller, have it remember which
+    // of our children each fd belongs to, so post_select() only needs to
+    // bother the ones that are actually ready.
+    WvPoller *poller = si.poller;
+    if (poller && poller->owner())
+	poller = NULL; // someone further out is already keeping track
+    if (poller)
+	poller->add_tracker(this);
+
     Iter i(*this);
     for (i.rewind(); i.next(); )
     {
@@ -115,7 +125,23 @@ void WvIStreamList::pre_select(SelectInfo &si)
 	WvCrashInfo::in_stream_id = i.link->id;
 #endif
 	si.wants = oldwant;
-	s.pre_select(si);
+	if (poller)
+	{
+	    // find out this stream's own timeout, not everyone's so far
+	    time_t old_timeout = si.msec_timeout;
+	    si.msec_timeout = -1;
+	    poller->set_owner(&s);
+	    s.pre_select(si);
+	    poller->set_owner(NULL);
+	    
+	    if (si.msec_timeout >= 0)
+		poller->add_timeout(&s, si.msec_timeout);
+	    if (old_timeout >= 0
+	      && (old_timeout < si.msec_timeout || si.msec_timeout < 0))
+		si.msec_timeout = old_timeout;
+	}
+	else
+	    s.pre_select(si);
 	
 	if (!s.isok())
 	    already_sure = true;
@@ -128,6 +154,14 @@ void WvIStreamList::pre_select(SelectInfo &si)
     WvCrashInfo::in_stream_id = old_in_stream_id;
     WvCrashInfo::in_stream_state = old_in_stream_state;
 
+    if (poller)
+    {
+	// our children left their alarms to us
+	time_t next = next_alarm(poller);
+	if (next >= 0 && (next + 10 < si.msec_timeout || si.msec_timeout < 0))
+	    si.msec_timeout = next + 10;
+    }
+
     if (alarmleft >= 0 && (alarmleft < si.msec_timeout || si.msec_timeout < 0))
 	si.msec_timeout = alarmleft;
     
@@ -153,10 +187,20 @@ bool WvIStreamList::post_select(SelectInfo &si)
     WvCrashInfo::InStreamState old_in_stream_state = WvCrashInfo::in_stream_state;
     WvCrashInfo::in_stream_state = WvCrashInfo::POST_SELECT;
 
+    // if our poller knows which children are ready, skip the rest
+    WvPoller *poller = si.poller;
+    if (poller && !poller->is_tracker(this))
+	poller = NULL;
+    if (poller)
+	ring_alarms(poller);
+
     Iter i(*this);
     for (i.rewind(); i.cur() && i.next(); )
     {
 	IWvStream &s(*i);
+	if (poller && s.isok() && !poller->is_ready(&s))
+	    continue;
+	
 #if I_ENJOY_FORMATTING_STRINGS
 	WvCrashWill will("doing post_select for \"%s\" (%s)\n%s",
 			 i.link->id, ptr2str(&s), wvcrash_read_will());
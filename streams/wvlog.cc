@@ -7,6 +7,7 @@
  * See wvlog.h for more information.
  */
 #include "wvlogrcv.h"
+#include "wvasynclog.h"
 #include "wvstringlist.h"
 #include "strutils.h"
 #include "wvfork.h"
@@ -20,6 +21,8 @@
 WvLogRcvBaseList *WvLog::receivers;
 int WvLog::num_receivers = 0, WvLog::num_logs = 0;
 WvLogRcvBase *WvLog::default_receiver = NULL;
+WvAsyncLog *WvLog::async = NULL;
+time_t WvLog::msgtime = 0;
 
 const char *WvLogRcv::loglevels[WvLog::NUM_LOGLEVELS] = {
     "Crit",
@@ -99,6 +102,17 @@ bool WvLog::post_select(SelectInfo &si)
 
 
 size_t WvLog::uwrite(const void *_buf, size_t len)
+{
+    if (async && async->enqueue(app, loglevel, (const char *)_buf, len))
+	return len;
+    
+    deliver(app, loglevel, (const char *)_buf, len);
+    return len;
+}
+
+
+void WvLog::deliver(WvStringParm app, int loglevel,
+		    const char *_buf, size_t len)
 {
     // Writing the log message to a stream might cause it to emit its own log
     // messages, causing recursion.  Don't let it get out of hand.
@@ -126,7 +140,7 @@ size_t WvLog::uwrite(const void *_buf, size_t len)
                     recursion_msg.len());
 
         --recursion_count;
-	return len;
+	return;
     }
     else if (default_receiver)
     {
@@ -150,7 +164,6 @@ size_t WvLog::uwrite(const void *_buf, size_t len)
     }
     
     --recursion_count;
-    return len;
 }
 
 
@@ -297,7 +310,7 @@ void WvLogRcv::log(WvStringParm source, int _loglevel,
     // only need to start a new line with new headers if they headers have
     // changed.  if the source and level are the same as before, just continue
     // the previous log entry.
-    time_t now = wvtime().tv_sec;
+    time_t now = WvLog::timestamp();
     if (source != last_source
             || loglevel != last_level
             || WvLogRcvBase::force_new_line)
@@ -13,7 +13,7 @@
 WvLogBuffer::Msg::Msg(WvLog::LogLevel _level, WvStringParm _source,
     WvString _message) : level(_level), source(_source), message(_message)
 {
-    time(&timestamp);
+    timestamp = WvLog::timestamp();
 }
 
 WvLogBuffer::Msg* WvLogBuffer::MsgCounter::add(WvLogBuffer::Msg* msg, int max)
@@ -23,6 +23,7 @@ static WvMoniker<IWvStream> reg("loop",  create_loopback);
 
 WvLoopback::WvLoopback()
 {
+    allow_iov(typeid(WvLoopback));
     int socks[2];
     
     if (wvsocketpair(SOCK_STREAM, socks))
@@ -0,0 +1,467 @@
+/*
+ * Worldvisions Weaver Software:
+ *   Copyright (C) 1997-2002 Net Integration Technologies, Inc.
+ *
+ * WvPoller keeps track of which file descriptors the streams want to
+ * select() on, and feeds only the differences to a backend like epoll.
+ * See wvpoller.h.
+ */
+#include "wvpoller.h"
+#include <assert.h>
+#include <errno.h>
+#include <limits.h>
+#include <string.h>
+
+#ifndef _WIN32
+#include "wvfork.h"
+#endif
+
+#ifdef HAVE_SYS_EPOLL_H
+#include <sys/epoll.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <stdint.h>
+#endif
+
+using std::make_pair;
+
+bool WvPoller::disabled = false;
+
+// all the pollers that currently exist, so fd_closed() and forking can
+// find them.
+static std::set<WvPoller *> *all_pollers;
+
+
+WvPoller::WvPoller()
+    : cur_owner(NULL), round(0), need_reset(false), nregistered(0)
+{
+    if (!all_pollers)
+    {
+	all_pollers = new std::set<WvPoller *>;
+#ifndef _WIN32
+	static bool fork_callback_added = false;
+	if (!fork_callback_added)
+	{
+	    add_wvfork_callback(WvPoller::onfork);
+	    fork_callback_added = true;
+	}
+#endif
+    }
+    all_pollers->insert(this);
+}
+
+
+WvPoller::~WvPoller()
+{
+    assert(all_pollers);
+    all_pollers->erase(this);
+    if (all_pollers->empty())
+    {
+	delete all_pollers;
+	all_pollers = NULL;
+    }
+}
+
+
+void WvPoller::begin()
+{
+    // zero means "never", so skip it when we wrap around
+    if (!++round)
+	++round;
+
+    declared.clear();
+    fired.clear();
+    shared_fds.clear();
+    trackers.clear();
+    timeouts.clear();
+    hot.clear();
+    cur_owner = NULL;
+}
+
+
+void WvPoller::add(int fd, unsigned events, const void *cookie)
+{
+    assert(fd >= 0);
+    if ((size_t)fd >= fds.size())
+	fds.resize(fd + 1);
+
+    FdInfo &f = fds[fd];
+    if (f.round != round)
+    {
+	// first time we've heard about this fd this round
+	f.round = round;
+	f.want = f.revents = 0;
+	f.shared = false;
+	f.owner = cur_owner;
+	if (f.cookie != cookie)
+	{
+	    f.cookie = cookie;
+	    f.moved = true;
+	}
+	declared.push_back(fd);
+    }
+    else if (f.owner != cur_owner)
+    {
+	// more than one stream wants this fd; remember all of them.
+	if (!f.shared)
+	    shared_fds.push_back(make_pair(fd, f.owner));
+	f.shared = true;
+	shared_fds.push_back(make_pair(fd, cur_owner));
+    }
+
+    f.want |= events;
+}
+
+
+bool WvPoller::is_tracker(IWvStream *list) const
+{
+    std::vector<IWvStream *>::const_iterator i;
+    for (i = trackers.begin(); i != trackers.end(); ++i)
+	if (*i == list)
+	    return true;
+    return false;
+}
+
+
+void WvPoller::add_timeout(IWvStream *s, time_t msec_timeout)
+{
+    if (!msec_timeout)
+    {
+	hot.insert(s);
+	return;
+    }
+
+    WvTime when = msecadd(wvstime(), msec_timeout);
+    std::map<IWvStream *, WvTime>::iterator i = timeouts.find(s);
+    if (i == timeouts.end())
+	timeouts.insert(make_pair(s, when));
+    else if (when < i->second)
+	i->second = when;
+}
+
+
+bool WvPoller::is_ready(IWvStream *s) const
+{
+    if (hot.find(s) != hot.end())
+	return true;
+
+    std::map<IWvStream *, WvTime>::const_iterator i = timeouts.find(s);
+    return i != timeouts.end() && !(wvstime() < i->second);
+}
+
+
+void WvPoller::reset()
+{
+    _reset();
+
+    std::vector<int>::iterator i;
+    for (i = active.begin(); i != active.end(); ++i)
+	fds[*i].registered = 0;
+    active.clear();
+    nregistered = 0;
+    need_reset = false;
+}
+
+
+void WvPoller::unregister(int fd)
+{
+    FdInfo &f = fds[fd];
+    f.always_ready = false;
+    if (!f.registered)
+	return;
+
+    unsigned had = f.registered;
+    f.registered = 0;
+    if (--nregistered)
+	_update(fd, had, 0);
+    else
+	_reset(); // nothing left to watch; no need to hang on to anything
+}
+
+
+void WvPoller::commit()
+{
+    if (need_reset)
+	reset();
+
+    std::vector<int>::iterator i;
+
+    // stop watching anything nobody asked for this time around
+    for (i = active.begin(); i != active.end(); ++i)
+    {
+	if (fds[*i].round != round)
+	    unregister(*i);
+    }
+    active.clear();
+
+    for (i = declared.begin(); i != declared.end(); ++i)
+    {
+	FdInfo &f = fds[*i];
+
+	if (f.moved)
+	    unregister(*i); // someone else owns this fd number now
+	f.moved = false;
+
+	if (!f.always_ready && f.registered != f.want)
+	{
+	    if (!f.registered)
+		f.serial++;
+	    if (_update(*i, f.registered, f.want))
+	    {
+		if (!f.registered)
+		    nregistered++;
+		f.registered = f.want;
+	    }
+	    else
+	    {
+		// The backend can't watch this fd (eg. epoll refuses
+		// regular files).  ::select() would say those are always
+		// ready, so we do too, until it's closed or changes hands.
+		unregister(*i);
+		f.always_ready = true;
+		if (!nregistered)
+		    _reset();
+	    }
+	}
+	active.push_back(*i);
+    }
+}
+
+
+int WvPoller::wait(time_t msec_timeout)
+{
+    commit();
+
+    std::vector<int>::iterator i;
+    for (i = declared.begin(); i != declared.end(); ++i)
+    {
+	FdInfo &f = fds[*i];
+	if (f.always_ready)
+	{
+	    f.revents = f.want;
+	    fired.push_back(*i);
+	    msec_timeout = 0;
+	}
+    }
+
+    if (_wait(msec_timeout) < 0)
+	return -1;
+
+    for (i = fired.begin(); i != fired.end(); ++i)
+	heat(*i);
+
+    return fired.size();
+}
+
+
+void WvPoller::ready(int fd, unsigned serial, unsigned revents)
+{
+    if (fd < 0 || (size_t)fd >= fds.size()
+	|| !fds[fd].registered || fds[fd].serial != serial)
+    {
+	// An event for an fd we don't know about.  Probably it was
+	// closed without telling us, but some dup() of it is still alive
+	// and the backend can't forget it anymore.  Start from scratch
+	// next time.
+	need_reset = true;
+	return;
+    }
+
+    FdInfo &f = fds[fd];
+    bool was_fired = f.revents != 0;
+    f.revents |= revents & f.want;
+    if (f.revents && !was_fired)
+	fired.push_back(fd);
+}
+
+
+void WvPoller::heat(int fd)
+{
+    const FdInfo &f = fds[fd];
+    if (!f.shared)
+    {
+	if (f.owner)
+	    hot.insert(f.owner);
+	return;
+    }
+
+    std::vector<std::pair<int, IWvStream *> >::iterator i;
+    for (i = shared_fds.begin(); i != shared_fds.end(); ++i)
+	if (i->first == fd && i->second)
+	    hot.insert(i->second);
+}
+
+
+void WvPoller::fd_closed(int fd)
+{
+    if (!all_pollers || fd < 0)
+	return;
+
+    std::set<WvPoller *>::iterator i;
+    for (i = all_pollers->begin(); i != all_pollers->end(); ++i)
+    {
+	if ((size_t)fd < (*i)->fds.size())
+	    (*i)->unregister(fd);
+    }
+}
+
+
+#ifndef _WIN32
+void WvPoller::onfork(pid_t pid)
+{
+    if (pid != 0 || !all_pollers)
+	return;
+
+    // this is the child process: our kernel-side state (if any) is shared
+    // with the parent, so let go of it without touching it.  wvfork()
+    // is about to close our close-on-exec fds anyway.
+    std::set<WvPoller *>::iterator i;
+    for (i = all_pollers->begin(); i != all_pollers->end(); ++i)
+	(*i)->reset();
+}
+#endif
+
+
+#ifdef HAVE_SYS_EPOLL_H
+
+/**
+ * A WvPoller that uses Linux's epoll.  The epoll fd is only kept open while
+ * there's something to watch; among other things, that means a reset() in
+ * a freshly forked child doesn't create one just for wvfork() to close.
+ */
+class WvEpollPoller : public WvPoller
+{
+public:
+    WvEpollPoller()
+	: epfd(-1), events(64)
+	{ }
+    virtual ~WvEpollPoller()
+	{ _reset(); }
+
+    bool open();
+    virtual void _reset();
+
+protected:
+    virtual bool _update(int fd, unsigned had, unsigned want);
+    virtual int _wait(time_t msec_timeout);
+
+private:
+    int epfd;
+    std::vector<struct epoll_event> events;
+};
+
+
+bool WvEpollPoller::open()
+{
+    if (epfd < 0)
+    {
+#ifdef EPOLL_CLOEXEC
+	epfd = epoll_create1(EPOLL_CLOEXEC);
+#else
+	epfd = epoll_create(64);
+	if (epfd >= 0)
+	    fcntl(epfd, F_SETFD, FD_CLOEXEC);
+#endif
+    }
+    return epfd >= 0;
+}
+
+
+bool WvEpollPoller::_update(int fd, unsigned had, unsigned want)
+{
+    if (!open())
+	return false;
+
+    struct epoll_event ev;
+    memset(&ev, 0, sizeof(ev));
+    ev.events = ((want & READ) ? EPOLLIN : 0)
+	| ((want & WRITE) ? EPOLLOUT : 0)
+	| ((want & EXCEPT) ? EPOLLPRI : 0);
+    ev.data.u64 = ((uint64_t)serial(fd) << 32) | (uint32_t)fd;
+
+    if (!want)
+    {
+	// failure just means the fd is already gone, which is fine
+	epoll_ctl(epfd, EPOLL_CTL_DEL, fd, &ev);
+	return true;
+    }
+
+    int op = had ? EPOLL_CTL_MOD : EPOLL_CTL_ADD;
+    if (epoll_ctl(epfd, op, fd, &ev) == 0)
+	return true;
+
+    // the fd was closed and reopened without us hearing about it, or the
+    // other way around.
+    if (op == EPOLL_CTL_MOD && errno == ENOENT)
+	return epoll_ctl(epfd, EPOLL_CTL_ADD, fd, &ev) == 0;
+    if (op == EPOLL_CTL_ADD && errno == EEXIST)
+	return epoll_ctl(epfd, EPOLL_CTL_MOD, fd, &ev) == 0;
+    return false;
+}
+
+
+int WvEpollPoller::_wait(time_t msec_timeout)
+{
+    int timeout = -1;
+    if (msec_timeout >= 0)
+	timeout = msec_timeout > INT_MAX ? INT_MAX : (int)msec_timeout;
+
+    // not watching anything, so we don't have an epoll fd; just sleep.
+    if (epfd < 0)
+	return ::poll(NULL, 0, timeout);
+
+    int n = epoll_wait(epfd, &events[0], events.size(), timeout);
+    for (int i = 0; i < n; i++)
+    {
+	uint32_t e = events[i].events;
+
+	// the same rules the kernel uses for select()
+	unsigned revents = 0;
+	if (e & (EPOLLIN | EPOLLHUP | EPOLLERR))
+	    revents |= READ;
+	if (e & (EPOLLOUT | EPOLLERR))
+	    revents |= WRITE;
+	if (e & EPOLLPRI)
+	    revents |= EXCEPT;
+
+	ready((int)(uint32_t)events[i].data.u64,
+	      (unsigned)(events[i].data.u64 >> 32), revents);
+    }
+
+    // if we filled the array, there were probably more; the rest will
+    // still be there next time, but let's make room for them.
+    if (n == (int)events.size())
+	events.resize(events.size() * 2);
+
+    return n;
+}
+
+
+void WvEpollPoller::_reset()
+{
+    if (epfd >= 0)
+	::close(epfd);
+    epfd = -1;
+}
+
+#endif // HAVE_SYS_EPOLL_H
+
+
+WvPoller *WvPoller::create()
+{
+    if (disabled)
+	return NULL;
+#ifdef HAVE_SYS_EPOLL_H
+    // make sure epoll actually works here, or fall back to ::select()
+    WvEpollPoller *p = new WvEpollPoller;
+    if (!p->open())
+    {
+	delete p;
+	return NULL;
+    }
+    p->_reset(); // we'll open it again when there's something to watch
+    return p;
+#else
+    return NULL;
+#endif
+}
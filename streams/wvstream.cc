@@ -20,6 +20,7 @@
 #include "wvistreamlist.h"
 #include "wvlinkerhack.h"
 #include "wvmoniker.h"
+#include "wvpoller.h"
 
 #ifdef _WIN32
 #define ENOBUFS WSAENOBUFS
@@ -33,6 +34,7 @@
 #include <errno.h>
 #endif
 
+#include <algorithm>
 #include <map>
 
 using std::make_pair;
@@ -66,6 +68,216 @@ UUID_MAP_BEGIN(WvStream)
 static map<WSID, WvStream*> *wsid_map;
 static WSID next_wsid_to_try;
 
+// One WvPoller for each level of select() recursion (post_select() likes to
+// call select(0) on other streams), so that nested selects don't keep
+// throwing away each other's fd registrations.  A NULL entry means we
+// couldn't get a poller and use plain ::select() at that level.
+static std::vector<WvPoller *> *pollers;
+static size_t poll_depth;
+
+
+#define NO_ALARM_SLOT ((size_t)-1)
+
+/**
+ * All the streams with an alarm set, as a binary min-heap ordered by
+ * alarm_time.  Each stream remembers its own position (alarm_slot), so
+ * changing or cancelling an alarm is O(log n) and finding the next one to
+ * go off is O(1).
+ */
+class WvAlarmHeap
+{
+public:
+    WvAlarmHeap()
+	: last_check(wvtime_zero)
+	{ }
+
+    bool empty() const
+        { return heap.empty(); }
+
+    /** s->alarm_time has changed; put s in the right place. */
+    void set(WvStream *s);
+
+    /** s doesn't have an alarm anymore. */
+    void remove(WvStream *s);
+
+    /**
+     * Time went backwards since we last looked?  Then move every alarm
+     * back by the same amount, so they still go off on schedule.  Moving
+     * them all together doesn't change their order.
+     */
+    void sync();
+
+    /** The soonest alarm marked for the given poller round, or NULL. */
+    WvStream *first(const WvPoller *poller, unsigned round) const;
+
+    /** Wakes the owners of the expired alarms marked for this round. */
+    void ring(WvPoller *poller, unsigned round) const;
+
+private:
+    std::vector<WvStream *> heap;
+    WvTime last_check;
+
+    static bool marked(const WvStream *s, const WvPoller *poller,
+		       unsigned round)
+	{ return s->alarm_poller == poller && s->alarm_round == round; }
+
+    bool before(size_t a, size_t b) const
+        { return heap[a]->alarm_time < heap[b]->alarm_time; }
+
+    // orders heap slots so std::pop_heap() gives the soonest alarm first
+    struct LaterSlot
+    {
+	const WvAlarmHeap *h;
+	LaterSlot(const WvAlarmHeap *_h) : h(_h) { }
+	bool operator()(size_t a, size_t b) const
+	    { return h->before(b, a); }
+    };
+
+    void place(size_t i, WvStream *s)
+        { heap[i] = s; s->alarm_slot = i; }
+    void up(size_t i);
+    void down(size_t i);
+};
+
+static WvAlarmHeap *alarms;
+
+
+void WvAlarmHeap::set(WvStream *s)
+{
+    size_t i = s->alarm_slot;
+    if (i == NO_ALARM_SLOT)
+    {
+	heap.push_back(s);
+	s->alarm_slot = heap.size() - 1;
+	up(s->alarm_slot);
+    }
+    else if (i && before(i, (i - 1) / 2))
+	up(i);
+    else
+	down(i);
+}
+
+
+void WvAlarmHeap::remove(WvStream *s)
+{
+    size_t i = s->alarm_slot;
+    if (i == NO_ALARM_SLOT)
+	return;
+    s->alarm_slot = NO_ALARM_SLOT;
+
+    WvStream *last = heap.back();
+    heap.pop_back();
+    if (last != s)
+    {
+	place(i, last);
+	set(last);
+    }
+}
+
+
+void WvAlarmHeap::sync()
+{
+    const WvTime &now = wvstime();
+    if (now < last_check)
+    {
+	WvTime delta = tvdiff(last_check, now);
+	std::vector<WvStream *>::iterator i;
+	for (i = heap.begin(); i != heap.end(); ++i)
+	    (*i)->alarm_time = tvdiff((*i)->alarm_time, delta);
+    }
+    last_check = now;
+}
+
+
+void WvAlarmHeap::up(size_t i)
+{
+    WvStream *s = heap[i];
+    while (i)
+    {
+	size_t parent = (i - 1) / 2;
+	if (!(s->alarm_time < heap[parent]->alarm_time))
+	    break;
+	place(i, heap[parent]);
+	i = parent;
+    }
+    place(i, s);
+}
+
+
+void WvAlarmHeap::down(size_t i)
+{
+    WvStream *s = heap[i];
+    size_t n = heap.size();
+    for (;;)
+    {
+	size_t child = 2 * i + 1;
+	if (child >= n)
+	    break;
+	if (child + 1 < n && before(child + 1, child))
+	    child++;
+	if (!(heap[child]->alarm_time < s->alarm_time))
+	    break;
+	place(i, heap[child]);
+	i = child;
+    }
+    place(i, s);
+}
+
+
+WvStream *WvAlarmHeap::first(const WvPoller *poller, unsigned round) const
+{
+    if (heap.empty())
+	return NULL;
+    if (marked(heap[0], poller, round))
+	return heap[0]; // the usual case
+    
+    // Somebody who isn't being selected right now has the soonest alarm.
+    // Search outward from the top, soonest first, until we find one of ours;
+    // the heap order means we only have to look at the ones ahead of it.
+    std::vector<size_t> todo(1, 0);
+    while (!todo.empty())
+    {
+	std::pop_heap(todo.begin(), todo.end(), LaterSlot(this));
+	size_t i = todo.back();
+	todo.pop_back();
+	if (marked(heap[i], poller, round))
+	    return heap[i];
+	for (size_t child = 2 * i + 1; child <= 2 * i + 2; child++)
+	{
+	    if (child < heap.size())
+	    {
+		todo.push_back(child);
+		std::push_heap(todo.begin(), todo.end(), LaterSlot(this));
+	    }
+	}
+    }
+    return NULL;
+}
+
+
+void WvAlarmHeap::ring(WvPoller *poller, unsigned round) const
+{
+    // everything below an alarm that hasn't expired yet hasn't either
+    const WvTime &now = wvstime();
+    std::vector<size_t> todo;
+    if (!heap.empty())
+	todo.push_back(0);
+    while (!todo.empty())
+    {
+	size_t i = todo.back();
+	todo.pop_back();
+	WvStream *s = heap[i];
+	if (msecdiff(s->alarm_time, now) > 0)
+	    continue;
+	if (marked(s, poller, round) && s->alarm_owner)
+	    poller->add_timeout(s->alarm_owner, 0);
+	if (2 * i + 1 < heap.size())
+	    todo.push_back(2 * i + 1);
+	if (2 * i + 2 < heap.size())
+	    todo.push_back(2 * i + 2);
+    }
+}
+
 
 WV_LINK(WvStream);
 
@@ -264,7 +476,10 @@ WvStream::WvStream():
     queue_min(0),
     autoclose_time(0),
     alarm_time(wvtime_zero),
-    last_alarm_check(wvtime_zero)
+    alarm_slot(NO_ALARM_SLOT),
+    alarm_poller(NULL),
+    alarm_round(0),
+    alarm_owner(NULL)
 {
     TRACE("Creating wvstream %p\n", this);
     
@@ -333,6 +548,8 @@ WvStream::~WvStream()
     // globallist *after* they get destroyed, so we might as well auto-remove
     // them already.  It's harmless for people to try to remove them twice.
     WvIStreamList::globallist.unlink(this);
+
+    alarm(-1);
     
     TRACE("done destroying %p\n", this);
 }
@@ -405,7 +622,7 @@ void WvStream::callback()
     // if the alarm has gone off and we're calling callback... good!
     if (alarm_remaining() == 0)
     {
-	alarm_time = wvtime_zero;
+	alarm(-1);
 	alarm_was_ticking = true;
     }
     else
@@ -460,11 +677,18 @@ void WvStream::seterr(int _errnum)
 
 size_t WvStream::read(WvBuf &outbuf, size_t count)
 {
-    // for now, just wrap the older read function
     size_t free = outbuf.free();
     if (count > free)
         count = free;
 
+    // nothing buffered?  Then we can read straight into outbuf.
+    if (!inbuf.used() && !queue_min)
+    {
+	size_t len = ureadv(outbuf, count);
+	maybe_autoclose();
+	return len;
+    }
+
     WvDynBuf tmp;
     unsigned char *buf = tmp.alloc(count);
     size_t len = read(buf, count);
@@ -476,17 +700,82 @@ size_t WvStream::read(WvBuf &outbuf, size_t count)
 
 size_t WvStream::write(WvBuf &inbuf, size_t count)
 {
-    // for now, just wrap the older write function
     size_t avail = inbuf.used();
     if (count > avail)
         count = avail;
-    const unsigned char *buf = inbuf.get(count);
-    size_t len = write(buf, count);
-    inbuf.unget(count - len);
+    if (!isok() || !count || stop_write) return 0;
+    
+    // just like write(const void *, size_t), except nothing has to be
+    // copied into a contiguous block first.
+    size_t wrote = 0;
+    if (!outbuf_delayed_flush && !outbuf.used())
+    {
+	wrote = uwritev(inbuf, count);
+	count -= wrote;
+	if (count > inbuf.used())
+	    count = inbuf.used(); // the stream died and uwritev() dropped it
+    }
+    if (max_outbuf_size != 0)
+    {
+        size_t canbuffer = max_outbuf_size - outbuf.used();
+        if (count > canbuffer)
+            count = canbuffer; // can't write the whole amount
+    }
+    if (count != 0)
+    {
+	outbuf.merge(inbuf, count);
+	wrote += count;
+    }
+
+    if (should_flush())
+    {
+        if (is_auto_flush)
+            flush(0);
+        else 
+            flush_outbuf(0);
+    }
+
+    return wrote;
+}
+
+
+size_t WvStream::ureadv(WvBuf &outbuf, size_t count)
+{
+    // uread() might hit an error and close us, and who knows what the
+    // close callback will do to outbuf, so read into our own buffer.
+    // merge() just moves the piece over without copying it.
+    WvDynBuf tmp;
+    unsigned char *buf = tmp.alloc(count);
+    size_t len = uread(buf, count);
+    tmp.unalloc(count - len);
+    outbuf.merge(tmp);
     return len;
 }
 
 
+size_t WvStream::uwritev(WvBuf &inbuf, size_t count)
+{
+    size_t attempt = inbuf.optgettable();
+    if (attempt > count)
+	attempt = count;
+    if (!attempt)
+	return 0;
+    
+    size_t real = uwrite(inbuf.get(attempt), attempt);
+    
+    // WARNING: uwrite() may have messed up inbuf, if it's our outbuf!
+    // This probably only happens if uwrite() closed the stream because
+    // of an error, so we'll check isok().
+    if (isok() && real < attempt)
+    {
+	TRACE("uwritev: unget %d-%d\n", attempt, real);
+	assert(inbuf.ungettable() >= attempt - real);
+	inbuf.unget(attempt - real);
+    }
+    return real;
+}
+
+
 size_t WvStream::read(void *buf, size_t count)
 {
     assert(!count || buf);
@@ -749,18 +1038,7 @@ bool WvStream::flush_outbuf(time_t msec_timeout)
 //	fprintf(stderr, "%p: fd:%d/%d, used:%d\n", 
 //		this, getrfd(), getwfd(), outbuf.used());
 	
-	size_t attempt = outbuf.optgettable();
-	size_t real = uwrite(outbuf.get(attempt), attempt);
-	
-	// WARNING: uwrite() may have messed up our outbuf!
-	// This probably only happens if uwrite() closed the stream because
-	// of an error, so we'll check isok().
-	if (isok() && real < attempt)
-	{
-	    TRACE("flush_outbuf: unget %d-%d\n", attempt, real);
-	    assert(outbuf.ungettable() >= attempt - real);
-	    outbuf.unget(attempt - real);
-	}
+	uwritev(outbuf, outbuf.used());
 	
 	// since post_select() can call us, and select() calls post_select(),
 	// we need to be careful not to call select() if we don't need to!
@@ -866,9 +1144,19 @@ void WvStream::pre_select(SelectInfo &si)
 	si.msec_timeout = 0; // already ready
 	return;
     }
-    if (alarmleft >= 0
-      && (alarmleft < si.msec_timeout || si.msec_timeout < 0))
-	si.msec_timeout = alarmleft + 10;
+    if (alarmleft >= 0)
+    {
+	if (si.poller && si.poller->owner())
+	{
+	    // whoever is tracking our owner will check the alarm heap for
+	    // all of us at once; see next_alarm().
+	    alarm_poller = si.poller;
+	    alarm_round = si.poller->current_round();
+	    alarm_owner = si.poller->owner();
+	}
+	else if (alarmleft < si.msec_timeout || si.msec_timeout < 0)
+	    si.msec_timeout = alarmleft + 10;
+    }
 }
 
 
@@ -899,11 +1187,18 @@ bool WvStream::post_select(SelectInfo &si)
 
 
 void WvStream::_build_selectinfo(SelectInfo &si, time_t msec_timeout,
-    bool readable, bool writable, bool isexcept, bool forceable)
+    bool readable, bool writable, bool isexcept, bool forceable,
+    WvPoller *poller)
 {
-    FD_ZERO(&si.read);
-    FD_ZERO(&si.write);
-    FD_ZERO(&si.except);
+    si.poller = poller;
+    if (poller)
+	poller->begin();
+    else
+    {
+	FD_ZERO(&si.read);
+	FD_ZERO(&si.write);
+	FD_ZERO(&si.except);
+    }
     
     if (forceable)
     {
@@ -938,6 +1233,19 @@ void WvStream::_build_selectinfo(SelectInfo &si, time_t msec_timeout,
 
 int WvStream::_do_select(SelectInfo &si)
 {
+    if (si.poller)
+    {
+	int sel = si.poller->wait(si.msec_timeout);
+	if (sel < 0 
+	  && errno != EAGAIN && errno != EINTR 
+	  && errno != EBADF
+	  && errno != ENOBUFS
+	  )
+	    seterr(errno);
+	TRACE("poller returned %d\n", sel);
+	return sel;
+    }
+    
     // prepare timeout
     timeval tv;
     tv.tv_sec = si.msec_timeout / 1000;
@@ -1002,14 +1310,22 @@ bool WvStream::_select(time_t msec_timeout, bool readable, bool writable,
     // Detect use of deleted stream
     assert(wsid_map && (wsid_map->find(my_wsid) != wsid_map->end()));
         
+    if (!pollers)
+	pollers = new std::vector<WvPoller *>;
+    if (poll_depth >= pollers->size())
+	pollers->push_back(WvPoller::create());
+    WvPoller *poller = WvPoller::disabled ? NULL : (*pollers)[poll_depth];
+    poll_depth++;
+        
     SelectInfo si;
     _build_selectinfo(si, msec_timeout, readable, writable, isexcept,
-		      forceable);
+		      forceable, poller);
     
     bool sure = false;
     int sel = _do_select(si);
     if (sel >= 0)
         sure = _process_selectinfo(si, forceable); 
+    poll_depth--;
     if (si.global_sure && globalstream && forceable && (globalstream != this))
 	globalstream->callback();
 
@@ -1048,35 +1364,37 @@ void WvStream::undo_force_select(bool readable, bool writable, bool isexception)
 void WvStream::alarm(time_t msec_timeout)
 {
     if (msec_timeout >= 0)
+    {
+	if (!alarms)
+	    alarms = new WvAlarmHeap;
+	alarms->sync(); // don't get moved back along with the old ones
         alarm_time = msecadd(wvstime(), msec_timeout);
+	alarms->set(this);
+    }
     else
+    {
 	alarm_time = wvtime_zero;
+	if (alarm_slot != NO_ALARM_SLOT)
+	{
+	    alarms->remove(this);
+	    if (alarms->empty())
+	    {
+		delete alarms;
+		alarms = NULL;
+	    }
+	}
+    }
 }
 
 
 time_t WvStream::alarm_remaining()
 {
-    if (alarm_time.tv_sec)
+    if (alarm_slot != NO_ALARM_SLOT)
     {
-	WvTime now = wvstime();
-
-	// Time is going backward!
-	if (now < last_alarm_check)
-	{
-#if 0 // okay, I give up.  Time just plain goes backwards on some systems.
-	    // warn only if it's a "big" difference (sigh...)
-	    if (msecdiff(last_alarm_check, now) > 200)
-		fprintf(stderr, " ************* TIME WENT BACKWARDS! "
-			"(%ld:%ld %ld:%ld)\n",
-			last_alarm_check.tv_sec, last_alarm_check.tv_usec,
-			now.tv_sec, now.tv_usec);
-#endif
-	    alarm_time = tvdiff(alarm_time, tvdiff(last_alarm_check, now));
-	}
+	// Time just plain goes backwards on some systems.
+	alarms->sync();
 
-	last_alarm_check = now;
-
-        time_t remaining = msecdiff(alarm_time, now);
+        time_t remaining = msecdiff(alarm_time, wvstime());
         if (remaining < 0)
             remaining = 0;
         return remaining;
@@ -1085,6 +1403,23 @@ time_t WvStream::alarm_remaining()
 }
 
 
+time_t WvStream::next_alarm(WvPoller *poller)
+{
+    if (!alarms)
+	return -1;
+    alarms->sync();
+    WvStream *s = alarms->first(poller, poller->current_round());
+    return s ? s->alarm_remaining() : -1;
+}
+
+
+void WvStream::ring_alarms(WvPoller *poller)
+{
+    if (alarms)
+	alarms->ring(poller, poller->current_round());
+}
+
+
 bool WvStream::continue_select(time_t msec_timeout)
 {
     assert(uses_continue_select);
@@ -13,8 +13,9 @@
 /***** UniConfDaemonConn *****/
 
 UniConfDaemonConn::UniConfDaemonConn(WvStream *_s, const UniConf &_root)
-    : UniClientConn(_s), root(_root)
+    : UniClientConn(_s), root(_root), subs(5)
 {
+    filtered = false;
     uses_continue_select = true;
     addcallback();
     writecmd(EVENT_HELLO,
@@ -46,7 +47,13 @@ void UniConfDaemonConn::addcallback()
 
 void UniConfDaemonConn::delcallback()
 {
-    root.del_callback(this, true);
+    if (!filtered)
+	root.del_callback(this, true);
+
+    SubscriptionDict::Iter i(subs);
+    for (i.rewind(); i.next(); )
+	root[i->base].del_callback(i.ptr(), true);
+    subs.zap();
 }
 
 
@@ -59,9 +66,10 @@ void UniConfDaemonConn::execute()
     
     if (command != UniClientConn::NONE)
     {
-        // parse and execute command
-        WvString arg1(readarg());
-        WvString arg2(readarg());
+        // parse and execute command.  The first argument, if any, is
+        // always a key.
+        UniConfKey key;
+        bool haskey = readkey(key);
         switch (command)
         {
 	case UniClientConn::NONE:
@@ -76,38 +84,54 @@ void UniConfDaemonConn::execute()
 	    break;
 	    
 	case UniClientConn::REQ_GET:
-	    if (arg1.isnull())
+	    if (!haskey)
 		do_malformed(command);
 	    else
-		do_get(arg1);
+		do_get(key);
 	    break;
             
-	case UniClientConn::REQ_SET:
-	    if (arg1.isnull() || arg2.isnull())
+	case UniClientConn::REQ_MGET:
+	    if (!haskey)
 		do_malformed(command);
 	    else
-		do_set(arg1, arg2);
+	    {
+		UniConfKeyList keys;
+		do
+		    keys.append(new UniConfKey(key), true);
+		while (readkey(key));
+		do_mget(keys);
+	    }
+	    break;
+            
+	case UniClientConn::REQ_SET:
+	    {
+		WvString value(readarg());
+		if (!haskey || value.isnull())
+		    do_malformed(command);
+		else
+		    do_set(key, value);
+	    }
 	    break;
 	    
 	case UniClientConn::REQ_REMOVE:
-	    if (arg1.isnull())
+	    if (!haskey)
 		do_malformed(command);
 	    else
-		do_remove(arg1);
+		do_remove(key);
 	    break;
 	    
 	case UniClientConn::REQ_SUBTREE:
-	    if (arg1.isnull())
+	    if (!haskey)
 		do_malformed(command);
 	    else
-		do_subtree(arg1, arg2.num() == 1);
+		do_subtree(key, readarg().num() == 1);
 	    break;
 	    
 	case UniClientConn::REQ_HASCHILDREN:
-	    if (arg1.isnull())
+	    if (!haskey)
 		do_malformed(command);
 	    else
-		do_haschildren(arg1);
+		do_haschildren(key);
 	    break;
 	    
 	case UniClientConn::REQ_COMMIT:
@@ -126,6 +150,20 @@ void UniConfDaemonConn::execute()
 	    do_help();
 	    break;
 	    
+	case UniClientConn::REQ_SUBSCRIBE:
+	    if (!haskey)
+		do_malformed(command);
+	    else
+		do_subscribe(key);
+	    break;
+	    
+	case UniClientConn::REQ_UNSUBSCRIBE:
+	    if (!haskey)
+		do_malformed(command);
+	    else
+		do_unsubscribe(key);
+	    break;
+	    
 	default:
 	    do_invalid(command_string);
 	    break;
@@ -170,6 +208,30 @@ void UniConfDaemonConn::do_get(const UniConfKey &key)
 }
 
 
+// Sends a VAL for each key that exists, then OK.  Keys that don't exist
+// are just left out.
+void UniConfDaemonConn::do_mget(const UniConfKeyList &keys)
+{
+    int niceness = 0;
+
+    UniConfKeyList::Iter i(keys);
+    for (i.rewind(); i.next(); )
+    {
+	WvString value(root[*i].getme());
+	if (!value.isnull())
+	    writevalue(*i, value);
+
+	if (!isok()) break;
+	if (++niceness > CONTINUE_SELECT_AT)
+	{
+	    niceness = 0;
+	    continue_select(0);
+	}
+    }
+    writeok();
+}
+
+
 void UniConfDaemonConn::do_set(const UniConfKey &key, WvStringParm value)
 {
     root[key].setme(value);
@@ -277,8 +339,7 @@ void UniConfDaemonConn::do_subtree(const UniConfKey &key, bool recursive)
 void UniConfDaemonConn::do_haschildren(const UniConfKey &key)
 {
     bool haschild = root[key].haschildren();
-    writecmd(REPLY_CHILD,
-	     spacecat(wvtcl_escape(key), haschild ? "TRUE" : "FALSE"));
+    writecmd(REPLY_CHILD, key, haschild ? "TRUE" : "FALSE");
 }
 
 
@@ -313,22 +374,126 @@ void UniConfDaemonConn::do_help()
 }
 
 
+// The watch for a pattern goes on the part of it before any wildcards.
+static UniConfKey watchbase(const UniConfKey &pattern)
+{
+    int n = 0;
+    while (n < pattern.numsegments() && !pattern.segment(n).iswild())
+	n++;
+    return pattern.first(n);
+}
+
+
+// Like set, sub and unsub don't send a reply, so a client can fire them
+// off in front of its real requests without having to wait.
+void UniConfDaemonConn::do_subscribe(const UniConfKey &pattern)
+{
+    UniConfKey base(watchbase(pattern));
+
+    if (!filtered)
+    {
+	// from now on, only tell them about what they asked for
+	root.del_callback(this, true);
+	filtered = true;
+    }
+
+    Subscription *sub = subs[base];
+    if (!sub)
+    {
+	sub = new Subscription(base);
+	subs.add(sub, true);
+	root[base].add_callback(sub,
+		wv::bind(&UniConfDaemonConn::subcallback, this, sub, _1, _2),
+		true);
+    }
+
+    UniConfKeyList::Iter i(sub->patterns);
+    for (i.rewind(); i.next(); )
+	if (*i == pattern)
+	    return;
+    sub->patterns.append(new UniConfKey(pattern), true);
+}
+
+
+void UniConfDaemonConn::do_unsubscribe(const UniConfKey &pattern)
+{
+    UniConfKey base(watchbase(pattern));
+
+    Subscription *sub = subs[base];
+    if (!sub)
+	return;
+
+    UniConfKeyList::Iter i(sub->patterns);
+    for (i.rewind(); i.next(); )
+    {
+	if (*i == pattern)
+	{
+	    i.xunlink();
+	    break;
+	}
+    }
+
+    if (sub->patterns.isempty())
+    {
+	root[base].del_callback(sub, true);
+	subs.remove(sub);
+    }
+}
+
+
+void UniConfDaemonConn::notify(const UniConfKey &key, WvStringParm value)
+{
+    writecmd(UniClientConn::EVENT_NOTICE, key, value);
+}
+
+
 void UniConfDaemonConn::deltacallback(const UniConf &cfg, const UniConfKey &key)
 {
-    // for now, we just send notifications for *any* key that changes.
-    // Eventually we probably want to do something about having each
-    // connection specify exactly which keys it cares about.
-    WvString value(cfg[key].getme());
-    WvString msg;
+    // an unfiltered connection hears about every key that changes
+    notify(key, cfg[key].getme());
+}
 
-    UniConfKey fullkey(cfg.fullkey(cfg));
-    fullkey.append(key);
 
-    if (value.isnull())
-        msg = wvtcl_escape(fullkey);
-    else
-        msg = spacecat(wvtcl_escape(fullkey),
-		       wvtcl_escape(cfg[key].getme()));
-		       
-    writecmd(UniClientConn::EVENT_NOTICE, msg);
+// Returns true if some key under 'key' might match 'pattern'.
+static bool could_contain(const UniConfKey &key, const UniConfKey &pattern)
+{
+    for (int n = 0; n < key.numsegments(); n++)
+    {
+	if (n >= pattern.numsegments())
+	    return false;
+	UniConfKey seg(pattern.segment(n));
+	if (seg == UniConfKey::RECURSIVE_ANY)
+	    return true;
+	if (seg != UniConfKey::ANY && seg != key.segment(n))
+	    return false;
+    }
+    return true;
+}
+
+
+void UniConfDaemonConn::subcallback(Subscription *sub, const UniConf &cfg,
+				    const UniConfKey &key)
+{
+    UniConfKey fullkey(cfg.fullkey(root));
+    if (!key.isempty())
+	fullkey.append(key);
+    WvString value(root[fullkey].getme());
+
+    UniConfKeyList::Iter i(sub->patterns);
+    for (i.rewind(); i.next(); )
+    {
+	if (fullkey.matches(*i))
+	{
+	    notify(fullkey, value);
+	    return;
+	}
+
+	// a key going away takes its children with it, so if any of them
+	// could match, the client needs to hear about it too
+	if (value.isnull() && could_contain(fullkey, *i))
+	{
+	    notify(fullkey, value);
+	    return;
+	}
+    }
 }
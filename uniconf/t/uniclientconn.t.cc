@@ -0,0 +1,158 @@
+#include "wvtest.h"
+#include "uniclientconn.h"
+#include "wvfdstream.h"
+#include "wvstrutils.h"
+#include "wvtclstring.h"
+#include "wvtimeutils.h"
+
+#include <sys/socket.h>
+
+
+// Two UniClientConns talking to each other over a socketpair.
+class ConnPair
+{
+public:
+    UniClientConn *a, *b;
+
+    ConnPair()
+    {
+	int fds[2];
+	WVPASS(!socketpair(AF_UNIX, SOCK_STREAM, 0, fds));
+	a = new UniClientConn(new WvFdStream(fds[0]), "a");
+	b = new UniClientConn(new WvFdStream(fds[1]), "b");
+    }
+
+    ~ConnPair()
+    {
+	WVRELEASE(a);
+	WVRELEASE(b);
+    }
+};
+
+
+static UniClientConn::Command wait_cmd(UniClientConn *to,
+				       UniClientConn *from)
+{
+    UniClientConn::Command cmd;
+    while ((cmd = to->readcmd()) == UniClientConn::NONE && to->isok())
+    {
+	from->flush(0);
+	to->select(100);
+    }
+    return cmd;
+}
+
+
+WVTEST_MAIN("binary encoding")
+{
+    ConnPair p;
+    WVFAIL(p.a->isbinary());
+    p.a->use_binary();
+    WVPASS(p.a->isbinary());
+
+    // nasty stuff that the tcl encoding would have to escape
+    WvString nasty("x {y} \n z\\ \"q\"");
+    p.a->writecmd(UniClientConn::REQ_SET, "a/b c/{d}", nasty);
+
+    WVPASSEQ(wait_cmd(p.b, p.a), UniClientConn::REQ_SET);
+    WVPASS(p.b->isbinary()); // it agreed when it saw our "binary"
+    UniConfKey key;
+    WVPASS(p.b->readkey(key));
+    WVPASSEQ(key.numsegments(), 3);
+    WVPASSEQ(key.printable(), "a/b c/{d}");
+    WVPASSEQ(p.b->readarg(), nasty);
+    WVPASS(p.b->readarg().isnull());
+
+    // and the other way
+    p.b->writecmd(UniClientConn::EVENT_NOTICE, "foo", WvString::null);
+    WVPASSEQ(wait_cmd(p.a, p.b), UniClientConn::EVENT_NOTICE);
+    WVPASS(p.a->readkey(key));
+    WVPASSEQ(key.printable(), "foo");
+    WVFAIL(p.a->readkey(key));
+
+    // key lists, and plain old payloads
+    UniConfKeyList keys;
+    keys.append(new UniConfKey("one"), true);
+    keys.append(new UniConfKey("two/three"), true);
+    keys.append(new UniConfKey("with space"), true);
+    p.a->writecmd(UniClientConn::REQ_MGET, keys);
+    p.a->writecmd(UniClientConn::REQ_SUBTREE,
+		  spacecat(wvtcl_escape("x y"), "1", ' '));
+    p.a->writecmd(UniClientConn::REQ_QUIT);
+
+    WVPASSEQ(wait_cmd(p.b, p.a), UniClientConn::REQ_MGET);
+    UniConfKeyList::Iter i(keys);
+    int n = 0;
+    for (i.rewind(); i.next() && p.b->readkey(key); n++)
+	WVPASSEQ(key.printable(), i->printable());
+    WVPASSEQ(n, 3);
+    WVFAIL(p.b->readkey(key));
+
+    WVPASSEQ(wait_cmd(p.b, p.a), UniClientConn::REQ_SUBTREE);
+    WVPASSEQ(p.b->readarg(), "x y");
+    WVPASSEQ(p.b->readarg(), "1");
+    WVPASSEQ(wait_cmd(p.b, p.a), UniClientConn::REQ_QUIT);
+}
+
+
+WVTEST_MAIN("binary frame too big")
+{
+    ConnPair p;
+    p.a->use_binary();
+    p.a->writecmd(UniClientConn::REQ_QUIT);
+    WVPASSEQ(wait_cmd(p.b, p.a), UniClientConn::REQ_QUIT);
+
+    // a length with the high bit set; we shouldn't even try reading it
+    p.a->write("\xff\xff\xff\xff", 4);
+    WVPASSEQ(wait_cmd(p.b, p.a), UniClientConn::NONE);
+    WVFAIL(p.b->isok());
+    printf("Error string is '%s'\n", p.b->errstr().cstr());
+}
+
+
+// Not really a test: how many messages per second can we push through
+// with each encoding?
+static long time_msgs(bool binary, int num)
+{
+    ConnPair p;
+    if (binary)
+	p.a->use_binary();
+
+    WvString value("value with spaces and {braces}");
+    WvTime start = wvtime();
+    int got = 0, right = 0;
+    for (int j = 0; j < num; j++)
+    {
+	p.a->writecmd(UniClientConn::PART_VALUE,
+		      WvString("cfg/section %s/key", j), value);
+	while (p.b->readcmd() == UniClientConn::PART_VALUE)
+	{
+	    UniConfKey key;
+	    p.b->readkey(key);
+	    if (p.b->readarg() == value)
+		right++;
+	    got++;
+	}
+    }
+    while (got < num && wait_cmd(p.b, p.a) == UniClientConn::PART_VALUE)
+    {
+	UniConfKey key;
+	p.b->readkey(key);
+	if (p.b->readarg() == value)
+	    right++;
+	got++;
+    }
+    time_t msec = msecdiff(wvtime(), start);
+    WVPASSEQ(right, num);
+
+    return msec ? (long)num * 1000 / msec : 0;
+}
+
+WVTEST_MAIN("text vs. binary speed")
+{
+    const int num = 50000;
+    long text = time_msgs(false, num);
+    long binary = time_msgs(true, num);
+    printf("%d messages: text %ld/sec, binary %ld/sec\n", num, text, binary);
+    fflush(stdout);
+}
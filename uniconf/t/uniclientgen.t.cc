@@ -329,3 +329,200 @@ WVTEST_MAIN("timeout")
 
     kill(daemon.get_pid(), SIGCONT);
 }
+
+
+static WvStringList noticed;
+static void notice_callback(const UniConf &, const UniConfKey &key)
+{
+    noticed.append(key);
+}
+
+WVTEST_MAIN("subscriptions")
+{
+    signal(SIGPIPE, SIG_IGN);
+
+    WvString sockname = wvtmpfilename("uniclientgen.t-sock");
+    unlink(sockname);
+
+    UniConfTestDaemon daemon(sockname, "temp:");
+
+    UniConfRoot watcher, writer;
+    UniClientGen *watcher_gen = create_client_conn("watcher", sockname);
+    watcher.mountgen(watcher_gen);
+    writer.mountgen(create_client_conn("writer", sockname));
+    watcher.add_callback(&noticed, "", notice_callback, true);
+
+    // nothing subscribed yet: we hear about everything
+    watcher.getme(); // wait for HELLO
+    writer["a/x"].setme("1");
+    writer["b/y"].setme("1");
+    writer.refresh();
+    watcher.refresh();
+    WVPASS(noticed.count() >= 2);
+
+    noticed.zap();
+    watcher_gen->subscribe("a/*");
+    watcher_gen->subscribe("c/*/z");
+    watcher.refresh(); // sub has no reply, so make sure it got there
+    writer["a/x"].setme("2");
+    writer["b/y"].setme("2");
+    writer["c/d/z"].setme("2");
+    writer["c/d/q"].setme("2");
+    writer.refresh();
+    watcher.refresh();
+    WVPASSEQ(noticed.join(" "), "a/x c/d/z");
+
+    // removing a key tells us about it if any of its children might have
+    // been interesting
+    noticed.zap();
+    writer["c"].remove();
+    writer["b"].remove();
+    writer.refresh();
+    watcher.refresh();
+    WVPASSEQ(noticed.join(" "), "c/d/z c/d c");
+
+    noticed.zap();
+    watcher_gen->unsubscribe("a/*");
+    watcher.refresh();
+    writer["a/x"].setme("3");
+    writer.refresh();
+    watcher.refresh();
+    WVPASS(noticed.isempty());
+
+    // auto-subscribe to what we read
+    noticed.zap();
+    watcher_gen->set_auto_subscribe(true);
+    WVPASSEQ(watcher["b/y"].getme(), WvString::null);
+    writer["b/y"].setme("4");
+    writer["b/z"].setme("4");
+    writer["a/x"].setme("4");
+    writer.refresh();
+    watcher.refresh();
+    WVPASSEQ(noticed.join(" "), "b/y");
+
+    watcher.del_callback(&noticed, "", true);
+}
+
+
+WVTEST_MAIN("getv and prefetch")
+{
+    signal(SIGPIPE, SIG_IGN);
+
+    WvString sockname = wvtmpfilename("uniclientgen.t-sock");
+    unlink(sockname);
+
+    UniConfTestDaemon daemon(sockname, "temp:");
+
+    UniConfRoot reader, writer;
+    UniClientGen *reader_gen = create_client_conn("reader", sockname);
+    reader.mountgen(reader_gen);
+    writer.mountgen(create_client_conn("writer", sockname));
+
+    const int num = 1000;
+    writer["tree"].setme("top");
+    for (int i = 0; i < num; i++)
+	writer["tree"].xset(i, i);
+    writer.refresh();
+
+    reader.getme(); // wait for HELLO, so we know about mget
+    WvTime start = wvtime();
+    for (int j = 0; j < num; j++)
+	reader[WvString("tree/%s", j)].getme();
+    time_t get_msec = msecdiff(wvtime(), start);
+
+    // ask for all of them (and some that don't exist) at once
+    UniConfKeyList keys;
+    for (int i = 0; i < num + 10; i++)
+	keys.append(new UniConfKey(WvString("tree/%s", i)), true);
+    UniConfPairList got;
+    start = wvtime();
+    reader_gen->getv(keys, got);
+    time_t getv_msec = msecdiff(wvtime(), start);
+    WVPASSEQ(got.count(), num + 10);
+    int right = 0, missing = 0;
+    UniConfPairList::Iter i(got);
+    for (i.rewind(); i.next(); )
+    {
+	if (i->value().isnull())
+	    missing++;
+	else if (i->value() == i->key().last().printable())
+	    right++;
+    }
+    WVPASSEQ(right, num);
+    WVPASSEQ(missing, 10);
+
+    printf("%d keys: getv %ld ms, one get at a time %ld ms\n",
+	   num, (long)getv_msec, (long)get_msec);
+    fflush(stdout);
+
+    // once a prefetch has come back, we don't need the server at all
+    reader.refresh();
+    reader["tree"].prefetch(true);
+    WVPASSEQ(reader["tree"].getme(), "top");
+    WVPASSEQ(reader["tree/5"].getme(), "5");
+    reader_gen->set_timeout(1000);
+    kill(daemon.get_pid(), SIGSTOP);
+    WVPASSEQ(reader["tree/6"].getme(), "6");
+    WVPASSEQ(reader["tree/999"].getme(), "999");
+    WVPASS(reader_gen->isok());
+    kill(daemon.get_pid(), SIGCONT);
+
+    // and notifications keep what we prefetched up to date
+    writer["tree/6"].setme("six");
+    writer.refresh();
+    reader_gen->flush_buffers();
+    WVPASSEQ(reader["tree/6"].getme(), "six");
+
+    // deleting some other key doesn't cost us what we prefetched...
+    writer["other"].setme("x");
+    writer.refresh();
+    writer["other"].remove();
+    writer.refresh();
+    reader_gen->flush_buffers();
+    kill(daemon.get_pid(), SIGSTOP);
+    WVPASSEQ(reader["tree/7"].getme(), "7");
+    WVPASS(reader_gen->isok());
+    kill(daemon.get_pid(), SIGCONT);
+
+    // ...but deleting a parent takes its children with it
+    writer["tree"].remove();
+    writer.refresh();
+    reader_gen->flush_buffers();
+    WVPASS(reader["tree/7"].getme().isnull());
+    WVPASS(reader["tree"].getme().isnull());
+}
+
+
+WVTEST_MAIN("binary protocol")
+{
+    signal(SIGPIPE, SIG_IGN);
+
+    WvString sockname = wvtmpfilename("uniclientgen.t-sock");
+    unlink(sockname);
+
+    UniConfTestDaemon daemon(sockname, "temp:");
+
+    UniConfRoot reader, writer;
+    reader.mountgen(create_client_conn("reader", sockname));
+    writer.mountgen(create_client_conn("writer", sockname));
+
+    // both ends speak version 23, so these all go across in binary
+    WvString nasty("x {y} \n z\\ \"q\"");
+    writer["a b/{c}"].setme(nasty);
+    writer["a b/empty"].setme("");
+    writer.refresh();
+    WVPASSEQ(reader["a b/{c}"].getme(), nasty);
+    WVPASSEQ(reader["a b/empty"].getme(), "");
+    WVPASS(reader["a b/nothing"].getme().isnull());
+    WVPASS(reader["a b"].haschildren());
+
+    int count = 0;
+    UniConf::RecursiveIter i(reader["a b"]);
+    for (i.rewind(); i.next(); )
+    {
+	if (i->fullkey(reader["a b"]).printable() == "{c}")
+	    WVPASSEQ(i->getme(), nasty);
+	count++;
+    }
+    WVPASSEQ(count, 2);
+}
@@ -199,12 +199,12 @@ WVTEST_MAIN("daemon multimount")
 				   UNICONF_PROTOCOL_VERSION));
     expected_responses.add(&hello_response, false);
     WvStringList expected_quit_response;
+    expected_quit_response.append("VAL pickles foo");
+    expected_quit_response.append("VAL subt {}");
+    expected_quit_response.append("VAL subt/mayo baz");
     expected_quit_response.append("VAL subtree {}");
     expected_quit_response.append("VAL subtree/fries bar1");
     expected_quit_response.append("VAL subtree/ketchup bar2");
-    expected_quit_response.append("VAL subt {}");
-    expected_quit_response.append("VAL subt/mayo baz");
-    expected_quit_response.append("VAL pickles foo");
     expected_quit_response.append("OK ");
     expected_responses.add(&expected_quit_response, false);
 
@@ -139,6 +139,17 @@ WVTEST_MAIN("members")
     WVPASS(!key.suborsame("foo/baz"));
     WVPASS(!key.suborsame("green"));
     WVPASSEQ(key.subkey("foo/bar/baz").printable(), "baz");
+
+    // appendseg() doesn't look for slashes, so only give it one segment
+    UniConfKey copy(key);
+    key.appendseg("with space");
+    WVPASSEQ(key.printable(), "foo/bar/with space");
+    WVPASSEQ(key.segmentstr(2), "with space");
+    WVPASSEQ(copy.printable(), "foo/bar");
+    key = UniConfKey("foo/");
+    key.appendseg("x");
+    WVPASSEQ(key.printable(), "foo/x");
+    WVPASS(!key.hastrailingslash());
 }
 WVTEST_MAIN("range")
 {
@@ -159,3 +170,20 @@ WVTEST_MAIN("range")
     WVPASSEQ(UniConfKey("fred/barney/betty").range(1,3).printable(), "barney/betty");
     WVPASSEQ(UniConfKey("fred/barney/betty").range(2,3).printable(), "betty");
 }
+WVTEST_MAIN("matches")
+{
+    UniConfKey key("foo/bar/baz");
+    WVPASS(key.matches("foo/bar/baz"));
+    WVPASS(key.matches("foo/bar/*"));
+    WVPASS(key.matches("foo/*/baz"));
+    WVPASS(key.matches("*/*/*"));
+    WVPASS(key.matches("foo/..."));
+    WVPASS(key.matches(".../baz"));
+    WVPASS(key.matches("foo/.../baz"));
+    WVPASS(key.matches("FOO/Bar/*"));
+    WVFAIL(key.matches("foo/*"));
+    WVFAIL(key.matches("foo/*/bar"));
+    WVFAIL(key.matches("foo/bar/baz/*"));
+    WVFAIL(key.matches("bar/..."));
+    WVFAIL(UniConfKey("foo").matches("foo/bar"));
+}
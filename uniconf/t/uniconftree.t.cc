@@ -47,3 +47,176 @@ WVTEST_MAIN("recursive compare")
     
     WVPASS(a.compare(&b, keyvalcomp));
 }
+
+
+static int count_children(UniConfValueTree &t)
+{
+    int n = 0;
+    UniConfValueTree::Iter i(t);
+    for (i.rewind(); i.next(); )
+	n++;
+    return n;
+}
+
+
+WVTEST_MAIN("small and big nodes")
+{
+    // a few children stay in a sorted array; lots of them get hashed
+    for (int num = 5; num <= 500; num *= 10)
+    {
+	UniConfValueTree t(NULL, "/", "root");
+	for (int i = num - 1; i >= 0; i--)
+	    new UniConfValueTree(&t, WvString("Child%s", i), i);
+	WVPASSEQ(t.numchildren(), (size_t)num);
+	WVPASSEQ(count_children(t), num);
+
+	WVPASS(t.findchild("child3") && t.findchild("child3")->value() == "3");
+	WVPASS(t.find("CHILD4") && t.find("CHILD4")->key().printable()
+	       == "Child4");
+	WVFAIL(t.findchild("child-1"));
+
+	UniConfValueTree *c = new UniConfValueTree(t.findchild("child2"),
+						   "grandchild", "x");
+	WVPASSEQ(c->fullkey().printable(), "Child2/grandchild");
+	WVPASSEQ(c->fullkey(t.findchild("child2")).printable(), "grandchild");
+	WVPASS(t.find("child2/GRANDCHILD") == c);
+
+	// deleting as we go along is fine, whether it's the current one
+	// or one we haven't got to yet
+	bool *seen = new bool[num];
+	for (int j = 0; j < num; j++)
+	    seen[j] = false;
+	bool twice = false;
+	UniConfValueTree::Iter i(t);
+	for (i.rewind(); i.next(); )
+	{
+	    int n = i->value().num();
+	    if (seen[n])
+		twice = true;
+	    seen[n] = true;
+	    if (n % 2)
+		delete i.ptr();
+	    else
+		t.remove(WvString("child%s", n + 1));
+	}
+	WVFAIL(twice);
+	WVPASS(seen[0] && seen[num - 1 - (num - 1) % 2]);
+	WVPASSEQ(count_children(t), (num + 1) / 2);
+	deletev seen;
+
+	t.zap();
+	WVFAIL(t.haschildren());
+	WVPASSEQ(count_children(t), 0);
+    }
+}
+
+
+static WvString list_children(UniConfValueTree &t)
+{
+    WvString s("");
+    UniConfValueTree::Iter i(t);
+    for (i.rewind(); i.next(); )
+	s = WvString("%s%s%s", s, !s ? "" : " ", i->key());
+    return s;
+}
+
+
+WVTEST_MAIN("numbered children stay in order")
+{
+    UniConfValueTree t(NULL, "/", WvString::null);
+    WvString want("");
+    for (int i = 0; i < 40; i++)
+    {
+	want = WvString("%s%s%s", want, i ? " " : "", i);
+	new UniConfValueTree(&t, WvString(i), WvString::null);
+	WVPASSEQ(list_children(t), want); // whether sorted array or hash
+    }
+
+    // names and numbers
+    UniConfValueTree u(NULL, "/", WvString::null);
+    const char *names[] = { "foo10", "Bar", "foo9", "foo", "007", "8",
+			    "foo09", NULL };
+    for (int i = 0; names[i]; i++)
+	new UniConfValueTree(&u, names[i], WvString::null);
+    WVPASSEQ(list_children(u), "007 8 Bar foo foo09 foo9 foo10");
+
+    // adding children partway through, so that the node gets hashed,
+    // still gets us each of the old ones exactly once, in order
+    UniConfValueTree v(NULL, "/", WvString::null);
+    for (int i = 0; i < 16; i += 2)
+	new UniConfValueTree(&v, WvString(i), WvString::null);
+    WvString got("");
+    UniConfValueTree::Iter i(v);
+    for (i.rewind(); i.next(); )
+    {
+	got = WvString("%s%s%s", got, !got ? "" : " ", i->key());
+	if (i->key() == "6")
+	{
+	    for (int j = 1; j < 32; j += 2)
+		new UniConfValueTree(&v, WvString(j), WvString::null);
+	    delete v.findchild("8");
+	}
+    }
+    WVPASSEQ(v.numchildren(), 23);
+    WVPASSEQ(got, "0 2 4 6 7 9 10 11 12 13 14 15 17 19 21 23 25 27 29 31");
+}
+
+
+WVTEST_MAIN("interned segments")
+{
+    size_t before, bytes;
+    UniHashTreeBase::internstats(before, bytes);
+
+    {
+	UniConfValueTree t(NULL, "/", WvString::null);
+	for (int i = 0; i < 100; i++)
+	{
+	    UniConfValueTree *dev = new UniConfValueTree(&t,
+				 WvString("device%s", i), WvString::null);
+	    new UniConfValueTree(dev, "name", "something");
+	    new UniConfValueTree(dev, "address", "something else");
+	}
+
+	// "name" and "address" are only stored once
+	size_t segs;
+	UniHashTreeBase::internstats(segs, bytes);
+	WVPASSEQ(segs, before + 1 + 100 + 2);
+	WVPASS(bytes > 0);
+	WVPASS(t.memusage() > 301 * sizeof(UniConfValueTree));
+    }
+
+    // and they go away when nobody's using them any more
+    size_t after;
+    UniHashTreeBase::internstats(after, bytes);
+    WVPASSEQ(after, before);
+}
+
+
+// Not really a test: how much does a big tree cost?
+WVTEST_MAIN("big tree memory usage")
+{
+    const int hosts = 20000;
+    UniConfValueTree t(NULL, "/", WvString::null);
+    for (int i = 0; i < hosts; i++)
+    {
+	UniConfValueTree *h = new UniConfValueTree(&t, WvString("host%s", i),
+						   WvString::null);
+	new UniConfValueTree(h, "name", WvString("host%s.example.com", i));
+	new UniConfValueTree(h, "enabled", "1");
+	new UniConfValueTree(h, "port", i);
+	UniConfValueTree *tags = new UniConfValueTree(h, "tags",
+						      WvString::null);
+	for (int j = 0; j < 5; j++)
+	    new UniConfValueTree(tags, j, "tag");
+    }
+
+    size_t segs, segbytes;
+    UniHashTreeBase::internstats(segs, segbytes);
+    size_t nodes = hosts * 10 + 1;
+    size_t total = t.memusage() + segbytes;
+    printf("%ld nodes: %ld bytes in the tree, %ld in %ld segments "
+	   "(%ld bytes/node)\n", (long)nodes, (long)t.memusage(),
+	   (long)segbytes, (long)segs, (long)(total / nodes));
+    fflush(stdout);
+    WVPASS(total / nodes < 200);
+}
@@ -1,4 +1,6 @@
 #include "uniinigen.h"
+#include "strutils.h"
+#include "unitempgen.h"
 #include "wvfile.h"
 #include "wvfileutils.h"
 #include "uniconfroot.h"
@@ -8,6 +10,9 @@
 #include "uniwatch.h"
 #include "wvsystem.h"
 #include "wvtest.h"
+#include "wvtclstring.h"
+#include "wvtimeutils.h"
+#include "wvstringmask.h"
 #include "uniconfgen-sanitytest.h"
 
 #ifdef _WIN32
@@ -329,3 +334,304 @@ WVTEST_MAIN("do not refresh if not requested")
     ::unlink(ininame);
 }
 
+
+
+static WvString file_contents(WvStringParm fname)
+{
+    WvFile f(fname, O_RDONLY);
+    WvDynBuf buf;
+    while (f.isok())
+	f.read(buf, 128*1024);
+    return buf.getstr();
+}
+
+
+WVTEST_MAIN("incremental commit")
+{
+    WvString ininame = inigen("/ = root\n"
+			      "top = 1\n"
+			      "\n[a]\n"
+			      "# a comment that save() would throw away\n"
+			      "x = 1\n"
+			      "y/z = 2\n"
+			      "\n[b]\n"
+			      "x = 3\n"
+			      "\n[c]\n"
+			      "# this one goes away\n"
+			      "x = 4");
+    {
+	UniConfRoot cfg(WvString("ini:%s", ininame));
+	WVPASSEQ(cfg["a/y/z"].getme(), "2");
+
+	// nothing in [a] changed, so it gets copied, comment and all
+	cfg["b/x"].setme("33");
+	cfg["c"].remove();
+	cfg["d/x"].setme("5");
+	cfg["top"].setme("11");
+	cfg.commit();
+
+	WvString s = file_contents(ininame);
+	WVPASS(strstr(s, "a comment that save() would throw away"));
+	WVFAIL(strstr(s, "this one goes away"));
+
+	// twice in a row, without a refresh() in between
+	cfg["d/x"].setme("55");
+	cfg["a/new"].setme("6");
+	cfg.commit();
+	s = file_contents(ininame);
+	WVFAIL(strstr(s, "a comment that save() would throw away"));
+
+	// we don't need to read back what we just wrote
+	WVPASS(cfg.refresh());
+	WVPASSEQ(cfg["d/x"].getme(), "55");
+    }
+
+    // and everything's where it should be
+    UniConfRoot cfg(WvString("ini:%s", ininame));
+    WVPASSEQ(cfg.getme(), "root");
+    WVPASSEQ(cfg["top"].getme(), "11");
+    WVPASSEQ(cfg["a/x"].getme(), "1");
+    WVPASSEQ(cfg["a/y/z"].getme(), "2");
+    WVPASSEQ(cfg["a/new"].getme(), "6");
+    WVPASSEQ(cfg["b/x"].getme(), "33");
+    WVFAIL(cfg["c"].exists());
+    WVPASSEQ(cfg["d/x"].getme(), "55");
+    WVPASSEQ(childcount(cfg), 4);
+
+    ::unlink(ininame);
+}
+
+
+WVTEST_MAIN("incremental commit with odd files")
+{
+    // sections that aren't one top-level key each, or that show up more
+    // than once, mean we can't tell what to copy; we just write the whole
+    // thing out like we used to.
+    WvString ininame = inigen("[a/b]\n"
+			      "x = 1\n"
+			      "[b]\n"
+			      "x = 2\n"
+			      "[a]\n"
+			      "b/y = 3\n"
+			      "[b]\n"
+			      "y = 4\n"
+			      "[]\n"
+			      "b/z = 5\n");
+    {
+	UniConfRoot cfg(WvString("ini:%s", ininame));
+	cfg["c"].setme("6");
+	cfg.commit();
+
+	// somebody else changes it behind our back
+	WvFile f(ininame, O_WRONLY|O_APPEND);
+	f.print("\n[b]\nx = 22\n");
+	f.close();
+	WVPASS(cfg.refresh());
+	WVPASSEQ(cfg["b/x"].getme(), "22");
+	cfg["a/b/x"].setme("11");
+	cfg.commit();
+    }
+
+    UniConfRoot cfg(WvString("ini:%s", ininame));
+    WVPASSEQ(cfg["a/b/x"].getme(), "11");
+    WVPASSEQ(cfg["a/b/y"].getme(), "3");
+    WVPASSEQ(cfg["b/x"].getme(), "22");
+    WVPASSEQ(cfg["b/y"].getme(), "4");
+    WVPASSEQ(cfg["b/z"].getme(), "5");
+    WVPASSEQ(cfg["c"].getme(), "6");
+
+    ::unlink(ininame);
+}
+
+
+// Not really a test: how long does changing one key in a big file take?
+WVTEST_MAIN("big file commit speed")
+{
+    const int nsect = 2000, nkeys = 50;
+    WvString ininame = inigen("");
+    UniConfRoot cfg(WvString("ini:%s", ininame));
+    for (int i = 0; i < nsect; i++)
+	for (int j = 0; j < nkeys; j++)
+	    cfg[WvString("section %s/key %s", i, j)].setme("some value");
+
+    WvTime start = wvtime();
+    cfg.commit();
+    time_t full_msec = msecdiff(wvtime(), start);
+
+    start = wvtime();
+    cfg["section 1000/key 0"].setme("another value");
+    cfg.commit();
+    cfg.refresh();
+    time_t one_msec = msecdiff(wvtime(), start);
+
+    UniConfRoot cfg2(WvString("ini:%s", ininame));
+    WVPASSEQ(cfg2["section 1000/key 0"].getme(), "another value");
+    WVPASSEQ(cfg2["section 1999/key 49"].getme(), "some value");
+
+    printf("%d keys (%ld bytes): %ld ms to write it all, "
+	   "%ld ms to change one\n", nsect * nkeys, (long)size_of(ininame),
+	   (long)full_msec, (long)one_msec);
+    fflush(stdout);
+    ::unlink(ininame);
+}
+
+
+// The way UniIniGen::refresh() used to read files: a line at a time,
+// one wvtcl_getword() after another.
+static void old_parse(WvStringParm fname, UniTempGen *gen)
+{
+    WvFile file(fname, O_RDONLY);
+    UniConfKey section;
+    WvDynBuf buf;
+    while (buf.used() || file.isok())
+    {
+	if (file.isok())
+	{
+	    char *line = file.blocking_getline(-1);
+	    if (line)
+	    {
+		buf.putstr(line);
+		buf.put('\n');
+	    }
+	}
+
+	WvString word;
+	while (!(word = wvtcl_getword(buf, WVTCL_NASTY_NEWLINES,
+				      false)).isnull())
+	{
+	    char *str = trim_string(word.edit());
+	    int len = strlen(str);
+	    if (len == 0 || str[0] == '#')
+		continue;
+	    if (str[0] == '[' && str[len - 1] == ']')
+	    {
+		str[len - 1] = '\0';
+		section = UniConfKey(wvtcl_unescape(trim_string(str + 1)));
+		continue;
+	    }
+
+	    WvConstStringBuffer line(word);
+	    static const WvStringMask nasty_equals("=");
+	    WvString name = wvtcl_getword(line, nasty_equals, false);
+	    if (!name.isnull() && line.used())
+	    {
+		name = wvtcl_unescape(trim_string(name.edit()));
+		if (!!name)
+		{
+		    UniConfKey key(name);
+		    key.prepend(section);
+		    WvString value = line.getstr();
+		    value = wvtcl_unescape(trim_string(value.edit() + 1));
+		    gen->set(key, value);
+		}
+	    }
+	}
+
+	if (buf.used() && !file.isok())
+	    buf.getstr(buf.strchr('\n'));
+    }
+}
+
+
+static WvString dump(UniConf cfg)
+{
+    WvStringList l;
+    UniConf::SortedRecursiveIter i(cfg);
+    for (i.rewind(); i.next(); )
+	l.append(WvString("%s=%s", i->fullkey(cfg), i->getme()));
+    return l.join("\n");
+}
+
+
+WVTEST_MAIN("parser matches the old one")
+{
+    WvString ininame = inigen("/ = root\r\n"
+			      "top = {braced value}\n"
+			      "  spaced key  =  spaced value  \n"
+			      "==leading = equals\n"
+			      "\n[a]\n"
+			      "# comment = not a key\n"
+			      "x = 1\n"
+			      "y/z = \"quoted \\\"value\\\"\"\n"
+			      "multi = {line one\n"
+			      "[not a section]\n"
+			      "line three}\n"
+			      "cont = first \\\n  second\n"
+			      "trailing/ = ignored\n"
+			      "no equals sign\n"
+			      "= no key\n"
+			      "{x = y} = 2\n"
+			      "\n[{b c}]\n"
+			      "\"q\" = quoted key\n"
+			      "empty =\n"
+			      "\n[ d/e ]\r\n"
+			      "f = g\r\n"
+			      "\n[]\n"
+			      "back = at the top\n"
+			      "\n[x/]\n"
+			      "/ = x's value\n"
+			      "broken = {never closed\n"
+			      "after = broken\n");
+
+    UniConfRoot cfg(WvString("ini:%s", ininame));
+    UniTempGen *gen = new UniTempGen();
+    old_parse(ininame, gen);
+    UniConfRoot ref;
+    ref.mountgen(gen);
+
+    WVPASSEQ(dump(cfg), dump(ref));
+    WVPASSEQ(cfg["a/multi"].getme(), "line one\n[not a section]\nline three");
+    WVPASSEQ(cfg["d/e/f"].getme(), "g");
+    WVPASSEQ(cfg["x"].getme(), "x's value");
+
+    ::unlink(ininame);
+}
+
+
+// Not really a test: how long does it take to read a big file in?
+WVTEST_MAIN("big file parse speed")
+{
+    const int nsect = 2000, nkeys = 50;
+    WvString ininame = inigen("");
+    {
+	WvFile f(ininame, O_WRONLY|O_TRUNC);
+	WvDynBuf buf;
+	for (int i = 0; i < nsect; i++)
+	{
+	    buf.putstr(WvString("\n[section %s]\n", i));
+	    for (int j = 0; j < nkeys; j++)
+	    {
+		if (j % 10 == 0)
+		    buf.putstr(WvString("key %s = {value with braces}\n", j));
+		else
+		    buf.putstr(WvString("key %s = some value %s\n", j, i));
+	    }
+	}
+	f.write(buf, buf.used());
+    }
+
+    WvTime start = wvtime();
+    UniTempGen *gen = new UniTempGen();
+    old_parse(ininame, gen);
+    time_t old_msec = msecdiff(wvtime(), start);
+
+    start = wvtime();
+    UniIniGen *ini = new UniIniGen(ininame);
+    ini->refresh();
+    time_t new_msec = msecdiff(wvtime(), start);
+
+    WVPASSEQ(ini->get("section 1999/key 49"), "some value 1999");
+    WVPASSEQ(ini->get("section 1999/key 40"), "value with braces");
+    WVPASSEQ(gen->get("section 1999/key 49"), "some value 1999");
+
+    // refresh() also has to compare the trees and send notifications,
+    // which the old parser here doesn't
+    printf("%d keys (%ld bytes): %ld ms for the old parser, "
+	   "%ld ms for all of refresh()\n",
+	   nsect * nkeys, (long)size_of(ininame),
+	   (long)old_msec, (long)new_msec);
+    fflush(stdout);
+    WVRELEASE(gen);
+    WVRELEASE(ini);
+    ::unlink(ininame);
+}
@@ -91,7 +91,7 @@ WVTEST_MAIN("Testing iterator")
     }
 
     WvString a[5] = {"foo/goose","foo/moose","foo/garoose","foo/setme!","foo/bloing"}, 
-        expected[5] = {"bloing", "setme!", "goose", "garoose", "moose"};
+        expected[5] = {"bloing", "garoose", "goose", "moose", "setme!"};
     int i;
     bool iterated_properly = true, iter_didnt_mangle = true;
         
@@ -115,10 +115,10 @@ WVTEST_MAIN("Testing iterator")
     WVPASS(iter_didnt_mangle);
 
     
-    WvString expected2[15] = {"bloing", "bloing/foo", "bloing/foo/bloing", "setme!", 
-        "setme!/foo", "setme!/foo/setme!", "goose", "goose/foo", "goose/foo/goose",
-        "garoose", "garoose/foo", "garoose/foo/garoose", "moose", "moose/foo",
-        "moose/foo/moose"};
+    WvString expected2[15] = {"bloing", "bloing/foo", "bloing/foo/bloing",
+        "garoose", "garoose/foo", "garoose/foo/garoose", "goose", "goose/foo",
+        "goose/foo/goose", "moose", "moose/foo", "moose/foo/moose", "setme!", 
+        "setme!/foo", "setme!/foo/setme!"};
     for (i = 0; i < 5; i++)
         uniconf.xsetint(WvString("%s/%s", a[i] , a[i]), 1);
     
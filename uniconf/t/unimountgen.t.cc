@@ -4,6 +4,7 @@
 #include "uniconf.h"
 #include "unitempgen.h"
 #include "uniconfgen-sanitytest.h"
+#include "wvtimeutils.h"
 
 WVTEST_MAIN("UniMountGen Sanity Test")
 {
@@ -61,14 +62,11 @@ WVTEST_MAIN("mounting multiple generators")
     t3->set("moo", "foo");
     WVPASSEQ(g.get("/moo"), "foo");
     
-    /* FIXME: t3 should *not* take precedence, innermost generators should be first
-     * since the generators should be sorted deepest first.
-     */
-#if 0
+    // t3 should *not* take precedence: innermost generators come first,
+    // no matter when they were mounted.
     WVPASSEQ(g.get("/foo/bum"), "boo");
     t3->set("/foo/bum", "fools");
     WVPASSEQ(g.get("/foo/bum"), "boo");
-#endif
 }
 
 WVTEST_MAIN("multiple generators - iterators")
@@ -211,3 +209,59 @@ WVTEST_MAIN("multiple generators - iterating with gaps")
     delete i;
 }
 
+
+
+WVTEST_MAIN("lots of mounts")
+{
+    const int num = 300;
+    UniMountGen g;
+    IUniConfGen *top = g.mount("/", "temp:", true);
+    IUniConfGen *gens[num];
+    for (int i = 0; i < num; i++)
+	gens[i] = g.mount(WvString("/tenant%s/dev/%s", i % 10, i), "temp:",
+			  true);
+    for (int i = 0; i < num; i++)
+	gens[i]->set("name", i);
+
+    UniConfKey mp;
+    WVPASS(g.whichmount("/tenant3/dev/13/name", &mp) == gens[13]);
+    WVPASSEQ(mp.printable(), "tenant3/dev/13");
+    WVPASS(g.whichmount("/TENANT3/Dev/13/", &mp) == gens[13]);
+    WVPASS(g.whichmount("/tenant3/dev/14/name", &mp) == top);
+    WVPASS(g.whichmount("/tenant3/dev", &mp) == top);
+    WVPASSEQ(mp.printable(), "");
+    WVPASS(g.ismountpoint("tenant3/dev/13"));
+    WVFAIL(g.ismountpoint("tenant3/dev"));
+
+    // the keys leading up to the mounts are there
+    WVPASS(g.haschildren("/tenant3/dev"));
+    WVPASS(g.exists("/tenant3/dev"));
+
+    int right = 0;
+    WvTime start = wvtime();
+    for (int j = 0; j < 100; j++)
+	for (int i = 0; i < num; i++)
+	    if (g.get(WvString("tenant%s/dev/%s/name", i % 10, i)).num() == i)
+		right++;
+    time_t msec = msecdiff(wvtime(), start);
+    WVPASSEQ(right, num * 100);
+    printf("%d gets with %d mounts: %ld ms\n", num * 100, num, (long)msec);
+    fflush(stdout);
+
+    // another mount at the same place hides the first one until it goes
+    IUniConfGen *over = g.mount("/tenant3/dev/13", "temp:", true);
+    over->set("name", "over");
+    WVPASSEQ(g.get("/tenant3/dev/13/name"), "over");
+    g.unmount(over, false);
+    WVPASSEQ(g.get("/tenant3/dev/13/name"), "13");
+
+    // unmounting cleans up after itself
+    g.unmount(gens[13], false);
+    WVFAIL(g.ismountpoint("tenant3/dev/13"));
+    WVPASS(g.whichmount("/tenant3/dev/13/name", NULL) == top);
+    for (int i = 0; i < num; i++)
+	if (i != 13)
+	    g.unmount(gens[i], false);
+    WVPASS(g.whichmount("/tenant3/dev/23/name", NULL) == top);
+    WVPASS(g.ismountpoint("/"));
+}
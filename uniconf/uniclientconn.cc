@@ -9,6 +9,13 @@
 #include "wvtclstring.h"
 #include "strutils.h"
 
+// how much to read at once, so we don't have to run through select() for
+// every little message during heavy data transfers
+#define READAHEAD 20480
+
+// nobody sends messages this big on purpose
+#define MAX_FRAME (64*1024*1024)
+
 /***** UniClientConn *****/
 
 /* This table is _very_ important!!!
@@ -49,6 +56,13 @@ const UniClientConn::CommandInfo UniClientConn::cmdinfos[
     // events
     { "HELLO", "HELLO <version> <message>: sent by server on connection" },
     { "NOTICE", "NOTICE <key> <oldval> <newval>: forget key and its children" },
+
+    // more requests
+    { "sub", "sub <pattern>: only send NOTICEs for keys matching the "
+      "subscribed patterns" },
+    { "unsub", "unsub <pattern>: cancel a sub" },
+    { "mget", "mget <key> <key>...: return the values of several keys" },
+    { "binary", "binary: switch to the binary encoding" },
 };
 
 
@@ -57,6 +71,7 @@ UniClientConn::UniClientConn(IWvStream *_s, WvStringParm dst) :
     log(WvString("UniConf to %s", dst.isnull() && _s->src() ? *_s->src() : WvString(dst)),
     WvLog::Debug5), closed(false), version(-1), payloadbuf("")
 {
+    binread = binwrite = false;
     log("Opened\n");
 }
 
@@ -87,7 +102,7 @@ WvString UniClientConn::readmsg()
     {
 	// use lots of readahead to prevent unnecessary runs through select()
 	// during heavy data transfers.
-        char *line = getline(0, '\n', 20480);
+        char *line = getline(0, '\n', READAHEAD);
         if (line)
         {
             msgbuf.putstr(line);
@@ -125,39 +140,314 @@ UniClientConn::Command UniClientConn::readcmd()
 
 UniClientConn::Command UniClientConn::readcmd(WvString &command)
 {
-    WvString msg(readmsg());
-    if (msg.isnull())
-	return NONE;
+    Command cmd = INVALID;
+
+    if (binread)
+    {
+	if (!readframe())
+	    return NONE;
+
+	int i = framebuf.used() ? framebuf.getch() : -1;
+	if (i >= 0 && i < NUM_COMMANDS)
+	{
+	    cmd = Command(i);
+	    command = cmdinfos[i].name;
+	}
+	else
+	    command = WvString("#%s", i);
+    }
+    else
+    {
+	WvString msg(readmsg());
+	if (msg.isnull())
+	    return NONE;
+
+	// extract command, leaving the remainder in payloadbuf
+	payloadbuf.reset(msg);
+	command = readarg();
+
+	if (command.isnull())
+	    return NONE;
+
+	for (int i = 0; i < NUM_COMMANDS; ++i)
+	    if (strcasecmp(cmdinfos[i].name, command.cstr()) == 0)
+		cmd = Command(i);
+    }
+
+    if (cmd == REQ_BINARY)
+    {
+	// everything after this is binary.  If we didn't ask for it, the
+	// other end did, so agree.
+	binread = true;
+	msgbuf.zap();
+	if (!binwrite)
+	    use_binary();
+	return readcmd(command);
+    }
+
+    return cmd;
+}
+
+
+static size_t getlen(const unsigned char *p)
+{
+    return ((uint32_t)p[0] << 24) | ((uint32_t)p[1] << 16)
+	| ((uint32_t)p[2] << 8) | p[3];
+}
+
+
+// The whole size of the frame whose header is at p, or 0 if the other end
+// is trying to get us to allocate something ridiculous.
+static size_t framelen(const unsigned char *p)
+{
+    size_t len = getlen(p);
+    return len > MAX_FRAME ? 0 : len + 4;
+}
+
+
+static void putlen(unsigned char *p, size_t len)
+{
+    p[0] = len >> 24;
+    p[1] = len >> 16;
+    p[2] = len >> 8;
+    p[3] = len;
+}
+
 
-    // extract command, leaving the remainder in payloadbuf
-    payloadbuf.reset(msg);
-    command = readarg();
+// A binary message is a four-byte length, then the command number, then
+// the arguments.  Each argument is either 's', a four-byte length and the
+// bytes of a string, or 'k', a two-byte segment count, and for each
+// segment, a two-byte length and its bytes.  Returns true if we've got a
+// whole message, and leaves it in framebuf.
+bool UniClientConn::readframe()
+{
+    size_t need = 4;
+    if (inbuf.used() >= 4)
+	need = framelen(inbuf.peek(0, 4));
+
+    if (need && inbuf.used() < need)
+    {
+	// like getline(0), only read if there's something there, in case
+	// we're on a blocking fd.
+	size_t want = need - inbuf.used();
+	queuemin(inbuf.used() + 1);
+	if (select(0, true, false))
+	    ureadv(inbuf, want > READAHEAD ? want : READAHEAD);
+	if (inbuf.used() >= 4)
+	    need = framelen(inbuf.peek(0, 4));
+    }
 
-    if (command.isnull())
-	return NONE;
+    if (!need)
+    {
+	seterr("Message too big (%s bytes)", getlen(inbuf.peek(0, 4)));
+	return false;
+    }
+    if (inbuf.used() < need)
+    {
+	// don't wake us up again until the rest of it gets here
+	queuemin(need);
+	return false;
+    }
 
-    for (int i = 0; i < NUM_COMMANDS; ++i)
-	if (strcasecmp(cmdinfos[i].name, command.cstr()) == 0)
-	    return Command(i);
-    return INVALID;
+    queuemin(0);
+    inbuf.skip(4);
+    framebuf.zap();
+    framebuf.merge(inbuf, need - 4);
+    return true;
 }
 
 
 WvString UniClientConn::readarg()
 {
-    return wvtcl_getword(payloadbuf);
+    if (!binread)
+	return wvtcl_getword(payloadbuf);
+    if (!framebuf.used())
+	return WvString::null;
+
+    switch (framebuf.getch())
+    {
+    case 's':
+	if (framebuf.used() >= 4)
+	{
+	    size_t len = getlen(framebuf.get(4));
+	    if (len <= framebuf.used())
+		return framebuf.getstr(len);
+	}
+	break;
+
+    case 'k':
+	{
+	    UniConfKey key;
+	    if (readkeysegs(key))
+		return key;
+	}
+	break;
+    }
+
+    framebuf.zap(); // end of the arguments, or garbage
+    return WvString::null;
+}
+
+
+bool UniClientConn::readkey(UniConfKey &key)
+{
+    if (!binread || !framebuf.used() || framebuf.peek() != 'k')
+    {
+	WvString s(readarg());
+	if (s.isnull())
+	    return false;
+	key = s;
+	return true;
+    }
+
+    framebuf.skip(1);
+    return readkeysegs(key);
+}
+
+
+// Reads the rest of a 'k' argument.
+bool UniClientConn::readkeysegs(UniConfKey &key)
+{
+    key = UniConfKey::EMPTY;
+    if (framebuf.used() < 2)
+	return false;
+    const unsigned char *p = framebuf.get(2);
+    int nsegs = (p[0] << 8) | p[1];
+
+    for (int i = 0; i < nsegs; i++)
+    {
+	if (framebuf.used() < 2)
+	    return false;
+	p = framebuf.get(2);
+	size_t len = (p[0] << 8) | p[1];
+	if (len > framebuf.used())
+	    return false;
+	key.appendseg(framebuf.getstr(len));
+    }
+    return true;
+}
+
+
+void UniClientConn::use_binary()
+{
+    if (binwrite)
+	return;
+    writecmd(REQ_BINARY);
+    binwrite = true;
+}
+
+
+static void putstrarg(WvBuf &buf, const char *s, size_t len)
+{
+    buf.putch('s');
+    putlen(buf.alloc(4), len);
+    buf.put(s, len);
+}
+
+
+static void putkeyarg(WvBuf &buf, const UniConfKey &key)
+{
+    int nsegs = key.numsegments();
+    bool fits = nsegs <= 0xffff;
+    for (int i = 0; fits && i < nsegs; i++)
+	fits = key.segmentstr(i).len() <= 0xffff;
+    if (!fits)
+    {
+	// too weird for a 'k'; a string works too, it's just slower
+	WvString s(key);
+	putstrarg(buf, s, s.len());
+	return;
+    }
+
+    buf.putch('k');
+    buf.putch(nsegs >> 8);
+    buf.putch(nsegs);
+    for (int i = 0; i < nsegs; i++)
+    {
+	const WvString &seg = key.segmentstr(i);
+	size_t len = seg.len();
+	buf.putch(len >> 8);
+	buf.putch(len);
+	buf.put(seg.cstr(), len);
+    }
+}
+
+
+// 'args' has five bytes at the front for the length and the command.
+void UniClientConn::writeframe(Command cmd, WvBuf &args)
+{
+    unsigned char *hdr = args.mutablepeek(0, 5);
+    putlen(hdr, args.used() - 4);
+    hdr[4] = cmd;
+    write(args, args.used());
 }
 
 
 void UniClientConn::writecmd(UniClientConn::Command cmd, WvStringParm msg)
 {
-    if (msg)
+    if (binwrite)
+    {
+	// somebody already escaped it, so all we can do is undo that
+	WvDynBuf args;
+	args.alloc(5);
+	if (!!msg)
+	{
+	    WvStringList words;
+	    wvtcl_decode(words, msg);
+	    WvStringList::Iter i(words);
+	    for (i.rewind(); i.next(); )
+		putstrarg(args, *i, i->len());
+	}
+	writeframe(cmd, args);
+    }
+    else if (msg)
         write(WvString("%s %s\n", cmdinfos[cmd].name, msg));
     else
         write(WvString("%s\n", cmdinfos[cmd].name));
 }
 
 
+void UniClientConn::writecmd(UniClientConn::Command cmd,
+			     const UniConfKey &key, WvStringParm value)
+{
+    if (binwrite)
+    {
+	WvDynBuf args;
+	args.alloc(5);
+	putkeyarg(args, key);
+	if (!value.isnull())
+	    putstrarg(args, value, value.len());
+	writeframe(cmd, args);
+    }
+    else if (value.isnull())
+	writecmd(cmd, wvtcl_escape(key));
+    else
+	writecmd(cmd, spacecat(wvtcl_escape(key), wvtcl_escape(value), ' '));
+}
+
+
+void UniClientConn::writecmd(UniClientConn::Command cmd,
+			     const UniConfKeyList &keys)
+{
+    UniConfKeyList::Iter i(keys);
+    if (binwrite)
+    {
+	WvDynBuf args;
+	args.alloc(5);
+	for (i.rewind(); i.next(); )
+	    putkeyarg(args, *i);
+	writeframe(cmd, args);
+    }
+    else
+    {
+	WvStringList l;
+	for (i.rewind(); i.next(); )
+	    l.append(*i);
+	writecmd(cmd, wvtcl_encode(l));
+    }
+}
+
+
 void UniClientConn::writeok(WvStringParm payload)
 {
     writecmd(REPLY_OK, payload);
@@ -172,16 +462,13 @@ void UniClientConn::writefail(WvStringParm payload)
 
 void UniClientConn::writevalue(const UniConfKey &key, WvStringParm value)
 {
-    if (value == WvString::null)
-        writecmd(PART_VALUE, wvtcl_escape(key));
-    else
-        writecmd(PART_VALUE, spacecat(wvtcl_escape(key), wvtcl_escape(value)));
+    writecmd(PART_VALUE, key, value);
 }
 
 
 void UniClientConn::writeonevalue(const UniConfKey &key, WvStringParm value)
 {
-    writecmd(REPLY_ONEVAL, spacecat(wvtcl_escape(key), wvtcl_escape(value)));
+    writecmd(REPLY_ONEVAL, key, value);
 }
 
 
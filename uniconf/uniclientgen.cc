@@ -103,15 +103,41 @@ static WvMoniker<IUniConfGen> wvstreamreg2("wv", wvstreamcreator);
 
 /***** UniClientGen *****/
 
+UniClientGen::Request::~Request()
+{
+    delete keys;
+    delete got;
+}
+
+
+// Returns true if this prefetch is going to tell us about key k.
+bool UniClientGen::Request::covers(const UniConfKey &k) const
+{
+    if (keys)
+    {
+	UniConfKeyList::Iter i(*keys);
+	for (i.rewind(); i.next(); )
+	    if (*i == k)
+		return true;
+	return false;
+    }
+    else if (subtree)
+	return key.suborsame(k) && key != k;
+    else
+	return key == k;
+}
+
+
 UniClientGen::UniClientGen(IWvStream *stream, WvStringParm dst) 
     : log(WvString("UniClientGen to %s",
 		   dst.isnull() && stream->src() 
 		   ? *stream->src() : WvString(dst))),
+      prefetched(100),
       timeout(60*1000),
       version(0)
 {
-    cmdinprogress = cmdsuccess = false;
-    result_list = NULL;
+    lastseq = doneseq = 0;
+    auto_subscribe = false;
 
     conn = new UniClientConn(stream, dst);
     conn->setcallback(wv::bind(&UniClientGen::conncallback, this));
@@ -125,6 +151,7 @@ UniClientGen::~UniClientGen()
 	conn->writecmd(UniClientConn::REQ_QUIT, "");
     WvIStreamList::globallist.unlink(conn);
     WVRELEASE(conn);
+    fail_pending();
 }
 
 
@@ -146,8 +173,11 @@ bool UniClientGen::isok()
 
 bool UniClientGen::refresh()
 {
-    conn->writecmd(UniClientConn::REQ_REFRESH);
-    return do_select();
+    prefetched.zap();
+
+    Request req;
+    send(&req, false, UniClientConn::REQ_REFRESH);
+    return do_select(req);
 }
 
 void UniClientGen::flush_buffers()
@@ -159,23 +189,160 @@ void UniClientGen::flush_buffers()
 
 void UniClientGen::commit()
 {
-    conn->writecmd(UniClientConn::REQ_COMMIT);
-    do_select();
+    Request req;
+    send(&req, false, UniClientConn::REQ_COMMIT);
+    do_select(req);
+}
+
+
+void UniClientGen::subscribe(const UniConfKey &pattern)
+{
+    UniConfKeyList::Iter i(subscriptions);
+    for (i.rewind(); i.next(); )
+	if (*i == pattern)
+	    return;
+    subscriptions.append(new UniConfKey(pattern), true);
+
+    // if we haven't heard HELLO yet, we'll send it then
+    if (version >= 21)
+	conn->writecmd(UniClientConn::REQ_SUBSCRIBE, pattern, WvString::null);
+}
+
+
+void UniClientGen::unsubscribe(const UniConfKey &pattern)
+{
+    UniConfKeyList::Iter i(subscriptions);
+    for (i.rewind(); i.next(); )
+    {
+	if (*i == pattern)
+	{
+	    i.xunlink();
+	    if (version >= 21)
+		conn->writecmd(UniClientConn::REQ_UNSUBSCRIBE, pattern,
+			       WvString::null);
+	    return;
+	}
+    }
+}
+
+
+// Subscribes to 'pattern' before we read it, if we're supposed to.  The
+// subscription goes out first so we can't miss a change that happens
+// after the server answers.
+void UniClientGen::autosubscribe(const UniConfKey &pattern)
+{
+    if (auto_subscribe)
+	subscribe_once(pattern);
+}
+
+
+// Subscribes to 'pattern' unless we're already subscribed to something
+// that covers it.
+void UniClientGen::subscribe_once(const UniConfKey &pattern)
+{
+    UniConfKeyList::Iter i(subscriptions);
+    for (i.rewind(); i.next(); )
+	if (pattern.matches(*i))
+	    return;
+    subscribe(pattern);
+}
+
+
+void UniClientGen::prefetch(const UniConfKeyList &keys)
+{
+    if (!isok() || keys.isempty())
+	return;
+
+    // if we're only hearing about some keys, we'd better hear about the
+    // ones we're keeping around
+    bool sub = auto_subscribe || !subscriptions.isempty();
+
+    UniConfKeyList::Iter i(keys);
+    if (version >= 22)
+    {
+	Request *req = new Request;
+	req->prefetch = true;
+	req->keys = new UniConfKeyList;
+	req->got = new UniConfKeyTable(10);
+
+	for (i.rewind(); i.next(); )
+	{
+	    if (sub)
+		subscribe_once(*i);
+	    req->keys->append(new UniConfKey(*i), true);
+	}
+	send(req, true, UniClientConn::REQ_MGET, *req->keys);
+    }
+    else
+    {
+	// the server doesn't know mget, but it still answers in order, so
+	// we can send all the gets without waiting
+	for (i.rewind(); i.next(); )
+	{
+	    if (sub)
+		subscribe_once(*i);
+	    Request *req = new Request(*i);
+	    req->prefetch = true;
+	    send(req, true, UniClientConn::REQ_GET, *i, WvString::null);
+	}
+    }
+}
+
+
+void UniClientGen::prefetch(const UniConfKey &key, bool recursive)
+{
+    UniConfKeyList keys;
+    keys.append(new UniConfKey(key), true);
+    prefetch(keys);
+
+    if (recursive && isok())
+    {
+	if (auto_subscribe || !subscriptions.isempty())
+	    subscribe_once(UniConfKey(key, UniConfKey::RECURSIVE_ANY));
+	Request *req = new Request(key);
+	req->prefetch = req->subtree = true;
+	send(req, true, UniClientConn::REQ_SUBTREE, key, WvString(true));
+    }
 }
 
+
+void UniClientGen::getv(const UniConfKeyList &keys, UniConfPairList &pairs)
+{
+    prefetch(keys);
+
+    // the first get() waits for the whole mget, and the rest are free
+    UniConfKeyList::Iter i(keys);
+    for (i.rewind(); i.next(); )
+	pairs.append(new UniConfPair(*i, get(*i)), true);
+}
+
+
 WvString UniClientGen::get(const UniConfKey &key)
 {
-    WvString value;
-    conn->writecmd(UniClientConn::REQ_GET, wvtcl_escape(key));
+    autosubscribe(key);
 
-    if (do_select())
+    UniConfPair *pair = prefetched[key];
+    if (!pair)
     {
-        if (result_key == key)
-            value = result;
-//        else
-//            seterror("Error: server sent wrong key pair.");
+	// maybe the answer is already on its way
+	unsigned long seq = 0;
+	RequestList::Iter i(pending);
+	for (i.rewind(); i.next(); )
+	    if (i->prefetch && i->covers(key))
+		seq = i->seq;
+	if (seq)
+	{
+	    do_select(seq);
+	    pair = prefetched[key];
+	}
     }
-    return value;
+    if (pair)
+	return pair->value();
+
+    Request req(key);
+    send(&req, false, UniClientConn::REQ_GET, key, WvString::null);
+    do_select(req);
+    return req.value;
 }
 
 
@@ -183,13 +350,12 @@ void UniClientGen::set(const UniConfKey &key, WvStringParm newvalue)
 {
     //set_queue.append(new WvString(key), true);
     hold_delta();
+    update(key, newvalue);
 
     if (newvalue.isnull())
-	conn->writecmd(UniClientConn::REQ_REMOVE, wvtcl_escape(key));
+	conn->writecmd(UniClientConn::REQ_REMOVE, key, WvString::null);
     else
-	conn->writecmd(UniClientConn::REQ_SET,
-		       spacecat(wvtcl_escape(key),
-				wvtcl_escape(newvalue), ' '));
+	conn->writecmd(UniClientConn::REQ_SET, key, newvalue);
 
     flush_buffers();
     unhold_delta();
@@ -207,9 +373,8 @@ void UniClientGen::setv(const UniConfPairList &pairs)
 	// until it sends a terminating SETV, which has no arguments.
 	for (i.rewind(); i.next(); )
 	{
-	    conn->writecmd(UniClientConn::REQ_SETV,
-			   spacecat(wvtcl_escape(i->key()),
-				    wvtcl_escape(i->value()), ' '));
+	    update(i->key(), i->value());
+	    conn->writecmd(UniClientConn::REQ_SETV, i->key(), i->value());
 	}
 	conn->writecmd(UniClientConn::REQ_SETV);
     }
@@ -227,36 +392,30 @@ void UniClientGen::setv(const UniConfPairList &pairs)
 
 bool UniClientGen::haschildren(const UniConfKey &key)
 {
-    conn->writecmd(UniClientConn::REQ_HASCHILDREN, wvtcl_escape(key));
+    autosubscribe(UniConfKey(key, UniConfKey::ANY));
 
-    if (do_select())
-    {
-        if (result_key == key && result == "TRUE")
-            return true;
-    }
-
-    return false;
+    Request req(key);
+    send(&req, false, UniClientConn::REQ_HASCHILDREN, key, WvString::null);
+    do_select(req);
+    return req.value == "TRUE";
 }
 
 
 UniClientGen::Iter *UniClientGen::do_iterator(const UniConfKey &key,
 					      bool recursive)
 {
-    assert(!result_list);
-    result_list = new UniListIter(this);
-    conn->writecmd(UniClientConn::REQ_SUBTREE,
-		   WvString("%s %s", wvtcl_escape(key), WvString(recursive)));
+    autosubscribe(UniConfKey(key, recursive
+			     ? UniConfKey::RECURSIVE_ANY : UniConfKey::ANY));
 
-    if (do_select())
-    {
-	ListIter *it = result_list;
-	result_list = NULL;
-	return it;
-    }
+    Request req(key);
+    req.list = new UniListIter(this);
+    send(&req, false, UniClientConn::REQ_SUBTREE, key, WvString(recursive));
+
+    if (do_select(req))
+	return req.list;
     else
     {
-	delete result_list;
-	result_list = NULL;
+	delete req.list;
 	return NULL;
     }
 }
@@ -274,10 +433,120 @@ UniClientGen::Iter *UniClientGen::recursiveiterator(const UniConfKey &key)
 }
 
 
+// Remembers a value we got from a prefetch.
+void UniClientGen::store(const UniConfKey &key, WvStringParm value)
+{
+    UniConfPair *pair = prefetched[key];
+    if (pair)
+	pair->setvalue(value);
+    else
+	prefetched.add(new UniConfPair(key, value), true);
+}
+
+
+// Keeps the prefetched values up to date when a key changes.
+void UniClientGen::update(const UniConfKey &key, WvStringParm value)
+{
+    if (prefetched.isempty())
+	return;
+
+    // a deleted key takes its children with it
+    if (value.isnull())
+    {
+	UniConfKeyList gone;
+	UniConfPairDict::Iter i(prefetched);
+	for (i.rewind(); i.next(); )
+	    if (key.suborsame(i->key()))
+		gone.append(new UniConfKey(i->key()), true);
+
+	UniConfKeyList::Iter g(gone);
+	for (g.rewind(); g.next(); )
+	    prefetched.remove(prefetched[*g]);
+    }
+    else
+    {
+	UniConfPair *pair = prefetched[key];
+	if (pair)
+	    pair->setvalue(value);
+    }
+}
+
+
+void UniClientGen::send(Request *req, bool autofree,
+			UniClientConn::Command cmd, WvStringParm msg)
+{
+    req->seq = ++lastseq;
+    pending.append(req, autofree);
+    conn->writecmd(cmd, msg);
+}
+
+
+void UniClientGen::send(Request *req, bool autofree,
+			UniClientConn::Command cmd,
+			const UniConfKey &key, WvStringParm value)
+{
+    req->seq = ++lastseq;
+    pending.append(req, autofree);
+    conn->writecmd(cmd, key, value);
+}
+
+
+void UniClientGen::send(Request *req, bool autofree,
+			UniClientConn::Command cmd,
+			const UniConfKeyList &keys)
+{
+    req->seq = ++lastseq;
+    pending.append(req, autofree);
+    conn->writecmd(cmd, keys);
+}
+
+
+// The first pending request got the last of its answer.
+void UniClientGen::finish(bool success)
+{
+    if (pending.isempty())
+	return; // nobody asked!
+
+    Request *req = pending.first();
+    req->success = success;
+
+    if (req->prefetch)
+    {
+	if (req->keys)
+	{
+	    // mget leaves out the keys that don't exist.  Anything it did
+	    // send might have been deleted since, so don't go by what's
+	    // still in 'prefetched'.
+	    UniConfKeyList::Iter i(*req->keys);
+	    for (i.rewind(); i.next(); )
+		if (!(*req->got)[*i])
+		    store(*i, WvString::null);
+	}
+	else if (!req->subtree)
+	    store(req->key, req->value);
+    }
+
+    doneseq = req->seq;
+    pending.unlink_first();
+}
+
+
+// We're never going to get answers to any of the pending requests.
+void UniClientGen::fail_pending()
+{
+    RequestList::Iter i(pending);
+    for (i.rewind(); i.next(); )
+	i->success = false;
+    pending.zap();
+    doneseq = lastseq;
+}
+
+
 void UniClientGen::conncallback()
 {
     UniClientConn::Command command = conn->readcmd();
     static const WvStringMask nasty_space(' ');
+    Request *req = pending.isempty() ? NULL : pending.first();
     switch (command)
     {
         case UniClientConn::NONE:
@@ -285,57 +554,49 @@ void UniClientGen::conncallback()
             break;
 
         case UniClientConn::REPLY_OK:
-            cmdsuccess = true;
-            cmdinprogress = false;
+            finish(true);
             break;
 
         case UniClientConn::REPLY_FAIL:
-            result_key = WvString::null;
-            cmdsuccess = false;
-            cmdinprogress = false;
+            finish(false);
             break;
 
         case UniClientConn::REPLY_CHILD:
-            {
-                WvString key(wvtcl_getword(conn->payloadbuf, nasty_space));
-                WvString value(wvtcl_getword(conn->payloadbuf, nasty_space));
-
-                if (!key.isnull() && !value.isnull())
-                {
-                    result_key = key;
-                    result = value;
-                    cmdsuccess = true;
-                }
-                cmdinprogress = false;
-                break;
-
-            }
-
         case UniClientConn::REPLY_ONEVAL:
             {
-                WvString key(wvtcl_getword(conn->payloadbuf, nasty_space));
-                WvString value(wvtcl_getword(conn->payloadbuf, nasty_space));
+                UniConfKey key;
+                bool haskey = conn->readkey(key);
+                WvString value(conn->readarg());
 
-                if (!key.isnull() && !value.isnull())
+                if (haskey && !value.isnull())
                 {
-                    result_key = key;
-                    result = value;
-                    cmdsuccess = true;
+                    if (req && req->key == key)
+                        req->value = value;
+                    finish(true);
                 }
-
-                cmdinprogress = false;
+                else
+                    finish(false);
                 break;
             }
 
         case UniClientConn::PART_VALUE:
             {
-                WvString key(wvtcl_getword(conn->payloadbuf, nasty_space));
-                WvString value(wvtcl_getword(conn->payloadbuf, nasty_space));
+                UniConfKey key;
+                bool haskey = conn->readkey(key);
+                WvString value(conn->readarg());
 
-                if (!key.isnull() && !value.isnull())
+                if (req && haskey && !value.isnull())
                 {
-                    if (result_list)
-			result_list->add(key, value);
+                    if (req->list)
+			req->list->add(key, value);
+                    else if (req->prefetch && req->subtree)
+                        store(UniConfKey(req->key, key), value);
+                    else if (req->prefetch)
+                    {
+                        if (req->got && !(*req->got)[key])
+                            req->got->add(new UniConfKey(key), true);
+                        store(key, value);
+                    }
                 }
                 break;
             }
@@ -352,23 +613,34 @@ void UniClientGen::conncallback()
 		    // wrong type of server!
 		    log(WvLog::Error, "Connected to a non-UniConf server!\n");
 
-		    cmdinprogress = false;
-		    cmdsuccess = false;
 		    conn->close();
+		    fail_pending();
 		}
 		else
 		{
 		    version = 0;
 		    sscanf(version_string, "%d", &version);
 		    log(WvLog::Debug3, "UniConf version %s.\n", version);
+
+		    if (version >= 21)
+		    {
+			UniConfKeyList::Iter i(subscriptions);
+			for (i.rewind(); i.next(); )
+			    conn->writecmd(UniClientConn::REQ_SUBSCRIBE, *i,
+					   WvString::null);
+		    }
+		    if (version >= 23)
+			conn->use_binary();
 		}
                 break;
             }
 
         case UniClientConn::EVENT_NOTICE:
             {
-                WvString key(wvtcl_getword(conn->payloadbuf, nasty_space));
-                WvString value(wvtcl_getword(conn->payloadbuf, nasty_space));
+                UniConfKey key;
+                conn->readkey(key);
+                WvString value(conn->readarg());
+                update(key, value);
                 delta(key, value);
             }   
 
@@ -379,20 +651,26 @@ void UniClientGen::conncallback()
 }
 
 
+bool UniClientGen::do_select(Request &req)
+{
+    do_select(req.seq);
+    return req.success;
+}
+
+
+// Waits until request number 'seq' (and so everything before it) has been
+// answered.
 // FIXME: horribly horribly evil!!
-bool UniClientGen::do_select()
+void UniClientGen::do_select(unsigned long seq)
 {
     wvstime_sync();
 
     hold_delta();
     
-    cmdinprogress = true;
-    cmdsuccess = false;
-
     time_t remaining = timeout;
     const time_t clock_error = 10*1000;
     WvTime timeout_at = msecadd(wvstime(), timeout);
-    while (conn->isok() && cmdinprogress)
+    while (conn->isok() && doneseq < seq)
     {
 	// We would really like to run the "real" wvstreams globallist
 	// select loop here, but we can't because we may already be inside
@@ -410,8 +688,6 @@ bool UniClientGen::do_select()
         else if (remaining <= 0 && remaining > -clock_error)
         {
             log(WvLog::Warning, "Command timeout; connection closed.\n");
-            cmdinprogress = false;
-            cmdsuccess = false;
             conn->close();
         }
 
@@ -428,10 +704,12 @@ bool UniClientGen::do_select()
         }
     }
 
+    // if the connection died, nobody's going to answer us
+    if (doneseq < seq)
+	fail_pending();
+
 //    if (!cmdsuccess)
 //        seterror("Error: server timed out on response.");
 
     unhold_delta();
-    
-    return cmdsuccess;
 }
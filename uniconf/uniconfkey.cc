@@ -22,11 +22,13 @@ unsigned WvHash(const UniConfKey &k)
             result = 0;
             break;
         case 1:
-            result = WvHash(k.store->segments[k.left]);
+            result = WvHashNoCase(k.store->segments[k.left]);
             break;
         default:
-            result = WvHash(k.store->segments[k.left])
-                ^ WvHash(k.store->segments[k.right - 1])
+            // keys compare case-insensitively, so they'd better hash that
+            // way too; the multiply keeps "a/b" and "b/a" apart
+            result = WvHashNoCase(k.store->segments[k.left]) * 31
+                ^ WvHashNoCase(k.store->segments[k.right - 1])
                 ^ numsegs;
             break;
     }
@@ -52,18 +54,35 @@ UniConfKey::Store::Store(int size, int _ref_count,
     if (!key)
         return;
 
-    WvStringList parts;
-    parts.split(key, "/");
-
-    segments.resize(parts.count());
-    WvStringList::Iter part(parts);
-    for (part.rewind(); part.next(); )
+    // Split it at the slashes ourselves; this gets called a lot, and a
+    // WvStringList is a lot of mallocs to throw away right after.
+    const char *s = key.cstr(), *p;
+    int n = 1;
+    for (p = s; *p; p++)
+        if (*p == '/')
+            n++;
+    segments.resize(n);
+
+    if (n == 1)
+        segments.append(key);
+    else
     {
-        if (!*part)
-            continue;
-        segments.append(*part);
+        for (p = s; *p; )
+        {
+            const char *slash = strchr(p, '/');
+            size_t len = slash ? slash - p : strlen(p);
+            if (len)
+            {
+                WvString seg;
+                seg.setsize(len + 1);
+                memcpy(seg.edit(), p, len);
+                seg.edit()[len] = '\0';
+                segments.append(seg);
+            }
+            p += slash ? len + 1 : len;
+        }
     }
-    if (!!key && key[key.len()-1] == '/' && segments.used() > 0)
+    if (p[-1] == '/' && segments.used() > 0)
         segments.append(Segment());
 }
 
@@ -149,6 +168,18 @@ void UniConfKey::append(const UniConfKey &_key)
 }
 
 
+void UniConfKey::appendseg(WvStringParm segment)
+{
+    unique();
+    if (hastrailingslash())
+        --right;
+    store->segments.resize(right + 1);
+    store->segments.replace(right, segment);
+    ++right;
+    collapse();
+}
+
+
 void UniConfKey::prepend(const UniConfKey &_key)
 {
     unique();
@@ -286,8 +317,10 @@ bool UniConfKey::matches(const UniConfKey &pattern) const
         return false;
     }
     
-    // no other wildcard arrangements currently supported
-    return false;
+    // an ordinary segment has to match exactly, and then so does the rest
+    if (isempty() || first() != head)
+        return false;
+    return removefirst().matches(pattern.removefirst());
 }
 
 
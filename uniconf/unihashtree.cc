@@ -1,20 +1,92 @@
 /*
  * Worldvisions Weaver Software:
  *   Copyright (C) 1997-2002 Net Integration Technologies, Inc.
- * 
+ *
  * UniConf low-level tree storage abstraction.
+ *
+ * Key segments are interned in one table of UniInternedSegs for the whole
+ * program, each with a count of the nodes using it, so a segment goes away
+ * as soon as its last node does.
  */
 #include "unihashtree.h"
 #include "assert.h"
+#include <ctype.h>
+#include <stdlib.h>
+#include <string.h>
 
 
-UniHashTreeBase::UniHashTreeBase(UniHashTreeBase *parent, 
+template <class T, class K>
+struct UniInternAccessor
+{
+    static const K *get_key(const T *obj)
+        { return &obj->str; }
+};
+
+typedef WvFlatHash<UniInternedSeg, WvFastString,
+		   UniInternAccessor<UniInternedSeg, WvFastString> >
+    UniInternTable;
+
+static UniInternTable *interned;
+
+
+static UniInternedSeg *intern(WvStringParm s)
+{
+    if (!interned)
+	interned = new UniInternTable(1024);
+
+    WvFastString str(!s ? WvFastString("") : s);
+    UniInternedSeg *seg = (*interned)[str];
+    if (!seg)
+    {
+	seg = new UniInternedSeg(str);
+	interned->add(seg, true);
+    }
+    seg->refs++;
+    return seg;
+}
+
+
+static void unintern(UniInternedSeg *seg)
+{
+    if (!--seg->refs)
+    {
+	interned->remove(seg);
+	if (interned->isempty())
+	{
+	    delete interned;
+	    interned = NULL;
+	}
+    }
+}
+
+
+void UniHashTreeBase::internstats(size_t &segments, size_t &bytes)
+{
+    segments = bytes = 0;
+    if (!interned)
+	return;
+
+    segments = interned->count();
+    bytes = sizeof(*interned) + interned->memusage();
+    UniInternTable::Iter i(*interned);
+    for (i.rewind(); i.next(); )
+    {
+	bytes += sizeof(UniInternedSeg);
+	if (i->str.len() >= WVSTRING_SMALL)
+	    bytes += sizeof(WvStringBuf) + i->str.len();
+    }
+}
+
+
+UniHashTreeBase::UniHashTreeBase(UniHashTreeBase *parent,
     const UniConfKey &key) :
-    xkey(key)
+    xseg(intern(key.numsegments() == 1 && !key.hastrailingslash()
+		? key.segmentstr(0) : key.printable()))
 {
     xparent = parent;
-    xchildren = NULL;
-    
+    xkids = NULL;
+    xnkids = 0;
+
     if (xparent)
         xparent->link(this);
 }
@@ -22,20 +94,20 @@ UniHashTreeBase::UniHashTreeBase(UniHashTreeBase *parent,
 
 UniHashTreeBase::~UniHashTreeBase()
 {
-    if (xchildren)
-    {
-        Container *oldchildren = xchildren;
-        xchildren = NULL;
-
-        delete oldchildren;
-    } 
+    if (xnkids < 0)
+	delete xhash;
+    else
+	free(xkids);
+    xkids = NULL;
+    xnkids = 0;
 
     // This happens only after the children are deleted by our
     // subclass.  This ensures that we do not confuse them
     // about their parentage as their destructors are invoked
-    // The xchildren vector is destroyed by the subclass!
     if (xparent)
         xparent->unlink(this);
+
+    unintern(xseg);
 }
 
 
@@ -62,27 +134,32 @@ UniHashTreeBase *UniHashTreeBase::_root() const
 
 UniConfKey UniHashTreeBase::_fullkey(const UniHashTreeBase *ancestor) const
 {
+    // collect the segments bottom-up, then build the key top-down, which
+    // saves prepend() from shuffling the whole key along every time.
+    int depth = 0;
+    const UniHashTreeBase *node;
+    for (node = this; node != ancestor && node->xparent; node = node->xparent)
+	depth++;
+    assert((!ancestor || node == ancestor) ||
+	   ! "ancestor was not a node in the tree");
+
+    const UniHashTreeBase **path = new const UniHashTreeBase *[depth];
+    int n = depth;
+    for (node = this; n > 0; node = node->xparent)
+	path[--n] = node;
+
     UniConfKey result;
-    if (ancestor)
+    for (n = 0; n < depth; n++)
     {
-        const UniHashTreeBase *node = this;
-        while (node != ancestor)
-        {
-            result.prepend(node->key());
-            node = node->xparent;
-            assert(node != NULL ||
-                ! "ancestor was not a node in the tree");
-        }
-    }
-    else
-    {
-        const UniHashTreeBase *node = this;
-        while (node->xparent)
-        {
-            result.prepend(node->key());
-            node = node->xparent;
-        }
+	const WvString &seg = path[n]->xseg->str;
+	if (!seg)
+	    continue;
+	else if (strchr(seg, '/'))
+	    result.append(path[n]->key()); // not really just one segment
+	else
+	    result.appendseg(seg);
     }
+    deletev path;
     return result;
 }
 
@@ -90,13 +167,12 @@ UniConfKey UniHashTreeBase::_fullkey(const UniHashTreeBase *ancestor) const
 UniHashTreeBase *UniHashTreeBase::_find(const UniConfKey &key) const
 {
     const UniHashTreeBase *node = this;
-    UniConfKey::Iter it(key);
-    it.rewind();
-    while (it.next())
+    int n = key.numsegments();
+    for (int i = 0; node && i < n; i++)
     {
-        node = node->_findchild(it());
-        if (!node)
-            break;
+	const WvString &seg = key.segmentstr(i);
+	if (!!seg)
+	    node = node->_findseg(seg);
     }
     return const_cast<UniHashTreeBase*>(node);
 }
@@ -107,44 +183,244 @@ UniHashTreeBase *UniHashTreeBase::_findchild(const UniConfKey &key) const
     if (key.isempty())
         return const_cast<UniHashTreeBase*>(this);
 
-    return xchildren ? (*xchildren)[key] : NULL;
+    if (key.numsegments() == 1)
+	return _findseg(key.segmentstr(0));
+    else
+	return _findseg(key.printable());
+}
+
+
+/*
+ * Case-insensitive, but a run of digits sorts by its value, so that
+ * numbered children (which uniconf has lots of) come out as 1, 2, ... 10
+ * instead of 1, 10, 2.  Only returns 0 if strcasecmp() would too, so it
+ * agrees with the hash about which names are the same.
+ */
+static int segcmp(const char *a, const char *b)
+{
+    const char *sa = a, *sb = b;
+    while (*a && *b)
+    {
+	if (isdigit((unsigned char)*a) && isdigit((unsigned char)*b))
+	{
+	    while (*a == '0')
+		a++;
+	    while (*b == '0')
+		b++;
+	    const char *da = a, *db = b;
+	    while (isdigit((unsigned char)*a))
+		a++;
+	    while (isdigit((unsigned char)*b))
+		b++;
+	    if (a - da != b - db)
+		return (a - da) < (b - db) ? -1 : 1;
+	    int cmp = strncmp(da, db, a - da);
+	    if (cmp)
+		return cmp;
+	    continue;
+	}
+
+	int ca = tolower((unsigned char)*a), cb = tolower((unsigned char)*b);
+	if (ca != cb)
+	    return ca - cb;
+	a++;
+	b++;
+    }
+    if (*a || *b)
+	return *a ? 1 : -1;
+
+    // same apart from leading zeroes, like "7" and "007"
+    return strcasecmp(sa, sb);
+}
+
+
+int UniHashTreeBase::upper(WvStringParm seg) const
+{
+    int lo = 0, hi = xnkids;
+    while (lo < hi)
+    {
+	int mid = (lo + hi) / 2;
+	if (segcmp(xkids[mid]->xseg->str, seg) <= 0)
+	    lo = mid + 1;
+	else
+	    hi = mid;
+    }
+    return lo;
+}
+
+
+UniHashTreeBase *UniHashTreeBase::_findseg(WvStringParm seg) const
+{
+    if (xnkids < 0)
+	return (*xhash)[seg];
+
+    int lo = 0, hi = xnkids;
+    while (lo < hi)
+    {
+	int mid = (lo + hi) / 2;
+	int cmp = segcmp(xkids[mid]->xseg->str, seg);
+	if (!cmp)
+	    return xkids[mid];
+	else if (cmp < 0)
+	    lo = mid + 1;
+	else
+	    hi = mid;
+    }
+    return NULL;
 }
 
 
 bool UniHashTreeBase::haschildren() const
 {
-    return xchildren && !xchildren->isempty();
+    return xnkids > 0 || (xnkids < 0 && !xhash->isempty());
+}
+
+
+size_t UniHashTreeBase::numchildren() const
+{
+    return xnkids < 0 ? xhash->count() : xnkids;
 }
 
 
 void UniHashTreeBase::link(UniHashTreeBase *node)
 {
-    if (!xchildren)
-        xchildren = new Container();
+    if (xnkids < 0)
+    {
+	xhash->add(node, false);
+	return;
+    }
 
-    xchildren->add(node);
+    if (xnkids == MAX_SORTED)
+    {
+	Container *hash = new Container(MAX_SORTED * 2);
+	for (int i = 0; i < xnkids; i++)
+	    hash->add(xkids[i], false);
+	hash->add(node, false);
+	free(xkids);
+	xhash = hash;
+	xnkids = -1;
+	return;
+    }
+
+    // the array is always big enough for the next power of two, so we
+    // only have to resize it when we get to one.
+    if (!(xnkids & (xnkids - 1)))
+	xkids = (UniHashTreeBase **)realloc(xkids, (xnkids ? xnkids * 2 : 1)
+					    * sizeof(UniHashTreeBase *));
+
+    int pos = upper(node->xseg->str);
+    memmove(xkids + pos + 1, xkids + pos,
+	    (xnkids - pos) * sizeof(UniHashTreeBase *));
+    xkids[pos] = node;
+    xnkids++;
 }
 
 
 void UniHashTreeBase::unlink(UniHashTreeBase *node)
 {
-    if (!xchildren)
-        return;
+    if (xnkids < 0)
+    {
+	// once we've got a hash, we keep it, or iterators would get lost
+	xhash->remove(node);
+	return;
+    }
 
-    xchildren->remove(node);
-    if (xchildren->count() == 0)
+    for (int pos = upper(node->xseg->str) - 1; pos >= 0; pos--)
     {
-        delete xchildren;
-	xchildren = NULL;
+	if (xkids[pos] == node)
+	{
+	    xnkids--;
+	    memmove(xkids + pos, xkids + pos + 1,
+		    (xnkids - pos) * sizeof(UniHashTreeBase *));
+	    if (!xnkids)
+	    {
+		free(xkids);
+		xkids = NULL;
+	    }
+	    return;
+	}
+	if (strcasecmp(xkids[pos]->xseg->str, node->xseg->str))
+	    break;
     }
 }
 
 
-static int keysorter(const UniHashTreeBase *a, const UniHashTreeBase *b)
+UniHashTreeBase **UniHashTreeBase::_takechildren(size_t &n)
 {
-    return a->key().compareto(b->key());
+    UniHashTreeBase **list;
+    if (xnkids < 0)
+    {
+	n = xhash->count();
+	list = (UniHashTreeBase **)malloc((n ? n : 1) * sizeof(*list));
+	size_t j = 0;
+	Container::Iter i(*xhash);
+	for (i.rewind(); i.next(); )
+	    list[j++] = i.ptr();
+	delete xhash;
+    }
+    else
+    {
+	n = xnkids;
+	list = xkids;
+    }
+
+    xkids = NULL;
+    xnkids = 0;
+    return list;
+}
+
+
+int UniHashTreeBase::segsorter(const void *a, const void *b)
+{
+    return segcmp(
+	(*(const UniHashTreeBase **)a)->xseg->str,
+	(*(const UniHashTreeBase **)b)->xseg->str);
+}
+
+
+UniHashTreeBase **UniHashTreeBase::sortedchildren(size_t &n) const
+{
+    n = numchildren();
+    UniHashTreeBase **list = (UniHashTreeBase **)malloc((n ? n : 1)
+							 * sizeof(*list));
+    if (xnkids >= 0)
+	memcpy(list, xkids, n * sizeof(*list)); // already sorted
+    else
+    {
+	size_t j = 0;
+	Container::Iter i(*xhash);
+	for (i.rewind(); i.next(); )
+	    list[j++] = i.ptr();
+	qsort(list, n, sizeof(*list), segsorter);
+    }
+    return list;
 }
 
+
+size_t UniHashTreeBase::_memusage(size_t nodesize,
+			size_t (*extra)(const UniHashTreeBase *)) const
+{
+    size_t total = nodesize;
+    if (extra)
+	total += extra(this);
+
+    if (xnkids < 0)
+	total += sizeof(*xhash) + xhash->memusage();
+    else if (xnkids)
+    {
+	size_t cap = 1;
+	while (cap <= (size_t)xnkids)
+	    cap *= 2;
+	total += cap * sizeof(UniHashTreeBase *);
+    }
+
+    Iter i(*const_cast<UniHashTreeBase *>(this));
+    for (i.rewind(); i.next(); )
+	total += i.ptr()->_memusage(nodesize, extra);
+    return total;
+}
+
+
 void UniHashTreeBase::_recursive_unsorted_visit(
     const UniHashTreeBase *a,
     const UniHashTreeBaseVisitor &visitor, void *userdata,
@@ -152,7 +428,7 @@ void UniHashTreeBase::_recursive_unsorted_visit(
 {
     if (preorder)
 	visitor(a, userdata);
-    Container::Iter i(*const_cast<Container*>(a->xchildren));
+    Iter i(*const_cast<UniHashTreeBase*>(a));
     for (i.rewind(); i.next();)
         _recursive_unsorted_visit(i.ptr(), visitor, userdata,
             preorder, postorder);
@@ -165,7 +441,7 @@ bool UniHashTreeBase::_recursivecompare(
     const UniHashTreeBaseComparator &comparator)
 {
     bool equal = true;
-    
+
     // don't bother comparing subtree if this returns false
     // apenwarr 2004/04/26: some people seem to call recursivecompare and
     // have their comparator function get called for *all* keys, because
@@ -175,63 +451,178 @@ bool UniHashTreeBase::_recursivecompare(
         equal = false;
 
     // begin iteration sequence
-    Container::Sorter *ait = NULL, *bit = NULL;
+    UniHashTreeBase **alist = NULL, **blist = NULL;
+    size_t an = 0, bn = 0, ai = 0, bi = 0;
     if (a != NULL)
     {
-	ait = new Container::Sorter(*const_cast<Container*>(a->xchildren),
-				    keysorter);
-        ait->rewind();
-        a = ait->next() ? ait->ptr() : NULL;
+	alist = a->sortedchildren(an);
+        a = ai < an ? alist[ai] : NULL;
     }
     if (b != NULL)
     {
-	bit = new Container::Sorter(*const_cast<Container*>(b->xchildren),
-				    keysorter);
-        bit->rewind();
-        b = bit->next() ? bit->ptr() : NULL;
+	blist = b->sortedchildren(bn);
+        b = bi < bn ? blist[bi] : NULL;
     }
 
     // compare each key
     while (a != NULL && b != NULL)
     {
-        int order = a->key().compareto(b->key());
+        int order = segcmp(a->xseg->str, b->xseg->str);
         if (order < 0)
         {
 	    equal = false;
 	    _recursivecompare(a, NULL, comparator);
-            a = ait->next() ? ait->ptr() : NULL;
+            a = ++ai < an ? alist[ai] : NULL;
         }
         else if (order > 0)
         {
 	    equal = false;
             _recursivecompare(NULL, b, comparator);
-            b = bit->next() ? bit->ptr() : NULL;
+            b = ++bi < bn ? blist[bi] : NULL;
         }
-        else // keys are equal 
+        else // keys are equal
         {
 	    if (!_recursivecompare(a, b, comparator))
 		equal = false;
-            a = ait->next() ? ait->ptr() : NULL;
-            b = bit->next() ? bit->ptr() : NULL;
+            a = ++ai < an ? alist[ai] : NULL;
+            b = ++bi < bn ? blist[bi] : NULL;
         }
     }
-    
+
     // finish up if one side is bigger than the other
     while (a != NULL)
     {
 	equal = false;
         _recursivecompare(a, NULL, comparator);
-        a = ait->next() ? ait->ptr() : NULL;
+        a = ++ai < an ? alist[ai] : NULL;
     }
     while (b != NULL)
     {
 	equal = false;
         _recursivecompare(NULL, b, comparator);
-        b = bit->next() ? bit->ptr() : NULL;
+        b = ++bi < bn ? blist[bi] : NULL;
     }
-    
-    delete ait;
-    delete bit;
-    
+
+    free(alist);
+    free(blist);
+
     return equal;
 }
+
+
+/***** UniHashTreeBase::Iter *****/
+
+UniHashTreeBase::Iter::Iter(UniHashTreeBase &b)
+    : node(&b), xcur(NULL), idx(-1), snap(NULL), nsnap(0)
+{
+}
+
+
+UniHashTreeBase::Iter::Iter(const Iter &other)
+    : node(other.node), xcur(other.xcur), curseg(other.curseg),
+      idx(other.idx), snap(NULL), nsnap(other.nsnap)
+{
+    if (other.snap)
+    {
+	snap = (UniInternedSeg **)malloc((nsnap ? nsnap : 1) * sizeof(*snap));
+	for (int i = 0; i < nsnap; i++)
+	{
+	    snap[i] = other.snap[i];
+	    snap[i]->refs++;
+	}
+    }
+}
+
+
+UniHashTreeBase::Iter::~Iter()
+{
+    dropsnapshot();
+}
+
+
+void UniHashTreeBase::Iter::dropsnapshot()
+{
+    for (int i = 0; i < nsnap; i++)
+	unintern(snap[i]);
+    free(snap);
+    snap = NULL;
+    nsnap = 0;
+}
+
+
+/*
+ * Sorts the names of the children, holding a reference to each so they
+ * outlive the children themselves.  If after_cur, we start after curseg,
+ * which is where an array iteration that got switched to a hash was up to.
+ */
+void UniHashTreeBase::Iter::snapshot(bool after_cur)
+{
+    size_t n;
+    UniHashTreeBase **list = node->sortedchildren(n);
+    snap = (UniInternedSeg **)malloc((n ? n : 1) * sizeof(*snap));
+    nsnap = n;
+    idx = -1;
+    for (int i = 0; i < nsnap; i++)
+    {
+	snap[i] = list[i]->xseg;
+	snap[i]->refs++;
+	if (after_cur && segcmp(snap[i]->str, curseg) <= 0)
+	    idx = i;
+    }
+    free(list);
+}
+
+
+void UniHashTreeBase::Iter::rewind()
+{
+    xcur = NULL;
+    idx = -1;
+    dropsnapshot();
+
+    if (node->xnkids < 0)
+	snapshot(false);
+}
+
+
+bool UniHashTreeBase::Iter::next()
+{
+    if (!snap && node->xnkids < 0)
+    {
+	if (idx >= 0 && !xcur)
+	    return false; // we'd already finished
+	// we got switched to a hash: carry on in the same order
+	snapshot(idx >= 0);
+    }
+
+    if (snap)
+    {
+	xcur = NULL;
+	while (!xcur && ++idx < nsnap)
+	    xcur = node->_findseg(snap[idx]->str); // NULL if deleted
+	if (idx > nsnap)
+	    idx = nsnap;
+	return xcur != NULL;
+    }
+
+    if (idx < 0)
+	idx = 0;
+    else if (!xcur)
+	return false;
+    else if (idx < node->xnkids && node->xkids[idx] == xcur)
+	idx++;
+    else
+    {
+	// the array changed under us: find our place again.  curseg is
+	// still good, even if xcur got deleted.
+	idx = node->upper(curseg);
+    }
+
+    if (idx < node->xnkids)
+    {
+	xcur = node->xkids[idx];
+	curseg = xcur->xseg->str;
+    }
+    else
+	xcur = NULL;
+    return xcur != NULL;
+}
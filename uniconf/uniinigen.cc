@@ -33,6 +33,7 @@ UniIniGen::UniIniGen(WvStringParm _filename, int _create_mode, UniIniGen::SaveCa
     // Create the root, since this generator can't handle it not existing.
     UniTempGen::set(UniConfKey::EMPTY, WvString::empty);
     memset(&old_st, 0, sizeof(old_st));
+    sections_ok = false;
 }
 
 
@@ -44,6 +45,21 @@ void UniIniGen::set(const UniConfKey &key, WvStringParm value)
     if (value.isnull() && key.isempty())
         UniTempGen::set(UniConfKey::EMPTY, WvString::empty);
 
+    // the root's section always gets printed, but anything else we'll have
+    // to stop copying from the old file
+    if (!key.isempty())
+    {
+	Section *sect = sections[key.segmentstr(0)];
+	if (sect)
+	    sect->dirty = true;
+    }
+}
+
+
+void UniIniGen::forget_sections()
+{
+    sections.zap();
+    sections_ok = false;
 }
 
 
@@ -52,6 +68,264 @@ UniIniGen::~UniIniGen()
 }
 
 
+#ifndef _WIN32
+// true if it's probably the same file, and nobody's touched it
+static bool same_stat(const struct stat &a, const struct stat &b)
+{
+    return a.st_ctime == b.st_ctime
+	&& a.st_dev == b.st_dev
+	&& a.st_ino == b.st_ino
+	&& a.st_blocks == b.st_blocks
+	&& a.st_size == b.st_size;
+}
+#endif
+
+
+// Reads the rest of 'fd' into a malloc()ed buffer, with a NUL after it so
+// we can use string functions on it.  Returns NULL on error.
+static char *read_all(int fd, size_t sizehint, size_t &len)
+{
+    size_t alloced = sizehint + 1 > 4096 ? sizehint + 1 : 4096;
+    char *data = (char *)malloc(alloced);
+    len = 0;
+
+    for (;;)
+    {
+	if (len + 1 >= alloced)
+	{
+	    alloced *= 2;
+	    data = (char *)realloc(data, alloced);
+	}
+
+	ssize_t got = read(fd, data + len, alloced - len - 1);
+	if (got < 0 && errno == EINTR)
+	    continue;
+	else if (got < 0)
+	{
+	    int err = errno;
+	    free(data);
+	    errno = err;
+	    return NULL;
+	}
+	else if (got == 0)
+	    break;
+	len += got;
+    }
+
+    data[len] = '\0';
+    return data;
+}
+
+
+enum LineType { BlankLine, SectionLine, KeyLine, BadLine };
+
+static void trim(const char *&s, const char *&e)
+{
+    while (s < e && isspace((unsigned char)*s))
+	s++;
+    while (e > s && isspace((unsigned char)e[-1]))
+	e--;
+}
+
+
+// A line with nothing in it that needs unescaping.  We can just cut it up
+// where it is.
+static LineType parse_plain(const char *s, const char *e,
+			    WvString &name, WvString &value)
+{
+    trim(s, e);
+    if (s == e || *s == '#')
+	return BlankLine; // FIXME: we drop comments completely!
+
+    if (s[0] == '[' && e[-1] == ']' && e - s > 1)
+    {
+	const char *ns = s + 1, *ne = e - 1;
+	trim(ns, ne);
+	name.setsize(ne - ns + 1);
+	memcpy(name.edit(), ns, ne - ns);
+	name.edit()[ne - ns] = '\0';
+	return SectionLine;
+    }
+
+    // like wvtcl_getword(), we skip any '=' at the front of the key
+    while (s < e && *s == '=')
+	s++;
+    const char *eq = (const char *)memchr(s, '=', e - s);
+    if (!eq)
+	return BadLine;
+
+    const char *ns = s, *ne = eq, *vs = eq + 1, *ve = e;
+    trim(ns, ne);
+    trim(vs, ve);
+    if (ns == ne)
+	return BadLine;
+
+    name.setsize(ne - ns + 1);
+    memcpy(name.edit(), ns, ne - ns);
+    name.edit()[ne - ns] = '\0';
+    value.setsize(ve - vs + 1);
+    memcpy(value.edit(), vs, ve - vs);
+    value.edit()[ve - vs] = '\0';
+    return KeyLine;
+}
+
+
+// Anything with braces, quotes or backslashes in it.
+static LineType parse_hard(WvString word, WvString &name, WvString &value)
+{
+    char *str = trim_string(word.edit());
+    int len = strlen(str);
+    if (len == 0 || str[0] == '#')
+	return BlankLine;
+
+    if (str[0] == '[' && str[len - 1] == ']')
+    {
+	str[len - 1] = '\0';
+	name = wvtcl_unescape(trim_string(str + 1));
+	return SectionLine;
+    }
+
+    WvConstStringBuffer line(str);
+    static const WvStringMask nasty_equals("=");
+    name = wvtcl_getword(line, nasty_equals, false);
+    if (name.isnull() || !line.used())
+	return BadLine;
+    name = wvtcl_unescape(trim_string(name.edit()));
+    if (!name)
+	return BadLine;
+
+    value = line.getstr();
+    assert(*value == '=');
+    value = wvtcl_unescape(trim_string(value.edit() + 1));
+    return KeyLine;
+}
+
+
+// Finds (or makes) the node for 'key' under 'node', the way
+// UniTempGen::set() would.
+static UniConfValueTree *mknode(UniConfValueTree *node, const UniConfKey &key)
+{
+    UniConfKey::Iter it(key);
+    for (it.rewind(); it.next(); )
+    {
+	if (it->isempty())
+	    continue;
+	UniConfValueTree *child = node->findchild(*it);
+	if (!child)
+	    child = new UniConfValueTree(node, *it, WvString::empty);
+	node = child;
+    }
+    return node;
+}
+
+
+void UniIniGen::parse(const char *data, size_t size,
+		      UniConfValueTree *newtree)
+{
+    const char *p = data, *end = data + size;
+    WvStringCache scache;
+    UniConfKey section;
+    UniConfValueTree *sectnode = newtree; // NULL until somebody needs it
+
+    // Keep track of where each top-level key's section is, so commit() can
+    // copy the ones that don't change.  That only works if each one has
+    // exactly one section, and nobody sneaks keys into it from elsewhere,
+    // which is how save() writes them; otherwise, forget it.
+    Section *cursect = NULL;
+    sections_ok = true;
+
+    while (p < end)
+    {
+	off_t wordpos = p - data;
+	const char *sptr = p;
+	while (sptr < end && (*sptr == '\n' || *sptr == '\r'))
+	    sptr++;
+	if (sptr == end)
+	    break;
+
+	// Nearly every line is a plain old "key = value" with nothing to
+	// unescape.  strcspn() can tell us that a lot faster than
+	// wvtcl_getword() could, and then we don't have to copy it anywhere.
+	WvString name, value, word;
+	LineType type;
+	const char *wend = sptr + strcspn(sptr, "{}\\\"\r\n");
+	if (*sptr != '"' && (wend == end || *wend == '\n' || *wend == '\r'))
+	{
+	    type = parse_plain(sptr, wend, name, value);
+	    if (type == BadLine)
+	    {
+		word.setsize(wend - sptr + 1);
+		memcpy(word.edit(), sptr, wend - sptr);
+		word.edit()[wend - sptr] = '\0';
+	    }
+	    p = wend;
+	}
+	else
+	{
+	    WvConstInPlaceBuf buf(p, end - p);
+	    word = wvtcl_getword(buf, WVTCL_NASTY_NEWLINES, false);
+	    if (word.isnull())
+	    {
+		// The rest of the file doesn't make a word, probably because
+		// of a missing brace or quote.  Throw away a line and try
+		// again.
+		const char *nl = (const char *)memchr(p, '\n', end - p);
+		nl = nl ? nl + 1 : end;
+		WvString line1;
+		line1.setsize(nl - p + 1);
+		memcpy(line1.edit(), p, nl - p);
+		line1.edit()[nl - p] = '\0';
+		line1 = trim_string(line1.edit());
+		if (!!line1) // not just whitespace
+		    log(WvLog::Warning,
+			"XXX Ignoring malformed input line: \"%s\"\n", line1);
+		p = nl;
+		continue;
+	    }
+	    p = end - buf.used();
+	    type = parse_hard(word, name, value);
+	}
+
+	if (type == SectionLine)
+	{
+	    section = UniConfKey(name);
+	    sectnode = NULL;
+
+	    if (cursect)
+		cursect->len = wordpos - cursect->start;
+	    cursect = NULL;
+	    if (section.numsegments() == 1 && !sections[section.segmentstr(0)])
+	    {
+		cursect = new Section(section.segmentstr(0), wordpos, 0);
+		sections.add(cursect, true);
+	    }
+	    else if (!section.isempty())
+		sections_ok = false;
+	}
+	else if (type == KeyLine)
+	{
+	    UniConfKey key(name);
+	    if (cursect ? key.isempty() : key.numsegments() > 1)
+		sections_ok = false;
+
+	    // UniTempGen::set() ignores these, so we do too
+	    if (key.hastrailingslash())
+		continue;
+
+	    if (!sectnode)
+		sectnode = mknode(newtree, section);
+	    mknode(sectnode, key)->setvalue(scache.get(value));
+	}
+	else if (type == BadLine)
+	    log(WvLog::Warning,
+		"Ignoring malformed input line: \"%s\"\n", word);
+    }
+
+    if (cursect)
+	cursect->len = size - cursect->start;
+}
+
+
 bool UniIniGen::refresh()
 {
     WvFile file(filename, O_RDONLY);
@@ -72,11 +346,7 @@ bool UniIniGen::refresh()
     }
     
     if (file.isok() // guarantes statbuf is valid from above
-	&& statbuf.st_ctime == old_st.st_ctime
-	&& statbuf.st_dev == old_st.st_dev
-	&& statbuf.st_ino == old_st.st_ino
-	&& statbuf.st_blocks == old_st.st_blocks
-	&& statbuf.st_size == old_st.st_size)
+	&& same_stat(statbuf, old_st))
     {
 	log(WvLog::Debug3, "refresh: file hasn't changed; do nothing.\n");
 	return true;
@@ -84,6 +354,9 @@ bool UniIniGen::refresh()
     memcpy(&old_st, &statbuf, sizeof(statbuf));
 #endif
 
+    // whatever happens, our idea of where things are in the file is wrong
+    forget_sections();
+
     if (!file.isok())
     {
         log(WvLog::Warning, 
@@ -93,108 +366,31 @@ bool UniIniGen::refresh()
         return false;
     }
     
-    // loop over all Tcl words in the file
-    UniTempGen *newgen = new UniTempGen();
-    newgen->set(UniConfKey::EMPTY, WvString::empty);
-    UniConfKey section;
-    WvDynBuf buf;
-    while (buf.used() || file.isok())
-    {
-        if (file.isok())
-        {
-            // read entire lines to ensure that we get whole values
-            char *line = file.blocking_getline(-1);
-            if (line)
-	    {
-                buf.putstr(line);
-		buf.put('\n'); // this was auto-stripped by getline()
-	    }
-        }
-
-        WvString word;
-	while (!(word = wvtcl_getword(buf,
-				      WVTCL_NASTY_NEWLINES,
-				      false)).isnull())
-        {
-	    //log(WvLog::Info, "LINE: '%s'\n", word);
-	    
-            char *str = trim_string(word.edit());
-            int len = strlen(str);
-            if (len == 0) continue; // blank line
-	    
-            if (str[0] == '#')
-            {
-                // a comment line.  FIXME: we drop it completely!
-                //log(WvLog::Debug5, "Comment: \"%s\"\n", str + 1);
-                continue;
-            }
-	    
-            if (str[0] == '[' && str[len - 1] == ']')
-            {
-                // a section name
-                str[len - 1] = '\0';
-                WvString name(wvtcl_unescape(trim_string(str + 1)));
-                section = UniConfKey(name);
-                //log(WvLog::Debug5, "Refresh section: \"%s\"\n", section);
-                continue;
-            }
-	    
-            // we possibly have a key = value line
-            WvConstStringBuffer line(word);
-	    static const WvStringMask nasty_equals("=");
-            WvString name = wvtcl_getword(line, nasty_equals, false);
-            if (!name.isnull() && line.used())
-            {
-                name = wvtcl_unescape(trim_string(name.edit()));
-		
-                if (!!name)
-                {
-		    UniConfKey key(name);
-                    key.prepend(section);
-		    
-                    WvString value = line.getstr();
-		    assert(*value == '=');
-                    value = wvtcl_unescape(trim_string(value.edit() + 1));
-                    newgen->set(key, value.unique());
-
-                    //log(WvLog::Debug5, "Refresh: (\"%s\", \"%s\")\n",
-                    //    key, value);
-                    continue;
-                }
-            }
-	    
-	    // if we get here, the line was tcl-decoded but not useful.
-            log(WvLog::Warning,
-		"Ignoring malformed input line: \"%s\"\n", word);
-        }
-	
-	if (buf.used() && !file.isok())
-	{
-	    // EOF and some of the data still hasn't been used.  Weird.
-	    // Let's remove a line of data and try again.
-	    size_t offset = buf.strchr('\n');
-	    assert(offset); // the last thing we put() is *always* a newline!
-	    WvString line1(trim_string(buf.getstr(offset).edit()));
-	    if (!!line1) // not just whitespace
-		log(WvLog::Warning,
-		    "XXX Ignoring malformed input line: \"%s\"\n", line1);
-	}
-    }
-
-    if (file.geterr())
+    // Read it all in at once.  mmap() would save us a copy, but then
+    // anybody rewriting the file in place (like our own commit(), when it
+    // can't do it atomically) could get us killed with SIGBUS.
+    size_t sizehint = 0;
+#ifndef _WIN32
+    sizehint = statbuf.st_size;
+#endif
+    size_t size;
+    char *data = read_all(file.getrfd(), sizehint, size);
+    if (!data)
     {
         log(WvLog::Warning, 
-	    "Error reading from config file: %s\n", file.errstr());
-        WVRELEASE(newgen);
+	    "Error reading from config file: %s\n", strerror(errno));
         return false;
     }
 
+    UniConfValueTree *newtree
+	= new UniConfValueTree(NULL, UniConfKey::EMPTY, WvString::empty);
+    parse(data, size, newtree);
+    free(data);
+
     // switch the trees and send notifications
     hold_delta();
     UniConfValueTree *oldtree = root;
-    UniConfValueTree *newtree = newgen->root;
     root = newtree;
-    newgen->root = NULL;
     dirty = false;
     oldtree->compare(newtree, wv::bind(&UniIniGen::refreshcomparator, this,
 				       _1, _2));
@@ -202,8 +398,6 @@ bool UniIniGen::refresh()
     delete oldtree;
     unhold_delta();
 
-    WVRELEASE(newgen);
-
     UniTempGen::refresh();
     return true;
 }
@@ -270,7 +464,20 @@ bool UniIniGen::commit_atomic(WvStringParm real_filename)
 	return false;
     }
 
-    save(file, *root); // write the changes out to our temp file
+    // if the file is still the one we last read or wrote, we can copy the
+    // sections that haven't changed out of it
+    int oldfd = open(real_filename, O_RDONLY);
+    if (oldfd >= 0 && (fstat(oldfd, &statbuf) == -1
+		       || !same_stat(statbuf, old_st)))
+    {
+	::close(oldfd);
+	oldfd = -1;
+    }
+
+    save(file, oldfd); // write the changes out to our temp file
+
+    if (oldfd >= 0)
+	::close(oldfd);
 
     mode_t theumask = umask(0);
     umask(theumask);
@@ -286,6 +493,7 @@ bool UniIniGen::commit_atomic(WvStringParm real_filename)
 	return false;
     }
 
+    save_stat(real_filename);
     return true;
 }
 #endif
@@ -302,12 +510,13 @@ void UniIniGen::commit()
     // Windows doesn't support all that fancy stuff, just open the
     // file and be done with it
     WvFile file(filename, O_WRONLY|O_TRUNC|O_CREAT, create_mode);
-    save(file, *root); // write the changes out to our file
+    save(file); // write the changes out to our file
     file.close();
     if (file.geterr())
     {
         log(WvLog::Warning, "Can't write '%s': %s\n",
 	    filename, file.errstr());
+	forget_sections();
 	return;
     }
 #else
@@ -331,7 +540,8 @@ void UniIniGen::commit()
 
         fchmod(file.getwfd(), (statbuf.st_mode & 07777) | S_ISVTX);
 
-        save(file, *root);
+        save(file);
+	file.flush(-1);
     
         if (!file.geterr())
         {
@@ -339,10 +549,14 @@ void UniIniGen::commit()
 	     * we close it, because we need the file descriptor. */
 	    statbuf.st_mode = statbuf.st_mode & ~S_ISVTX;
 	    fchmod(file.getwfd(), statbuf.st_mode & 07777);
+	    save_stat(real_filename);
 	}
 	else
+	{
 	    log(WvLog::Warning, "Error writing '%s' ('%s'): %s\n",
 		filename, real_filename, file.errstr());
+	    forget_sections();
+	}
     }
 #endif
 
@@ -393,7 +607,7 @@ static bool absolutely_needs_escape(WvStringParm s, const char *sepchars)
 }
 
 
-static void printsection(WvStream &file, const UniConfKey &key, UniIniGen::SaveCallback save_cb)
+static void printsection(WvBuf &out, const UniConfKey &key, UniIniGen::SaveCallback save_cb)
 {
     WvString s;
     static const WvStringMask nasties("\r\n[]");
@@ -404,16 +618,16 @@ static void printsection(WvStream &file, const UniConfKey &key, UniIniGen::SaveC
 	s = key;
     // broken up for optimization, no temp wvstring created
     //file.print("\n[%s]\n", s);
-    file.print("\n[");
-    file.print(s);
-    file.print("]\n");
+    out.putstr("\n[");
+    out.putstr(s);
+    out.putstr("]\n");
 
     if (!!save_cb)
         save_cb();
 }
 
 
-static void printkey(WvStream &file, const UniConfKey &_key,
+static void printkey(WvBuf &out, const UniConfKey &_key,
 		     WvStringParm _value, UniIniGen::SaveCallback save_cb)
 {
     WvString key, value;
@@ -437,17 +651,17 @@ static void printkey(WvStream &file, const UniConfKey &_key,
     // pair from a section name or comment and to delimit the value
     // broken up for optimization, no temp wvstring created
     //file.print("%s = %s\n", key, value);
-    file.print(key);
-    file.print(" = ");
-    file.print(value);
-    file.print("\n");
+    out.putstr(key);
+    out.putstr(" = ");
+    out.putstr(value);
+    out.putstr("\n");
 
     if (!!save_cb)
         save_cb();
 }
 
 
-static void save_sect(WvStream &file, UniConfValueTree &toplevel,
+static void save_sect(WvBuf &out, UniConfValueTree &toplevel,
 		      UniConfValueTree &sect, bool &printedsection,
 		      bool recursive, UniIniGen::SaveCallback save_cb)
 {
@@ -469,44 +683,130 @@ static void save_sect(WvStream &file, UniConfValueTree &toplevel,
         {
             if (!printedsection)
             {
-                printsection(file, toplevel.fullkey(), save_cb);
+                printsection(out, toplevel.fullkey(), save_cb);
                 printedsection = true;
             }
-            printkey(file, node.fullkey(&toplevel), node.value(), save_cb);
+            printkey(out, node.fullkey(&toplevel), node.value(), save_cb);
         }
 
 	// print all children, if requested
 	if (recursive && node.haschildren())
-	    save_sect(file, toplevel, node, printedsection, recursive, save_cb);
+	    save_sect(out, toplevel, node, printedsection, recursive, save_cb);
     }
 }
 
 
-void UniIniGen::save(WvStream &file, UniConfValueTree &parent)
+// Copies 'len' bytes at 'start' in 'fd' into 'out'.
+static bool copy_region(WvBuf &out, int fd, off_t start, size_t len,
+			UniIniGen::SaveCallback save_cb)
 {
-    // parent might be NULL, so it really should be a pointer, not
-    // a reference.  Oh well...
-    if (!&parent) return;
-    
-    if (parent.fullkey() == root->fullkey())
+    while (len)
     {
-	// the root itself is a special case, since it's not in a section,
-	// and it's never NULL (so we don't need to write it if it's just
-	// blank)
-	if (!!parent.value())
-	    printkey(file, parent.key(), parent.value(), save_cb);
+	size_t want = len < 65536 ? len : 65536;
+	ssize_t got = pread(fd, out.alloc(want), want, start);
+	if (got <= 0)
+	{
+	    out.unalloc(want);
+	    return false;
+	}
+	out.unalloc(want - got);
+	start += got;
+	len -= got;
+
+	if (!!save_cb)
+	    save_cb();
     }
+    return true;
+}
+
 
+void UniIniGen::save(WvStream &file, int oldfd)
+{
+    if (oldfd >= 0 && !sections_ok)
+	oldfd = -1;
+
+    WvDynBuf out;
+    off_t flushed = 0;
+    int last = '\n';
+
+    // the root itself is a special case, since it's not in a section,
+    // and it's never NULL (so we don't need to write it if it's just
+    // blank)
+    if (!!root->value())
+	printkey(out, root->key(), root->value(), save_cb);
+
+    // the root's direct children get their values printed in the "[]"
+    // section, every time; it's the subtrees that take up the space
     bool printedsection = false;
+    save_sect(out, *root, *root, printedsection, false, save_cb);
     
-    save_sect(file, parent, parent, printedsection, false, save_cb);
-    
-    UniConfValueTree::Iter it(parent);
+    UniConfValueTree::Iter it(*root);
     for (it.rewind(); it.next(); )
     {
         UniConfValueTree &node = *it;
-	
+	Section *sect = sections[node.key().segmentstr(0)];
+
+	if (out.used())
+	    last = *out.peek(out.used() - 1, 1);
+	if (out.used() >= 1024*1024)
+	{
+	    flushed += out.used();
+	    file.write(out, out.used());
+	}
+
+	if (oldfd >= 0 && sect && !sect->dirty)
+	{
+	    size_t before = out.used();
+
+	    // it could have started right after the end of the last line
+	    if (last != '\n')
+		out.putch('\n');
+	    off_t start = flushed + out.used();
+	    if (copy_region(out, oldfd, sect->start, sect->len, save_cb))
+	    {
+		sect->start = start;
+		continue;
+	    }
+
+	    log(WvLog::Warning, "Can't read old '%s': %s\n",
+		filename, strerror(errno));
+	    out.unalloc(out.used() - before);
+	    oldfd = -1; // just print everything from now on
+	}
+
+	off_t start = flushed + out.used();
 	printedsection = false;
-	save_sect(file, node, node, printedsection, true, save_cb);
+	save_sect(out, node, node, printedsection, true, save_cb);
+	size_t len = flushed + out.used() - start;
+
+	if (sect)
+	{
+	    sect->start = start;
+	    sect->len = len;
+	    sect->dirty = false;
+	}
+	else
+	    sections.add(new Section(node.key().segmentstr(0), start, len),
+			 true);
+    }
+    file.write(out, out.used());
+
+    // and forget about anything that isn't there anymore
+    SectionCaseDict::Iter i(sections);
+    for (i.rewind(); i.next(); )
+	if (!root->findchild(i->seg))
+	    sections.remove(i.ptr());
+    sections_ok = true;
+}
+
+
+void UniIniGen::save_stat(WvStringParm fname)
+{
+    // if the next refresh() sees exactly this, it's what we just wrote,
+    // and there's no point reading it back in
+    if (stat(fname, &old_st) == -1)
+    {
+	memset(&old_st, 0, sizeof(old_st));
+	forget_sections();
     }
 }
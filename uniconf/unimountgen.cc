@@ -15,6 +15,7 @@
 /***** UniMountGen *****/
 
 UniMountGen::UniMountGen()
+    : root(WvString::null, NULL)
 {
     // nothing special
 }
@@ -43,6 +44,14 @@ WvString UniMountGen::get(const UniConfKey &key)
 }
 
 
+void UniMountGen::prefetch(const UniConfKey &key, bool recursive)
+{
+    UniGenMount *found = findmount(key);
+    if (found)
+	found->gen->prefetch(trimkey(found->key, key), recursive);
+}
+
+
 void UniMountGen::set(const UniConfKey &key, WvStringParm value)
 {
     UniGenMount *found = findmount(key);
@@ -126,24 +135,10 @@ bool UniMountGen::haschildren(const UniConfKey &key)
 
 bool UniMountGen::has_subkey(const UniConfKey &key, UniGenMount *found)
 {
-    MountList::Iter i(mounts);
-    for (i.rewind(); i.next(); )
-    {
-        if (key.suborsame(i->key) && key < i->key)
-        {
-            //fprintf(stdout, "%s has_subkey %s : true\n", key.printable().cstr(), 
-            //        i->key.printable().cstr());            
-            return true;
-        }
-
-	// the list is sorted innermost-first.  So if we find the key
-	// we started with, we've finished searching all children of it.
-        if (found && (i->gen == found->gen))
-            break;
-    }
-
-    //fprintf(stdout, "%s has_subkey false \n", key.printable().cstr());
-    return false;
+    // 'found' is mounted at or above the key, so anything mounted under
+    // the key is deeper, and shows through.
+    MountNode *node = findnode(key);
+    return node && !node->children.isempty();
 }
 
 bool UniMountGen::refresh()
@@ -207,6 +202,7 @@ IUniConfGen *UniMountGen::mountgen(const UniConfKey &key,
         gen->refresh();
 
     mounts.prepend(newgen, true);
+    findnode(key, true)->mounts.prepend(newgen, false);
     
     delta(key, get(key));
     unhold_delta();
@@ -236,19 +232,19 @@ void UniMountGen::unmount(IUniConfGen *gen, bool commit)
     gen->del_callback(this);
 
     UniConfKey key(i->key);
-    IUniConfGen *next = NULL;
 
     delta(key, WvString());
 
-    // Find the first generator mounted past the one we're removing (if
-    // any). This way we can make sure that each generator still has keys
-    // leading up to it (in case they lost their mountpoint due to the
-    // unmounted generator)
+    MountNode *node = findnode(key);
+    assert(node);
+    node->mounts.unlink(i.ptr());
+    prunenode(node);
     i.xunlink();
-    if (i.next())
-        next = i->gen;
 
-    for (i.rewind(); i.next() && i->gen != next; )
+    // Anything mounted under the one we're removing now sits on whatever
+    // is left above it, so make sure each of them still has keys leading
+    // up to it.
+    for (i.rewind(); i.next(); )
     {
         if (key.suborsame(i->key) && key != i->key)
 	{
@@ -271,26 +267,23 @@ void UniMountGen::zap()
 IUniConfGen *UniMountGen::whichmount(const UniConfKey &key,
 				    UniConfKey *mountpoint)
 {
-    MountList::Iter i(mounts);
-
-    for (i.rewind(); i.next(); )
-    {
-        if (i->key.suborsame(key))
-        {
-            if (mountpoint)
-                *mountpoint = i->key;
-            return i->gen;
-        }
-    }
+    UniGenMount *found = findmount(key);
+    if (!found)
+	return NULL;
 
-    return NULL;
+    if (mountpoint)
+	*mountpoint = found->key;
+    return found->gen;
 }
 
 
 bool UniMountGen::ismountpoint(const UniConfKey &key)
 {
-    MountList::Iter i(mounts);
+    MountNode *node = findnode(key);
+    if (!node)
+	return false;
 
+    MountList::Iter i(node->mounts);
     for (i.rewind(); i.next(); )
     {
         if (i->key == key)
@@ -316,22 +309,16 @@ UniMountGen::Iter *UniMountGen::iterator(const UniConfKey &key)
 	// FIXME: this is really a hack, and should (somehow) be dealt with
 	// in a more general way.
 	ListIter *it = new ListIter(this);
-
-	MountList::Iter i(mounts);
         WvStringTable t(10);
-	for (i.rewind(); i.next(); )
+
+	// every child node has something mounted under it somewhere, so
+	// each one is a key leading up to a mount.
+	MountNode *node = findnode(key);
+	if (node)
 	{
-	    if (key.numsegments() < i->key.numsegments()
-	      && key.suborsame(i->key))
-            {
-                // trim off any stray segments coming between the virtual
-                // "key" we're iterating over and the mount
-                UniConfKey k1 = i->key.first(key.numsegments() + 1);
-                UniConfKey k2 = k1.last(); // final "key" should be size 1
-
-                if (!t[k2])
-                    t.add(new WvString(k2), true);
-            }
+	    MountNodeCaseDict::Iter i(node->children);
+	    for (i.rewind(); i.next(); )
+		t.add(new WvString(i->seg), true);
 	}
         WvStringTable::Sorter s(t, &::wvstrcmp);
         for (s.rewind(); s.next();)
@@ -355,46 +342,85 @@ UniMountGen::Iter *UniMountGen::recursiveiterator(const UniConfKey &key)
 }
 
 
+UniMountGen::MountNode *UniMountGen::findnode(const UniConfKey &key,
+					      bool create)
+{
+    // a trailing slash doesn't count, just like in UniConfKey::suborsame()
+    int n = key.numsegments();
+    if (key.hastrailingslash())
+	n--;
+
+    MountNode *node = &root;
+    for (int i = 0; node && i < n; i++)
+    {
+	MountNode *child = node->children[key.segmentstr(i)];
+	if (!child && create)
+	{
+	    child = new MountNode(key.segmentstr(i), node);
+	    node->children.add(child, true);
+	}
+	node = child;
+    }
+
+    return node;
+}
+
+
+void UniMountGen::prunenode(MountNode *node)
+{
+    while (node != &root && node->mounts.isempty()
+	   && node->children.isempty())
+    {
+	MountNode *parent = node->parent;
+	parent->children.remove(node);
+	node = parent;
+    }
+}
+
+
 UniMountGen::UniGenMount *UniMountGen::findmount(const UniConfKey &key)
 {
-    // Find the needed generator and keep it as a lastfound
-    MountList::Iter i(mounts);
-    for (i.rewind(); i.next(); )
+    // Every mount on the way down to the key covers it; the innermost one
+    // wins, and if there are several right there, the newest one.
+    UniGenMount *found = NULL;
+    MountNode *node = &root;
+    int n = key.numsegments();
+
+    for (int i = 0; ; i++)
     {
-        if (i->key.suborsame(key))
-	    return i.ptr();
-    } 
+	if (!node->mounts.isempty())
+	    found = node->mounts.first();
+	if (i >= n || !(node = node->children[key.segmentstr(i)]))
+	    break;
+    }
 
-    return NULL;
+    return found;
 }
 
 
 UniMountGen::UniGenMount *UniMountGen::findmountunder(const UniConfKey &key)
 {
-    UniMountGen::UniGenMount * foundmount = NULL;
-    int num_found_mounts = 0;
+    // we want the mount that covers the key, and nothing else mounted at
+    // or under it.
+    UniGenMount *found = findmount(key);
+    if (!found)
+	return NULL;
 
-    // Find the needed generator and keep it as a lastfound
-    MountList::Iter i(mounts);
+    MountNode *node = findnode(key);
+    if (!node)
+	return found;
+
+    MountList::Iter i(node->mounts);
     for (i.rewind(); i.next(); )
     {
-        // key lies beneath mount (only care about the first)
-        if (i->key.suborsame(key) && !foundmount)
-        {
-            foundmount = i.ptr();
-            num_found_mounts++;
-        }
-        // mount lies beneath key
-        else if (key.suborsame(i->key))
-        {
-            num_found_mounts++;
-        }
+	if (i.ptr() != found)
+	    return NULL;
     }
 
-    if (num_found_mounts == 1 && foundmount)
-        return foundmount;
+    if (!node->children.isempty())
+	return NULL;
 
-    return NULL;
+    return found;
 }
 
 
@@ -128,3 +128,83 @@ WVTEST_MAIN("dynbuf contiguous getting")
     }
 }
 
+
+
+WVTEST_MAIN("dynbuf chunk pool")
+{
+    WvBufChunkPool::trim();
+    WvBufChunkPool::Stats before = WvBufChunkPool::stats();
+    WVPASSEQ(before.cached, 0);
+    
+    size_t size = 1000;
+    void *chunk = WvBufChunkPool::get(size);
+    WVPASSEQ(size, 1024);
+    WVPASSEQ(WvBufChunkPool::stats().misses, before.misses + 1);
+    WVPASSEQ(WvBufChunkPool::stats().in_use, before.in_use + 1024);
+    WvBufChunkPool::put(chunk, size);
+    WVPASSEQ(WvBufChunkPool::stats().cached, 1024);
+    
+    size = 1024;
+    WVPASS(WvBufChunkPool::get(size) == chunk);
+    WVPASSEQ(WvBufChunkPool::stats().hits, before.hits + 1);
+    WvBufChunkPool::put(chunk, size);
+    
+    // the same buffer going through the same sizes over and over again
+    // should only ever need to allocate the first time
+    WvDynBuf b;
+    char data[5000];
+    memset(data, 'x', sizeof(data));
+    for (int i = 0; i < 100; i++)
+    {
+        b.put(data, sizeof(data));
+        b.put(data, 100);
+        WVPASSEQ(b.used(), sizeof(data) + 100);
+        b.get(b.used());
+    }
+    size_t misses = WvBufChunkPool::stats().misses;
+    for (int i = 0; i < 100; i++)
+    {
+        b.put(data, sizeof(data));
+        b.put(data, 100);
+        b.get(b.used());
+    }
+    WVPASSEQ(WvBufChunkPool::stats().misses, misses);
+    WVPASS(WvBufChunkPool::stats().in_use_max > 5000);
+    
+    // too big for the pool
+    size = WvBufChunkPool::MAX_CHUNK + 1;
+    chunk = WvBufChunkPool::get(size);
+    WVPASSEQ(size, WvBufChunkPool::MAX_CHUNK + 1);
+    WVPASSEQ(WvBufChunkPool::stats().oversize, before.oversize + 1);
+    size_t cached = WvBufChunkPool::stats().cached;
+    WvBufChunkPool::put(chunk, size);
+    WVPASSEQ(WvBufChunkPool::stats().cached, cached);
+    
+    WvBufChunkPool::trim();
+    WVPASSEQ(WvBufChunkPool::stats().cached, 0);
+}
+
+
+WVTEST_MAIN("dynbuf peek across buffers at an offset")
+{
+    WvDynBuf b;
+    char data[3000];
+    for (size_t i = 0; i < sizeof(data); i++)
+        data[i] = i % 251;
+    
+    // lots of little buffers, so anything big has to get coalesced
+    for (size_t i = 0; i < sizeof(data); i += 100)
+    {
+        WvDynBuf part;
+        part.put(data + i, 100);
+        b.merge(part);
+    }
+    WVPASSEQ(b.used(), sizeof(data));
+    
+    const unsigned char *p = b.peek(150, 2800);
+    WVPASS(p && !memcmp(p, data + 150, 2800));
+    p = b.peek(2950, 50);
+    WVPASS(p && !memcmp(p, data + 2950, 50));
+    p = b.peek(0, sizeof(data));
+    WVPASS(p && !memcmp(p, data, sizeof(data)));
+}
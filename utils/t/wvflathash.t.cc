@@ -0,0 +1,194 @@
+#include "wvtest.h"
+#include "wvflathash.h"
+#include "wvhashtable.h"
+#include "wvscatterhash.h"
+#include "wvstring.h"
+#include "wvtimeutils.h"
+
+
+DeclareWvFlatTable2(TestFlat, WvString);
+
+struct Intstr
+{
+    int i;
+    WvString s;
+
+    Intstr(int _i, WvStringParm _s)
+        { i = _i; s = _s; }
+};
+DeclareWvFlatDict(Intstr, int, i);
+DeclareWvFlatCaseDict(Intstr, WvString, s);
+
+
+WVTEST_MAIN("flathash basics")
+{
+    TestFlat h;
+    WVPASS(h.isempty());
+    WVFAIL(h.count());
+
+    WvString s("foo");
+
+    h.add(new WvString(s), true);
+    WVPASSEQ(h.count(), 1);
+    WVPASS(h[s] && *h[s] == "foo");
+    WVFAIL(h[WvString("Foo")]);
+    h.remove(&s); // not the same object we added, but compares equal
+    WVPASS(h.isempty());
+    WVFAIL(h[s]);
+}
+
+
+WVTEST_MAIN("flathash growth, remove, iter")
+{
+    const int size = 10000;
+    IntstrDict d(10);
+    unsigned initial = d.capacity();
+
+    for (int i = 0; i < size; i++)
+	d.add(new Intstr(i, WvString("Test%s", i)), true);
+    WVPASSEQ(d.count(), size);
+    WVPASS(d.capacity() > initial);
+    WVPASS(d.capacity() >= size * 8 / 7);
+
+    int found = 0;
+    for (int i = 0; i < size; i++)
+    {
+	Intstr *is = d[i];
+	if (is && is->i == i)
+	    found++;
+    }
+    WVPASSEQ(found, size);
+    WVFAIL(d[size]);
+    WVFAIL(d[-1]);
+
+    // remove the odd ones while iterating, which is allowed
+    IntstrDict::Iter i(d);
+    for (i.rewind(); i.next(); )
+    {
+	if (i->i & 1)
+	    d.remove(i.ptr());
+    }
+    WVPASSEQ(d.count(), size / 2);
+
+    int seen = 0;
+    bool all_even = true;
+    for (i.rewind(); i.next(); )
+    {
+	seen++;
+	if (i->i & 1)
+	    all_even = false;
+    }
+    WVPASSEQ(seen, size / 2);
+    WVPASS(all_even);
+    WVFAIL(d[7]);
+    WVPASS(d[8]);
+
+    // lots of adds and removes shouldn't grow the table forever, since
+    // rehashing throws away the tombstones
+    unsigned cap = d.capacity();
+    for (int round = 0; round < 20; round++)
+    {
+	for (int j = 0; j < 1000; j++)
+	    d.add(new Intstr(size + j, "churn"), true);
+	for (int j = 0; j < 1000; j++)
+	{
+	    Intstr *is = d[size + j];
+	    if (is)
+		d.remove(is);
+	}
+    }
+    WVPASSEQ(d.count(), size / 2);
+    WVPASSEQ(d.capacity(), cap);
+
+    d.zap();
+    WVPASS(d.isempty());
+    WVFAIL(d[8]);
+}
+
+
+static int strsort(const WvString *a, const WvString *b)
+{
+    return strcmp(*a, *b);
+}
+
+
+WVTEST_MAIN("flathash autofree and sorter")
+{
+    TestFlat h(5);
+    WvString *a = new WvString("b"), *b = new WvString("a");
+    h.add(a, false);
+    h.add(b, true);
+    WVFAIL(h.get_autofree(a));
+    WVPASS(h.get_autofree(b));
+    h.set_autofree(a, true);
+    WVPASS(h.get_autofree(WvString("b")));
+
+    WvString order;
+    TestFlat::Sorter i(h, strsort);
+    for (i.rewind(); i.next(); )
+	order.append(*i);
+    WVPASSEQ(order, "ab");
+}
+
+
+WVTEST_MAIN("flathash case-insensitive dict")
+{
+    IntstrCaseDict d;
+    d.add(new Intstr(1, "Content-Type"), true);
+    d.add(new Intstr(2, "HOST"), true);
+    WVPASS(d[WvString("content-type")] && d[WvString("content-type")]->i == 1);
+    WVPASS(d[WvString("Host")] && d[WvString("Host")]->i == 2);
+    WVFAIL(d[WvString("Content-Length")]);
+}
+
+
+// Not really a test: compare lookups in the three kinds of tables.
+DeclareWvFlatDict2(IntstrFlatDict, Intstr, WvString, s);
+DeclareWvScatterDict2(IntstrScatterDict, Intstr, WvString, s);
+DeclareWvDict2(IntstrChainDict, Intstr, WvString, s);
+
+template <class Dict>
+static time_t time_lookups(Dict &d, WvString *keys, int size, int rounds)
+{
+    WvTime start = wvtime();
+    int found = 0;
+    for (int r = 0; r < rounds; r++)
+	for (int j = 0; j < size; j++)
+	    found += d[keys[j]] != NULL;
+    WVPASSEQ(found, size * rounds);
+    return msecdiff(wvtime(), start);
+}
+
+WVTEST_MAIN("flathash vs. the others")
+{
+    const int size = 100000, rounds = 5;
+    Intstr **v = new Intstr *[size];
+    WvString *keys = new WvString[size];
+    for (int j = 0; j < size; j++)
+    {
+	v[j] = new Intstr(j, WvString("/cfg/host%s/key", j));
+	keys[j] = v[j]->s;
+    }
+
+    IntstrFlatDict flat;
+    IntstrScatterDict scatter;
+    IntstrChainDict chain(size);
+    for (int j = 0; j < size; j++)
+    {
+	flat.add(v[j], false);
+	scatter.add(v[j], false);
+	chain.add(v[j], false);
+    }
+
+    printf("%d lookups: WvFlatHash %ld ms, WvScatterHash %ld ms, "
+	   "WvHashTable %ld ms\n", size * rounds,
+	   (long)time_lookups(flat, keys, size, rounds),
+	   (long)time_lookups(scatter, keys, size, rounds),
+	   (long)time_lookups(chain, keys, size, rounds));
+    fflush(stdout);
+
+    for (int j = 0; j < size; j++)
+	delete v[j];
+    deletev v;
+    deletev keys;
+}
@@ -1,6 +1,7 @@
 #include "wvtest.h"
 #include "wvhashtable.h"
 #include "wvstring.h"
+#include "wvtimeutils.h"
 
 struct Intstr
 {
@@ -24,10 +25,37 @@ public:
         { fprintf (stderr, "AutoFreeTest deleted.\n"); }
 };
 
-WVTEST_MAIN("WvHash(string) case insensitivity")
+WVTEST_MAIN("WvHash(string) case sensitivity")
 {
-    WVPASS(WvHash("I'm a weasel") == WvHash("i'M a weAseL"));
-    WVPASS(WvHash("a") == WvHash("A"));
+    WVPASS(WvHashNoCase("I'm a weasel") == WvHashNoCase("i'M a weAseL"));
+    WVPASS(WvHashNoCase("a") == WvHashNoCase("A"));
+    WVPASS(WvHashNoCase("[@Z") != WvHashNoCase("{`z"));
+    WVPASS(WvHashNoCase("\xc9t\xc9") != WvHashNoCase("\xe9t\xe9"));
+    WVPASS(WvHash("a") != WvHash("A"));
+    WVPASS(WvHash("host1.example.com") != WvHash("host2.example.com"));
+    WVPASS(WvHash(WvString("long enough for more than one word"))
+	   == WvHash("long enough for more than one word"));
+}
+
+
+template <class T, class K> struct WvStringCaseDictAccessor
+{
+    static const K *get_key(const T *obj)
+        { return obj; }
+};
+typedef WvHashTable<WvString, WvString,
+	WvStringCaseDictAccessor<WvString, WvString>, StrCaseComp>
+    WvStringCaseDict;
+
+WVTEST_MAIN("case-insensitive tables")
+{
+    WvString a("Some/Mixed/Case/Key"), b("another");
+    WvStringCaseDict t(10);
+    t.add(&a, false);
+    t.add(&b, false);
+    WVPASS(t[WvString("some/mixed/case/key")] == &a);
+    WVPASS(t[WvString("ANOTHER")] == &b);
+    WVPASS(!t[WvString("nope")]);
 }
 
  
@@ -187,3 +215,104 @@ WVTEST_MAIN("hashtest.cc")
         printf("   because [%p] != [0x00000000]\n", d[10]);
 }
 
+
+
+WVTEST_MAIN("growing")
+{
+    const int elems = 20000;
+    IntstrDict2 d(10);
+    unsigned initial = d.numslots;
+
+    for (int count = 0; count < elems; count++)
+	d.add(new Intstr(count, count), true);
+    WVPASS(d.numslots > initial);
+    WVPASSEQ(d.count(), elems);
+
+    bool all_found = true;
+    for (int count = 0; count < elems; count++)
+	if (!d[count] || d[count]->i != count)
+	    all_found = false;
+    WVPASS(all_found);
+
+    // nothing moves while we're iterating, even if we add more
+    {
+	IntstrDict2::Iter i(d);
+	int seen = 0, added = 0;
+	unsigned slots = d.numslots;
+	for (i.rewind(); i.next(); )
+	{
+	    if (i->i < elems)
+		seen++;
+	    if (added < elems)
+		d.add(new Intstr(elems + added++, "x"), true);
+	}
+	WVPASSEQ(seen, elems);
+	WVPASSEQ(d.numslots, slots);
+    }
+    WVPASSEQ(d.count(), elems * 2);
+
+    // and it catches up afterwards
+    for (int count = 0; count < elems; count += 2)
+	d.remove(d[count]);
+    WVPASSEQ(d.count(), elems * 3 / 2);
+    WVPASS(d[1] && !d[2] && d[elems * 2 - 1]);
+    WVPASS(d.numslots > initial);
+
+    d.zap();
+    WVPASS(d.isempty());
+}
+
+
+WVTEST_MAIN("iterator assignment")
+{
+    IntstrDict2 a(10), b(10);
+    unsigned initial = a.numslots;
+    for (int count = 0; count < 5; count++)
+	b.add(new Intstr(count, count), true);
+
+    {
+	IntstrDict2::Iter ia(a), ib(b);
+	ia = ib;
+	int seen = 0;
+	for (ia.rewind(); ia.next(); )
+	    seen++;
+	WVPASSEQ(seen, 5);
+	ia = ia;
+	ib = IntstrDict2::Iter(a);
+    }
+
+    // nobody's iterating over a anymore, so it's free to grow
+    for (int count = 0; count < 20000; count++)
+	a.add(new Intstr(count, count), true);
+    WVPASS(a.numslots > initial);
+}
+
+
+// Not really a test: shows that lookups don't get slower as the table
+// grows way past the size it was created with.
+WVTEST_MAIN("lookup time vs. size")
+{
+    const int lookups = 200000;
+    for (int elems = 10; elems <= 100000; elems *= 10)
+    {
+	IntstrDict d(10);
+	WvString *keys = new WvString[elems];
+	for (int count = 0; count < elems; count++)
+	{
+	    d.add(new Intstr(count, count), true);
+	    keys[count] = count;
+	}
+
+	WvTime start = wvtime();
+	int found = 0;
+	for (int count = 0; count < lookups; count++)
+	    found += d[keys[count % elems]] != NULL;
+	time_t msec = msecdiff(wvtime(), start);
+	WVPASSEQ(found, lookups);
+
+	printf("%6d elements in %6u slots: %ld ns per lookup\n",
+	       elems, d.numslots, (long)(msec * 1000000 / lookups));
+	fflush(stdout);
+	deletev keys;
+    }
+}
@@ -2,6 +2,7 @@
 #include "wvtest.h"
 #include "wvscatterhash.h"
 #include "wvstring.h"
+#include "wvtimeutils.h"
 
 
 DeclareWvScatterTable2(TestScatter, WvString);
@@ -106,3 +107,81 @@ WVTEST_MAIN("scatter hashing Iter")
     WVPASS(scatterHash.isempty());
     WVPASS(scatterHash.count() == 0);
 }
+
+
+WVTEST_MAIN("scatter hashing growth")
+{
+    const int size = 20000;
+    TestScatter h(10);
+    WvString **strings = new WvString *[size * 2];
+    for (int i = 0; i < size * 2; i++)
+        strings[i] = new WvString("Test%s", i);
+
+    for (int i = 0; i < size; i++)
+        h.add(strings[i], false);
+    WVPASSEQ(h.count(), size);
+    WVPASSEQ(h.slowcount(), size);
+
+    bool all_found = true;
+    for (int i = 0; i < size; i++)
+        if (h[*strings[i]] != strings[i])
+            all_found = false;
+    WVPASS(all_found);
+
+    // removing and adding while iterating doesn't upset the iterator
+    {
+        TestScatter::Iter i(h);
+        int seen = 0, added = 0;
+        for (i.rewind(); i.next(); )
+        {
+            if (h[*i.ptr()] == i.ptr())
+                seen++;
+            h.remove(i.ptr());
+            if (added < 100)
+                h.add(strings[size + added++], false);
+        }
+        WVPASS(seen >= size);
+    }
+    WVPASS(h.count() <= 100);
+    WVPASSEQ(h.count(), h.slowcount());
+
+    for (int i = 0; i < size * 2; i++)
+        h.add(strings[i], true);
+    all_found = true;
+    for (int i = 0; i < size * 2; i++)
+        if (h[*strings[i]] != strings[i])
+            all_found = false;
+    WVPASS(all_found);
+    h.zap();
+    deletev strings;
+}
+
+
+// Not really a test: shows that lookups don't get slower as the table
+// grows way past the size it was created with.
+WVTEST_MAIN("scatter lookup time vs. size")
+{
+    const int lookups = 200000;
+    for (int elems = 10; elems <= 100000; elems *= 10)
+    {
+        TestScatter h(10);
+        WvString *keys = new WvString[elems];
+        for (int i = 0; i < elems; i++)
+        {
+            keys[i] = i;
+            h.add(new WvString(keys[i]), true);
+        }
+
+        WvTime start = wvtime();
+        int found = 0;
+        for (int i = 0; i < lookups; i++)
+            found += h[keys[i % elems]] != NULL;
+        time_t msec = msecdiff(wvtime(), start);
+        WVPASSEQ(found, lookups);
+
+        printf("%6d elements: %ld ns per lookup\n",
+               elems, (long)(msec * 1000000 / lookups));
+        fflush(stdout);
+        deletev keys;
+    }
+}
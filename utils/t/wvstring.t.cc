@@ -1,5 +1,6 @@
 #include "wvtest.h"
 #include "wvstring.h"
+#include "wvtimeutils.h"
 
 
 WVTEST_MAIN("basic")
@@ -54,8 +55,8 @@ WVTEST_MAIN("basic")
 
 WVTEST_MAIN("copying")
 {
-    WvString a1, b1, c1(""), d1(""), e1("hello"), f1("Hello"), g1(0),
-    		h1(1), i1(1.0);
+    WvString a1, b1, c1(""), d1(""), e1("hello, this is a long string"),
+    		f1("Hello"), g1(0), h1(1), i1(1.0);
     WvString a2(a1), b2(b1), c2(c1), d2(d1), e2(e1), f2(f1), g2(g1), 
     		h2(h1), i2(i1);
     
@@ -68,6 +69,13 @@ WVTEST_MAIN("copying")
     { WvString x(e1); } // copy and destroy
     WVPASS(e1.edit() == olde1); // no unnecessary copies
     
+    // short strings live inside the WvString, so they can't be shared
+    WVPASS(f1+0 != f2+0);
+    WVPASS(f1.is_unique());
+    WVPASS(f2.is_unique());
+    const char *oldf1 = f1;
+    WVPASS(f1.edit() == oldf1);
+    
     // make sure values are equivalent
     WVPASS(a1 == a2);
     WVPASS(b1 == b2);
@@ -229,6 +237,8 @@ class WvFooString : public WvFastString
 public:
 	static unsigned get_nullbuf_links()
 	{ return nullbuf.links; }
+	static unsigned get_smallbuf_links()
+	{ return smallbuf.links; }
 };
 WVTEST_MAIN("nullbuf link counting")
 {
@@ -249,3 +259,91 @@ WVTEST_MAIN("nullbuf link counting")
     // ensure that we don't leak references when creating WvStrings
     WVPASS(before == after);
 }
+
+
+// Not much of a test, but prints how many WvStringBufs we had to malloc()
+// and how fast copying is for short strings (kept in small[]) compared to
+// long ones (which still work like they always did).
+static void string_bench(const char *name, WvStringParm pad)
+{
+    const int count = 100000, rounds = 10;
+    WvString *v = new WvString[count], *copies = new WvString[count];
+    
+    unsigned before = WvFooString::get_smallbuf_links();
+    WvTime start = wvtime();
+    for (int i = 0; i < count; i++)
+	v[i] = WvString("%s%s", pad, i);
+    time_t build = msecdiff(wvtime(), start);
+    unsigned mallocs = count - (WvFooString::get_smallbuf_links() - before);
+    
+    start = wvtime();
+    for (int r = 0; r < rounds; r++)
+    {
+	for (int i = 0; i < count; i++)
+	    copies[i] = v[i];
+	for (int i = 0; i < count; i++)
+	    copies[i] = WvString::null;
+    }
+    time_t copy = msecdiff(wvtime(), start);
+    
+    printf("%s strings: %u of %d malloc()ed, built in %ld ms, "
+	   "%d copies in %ld ms\n",
+	   name, mallocs, count, (long)build, count * rounds, (long)copy);
+    fflush(stdout);
+    
+    if (pad.len() + 7 < WVSTRING_SMALL)
+	WVPASSEQ(mallocs, 0);
+    else
+	WVPASSEQ(mallocs, count);
+    WVPASSEQ(v[count-1], WvString("%s%s", pad, count-1));
+    
+    delete[] copies;
+    delete[] v;
+}
+
+
+WVTEST_MAIN("small string benchmark")
+{
+    unsigned before = WvFooString::get_smallbuf_links();
+    string_bench("short", "key");
+    string_bench("long", "/some/rather/long/uniconf/key/");
+    WVPASSEQ(WvFooString::get_smallbuf_links(), before);
+    
+    // numbers never need a malloc
+    WvString n(-2147483647LL * 1000000LL), d(-1.5e300);
+    WVPASSEQ(n, "-2147483647000000");
+    WVPASSEQ(d, "-1.5e+300");
+    WVPASS(n.is_unique());
+    WVPASSEQ(WvFooString::get_smallbuf_links(), before + 2);
+}
+
+
+static WvString short_string()
+{
+    return WvString("%s", 42);
+}
+
+
+WVTEST_MAIN("WvFastString outliving a short WvString")
+{
+    unsigned before = WvFooString::get_smallbuf_links();
+    WvFastString f = short_string();
+    WvFastString *g;
+    {
+	WvString s("short");
+	WvStringParm parm = s;
+	g = new WvFastString(parm);
+    }
+    WVPASSEQ(f, "42");
+    WVPASSEQ(*g, "short");
+    
+    // ...and they got their own small[] copies, not a malloc()
+    WVPASSEQ(WvFooString::get_smallbuf_links(), before + 2);
+    {
+	WvFastString o = g->offset(2);
+	WVPASSEQ(o, "ort");
+	WVPASSEQ(WvFooString::get_smallbuf_links(), before + 3);
+    }
+    delete g;
+    WVPASSEQ(WvFooString::get_smallbuf_links(), before + 1);
+}
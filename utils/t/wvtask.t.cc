@@ -111,6 +111,116 @@ WVTEST_MAIN("simple")
     WVPASS("--REPEATING TEST--");
     testme(); // make sure deletion/creation works
 }
+
+static void stacktask(void *userdata)
+{
+    *(const void **)userdata = WvTaskMan::current_top_of_stack();
+    WvTaskMan::yield();
+}
+
+
+WVTEST_MAIN("lots of tasks")
+{
+    // far more than would ever have fit in the old stack arena
+    const int num = 20000;
+    WvTaskMan *man = WvTaskMan::get();
+    WvTask **tasks = new WvTask *[num];
+    const void **tops = new const void *[num];
+    
+    for (int i = 0; i < num; i++)
+    {
+	tasks[i] = man->start("lots", stacktask, &tops[i]);
+	man->run(*tasks[i]);
+    }
+    
+    // every task really got its own stack
+    int distinct = 0;
+    for (int i = 0; i < num; i++)
+	if (!i || tops[i] != tops[i-1])
+	    distinct++;
+    WVPASSEQ(distinct, num);
+    
+    bool all_done = true;
+    for (int i = 0; i < num; i++)
+    {
+	man->run(*tasks[i]);
+	if (tasks[i]->isrunning())
+	    all_done = false;
+	tasks[i]->recycle();
+    }
+    WVPASS(all_done);
+    
+    // a recycled stack gets used again for the next task
+    const void *top = NULL;
+    WvTask *t = man->start("again", stacktask, &top);
+    man->run(*t);
+    bool reused = false;
+    for (int i = 0; i < num; i++)
+	if (tops[i] == top)
+	    reused = true;
+    WVPASS(reused);
+    man->run(*t);
+    t->recycle();
+    
+    deletev tops;
+    deletev tasks;
+    man->unlink();
+}
+
+
+static void spintask(void *userdata)
+{
+    long count = (long)userdata;
+    while (count-- > 0)
+	WvTaskMan::yield();
+}
+
+
+static ucontext_t ping_ctx, pong_ctx;
+
+static void pong(long count)
+{
+    while (count-- > 0)
+	swapcontext(&pong_ctx, &ping_ctx);
+}
+
+
+// Not really a test: how many task switches we can do per second, compared
+// to plain old swapcontext().
+WVTEST_MAIN("context switch speed")
+{
+    const long rounds = 500000;
+    WvTaskMan *man = WvTaskMan::get();
+    
+    WvTask *t = man->start("spin", spintask, (void *)rounds);
+    WvTime start = wvtime();
+    while (t->isrunning())
+	man->run(*t);
+    time_t msec = msecdiff(wvtime(), start);
+    t->recycle();
+    
+    char *stack = new char[64*1024];
+    getcontext(&pong_ctx);
+    pong_ctx.uc_stack.ss_sp = stack;
+    pong_ctx.uc_stack.ss_size = 64*1024;
+    pong_ctx.uc_link = &ping_ctx;
+    makecontext(&pong_ctx, (void (*)(void))pong, 1, rounds);
+    WvTime start2 = wvtime();
+    for (long i = 0; i <= rounds; i++)
+	swapcontext(&ping_ctx, &pong_ctx);
+    time_t msec2 = msecdiff(wvtime(), start2);
+    deletev stack;
+    
+    printf("%ld switches: WvTask %ld/sec, swapcontext %ld/sec\n",
+	   rounds * 2,
+	   (long)(rounds * 2 * 1000.0 / (msec ? msec : 1)),
+	   (long)(rounds * 2 * 1000.0 / (msec2 ? msec2 : 1)));
+    fflush(stdout);
+    WVPASS(msec >= 0);
+    
+    man->unlink();
+}
+
 #ifdef TASKTEST_IS_CONVERTED
 WVTEST_MAIN("tasktest.cc")
 {
@@ -734,6 +734,139 @@ void WvCircularBufStore::compact(void *data, size_t size,
 
 
 
+/***** WvBufChunkPool *****/
+
+// size classes go from MIN_CHUNK (2^6) to MAX_CHUNK (2^20)
+#define NUM_CHUNK_CLASSES 15
+
+// a chunk waiting to be reused remembers the next one in its own first bytes
+struct WvFreeChunk
+{
+    WvFreeChunk *next;
+};
+
+// these are all plain old data, so they're ready before any static
+// constructor gets a chance to use a buffer.
+static WvFreeChunk *free_chunks[NUM_CHUNK_CLASSES];
+static WvBufChunkPool::Stats chunk_stats;
+size_t WvBufChunkPool::limit = 4 * 1048576;
+
+
+/** Returns the size class for a chunk of the given size, rounding it up. */
+static int chunk_class(size_t &size)
+{
+    int c = 0;
+    size_t classsize = WvBufChunkPool::MIN_CHUNK;
+    while (classsize < size)
+    {
+        classsize <<= 1;
+        c++;
+    }
+    size = classsize;
+    return c;
+}
+
+
+void *WvBufChunkPool::get(size_t &size)
+{
+    void *chunk;
+    if (size > MAX_CHUNK)
+    {
+        chunk_stats.oversize++;
+        chunk = memops.newarray(size);
+    }
+    else
+    {
+        int c = chunk_class(size);
+        if (free_chunks[c])
+        {
+            chunk_stats.hits++;
+            chunk_stats.cached -= size;
+            chunk = free_chunks[c];
+            free_chunks[c] = free_chunks[c]->next;
+        }
+        else
+        {
+            chunk_stats.misses++;
+            chunk = memops.newarray(size);
+        }
+    }
+
+    chunk_stats.in_use += size;
+    if (chunk_stats.in_use > chunk_stats.in_use_max)
+        chunk_stats.in_use_max = chunk_stats.in_use;
+    return chunk;
+}
+
+
+void WvBufChunkPool::put(void *chunk, size_t size)
+{
+    chunk_stats.in_use -= size;
+    if (size > MAX_CHUNK || chunk_stats.cached + size > limit)
+    {
+        memops.deletearray(chunk);
+        return;
+    }
+
+    int c = chunk_class(size);
+    WvFreeChunk *f = (WvFreeChunk *)chunk;
+    f->next = free_chunks[c];
+    free_chunks[c] = f;
+
+    chunk_stats.cached += size;
+    if (chunk_stats.cached > chunk_stats.cached_max)
+        chunk_stats.cached_max = chunk_stats.cached;
+}
+
+
+void WvBufChunkPool::trim()
+{
+    for (int c = 0; c < NUM_CHUNK_CLASSES; c++)
+    {
+        while (free_chunks[c])
+        {
+            WvFreeChunk *f = free_chunks[c];
+            free_chunks[c] = f->next;
+            memops.deletearray(f);
+        }
+    }
+    chunk_stats.cached = 0;
+}
+
+
+const WvBufChunkPool::Stats &WvBufChunkPool::stats()
+{
+    return chunk_stats;
+}
+
+
+/**
+ * A WvCircularBufStore whose memory comes from WvBufChunkPool, and goes
+ * back there when we're done with it.
+ */
+class WvPooledBufStore : public WvCircularBufStore
+{
+    void *chunk;
+    size_t chunksize;
+
+public:
+    WvPooledBufStore(int _granularity, size_t _size) :
+        WvCircularBufStore(_granularity, NULL, 0, 0, false),
+        chunksize(_size)
+    {
+        chunk = WvBufChunkPool::get(chunksize);
+        // the size class might not be a multiple of the granularity
+        reset(chunk, 0, chunksize - chunksize % granularity, false);
+    }
+
+    virtual ~WvPooledBufStore()
+    {
+        WvBufChunkPool::put(chunk, chunksize);
+    }
+};
+
+
+
 /***** WvLinkedBufferStore *****/
 
 WvLinkedBufferStore::WvLinkedBufferStore(int _granularity) :
@@ -986,9 +1119,10 @@ void *WvLinkedBufferStore::mutablepeek(int offset, size_t count)
     assert(buf && "attempted to peek() with invalid offset or count");
     
     // return data if we have enough
+    // coalesce() counts from the start of buf, not from offset
     size_t availpeek = buf->peekable(offset);
     if (availpeek < count)
-        buf = coalesce(it, count);
+        buf = coalesce(it, offset > 0 ? offset + count : count);
     return buf->mutablepeek(offset, count);
 }
 
@@ -997,7 +1131,7 @@ WvBufStore *WvLinkedBufferStore::newbuffer(size_t minsize)
 {
     minsize = roundup(minsize, granularity);
     //return new WvInPlaceBufStore(granularity, minsize);
-    return new WvCircularBufStore(granularity, minsize);
+    return new WvPooledBufStore(granularity, minsize);
 }
 
 
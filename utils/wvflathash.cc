@@ -0,0 +1,265 @@
+/*
+ * Worldvisions Weaver Software:
+ *   Copyright (C) 1997-2003 Net Integration Technologies, Inc.
+ *
+ * An open-addressing hash table container.  See wvflathash.h.
+ *
+ * The slots are split into groups of GROUP (16) slots, each with a matching
+ * group of control bytes.  A key's (scrambled) hash picks the first group
+ * to look in and a seven-bit "tag" to look for.  We check all 16 control
+ * bytes of the group in one go, compare() the elements whose tags match,
+ * and if the group has any EMPTY slots, the key can't be anywhere further
+ * along, so we give up.  Otherwise we try the next group in a triangular
+ * sequence (+1, +2, +3, ...), which visits every group exactly once since
+ * there's a power-of-two number of them.
+ */
+#include "wvflathash.h"
+#include <assert.h>
+#include <string.h>
+
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+
+// The WvHash() functions for ints and pointers don't scramble anything,
+// so we do it here (this is the MurmurHash3 finalizer).  That way the tag
+// and the group number both come from well-mixed bits.
+static inline unsigned mix(unsigned h)
+{
+    h ^= h >> 16;
+    h *= 0x85ebca6bU;
+    h ^= h >> 13;
+    h *= 0xc2b2ae35U;
+    h ^= h >> 16;
+    return h;
+}
+
+
+static inline unsigned char tag_of(unsigned mixed)
+{
+    return mixed >> 25;
+}
+
+
+// Returns a bitmask of which of the GROUP control bytes at g equal c.
+static inline unsigned match(const unsigned char *g, unsigned char c)
+{
+#ifdef __SSE2__
+    __m128i ctrl = _mm_loadu_si128((const __m128i *)g);
+    return _mm_movemask_epi8(_mm_cmpeq_epi8(ctrl, _mm_set1_epi8((char)c)));
+#else
+    unsigned bits = 0;
+    for (int i = 0; i < WvFlatHashBase::GROUP; i++)
+	if (g[i] == c)
+	    bits |= 1 << i;
+    return bits;
+#endif
+}
+
+
+// Returns a bitmask of the control bytes at g that aren't full slots,
+// ie. EMPTY or DELETED (which both have the top bit set).
+static inline unsigned match_free(const unsigned char *g)
+{
+#ifdef __SSE2__
+    return _mm_movemask_epi8(_mm_loadu_si128((const __m128i *)g));
+#else
+    unsigned bits = 0;
+    for (int i = 0; i < WvFlatHashBase::GROUP; i++)
+	if (g[i] & 0x80)
+	    bits |= 1 << i;
+    return bits;
+#endif
+}
+
+
+static inline unsigned lowest_bit(unsigned bits)
+{
+    return __builtin_ctz(bits);
+}
+
+
+WvFlatHashBase::WvFlatHashBase(unsigned _numslots)
+{
+    // _numslots is how many elements we expect; make room for that many
+    // without growing.
+    unsigned want = GROUP;
+    while (want / 8 * 7 < _numslots)
+	want *= 2;
+    setup(want);
+}
+
+
+WvFlatHashBase::~WvFlatHashBase()
+{
+    deletev xslots;
+    deletev ctrl;
+}
+
+
+void WvFlatHashBase::setup(unsigned _numslots)
+{
+    numslots = _numslots;
+    xslots = new Slot[numslots];
+    ctrl = new unsigned char[numslots];
+    memset(ctrl, EMPTY, numslots);
+    num = deleted = 0;
+}
+
+
+unsigned WvFlatHashBase::genfind(const void *key, unsigned hash) const
+{
+    unsigned mixed = mix(hash);
+    unsigned char tag = tag_of(mixed);
+    unsigned mask = numslots / GROUP - 1;
+    unsigned group = mixed & mask;
+
+    for (unsigned step = 1; step <= mask + 1; step++)
+    {
+	const unsigned char *g = ctrl + group * GROUP;
+	for (unsigned bits = match(g, tag); bits; bits &= bits - 1)
+	{
+	    unsigned slot = group * GROUP + lowest_bit(bits);
+	    if (xslots[slot].hash == hash && compare(key, xslots[slot].data))
+		return slot;
+	}
+	if (match(g, EMPTY))
+	    break;
+	group = (group + step) & mask;
+    }
+
+    return null_idx;
+}
+
+
+void *WvFlatHashBase::genfind_or_null(const void *key, unsigned hash) const
+{
+    unsigned slot = genfind(key, hash);
+    if (slot == null_idx)
+	return NULL;
+    else
+	return xslots[slot].data;
+}
+
+
+// Returns the first EMPTY or DELETED slot along hash's probe sequence.
+// There always is one, since we never let the table fill up.
+unsigned WvFlatHashBase::find_free(unsigned hash) const
+{
+    unsigned mixed = mix(hash);
+    unsigned mask = numslots / GROUP - 1;
+    unsigned group = mixed & mask;
+
+    for (unsigned step = 1; ; step++)
+    {
+	unsigned bits = match_free(ctrl + group * GROUP);
+	if (bits)
+	    return group * GROUP + lowest_bit(bits);
+	group = (group + step) & mask;
+    }
+}
+
+
+void WvFlatHashBase::rehash(unsigned newslots)
+{
+    Slot *oldslots = xslots;
+    unsigned char *oldctrl = ctrl;
+    unsigned oldnumslots = numslots;
+    size_t oldnum = num;
+
+    setup(newslots);
+
+    for (unsigned i = 0; i < oldnumslots; i++)
+    {
+	if (!is_full(oldctrl[i]))
+	    continue;
+	unsigned slot = find_free(oldslots[i].hash);
+	ctrl[slot] = tag_of(mix(oldslots[i].hash));
+	xslots[slot] = oldslots[i];
+    }
+    num = oldnum;
+
+    deletev oldslots;
+    deletev oldctrl;
+}
+
+
+void WvFlatHashBase::_add(void *data, unsigned hash, bool autofree)
+{
+    if (num + deleted + 1 > numslots / 8 * 7)
+    {
+	// if it's mostly tombstones, just clean up; otherwise grow.
+	if (num + 1 > numslots / 16 * 7)
+	    rehash(numslots * 2);
+	else
+	    rehash(numslots);
+    }
+
+    unsigned slot = find_free(hash);
+    if (ctrl[slot] == DELETED)
+	deleted--;
+    ctrl[slot] = tag_of(mix(hash));
+    xslots[slot].data = data;
+    xslots[slot].hash = hash;
+    xslots[slot].autofree = autofree;
+    num++;
+}
+
+
+void WvFlatHashBase::_remove(const void *key, unsigned hash)
+{
+    unsigned slot = genfind(key, hash);
+    if (slot == null_idx)
+	return;
+
+    void *data = xslots[slot].data;
+    bool autofree = xslots[slot].autofree;
+
+    // Lookups stop at the first group with an EMPTY slot in it, so if this
+    // group already has one, nobody can be probing past it and we don't
+    // need to leave a tombstone.
+    if (match(ctrl + slot / GROUP * GROUP, EMPTY))
+	ctrl[slot] = EMPTY;
+    else
+    {
+	ctrl[slot] = DELETED;
+	deleted++;
+    }
+    num--;
+
+    if (autofree)
+	do_delete(data);
+}
+
+
+void WvFlatHashBase::_zap()
+{
+    for (unsigned i = 0; i < numslots; i++)
+    {
+	if (is_full(ctrl[i]) && xslots[i].autofree)
+	    do_delete(xslots[i].data);
+    }
+    memset(ctrl, EMPTY, numslots);
+    num = deleted = 0;
+}
+
+
+void WvFlatHashBase::_set_autofree(const void *key, unsigned hash,
+				   bool autofree)
+{
+    unsigned slot = genfind(key, hash);
+    if (slot != null_idx)
+	xslots[slot].autofree = autofree;
+}
+
+
+bool WvFlatHashBase::_get_autofree(const void *key, unsigned hash) const
+{
+    unsigned slot = genfind(key, hash);
+    if (slot != null_idx)
+	return xslots[slot].autofree;
+
+    assert(0 && "You checked auto_free of a nonexistant thing.");
+    return false;
+}
@@ -1,19 +1,76 @@
 #include "wvhash.h"
+#include <stdint.h>
 
-// Note: this hash function is case-insensitive since it ignores the
-// bit in ASCII that defines case.  You may want to take advantage of this.
-unsigned int WvHash(const char *s)
+// These are MurmurHash64A (by Austin Appleby, public domain), which chews
+// through the string a whole 64-bit word at a time and spreads every input
+// bit across the whole result.  The old shift-and-xor hash only looked at
+// the bottom five bits of each character, so it collided all the time on
+// things like hostnames and paths that only differ by a digit or two.
+
+#define HASH_M 0xc6a4a7935bd1e995ULL
+#define HASH_R 47
+
+static inline uint64_t hash_word(uint64_t h, uint64_t k)
+{
+    k *= HASH_M;
+    k ^= k >> HASH_R;
+    k *= HASH_M;
+    h ^= k;
+    h *= HASH_M;
+    return h;
+}
+
+
+static inline unsigned hash_finish(uint64_t h)
+{
+    h ^= h >> HASH_R;
+    h *= HASH_M;
+    h ^= h >> HASH_R;
+    return (unsigned)(h ^ (h >> 32));
+}
+
+
+// Fold ASCII uppercase to lowercase in all 8 bytes of w at once, the same
+// way strcasecmp() does in the C locale.
+static inline uint64_t word_tolower(uint64_t w)
+{
+    const uint64_t ones = 0x0101010101010101ULL, highs = ones * 0x80;
+    uint64_t low7 = w & ~highs;
+    uint64_t above_Z = low7 + ones * (0x7f - 'Z');
+    uint64_t from_A = low7 + ones * (0x80 - 'A');
+    uint64_t upper = (from_A ^ above_Z) & ~w & highs;
+    return w | (upper >> 2);
+}
+
+
+template <bool nocase>
+static inline unsigned hash_bytes(const char *s, size_t len)
+{
+    uint64_t h = len * HASH_M;
+    const char *end = s + (len & ~(size_t)7);
+
+    for (; s < end; s += 8)
+    {
+	uint64_t k;
+	memcpy(&k, s, sizeof(k)); // unaligned-safe; compiles to a plain load
+	h = hash_word(h, nocase ? word_tolower(k) : k);
+    }
+
+    if (len & 7)
+    {
+	uint64_t k = 0;
+	memcpy(&k, s, len & 7);
+	h = hash_word(h, nocase ? word_tolower(k) : k);
+    }
+
+    return hash_finish(h);
+}
+
+
+unsigned WvHash(const char *s)
 {
-    unsigned hash = 0, slide, andval;
     if (!s) return 0;
-    
-    slide = sizeof(hash)*8 - 5;
-    andval = 0x1F << slide;
-    
-    while (*s)
-	hash = (hash<<4) ^ (*(s++) & 0x1F) ^ ((hash & andval) >> slide);
-    
-    return hash;
+    return hash_bytes<false>(s, strlen(s));
 }
 
 unsigned WvHash(WvStringParm s)
@@ -21,6 +78,17 @@ unsigned WvHash(WvStringParm s)
     return !s ? 0 : WvHash((const char *)s);
 }
 
+unsigned WvHashNoCase(const char *s)
+{
+    if (!s) return 0;
+    return hash_bytes<true>(s, strlen(s));
+}
+
+unsigned WvHashNoCase(WvStringParm s)
+{
+    return !s ? 0 : WvHashNoCase((const char *)s);
+}
+
 // FIXME: does this suck?
 unsigned WvHash(const int &i)
 {
@@ -7,6 +7,12 @@
 #include "wvhashtable.h"
 #include "wvstring.h"
 
+// grow when the average slot has more than this many elements in it
+#define MAX_LOAD 3
+
+// how many old slots to empty out per add() or remove() while growing
+#define REHASH_STEP 4
+
 // we do not accept the _numslots value directly.  Instead, we find the
 // next number of slots which is >= _numslots and one less then a power
 // of 2.  This usually results in a fairly good hash table size.
@@ -16,31 +22,68 @@ WvHashTableBase::WvHashTableBase(unsigned _numslots)
     while ((_numslots >>= 1) != 0)
 	slides++;
     numslots = (1 << slides) - 1;
+
+    oldslots = NULL;
+    oldnumslots = rehash_idx = 0;
+    num = 0;
+    iterators = NULL;
+}
+
+
+WvHashTableBase::~WvHashTableBase()
+{
+    for (IterBase *i = iterators; i; i = i->nextiter)
+	i->tbl = NULL;
+}
+
+
+void WvHashTableBase::IterBase::detach()
+{
+    if (!tbl)
+	return;
+    IterBase **i;
+    for (i = &tbl->iterators; *i != this; i = &(*i)->nextiter)
+	;
+    *i = nextiter;
 }
 
 
 // never returns NULL.  If the object is not found, the 'previous' link
 // is the last one in the list.
-WvLink *WvHashTableBase::prevlink(WvListBase *wvslots, const void *data,
-			      unsigned hash) const
+WvLink *WvHashTableBase::prevlink(const void *data, unsigned hash,
+				  WvListBase **list) const
 {
-    WvListBase::IterBase i(wvslots[hash % numslots]);
+    // while we're growing, the element might not have moved yet
+    if (oldslots && hash % oldnumslots >= rehash_idx)
+    {
+	WvListBase &old = oldslots[hash % oldnumslots];
+	for (WvLink *prev = &old.head; prev->next; prev = prev->next)
+	{
+	    if (compare(data, prev->next->data))
+	    {
+		if (list)
+		    *list = &old;
+		return prev;
+	    }
+	}
+    }
+
+    WvListBase &slot = wvslots[hash % numslots];
     WvLink *prev;
-    
-    i.rewind();
-    for (prev = i.cur(); prev->next; prev = i.next())
+    for (prev = &slot.head; prev->next; prev = prev->next)
     {
 	if (compare(data, prev->next->data))
 	    break;
     }
+    if (list)
+	*list = &slot;
     return prev;
 }
 
 
-void *WvHashTableBase::genfind(WvListBase *wvslots, const void *data,
-			      unsigned hash) const
+void *WvHashTableBase::genfind(const void *data, unsigned hash) const
 {
-    WvLink *prev = prevlink(wvslots, data, hash);
+    WvLink *prev = prevlink(data, hash);
     if (prev->next)
 	return prev->next->data;
     else
@@ -48,12 +91,76 @@ void *WvHashTableBase::genfind(WvListBase *wvslots, const void *data,
 }
 
 
+WvListBase *WvHashTableBase::addslot(unsigned hash)
+{
+    num++;
+    if (!iterators)
+    {
+	if (!oldslots && num > (size_t)numslots * MAX_LOAD)
+	{
+	    // start growing: the current slots become the old ones, and
+	    // we'll move their contents over bit by bit.
+	    oldslots = wvslots;
+	    oldnumslots = numslots;
+	    rehash_idx = 0;
+	    numslots = numslots * 2 + 1;
+	    wvslots = new_slots(numslots);
+	}
+	rehash_step(REHASH_STEP);
+    }
+    return &wvslots[hash % numslots];
+}
+
+
+void WvHashTableBase::removed()
+{
+    num--;
+    if (!iterators)
+	rehash_step(REHASH_STEP);
+}
+
+
+// Move the contents of the next nslots old slots into the new ones.  The
+// WvLinks themselves move, so nobody's WvLink pointers go stale.
+void WvHashTableBase::rehash_step(unsigned nslots)
+{
+    for (; oldslots && nslots > 0; nslots--)
+    {
+	WvListBase &old = oldslots[rehash_idx];
+	WvLink *link;
+	while ((link = old.head.next) != NULL)
+	{
+	    old.head.next = link->next;
+	    WvListBase &slot = wvslots[do_hash(link->data) % numslots];
+	    link->next = NULL;
+	    slot.tail->next = link;
+	    slot.tail = link;
+	}
+	old.tail = &old.head;
+
+	if (++rehash_idx >= oldnumslots)
+	    zap_old();
+    }
+}
+
+
+void WvHashTableBase::zap_old()
+{
+    if (oldslots)
+	delete_slots(oldslots);
+    oldslots = NULL;
+    oldnumslots = rehash_idx = 0;
+}
+
+
 size_t WvHashTableBase::count() const
 {
     size_t count = 0;
     
     for (unsigned i = 0; i < numslots; i++)
 	count += wvslots[i].count();
+    for (unsigned i = rehash_idx; oldslots && i < oldnumslots; i++)
+	count += oldslots[i].count();
     return count;
 }
 
@@ -63,6 +170,9 @@ bool WvHashTableBase::isempty() const
     for (unsigned i = 0; i < numslots; i++)
         if (! wvslots[i].isempty())
             return false;
+    for (unsigned i = rehash_idx; oldslots && i < oldnumslots; i++)
+        if (! oldslots[i].isempty())
+            return false;
     return true;
 }
 
@@ -74,24 +184,24 @@ WvLink *WvHashTableBase::IterBase::next()
     if (link)
 	return link;
 
-    // Keep local copies of information, so we don't have to poke into the
-    // data structure.
     WvLink *_link = NULL;	// we would have returned if link were non-NULL
-    WvListBase *begin = tbl->wvslots;
-    WvListBase *cur = begin + tblindex;
-    WvListBase *end = begin + tbl->numslots - 1;
+    WvHashTableBase *t = tbl;
 
     // We'll go from the current bucket to the last bucket, in hopes that
-    // one of them will contain something.
-    while (cur < end)
+    // one of them will contain something.  If we're in the middle of
+    // growing, the old buckets count as coming after the new ones.
+    unsigned end = t->numslots + (t->oldslots ? t->oldnumslots : 0) - 1;
+    while (tblindex < end)
     {
-	++cur;
-	_link = cur->head.next;
+	++tblindex;
+	if (tblindex < t->numslots)
+	    _link = t->wvslots[tblindex].head.next;
+	else
+	    _link = t->oldslots[tblindex - t->numslots].head.next;
 	if (_link)
 	    break;
     }
 
-    tblindex = cur - begin;	// Compute the tblindex.
     link = _link;		// Save the link
     return link;
 }
@@ -19,6 +19,16 @@ const unsigned WvScatterHashBase::prime_numbers[]
        33554393u, 67108859u, 134217689u, 268435399u,
        536870909u, 1073741789u, 2147483647u, 4294967281u};
 
+// how many old slots to move per add() or remove() while we're growing
+#define MIGRATE_STEP 8
+
+// if there are iterators around, we put off growing until we're this full
+#define ITER_LOAD_FACTOR 0.9
+
+// tables up to this many slots are still rebuilt in one go, same as always;
+// it's cheap, and some people depend on the resulting order
+#define SMALL_TABLE 1024
+
 // we do not accept the _numslots value directly.  Instead, we find the
 // next number of xslots which is >= _numslots and take the closest prime
 // number
@@ -41,46 +51,107 @@ WvScatterHashBase::WvScatterHashBase(unsigned _numslots)
     xstatus = new Status[numslots];
     memset(xslots, 0, numslots * sizeof(xslots[0]));
     memset(xstatus, 0, numslots * sizeof(xstatus[0]));
+
+    oldslots = NULL;
+    oldstatus = NULL;
+    oldnumslots = migrate_idx = 0;
+    iterators = NULL;
+}
+
+WvScatterHashBase::~WvScatterHashBase()
+{
+    for (IterBase *i = iterators; i; i = i->nextiter)
+        i->table = NULL;
+
+    deletev xslots;
+    deletev xstatus;
+    deletev oldslots;
+    deletev oldstatus;
+}
+
+void WvScatterHashBase::IterBase::detach()
+{
+    if (!table)
+        return;
+    IterBase **i;
+    for (i = &table->iterators; *i != this; i = &(*i)->nextiter)
+        ;
+    *i = nextiter;
 }
 
 size_t WvScatterHashBase::slowcount() const 
 {   
     unsigned count = 0;
-    for (unsigned index = 0; index < numslots; index++)
+    for (unsigned index = 0; index < totalslots(); index++)
     {
-        if (IS_OCCUPIED(xstatus[index]))
+        if (IS_OCCUPIED(status_at(index)))
             count++;
     }
 
     return count;
 }
 
+// Move the elements in the next nslots old slots to the new table.  Once
+// they're all gone, throw the old table away.
+void WvScatterHashBase::migrate(unsigned nslots)
+{
+    for (; oldslots && nslots > 0; nslots--)
+    {
+        if (IS_OCCUPIED(oldstatus[migrate_idx]))
+        {
+            insert(oldslots[migrate_idx], do_hash(oldslots[migrate_idx]),
+                   oldstatus[migrate_idx]);
+            // leave a tombstone, so lookups in the old table still work
+            oldstatus[migrate_idx] = 1;
+        }
+
+        if (++migrate_idx >= oldnumslots)
+        {
+            deletev oldslots;
+            deletev oldstatus;
+            oldslots = NULL;
+            oldstatus = NULL;
+            oldnumslots = migrate_idx = 0;
+        }
+    }
+}
+
 void WvScatterHashBase::rebuild()
 {
+    if (!iterators)
+        migrate(MIGRATE_STEP);
+
     if (!(numslots * REBUILD_LOAD_FACTOR <= used + 1))
         return;
 
-    unsigned oldnumslots = numslots;
+    // Moving things around would confuse any iterators, so don't unless
+    // we're about to run out of room.
+    if (iterators && numslots > SMALL_TABLE
+            && !(numslots * ITER_LOAD_FACTOR <= used + 1))
+        return;
+
+    // still moving into the current table?  Finish that first.
+    migrate(oldnumslots);
 
+    oldslots = xslots;
+    oldstatus = xstatus;
+    oldnumslots = numslots;
+    migrate_idx = 0;
+
+    // if it's mostly deleted slots, the same size will do
     if (numslots * RESIZE_LOAD_FACTOR <= num + 1) 
         numslots = prime_numbers[++prime_index];
 
-    Slot *tmpslots = xslots;
-    Status *tmpstatus = xstatus;
     xslots = new Slot[numslots];
     xstatus = new Status[numslots];
     memset(xslots, 0, numslots * sizeof(xslots[0]));
     memset(xstatus, 0, numslots * sizeof(xstatus[0]));
-    used = num = 0;
-
-    for (unsigned i = 0; i < oldnumslots; i++)
-    {
-        if (IS_OCCUPIED(tmpstatus[i]))
-            _add(tmpslots[i], IS_AUTO_FREE(tmpstatus[i]));
-    }
+    used = 0;
 
-    deletev tmpslots;
-    deletev tmpstatus;
+    if (oldnumslots <= SMALL_TABLE)
+        migrate(oldnumslots);
+    else if (!iterators)
+        migrate(MIGRATE_STEP);
 }
 
 void WvScatterHashBase::_add(void *data, bool auto_free)
@@ -91,23 +162,29 @@ void WvScatterHashBase::_add(void *data, bool auto_free)
 void WvScatterHashBase::_add(void *data, unsigned hash, bool auto_free)
 {
     rebuild();
+    insert(data, hash, auto_free ? 3 : 2);
+    num++;
+}
+
+// put data in the new table (without counting it in num)
+void WvScatterHashBase::insert(void *data, unsigned hash, Status status)
+{
     unsigned slot = hash % numslots;
 
     if (IS_OCCUPIED(xstatus[slot]))
     {
         unsigned attempt = 0;
-        unsigned hash2 = second_hash(hash);
+        unsigned hash2 = second_hash(hash, numslots);
 
         while (IS_OCCUPIED(xstatus[slot]))
-            slot = curhash(hash, hash2, ++attempt);
+            slot = curhash(hash, hash2, ++attempt, numslots);
     }
 
-    num++;
     if (!IS_DELETED(xstatus[slot]))
         used++;
 
     xslots[slot] = data;
-    xstatus[slot] = auto_free ? 3 : 2;
+    xstatus[slot] = status;
 }
 
 void WvScatterHashBase::_remove(const void *data, unsigned hash)
@@ -116,23 +193,31 @@ void WvScatterHashBase::_remove(const void *data, unsigned hash)
 
     if (res != null_idx)
     {
-        if (IS_AUTO_FREE(xstatus[res]))
-            do_delete(xslots[res]);
-	xstatus[res] = 1;
+        if (IS_AUTO_FREE(status_at(res)))
+            do_delete(slot_at(res));
+	status_at(res) = 1;
         num--;
+
+        if (!iterators)
+            migrate(MIGRATE_STEP);
     }
 }
 
 void WvScatterHashBase::_zap()
 {
-    for (unsigned i = 0; i < numslots; i++)
+    for (unsigned i = 0; i < totalslots(); i++)
     {
-        if (IS_AUTO_FREE(xstatus[i]))
-            do_delete(xslots[i]);
+        if (IS_AUTO_FREE(status_at(i)))
+            do_delete(slot_at(i));
 
-        xstatus[i] = 0;
+        status_at(i) = 0;
     }
     
+    deletev oldslots;
+    deletev oldstatus;
+    oldslots = NULL;
+    oldstatus = NULL;
+    oldnumslots = migrate_idx = 0;
     used = num = 0;
 }
 
@@ -142,7 +227,7 @@ void WvScatterHashBase::_set_autofree(const void *data,
     unsigned res = genfind(data, hash);
 
     if (res != null_idx)
-        xstatus[res] = auto_free ? 3 : 2;
+        status_at(res) = auto_free ? 3 : 2;
 }
 
 bool WvScatterHashBase::_get_autofree(const void *data, unsigned hash)
@@ -150,33 +235,48 @@ bool WvScatterHashBase::_get_autofree(const void *data, unsigned hash)
     unsigned res = genfind(data, hash);
 
     if (res != null_idx)
-        return IS_AUTO_FREE(xstatus[res]);
+        return IS_AUTO_FREE(status_at(res));
 
     assert(0 && "You checked auto_free of a nonexistant thing.");
     return false;
 }
 
-unsigned WvScatterHashBase::genfind(const void *data, unsigned hash) const
+unsigned WvScatterHashBase::find_in(const Slot *slots, const Status *status,
+                                    unsigned n, const void *data,
+                                    unsigned hash) const
 {
-    unsigned slot = hash % numslots;
+    unsigned slot = hash % n;
 
-    if (IS_OCCUPIED(xstatus[slot]) && compare(data, xslots[slot]))
+    if (IS_OCCUPIED(status[slot]) && compare(data, slots[slot]))
         return slot;
 
     unsigned attempt = 0;
-    unsigned hash2 = second_hash(hash);
+    unsigned hash2 = second_hash(hash, n);
 
-    while (xstatus[slot])
+    while (status[slot])
     {
-        slot = curhash(hash, hash2, ++attempt);
+        slot = curhash(hash, hash2, ++attempt, n);
 
-        if (IS_OCCUPIED(xstatus[slot]) && compare(data, xslots[slot]))
+        if (IS_OCCUPIED(status[slot]) && compare(data, slots[slot]))
             return slot;
     } 
 
     return null_idx;
 }
 
+unsigned WvScatterHashBase::genfind(const void *data, unsigned hash) const
+{
+    unsigned slot = find_in(xslots, xstatus, numslots, data, hash);
+    if (slot == null_idx && oldslots)
+    {
+        // maybe it hasn't been moved to the new table yet
+        slot = find_in(oldslots, oldstatus, oldnumslots, data, hash);
+        if (slot != null_idx)
+            slot += numslots;
+    }
+    return slot;
+}
+
 
 void *WvScatterHashBase::genfind_or_null(const void *data, unsigned hash) const
 {
@@ -184,5 +284,5 @@ void *WvScatterHashBase::genfind_or_null(const void *data, unsigned hash) const
     if (slot == null_idx)
 	return NULL;
     else
-	return xslots[slot];
+	return slot_at(slot);
 }
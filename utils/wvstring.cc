@@ -10,6 +10,7 @@
 #include <assert.h>
 
 WvStringBuf WvFastString::nullbuf = { 0, 1 };
+WvStringBuf WvFastString::smallbuf = { 0, 1 };
 const WvFastString WvFastString::null;
 
 const WvString WvString::empty("");
@@ -38,13 +39,26 @@ WvFastString::WvFastString()
 
 WvFastString::WvFastString(const WvFastString &s)
 {
-    link(s.buf, s.str);
+    link_or_copy(s);
 }
 
 
 WvFastString::WvFastString(const WvString &s)
 {
-    link(s.buf, s.str);
+    link_or_copy(s);
+}
+
+
+void WvFastString::link_or_copy(const WvFastString &s)
+{
+    if (s.buf == &smallbuf)
+    {
+	// it lives in someone else's small[], which dies with them
+	memcpy(small, s.str, strlen(s.str) + 1);
+	link(&smallbuf, small);
+    }
+    else
+	link(s.buf, s.str);
 }
 
 
@@ -66,8 +80,9 @@ void WvString::copy_constructor(const WvFastString &s)
 {
     unlink();	// WvFastString has already been created by now
 
-    if (!s.buf)
+    if (!s.buf || s.buf == &smallbuf)
     {
+	// a char* string, or someone else's small[]: we need our own copy
 	link(&nullbuf, s.str);
 	unique();
     }
@@ -238,6 +253,70 @@ WvFastString::WvFastString(double i)
 }
 
 
+// Same again for WvString, except these all fit in small[].
+WvString::WvString(short i)
+{
+    use_small();
+    wv_strrev(str, wv_itoar(str, i));
+}
+
+
+WvString::WvString(unsigned short i)
+{
+    use_small();
+    wv_strrev(str, wv_uitoar(str, i));
+}
+
+
+WvString::WvString(int i)
+{
+    use_small();
+    wv_strrev(str, wv_itoar(str, i));
+}
+
+
+WvString::WvString(unsigned int i)
+{
+    use_small();
+    wv_strrev(str, wv_uitoar(str, i));
+}
+
+
+WvString::WvString(long i)
+{
+    use_small();
+    wv_strrev(str, wv_itoar(str, i));
+}
+
+
+WvString::WvString(unsigned long i)
+{
+    use_small();
+    wv_strrev(str, wv_uitoar(str, i));
+}
+
+
+WvString::WvString(long long i)
+{
+    use_small();
+    wv_strrev(str, wv_itoar(str, i));
+}
+
+
+WvString::WvString(unsigned long long i)
+{
+    use_small();
+    wv_strrev(str, wv_uitoar(str, i));
+}
+
+
+WvString::WvString(double i)
+{
+    use_small();
+    snprintf(str, WVSTRING_SMALL, "%g", i);
+}
+
+
 WvFastString::~WvFastString()
 {
     unlink();
@@ -307,10 +386,21 @@ WvString &WvString::unique()
 {
     if (!is_unique() && str)
     {
-	WvStringBuf *newb = alloc(len() + 1);
-	memcpy(newb->data, str, newb->size);
-	unlink();
-	link(newb, newb->data);
+	size_t size = len() + 1;
+	if (size <= WVSTRING_SMALL)
+	{
+	    // str might be pointing into small[] already, eg. after
+	    // operator= from our own offset().
+	    memmove(small, str, size);
+	    use_small();
+	}
+	else
+	{
+	    WvStringBuf *newb = alloc(size);
+	    memcpy(newb->data, str, newb->size);
+	    unlink();
+	    link(newb, newb->data);
+	}
     }
 	    
     return *this; 
@@ -319,6 +409,8 @@ WvString &WvString::unique()
 
 bool WvString::is_unique() const
 {
+    if (buf == &smallbuf)
+	return str >= small && str < small + sizeof(small);
     return (buf->links <= 1);
 }
 
@@ -338,8 +430,7 @@ WvFastString &WvFastString::operator= (const WvFastString &s2)
 
 WvString &WvString::operator= (int i)
 {
-    unlink();
-    newbuf(32);
+    use_small();
     sprintf(str, "%d", i);
     return *this;
 }
@@ -349,10 +440,10 @@ WvString &WvString::operator= (const WvFastString &s2)
 {
     if (s2.str == str && (!s2.buf || s2.buf == buf))
 	return *this; // no change
-    else if (!s2.buf)
+    else if (!s2.buf || s2.buf == &smallbuf)
     {
 	// We have a string, and we're about to free() it.
-	if (str && buf && buf->links == 1)
+	if (str && buf && buf != &smallbuf && buf->links == 1)
 	{
 	    // Set buf->size, if we don't already know it.
 	    if (buf->size == 0)
@@ -496,6 +587,13 @@ static const char *pparse(const char *cptr, bool &zeropad,
  */
 void WvFastString::do_format(WvFastString &output, const char *format,
 			     const WvFastString * const *argv)
+{
+    do_format(output, format, argv, NULL);
+}
+
+
+void WvFastString::do_format(WvFastString &output, const char *format,
+			     const WvFastString * const *argv, char *room)
 {
     static const char blank[] = "(nil)";
     const WvFastString * const *argptr = argv;
@@ -552,7 +650,13 @@ void WvFastString::do_format(WvFastString &output, const char *format,
 	}
     }
     
-    output.setsize(total + 1);
+    if (room && total + 1 <= WVSTRING_SMALL)
+    {
+	output.unlink();
+	output.link(&smallbuf, room);
+    }
+    else
+	output.setsize(total + 1);
     
     // actually render the final string
     iptr = format;
@@ -39,6 +39,12 @@ WvStringCache::~WvStringCache()
 WvString WvStringCache::get(WvStringParm s)
 {
     // return s; // disable cache
+
+    // short strings live right inside the WvString, so there's nothing
+    // to share and no point looking them up
+    if (s.isnull() || s.len() < WVSTRING_SMALL)
+	return s;
+
     WvString *ret = (*t)[s];
     if (ret)
     {
@@ -31,6 +31,8 @@ char *alloca ();
 #include "wvtask.h"
 #include <stdio.h>
 #include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
 #include <assert.h>
 #include <sys/mman.h>
 #include <signal.h>
@@ -48,6 +50,19 @@ char *alloca ();
 #define RUNNING_ON_VALGRIND 0
 #endif
 
+// getcontext() and setcontext() save and restore the signal mask, which
+// costs a system call every time we switch tasks.  Where we know how, we
+// switch stacks ourselves instead, saving only the registers the ABI says
+// a function call has to preserve.  Configure with --disable-asm-tasks to
+// always use ucontext.  (We still use ucontext under valgrind, since the
+// shared-stack trickery needs it.)
+#if !defined(WVTASK_UCONTEXT) && defined(__ELF__) \
+    && (defined(__x86_64__) || defined(__aarch64__))
+# define WVTASK_ASM 1
+#else
+# define WVTASK_ASM 0
+#endif
+
 #define TASK_DEBUG 0
 #if TASK_DEBUG
 # define Dprintf(fmt, args...) fprintf(stderr, fmt, ##args)
@@ -67,6 +82,119 @@ char *WvTaskMan::stacktop;
 
 static int context_return;
 
+#if WVTASK_ASM
+static void *toplevel_sp;
+
+// Saves the callee-saved registers on the current stack, stores the stack
+// pointer in *from, then switches to the stack 'to' and restores the
+// registers that were saved there.  Returns into whoever saved 'to'.
+extern "C" void wvtask_swap(void **from, void *to);
+
+// A brand new stack "returns" into here from wvtask_swap(), with the task
+// and the function to call in callee-saved registers.  The function never
+// returns.
+extern "C" void wvtask_trampoline();
+
+#if defined(__x86_64__)
+asm(".text\n"
+    ".globl wvtask_swap\n"
+    ".type wvtask_swap, @function\n"
+    "wvtask_swap:\n"
+    "    pushq %rbp\n"
+    "    pushq %rbx\n"
+    "    pushq %r12\n"
+    "    pushq %r13\n"
+    "    pushq %r14\n"
+    "    pushq %r15\n"
+    "    subq $8, %rsp\n"
+    "    stmxcsr (%rsp)\n"
+    "    fnstcw 4(%rsp)\n"
+    "    movq %rsp, (%rdi)\n"
+    "    movq %rsi, %rsp\n"
+    "    ldmxcsr (%rsp)\n"
+    "    fldcw 4(%rsp)\n"
+    "    addq $8, %rsp\n"
+    "    popq %r15\n"
+    "    popq %r14\n"
+    "    popq %r13\n"
+    "    popq %r12\n"
+    "    popq %rbx\n"
+    "    popq %rbp\n"
+    "    ret\n"
+    ".size wvtask_swap, .-wvtask_swap\n"
+    "\n"
+    ".globl wvtask_trampoline\n"
+    ".type wvtask_trampoline, @function\n"
+    "wvtask_trampoline:\n"
+    "    movq %r12, %rdi\n"
+    "    callq *%rbx\n"
+    "    ud2\n"
+    ".size wvtask_trampoline, .-wvtask_trampoline\n");
+
+// fpu control words, r15, r14, r13, r12, rbx, rbp, return address
+enum { SWAP_FRAME = 8, SWAP_TASK = 4, SWAP_FUNC = 5, SWAP_RET = 7 };
+
+#elif defined(__aarch64__)
+asm(".text\n"
+    ".globl wvtask_swap\n"
+    ".type wvtask_swap, %function\n"
+    "wvtask_swap:\n"
+    "    sub sp, sp, #160\n"
+    "    stp x19, x20, [sp, #0]\n"
+    "    stp x21, x22, [sp, #16]\n"
+    "    stp x23, x24, [sp, #32]\n"
+    "    stp x25, x26, [sp, #48]\n"
+    "    stp x27, x28, [sp, #64]\n"
+    "    stp x29, x30, [sp, #80]\n"
+    "    stp d8, d9, [sp, #96]\n"
+    "    stp d10, d11, [sp, #112]\n"
+    "    stp d12, d13, [sp, #128]\n"
+    "    stp d14, d15, [sp, #144]\n"
+    "    mov x9, sp\n"
+    "    str x9, [x0]\n"
+    "    mov sp, x1\n"
+    "    ldp x19, x20, [sp, #0]\n"
+    "    ldp x21, x22, [sp, #16]\n"
+    "    ldp x23, x24, [sp, #32]\n"
+    "    ldp x25, x26, [sp, #48]\n"
+    "    ldp x27, x28, [sp, #64]\n"
+    "    ldp x29, x30, [sp, #80]\n"
+    "    ldp d8, d9, [sp, #96]\n"
+    "    ldp d10, d11, [sp, #112]\n"
+    "    ldp d12, d13, [sp, #128]\n"
+    "    ldp d14, d15, [sp, #144]\n"
+    "    add sp, sp, #160\n"
+    "    ret\n"
+    ".size wvtask_swap, .-wvtask_swap\n"
+    "\n"
+    ".globl wvtask_trampoline\n"
+    ".type wvtask_trampoline, %function\n"
+    "wvtask_trampoline:\n"
+    "    mov x0, x19\n"
+    "    blr x20\n"
+    "    brk #0\n"
+    ".size wvtask_trampoline, .-wvtask_trampoline\n");
+
+// x19-x28, x29 (frame pointer), x30 (return address), d8-d15
+enum { SWAP_FRAME = 20, SWAP_TASK = 0, SWAP_FUNC = 1, SWAP_RET = 11 };
+
+#endif
+#endif // WVTASK_ASM
+
+// Freed stacks wait here for someone to start another task.  The list is
+// threaded through the stacks themselves, at the very bottom (where the
+// stack_magic goes when they're in use).
+struct FreeStack
+{
+    FreeStack *next;
+    size_t size;
+};
+static FreeStack *free_stacks;
+static int num_free_stacks;
+
+// beyond this many, freed stacks go straight back to the OS
+#define MAX_FREE_STACKS 64
+
 
 static bool use_shared_stack()
 {
@@ -96,8 +224,12 @@ WvTask::WvTask(WvTaskMan &_man, size_t _stacksize) : man(_man)
     numtasks++;
     magic_number = WVTASK_MAGIC;
     stack_magic = NULL;
+    stack = NULL;
     
-    man.get_stack(*this, stacksize);
+    // with a shared stack, each task's stack gets carved out of the
+    // stackmaster's; otherwise we mmap one for it in start().
+    if (use_shared_stack())
+	man.get_stack(*this, stacksize);
 
     man.all_tasks.append(this, false);
 }
@@ -105,6 +237,8 @@ WvTask::WvTask(WvTaskMan &_man, size_t _stacksize) : man(_man)
 
 WvTask::~WvTask()
 {
+    if (stack)
+	man.free_stack(stack, stacksize);
     numtasks--;
     if (running)
 	numrunning--;
@@ -120,6 +254,42 @@ void WvTask::start(WvStringParm _name, TaskFunc *_func, void *_userdata)
     userdata = _userdata;
     running = true;
     numrunning++;
+
+    if (!use_shared_stack())
+    {
+	if (!stack)
+	    stack = man.alloc_stack(stacksize);
+
+	// a little sentinel so we can detect stack overflows.  The guard
+	// page right under it should catch them first, though.
+	stack_magic = (int *)stack;
+	*stack_magic = WVTASK_MAGIC;
+
+	// start over from the top of the stack, in call_func()
+#if WVTASK_ASM
+	// make it look like we called wvtask_swap() from the trampoline.
+	// The top of the frame needs to be 16-byte aligned.
+	uintptr_t top = ((uintptr_t)stack + stacksize - 16) & ~(uintptr_t)15;
+	void **frame = (void **)top - SWAP_FRAME;
+	memset(frame, 0, SWAP_FRAME * sizeof(void *));
+#if defined(__x86_64__)
+	// the usual defaults: all exceptions masked, round to nearest
+	*(unsigned *)frame = 0x1f80;
+	*((unsigned short *)frame + 2) = 0x037f;
+#endif
+	frame[SWAP_TASK] = this;
+	frame[SWAP_FUNC] = (void *)man.call_func;
+	frame[SWAP_RET] = (void *)wvtask_trampoline;
+	sp = frame;
+#else
+	assert(getcontext(&mystate) == 0);
+	mystate.uc_stack.ss_sp = stack;
+	mystate.uc_stack.ss_size = stacksize;
+	mystate.uc_stack.ss_flags = 0;
+	mystate.uc_link = NULL;
+	makecontext(&mystate, (void (*)(void))man.call_func, 1, this);
+#endif
+    }
 }
 
 
@@ -129,6 +299,14 @@ void WvTask::recycle()
     
     if (!running && !recycled)
     {
+	// nobody needs the stack until we're started again, and then
+	// anybody's stack will do.
+	if (stack && !use_shared_stack())
+	{
+	    man.free_stack(stack, stacksize);
+	    stack = NULL;
+	    stack_magic = NULL;
+	}
 	man.free_tasks.append(this, true);
 	recycled = true;
     }
@@ -198,6 +376,9 @@ WvTaskMan::WvTaskMan()
     
     stacktop = (char *)alloca(0);
     
+    if (!use_shared_stack())
+	return;
+    
     context_return = 0;
     assert(getcontext(&get_stack_return) == 0);
     if (context_return == 0)
@@ -213,6 +394,7 @@ WvTaskMan::~WvTaskMan()
 {    
     magic_number = -42;
     free_tasks.zap();
+    zap_stacks();
 }
 
 
@@ -225,6 +407,11 @@ WvTask *WvTaskMan::start(WvStringParm name,
     WvTaskList::Iter i(free_tasks);
     for (i.rewind(); i.next(); )
     {
+	// without a shared stack, recycled tasks don't have a stack any
+	// more, so any of them will do.
+	if (!use_shared_stack() && !i->stack)
+	    i->stacksize = stacksize;
+	
 	if (i().stacksize >= stacksize)
 	{
 	    t = &i();
@@ -257,6 +444,19 @@ int WvTaskMan::run(WvTask &task, int val)
         
     WvTask *old_task = current_task;
     current_task = &task;
+
+#if WVTASK_ASM
+    if (!use_shared_stack())
+    {
+	// someone will eventually yield() (if toplevel) or run() our old
+	// task, and we'll come back here.
+	context_return = val;
+	wvtask_swap(old_task ? &old_task->sp : &toplevel_sp, task.sp);
+	current_task = old_task;
+	return context_return;
+    }
+#endif
+    
     ucontext_t *state;
     
     if (!old_task)
@@ -317,6 +517,16 @@ int WvTaskMan::yield(int val)
                 (long)current_task->stacksize);
     }
 #endif
+
+#if WVTASK_ASM
+    if (!use_shared_stack())
+    {
+	// we'll be back when someone calls run() again.
+	context_return = val;
+	wvtask_swap(&current_task->sp, toplevel_sp);
+	return context_return;
+    }
+#endif
 		
     context_return = 0;
     assert(getcontext(&current_task->mystate) == 0);
@@ -346,27 +556,6 @@ void WvTaskMan::get_stack(WvTask &task, size_t size)
     {
 	assert(magic_number == -WVTASK_MAGIC);
 	assert(task.magic_number == WVTASK_MAGIC);
-
-        if (!use_shared_stack())
-        {
-#if defined(__linux__) && (defined(__386__) || defined(__i386) || defined(__i386__))
-            static char *next_stack_addr = (char *)0xB0000000;
-            static const size_t stack_shift = 0x00100000;
-
-            next_stack_addr -= stack_shift;
-#else
-            static char *next_stack_addr = NULL;
-#endif
-        
-            task.stack = mmap(next_stack_addr, task.stacksize,
-                PROT_READ | PROT_WRITE,
-#ifndef MACOS 
-                MAP_PRIVATE | MAP_ANONYMOUS,
-#else
-                MAP_PRIVATE,
-#endif
-                -1, 0);
-        }
 	
 	// initial setup
 	stack_target = &task;
@@ -427,9 +616,6 @@ void WvTaskMan::_stackmaster()
 	    assert(magic_number == -WVTASK_MAGIC);
 	    
 	    total = (val+1) * (size_t)1024;
-	    
-            if (!use_shared_stack())
-                total = 1024; // enough to save the do_task stack frame
 
 	    // set up a stack frame for the new task.  This runs once
 	    // per get_stack.
@@ -455,14 +641,30 @@ void WvTaskMan::_stackmaster()
 }
 
 
+// Where a task with its own stack starts running, every time it's start()ed.
 void WvTaskMan::call_func(WvTask *task)
 {
-    Dprintf("WvTaskMan: calling task #%d (%s)\n",
-	    task->tid, (const char *)task->name);
-    task->func(task->userdata);
-    Dprintf("WvTaskMan: returning from task #%d (%s)\n",
-	    task->tid, (const char *)task->name);
-    context_return = 1;
+    valgrind_fix(stacktop);
+    for (;;)
+    {
+	assert(magic_number == -WVTASK_MAGIC);
+	assert(task->magic_number == WVTASK_MAGIC);
+	
+	if (task->func && task->running)
+	{
+	    Dprintf("WvTaskMan: calling task #%d (%s)\n",
+		    task->tid, (const char *)task->name);
+	    task->func(task->userdata);
+	    Dprintf("WvTaskMan: returning from task #%d (%s)\n",
+		    task->tid, (const char *)task->name);
+	    
+	    // the task's function terminated.
+	    task->name = "DEAD";
+	    task->running = false;
+	    task->numrunning--;
+	}
+	yield();
+    }
 }
 
 
@@ -501,30 +703,10 @@ void WvTaskMan::do_task()
 	    
 	    if (task->func && task->running)
 	    {
-                if (use_shared_stack())
-                {
-                    // this is the task's main function.  It can call yield()
-                    // to give up its timeslice if it wants.  Either way, it
-                    // only returns to *us* if the function actually finishes.
-                    task->func(task->userdata);
-                }
-                else
-                {
-                    assert(getcontext(&task->func_call) == 0);
-                    task->func_call.uc_stack.ss_size = task->stacksize;
-                    task->func_call.uc_stack.ss_sp = task->stack;
-                    task->func_call.uc_stack.ss_flags = 0;
-                    task->func_call.uc_link = &task->func_return;
-                    Dprintf("WvTaskMan: makecontext #%d (%s)\n",
-                            task->tid, (const char *)task->name);
-                    makecontext(&task->func_call,
-                            (void (*)(void))call_func, 1, task);
-
-                    context_return = 0;
-                    assert(getcontext(&task->func_return) == 0);
-                    if (context_return == 0)
-                        setcontext(&task->func_call);
-                }
+		// this is the task's main function.  It can call yield()
+		// to give up its timeslice if it wants.  Either way, it
+		// only returns to *us* if the function actually finishes.
+		task->func(task->userdata);
 		
 		// the task's function terminated.
 		task->name = "DEAD";
@@ -537,6 +719,84 @@ void WvTaskMan::do_task()
 }
 
 
+static size_t round_to_pages(size_t size)
+{
+    size_t pagesize = getpagesize();
+    return (size + pagesize - 1) / pagesize * pagesize;
+}
+
+
+// Each stack gets a PROT_NONE guard page underneath it, so a task that
+// overflows its stack crashes right away instead of scribbling all over
+// whatever happens to be mapped below.  The pages aren't touched until the
+// task actually uses them, so a big pile of mostly-idle tasks (or WvConts)
+// costs address space, but not much memory.
+//
+// Note that each guarded stack is two separate mappings as far as the
+// kernel is concerned, and there's a limit on those (vm.max_map_count,
+// usually around 65000).  If we hit it, we just do without the guard page.
+void *WvTaskMan::alloc_stack(size_t size)
+{
+    size = round_to_pages(size);
+    
+    FreeStack **prev;
+    for (prev = &free_stacks; *prev; prev = &(*prev)->next)
+    {
+	if ((*prev)->size == size)
+	{
+	    FreeStack *fs = *prev;
+	    *prev = fs->next;
+	    num_free_stacks--;
+	    return fs;
+	}
+    }
+    
+    size_t pagesize = getpagesize();
+    char *base = (char *)mmap(NULL, size + pagesize, PROT_READ | PROT_WRITE,
+#ifndef MACOS 
+	MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE,
+#else
+	MAP_PRIVATE,
+#endif
+	-1, 0);
+    assert(base != MAP_FAILED);
+    mprotect(base, pagesize, PROT_NONE);
+    return base + pagesize;
+}
+
+
+void WvTaskMan::free_stack(void *stack, size_t size)
+{
+    size = round_to_pages(size);
+    
+    if (num_free_stacks >= MAX_FREE_STACKS)
+    {
+	size_t pagesize = getpagesize();
+	munmap((char *)stack - pagesize, size + pagesize);
+	return;
+    }
+    
+    FreeStack *fs = (FreeStack *)stack;
+    fs->size = size;
+    fs->next = free_stacks;
+    free_stacks = fs;
+    num_free_stacks++;
+}
+
+
+void WvTaskMan::zap_stacks()
+{
+    size_t pagesize = getpagesize();
+    while (free_stacks)
+    {
+	FreeStack *fs = free_stacks;
+	free_stacks = fs->next;
+	munmap((char *)fs - pagesize, fs->size + pagesize);
+    }
+    num_free_stacks = 0;
+}
+
+
 const void *WvTaskMan::current_top_of_stack()
 {
 #ifdef HAVE_LIBC_STACK_END